@@ -3,15 +3,36 @@
 #include <timezoneapi.h>
 #include <windows.h>
 #include <process.h>  // For _spawn functions
+#define PSAPI_VERSION 2   // GetProcessMemoryInfo from kernel32, no psapi.lib
+#include <psapi.h>
 #include <direct.h>   // For *chdir and *getcwd
+#include <io.h>       // For _dup2 and _open_osfhandle
+#include <fcntl.h>    // For _O_TEXT
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <conio.h>  // For _getch
 #include <ctype.h>  // For isprint
 #include <winerror.h>
 #include <winnt.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LSH_HAVE_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define LSH_HAVE_SSE2 1
+#endif
+#if defined(__SSE4_2__) || defined(__AVX2__)
+#include <nmmintrin.h>
+#define LSH_HAVE_SSE42 1
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 int lsh_cd(char **args);
 int lsh_help(char **args);
 int lsh_exit(char **args);
@@ -23,12 +44,51 @@ int lsh_del(char **args);
 int lsh_touch(char **args);
 int lsh_pwd(char **args);
 int lsh_cat(char **args);
+int lsh_du(char **args);
+int lsh_wc(char **args);
+int lsh_head(char **args);
+int lsh_tail(char **args);
+int lsh_view(char **args);
+int lsh_z(char **args);
+int lsh_time(char **args);
+int lsh_timing(char **args);
+int lsh_alias(char **args);
+int lsh_unalias(char **args);
+int lsh_true(char **args);
+int lsh_false(char **args);
+int lsh_test(char **args);
+int lsh_break(char **args);
+int lsh_return(char **args);
+int lsh_export(char **args);
+int lsh_unset(char **args);
+int lsh_env_cmd(char **args);
+int lsh_local(char **args);
+int lsh_stats(char **args);
+int lsh_jobs(char **args);
+int lsh_wait(char **args);
+int lsh_out(char **args);
+int lsh_memo(char **args);
+int lsh_sum(char **args);
+int lsh_sort(char **args);
 
 #define KEY_TAB 9
 #define KEY_BACKSPACE 8
 #define KEY_ENTER 13
 #define KEY_ESC 27
 
+// Keys without a character, above the byte range
+#define KEY_LEFT 0x101
+#define KEY_RIGHT 0x102
+#define KEY_UP 0x103
+#define KEY_DOWN 0x104
+#define KEY_HOME 0x105
+#define KEY_END 0x106
+#define KEY_DELETE 0x107
+#define KEY_CTRL_LEFT 0x108
+#define KEY_CTRL_RIGHT 0x109
+
+#define LSH_MAX_THREADS 64
+
 char *builtin_str[] = {
   "cd",
   "help",
@@ -44,6 +104,37 @@ char *builtin_str[] = {
   "touch",
   "pwd",
   "cat",
+  "du",
+  "wc",
+  "head",
+  "tail",
+  "view",
+  "less",
+  "z",
+  "j",
+  "time",
+  "timing",
+  "alias",
+  "unalias",
+  "true",
+  "false",
+  "test",
+  "[",
+  "break",
+  "continue",
+  "return",
+  "export",
+  "unset",
+  "env",
+  "local",
+  "stats",
+  "lsh-stats",
+  "jobs",
+  "wait",
+  "out",
+  "memo",
+  "sum",
+  "sort",
 };
 
 int (*builtin_func[]) (char **) = {
@@ -61,22 +152,877 @@ int (*builtin_func[]) (char **) = {
   &lsh_touch,
   &lsh_pwd,
   &lsh_cat,
+  &lsh_du,
+  &lsh_wc,
+  &lsh_head,
+  &lsh_tail,
+  &lsh_view,
+  &lsh_view,
+  &lsh_z,
+  &lsh_z,
+  &lsh_time,
+  &lsh_timing,
+  &lsh_alias,
+  &lsh_unalias,
+  &lsh_true,
+  &lsh_false,
+  &lsh_test,
+  &lsh_test,
+  &lsh_break,
+  &lsh_break,
+  &lsh_return,
+  &lsh_export,
+  &lsh_unset,
+  &lsh_env_cmd,
+  &lsh_local,
+  &lsh_stats,
+  &lsh_stats,
+  &lsh_jobs,
+  &lsh_wait,
+  &lsh_out,
+  &lsh_memo,
+  &lsh_sum,
+  &lsh_sort,
 };
 
 int lsh_num_builtins() {
   return sizeof(builtin_str) / sizeof(char *);
 }
 
+// Microseconds from a monotonic clock, used for timing builtins
+unsigned long long lsh_now_us(void) {
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (freq.QuadPart == 0) {
+    QueryPerformanceFrequency(&freq);
+  }
+  QueryPerformanceCounter(&now);
+  return (unsigned long long)(now.QuadPart / freq.QuadPart) * 1000000ULL +
+         (unsigned long long)(now.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+}
+
+/*
+ * Internal metrics.
+ *
+ * Counters and latency histograms for the shell's own work, printed by the
+ * stats builtin. Each thread records into its own shard with plain adds:
+ * no lock or interlocked operation on the recording path. A thread takes a
+ * shard the first time it records and gives it back when it exits, so
+ * short-lived workers reuse shards rather than adding one each; totals sum
+ * all shards. Histogram buckets are powers of two of nanoseconds.
+ */
+
+enum {
+  LSH_M_PROMPTS,              // lines read
+  LSH_M_COMPLETION_ENTRIES,   // directory entries looked at for completion
+  LSH_M_SUGGESTION_HITS,
+  LSH_M_PARSE_HITS,
+  LSH_M_PARSE_MISSES,
+  LSH_M_ARENA_BLOCKS,         // blocks allocated for parse trees
+  LSH_M_SPAWNS,
+  LSH_M_ENV_BUILDS,
+  LSH_M_ENV_REUSES,
+  LSH_M_RENDER_BYTES,
+  LSH_M_OUT_BYTES,            // output relayed into the scrollback
+  LSH_M_MEMO_HITS,
+  LSH_M_MEMO_MISSES,
+  LSH_M_COUNTERS,
+};
+
+enum {
+  LSH_H_FIND_MATCHES,
+  LSH_H_FIND_BEST_MATCH,
+  LSH_H_PARSE,
+  LSH_H_EXECUTE,
+  LSH_H_RENDER,
+  LSH_H_HIGHLIGHT,
+  LSH_H_OUT_COMPRESS,
+  LSH_M_HISTOGRAMS,
+};
+
+static const char *lsh_counter_names[] = {
+  "prompts",
+  "completion.entries",
+  "suggestion.hits",
+  "parse.cache_hits",
+  "parse.cache_misses",
+  "parse.arena_blocks",
+  "execute.spawns",
+  "env.builds",
+  "env.reuses",
+  "render.bytes",
+  "out.bytes",
+  "memo.hits",
+  "memo.misses",
+};
+
+static const char *lsh_histogram_names[] = {
+  "find_matches",
+  "find_best_match",
+  "parse",
+  "execute",
+  "render",
+  "highlight",
+  "out.compress",
+};
+
+#define LSH_HIST_BUCKETS 40   // bucket b holds [2^b, 2^(b+1)) ns, the last anything longer
+
+typedef struct lsh_histogram {
+  unsigned long long buckets[LSH_HIST_BUCKETS];
+  unsigned long long count, sum_ns, max_ns;
+} lsh_histogram;
+
+typedef struct lsh_metric_shard {
+  struct lsh_metric_shard *next;        // all shards, for readers
+  struct lsh_metric_shard *next_free;
+  unsigned long long counters[LSH_M_COUNTERS];
+  lsh_histogram histograms[LSH_M_HISTOGRAMS];
+} lsh_metric_shard;
+
+static volatile LONG lsh_metrics_state = 0;     // 0 new, 1 starting, 2 ready
+static DWORD lsh_metrics_fls = FLS_OUT_OF_INDEXES;
+static CRITICAL_SECTION lsh_metrics_lock;       // shard list, threads starting and exiting only
+static lsh_metric_shard *lsh_metric_shards = NULL, *lsh_metric_free = NULL;
+static double lsh_metric_ns_per_tick = 0;
+static char *lsh_stats_exit_path = NULL;
+
+// A thread exited: its shard keeps its counts and goes to the next thread
+static void WINAPI lsh_metric_release(PVOID data) {
+  lsh_metric_shard *shard = (lsh_metric_shard*)data;
+  EnterCriticalSection(&lsh_metrics_lock);
+  shard->next_free = lsh_metric_free;
+  lsh_metric_free = shard;
+  LeaveCriticalSection(&lsh_metrics_lock);
+}
+
+static void lsh_metrics_init(void) {
+  if (lsh_metrics_state == 2) return;
+  if (InterlockedCompareExchange(&lsh_metrics_state, 1, 0) == 0) {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    lsh_metric_ns_per_tick = 1e9 / (double)freq.QuadPart;
+    InitializeCriticalSection(&lsh_metrics_lock);
+    lsh_metrics_fls = FlsAlloc(lsh_metric_release);
+    InterlockedExchange(&lsh_metrics_state, 2);
+  } else {
+    while (lsh_metrics_state != 2) Sleep(0);
+  }
+}
+
+static lsh_metric_shard *lsh_metric_shard_get(void) {
+  static lsh_metric_shard fallback;     // if FLS is unavailable; counts may race
+  lsh_metric_shard *shard;
+
+  lsh_metrics_init();
+  if (lsh_metrics_fls == FLS_OUT_OF_INDEXES) return &fallback;
+  shard = (lsh_metric_shard*)FlsGetValue(lsh_metrics_fls);
+  if (shard) return shard;
+
+  EnterCriticalSection(&lsh_metrics_lock);
+  if (lsh_metric_free) {
+    shard = lsh_metric_free;
+    lsh_metric_free = shard->next_free;
+  } else if ((shard = calloc(1, sizeof(lsh_metric_shard))) != NULL) {
+    shard->next = lsh_metric_shards;
+    lsh_metric_shards = shard;
+  }
+  LeaveCriticalSection(&lsh_metrics_lock);
+  if (!shard) return &fallback;
+  FlsSetValue(lsh_metrics_fls, shard);
+  return shard;
+}
+
+void lsh_metric_count(int counter, unsigned long long n) {
+  lsh_metric_shard_get()->counters[counter] += n;
+}
+
+// Start timing: returns a timestamp for lsh_metric_stop
+unsigned long long lsh_metric_start(void) {
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (unsigned long long)now.QuadPart;
+}
+
+void lsh_metric_stop(int histogram, unsigned long long start) {
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  lsh_metric_shard *shard = lsh_metric_shard_get();
+  unsigned long long ns = (unsigned long long)(((unsigned long long)now.QuadPart - start) * lsh_metric_ns_per_tick);
+  int bucket = 0;
+  while (bucket < LSH_HIST_BUCKETS - 1 && (ns >> (bucket + 1)) != 0) bucket++;
+
+  lsh_histogram *h = &shard->histograms[histogram];
+  h->buckets[bucket]++;
+  h->count++;
+  h->sum_ns += ns;
+  if (ns > h->max_ns) h->max_ns = ns;
+}
+
+// A counter summed over every thread
+unsigned long long lsh_metric_total(int counter) {
+  unsigned long long total = 0;
+  lsh_metrics_init();
+  EnterCriticalSection(&lsh_metrics_lock);
+  for (lsh_metric_shard *s = lsh_metric_shards; s; s = s->next) total += s->counters[counter];
+  LeaveCriticalSection(&lsh_metrics_lock);
+  return total;
+}
+
+static void lsh_histogram_total(int histogram, lsh_histogram *out) {
+  memset(out, 0, sizeof(lsh_histogram));
+  lsh_metrics_init();
+  EnterCriticalSection(&lsh_metrics_lock);
+  for (lsh_metric_shard *s = lsh_metric_shards; s; s = s->next) {
+    const lsh_histogram *h = &s->histograms[histogram];
+    for (int b = 0; b < LSH_HIST_BUCKETS; b++) out->buckets[b] += h->buckets[b];
+    out->count += h->count;
+    out->sum_ns += h->sum_ns;
+    if (h->max_ns > out->max_ns) out->max_ns = h->max_ns;
+  }
+  LeaveCriticalSection(&lsh_metrics_lock);
+}
+
+// Upper bound of the bucket holding quantile q, in ns
+static unsigned long long lsh_histogram_quantile(const lsh_histogram *h, double q) {
+  unsigned long long rank = (unsigned long long)(q * h->count), seen = 0;
+  for (int b = 0; b < LSH_HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank) {
+      unsigned long long bound = 2ULL << b;
+      return bound < h->max_ns ? bound : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
+
+static void lsh_stats_print(void) {
+  unsigned long long prompts = lsh_metric_total(LSH_M_PROMPTS);
+
+  printf("%-20s %14s %12s\n", "counter", "total", "per prompt");
+  for (int i = 0; i < LSH_M_COUNTERS; i++) {
+    unsigned long long total = lsh_metric_total(i);
+    printf("%-20s %14llu %12.1f\n", lsh_counter_names[i], total,
+           prompts ? (double)total / prompts : 0.0);
+  }
+  printf("\n%-20s %9s %10s %10s %10s %10s %10s\n", "latency (us)", "count", "mean", "p50", "p90", "p99", "max");
+  for (int i = 0; i < LSH_M_HISTOGRAMS; i++) {
+    lsh_histogram h;
+    lsh_histogram_total(i, &h);
+    printf("%-20s %9llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", lsh_histogram_names[i], h.count,
+           h.count ? h.sum_ns / 1000.0 / h.count : 0.0,
+           lsh_histogram_quantile(&h, 0.5) / 1000.0, lsh_histogram_quantile(&h, 0.9) / 1000.0,
+           lsh_histogram_quantile(&h, 0.99) / 1000.0, h.max_ns / 1000.0);
+  }
+}
+
+// One line per metric, with the raw buckets, for comparing runs offline
+static int lsh_stats_write(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    fprintf(stderr, "lsh: stats: cannot write %s\n", path);
+    return 0;
+  }
+  for (int i = 0; i < LSH_M_COUNTERS; i++) {
+    fprintf(f, "counter %s %llu\n", lsh_counter_names[i], lsh_metric_total(i));
+  }
+  for (int i = 0; i < LSH_M_HISTOGRAMS; i++) {
+    lsh_histogram h;
+    lsh_histogram_total(i, &h);
+    fprintf(f, "histogram %s count=%llu sum_ns=%llu max_ns=%llu buckets=", lsh_histogram_names[i],
+            h.count, h.sum_ns, h.max_ns);
+    for (int b = 0; b < LSH_HIST_BUCKETS; b++) fprintf(f, b ? ",%llu" : "%llu", h.buckets[b]);
+    fprintf(f, "\n");
+  }
+  fclose(f);
+  return 1;
+}
+
+static void lsh_stats_at_exit(void) {
+  if (lsh_stats_exit_path) lsh_stats_write(lsh_stats_exit_path);
+}
+
+// Write the metrics to path when the shell exits
+void lsh_stats_dump_at_exit(const char *path) {
+  static int registered = 0;
+  free(lsh_stats_exit_path);
+  lsh_stats_exit_path = _strdup(path);
+  if (!registered) {
+    atexit(lsh_stats_at_exit);
+    registered = 1;
+  }
+}
+
+/*
+ * The event loop.
+ *
+ * Everything the shell waits for goes through lsh_ev_run: console input,
+ * the foreground program and background jobs, the prompt and highlighter
+ * workers, the completion counter, Ctrl-C, change notifications on the
+ * current directory and timers, all in one WaitForMultipleObjects. A source
+ * is a handle and a callback; a timer is a deadline that bounds the wait.
+ * With no timer armed the wait is INFINITE, so an idle shell takes no CPU.
+ *
+ * Sources flagged LSH_EV_PROMPT are only waited on while a line is being
+ * read. While a program runs in the foreground the others still are, so
+ * jobs finishing are noticed without reading the program's input.
+ */
+
+#define LSH_EV_MAX_SOURCES (MAXIMUM_WAIT_OBJECTS - 1)   // a slot is kept for `until`
+#define LSH_EV_MAX_TIMERS 8
+#define LSH_EV_PROMPT 1
+
+typedef void (*lsh_ev_fn)(void *data, HANDLE h);
+
+typedef struct lsh_ev_source {
+  HANDLE h;
+  lsh_ev_fn fn;
+  void *data;
+  int flags;
+} lsh_ev_source;
+
+typedef struct lsh_ev_timer {
+  unsigned long long due;       // GetTickCount64, 0 = not armed
+  lsh_ev_fn fn;
+  void *data;
+} lsh_ev_timer;
+
+static lsh_ev_source lsh_ev_sources[LSH_EV_MAX_SOURCES];   // earlier ones win ties
+static int lsh_ev_count = 0;
+static lsh_ev_timer lsh_ev_timers[LSH_EV_MAX_TIMERS];
+unsigned long long lsh_ev_wakeups = 0;
+
+// Watch a handle, or change what happens for one already watched.
+// Returns 0 if the loop is full.
+int lsh_ev_add(HANDLE h, lsh_ev_fn fn, void *data, int flags) {
+  lsh_ev_source *s = NULL;
+  for (int i = 0; i < lsh_ev_count; i++) {
+    if (lsh_ev_sources[i].h == h) s = &lsh_ev_sources[i];
+  }
+  if (!s) {
+    if (lsh_ev_count == LSH_EV_MAX_SOURCES) return 0;
+    s = &lsh_ev_sources[lsh_ev_count++];
+  }
+  s->h = h;
+  s->fn = fn;
+  s->data = data;
+  s->flags = flags;
+  return 1;
+}
+
+// Stop watching a handle. Must be done before it is closed.
+void lsh_ev_remove(HANDLE h) {
+  for (int i = 0; i < lsh_ev_count; i++) {
+    if (lsh_ev_sources[i].h == h) {
+      memmove(&lsh_ev_sources[i], &lsh_ev_sources[i + 1], (lsh_ev_count - i - 1) * sizeof(lsh_ev_source));
+      lsh_ev_count--;
+      return;
+    }
+  }
+}
+
+// Call fn(data, NULL) once, ms from now. Returns NULL if all timers are in use.
+lsh_ev_timer *lsh_ev_after(DWORD ms, lsh_ev_fn fn, void *data) {
+  for (int i = 0; i < LSH_EV_MAX_TIMERS; i++) {
+    lsh_ev_timer *t = &lsh_ev_timers[i];
+    if (!t->due) {
+      t->due = GetTickCount64() + ms;
+      t->fn = fn;
+      t->data = data;
+      return t;
+    }
+  }
+  return NULL;
+}
+
+void lsh_ev_cancel(lsh_ev_timer *t) {
+  if (t) t->due = 0;
+}
+
+// Drop every source and timer set up with `data`, which is going away
+void lsh_ev_forget(void *data) {
+  for (int i = lsh_ev_count - 1; i >= 0; i--) {
+    if (lsh_ev_sources[i].data == data) lsh_ev_remove(lsh_ev_sources[i].h);
+  }
+  for (int i = 0; i < LSH_EV_MAX_TIMERS; i++) {
+    if (lsh_ev_timers[i].data == data) lsh_ev_timers[i].due = 0;
+  }
+}
+
+// Wait for `until` (may be NULL), handling one other event meanwhile: a
+// signaled source, or the timers that are due. Returns 1 once `until` is
+// signaled, 0 after handling an event or after timeout_ms.
+int lsh_ev_run(HANDLE until, int flags, DWORD timeout_ms) {
+  HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+  lsh_ev_source *sources[MAXIMUM_WAIT_OBJECTS];
+  DWORD n = 0, wait = timeout_ms;
+  unsigned long long now = GetTickCount64(), due = 0;
+
+  if (until) handles[n++] = until;
+  for (int i = 0; i < lsh_ev_count; i++) {
+    if ((lsh_ev_sources[i].flags & LSH_EV_PROMPT) && !(flags & LSH_EV_PROMPT)) continue;
+    sources[n] = &lsh_ev_sources[i];
+    handles[n++] = lsh_ev_sources[i].h;
+  }
+  for (int i = 0; i < LSH_EV_MAX_TIMERS; i++) {
+    if (lsh_ev_timers[i].due && (!due || lsh_ev_timers[i].due < due)) due = lsh_ev_timers[i].due;
+  }
+  if (due) {
+    DWORD left = due > now ? (DWORD)(due - now) : 0;
+    if (left < wait) wait = left;
+  }
+  if (n == 0 && wait == INFINITE) return 0;   // nothing could ever wake us
+
+  DWORD result = WAIT_TIMEOUT;
+  if (n > 0) {
+    result = WaitForMultipleObjects(n, handles, FALSE, wait);
+  } else {
+    Sleep(wait);
+  }
+  lsh_ev_wakeups++;
+
+  if (until && result == WAIT_OBJECT_0) return 1;
+  if (result < WAIT_OBJECT_0 + n) {
+    lsh_ev_source s = *sources[result - WAIT_OBJECT_0];   // the callback may remove it
+    s.fn(s.data, s.h);
+    return 0;
+  }
+  if (result == WAIT_FAILED) {
+    // A handle was closed while still watched: drop it rather than spin
+    for (int i = lsh_ev_count - 1; i >= 0; i--) {
+      if (WaitForSingleObject(lsh_ev_sources[i].h, 0) == WAIT_FAILED) lsh_ev_remove(lsh_ev_sources[i].h);
+    }
+    return 0;
+  }
+
+  now = GetTickCount64();
+  for (int i = 0; i < LSH_EV_MAX_TIMERS; i++) {
+    lsh_ev_timer t = lsh_ev_timers[i];
+    if (t.due && t.due <= now) {
+      lsh_ev_timers[i].due = 0;
+      t.fn(t.data, NULL);
+    }
+  }
+  return 0;
+}
+
+/*
+ * Ctrl-C.
+ *
+ * The console calls the handler on a thread of its own, so all it does is
+ * raise lsh_interrupted and set lsh_interrupt_event. Long builtins check
+ * the flag between chunks (a read buffer, a batch of directory entries, a
+ * loop iteration) and unwind through their normal exits, so files, find
+ * handles and buffers are released as usual. The event is an event loop
+ * source, which makes every wait come back to look at the flag.
+ *
+ * A foreground program is attached to our console and gets the Ctrl-C
+ * itself; the shell only survives it and stops any loop or script the
+ * program was part of. Background jobs are in process groups of their own
+ * and don't see it. The flag is cleared before each prompt. Only the
+ * interactive shell installs the handler: lsh -c and scripts die on Ctrl-C
+ * like any other program.
+ */
+
+volatile LONG lsh_interrupted = 0;
+HANDLE lsh_interrupt_event = NULL;   // auto-reset
+int lsh_last_status = 0;             // $?, which an interrupted command sets to 130
+
+static BOOL WINAPI lsh_interrupt_handler(DWORD type) {
+  if (type != CTRL_C_EVENT && type != CTRL_BREAK_EVENT) return FALSE;
+  InterlockedExchange(&lsh_interrupted, 1);
+  SetEvent(lsh_interrupt_event);
+  return TRUE;
+}
+
+// Nothing to do but wake up: the caller sees lsh_interrupted
+static void lsh_interrupt_seen(void *data, HANDLE h) {
+}
+
+void lsh_interrupt_init(void) {
+  lsh_interrupt_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+  if (!lsh_interrupt_event) return;
+  lsh_ev_add(lsh_interrupt_event, lsh_interrupt_seen, NULL, 0);
+  SetConsoleCtrlHandler(lsh_interrupt_handler, TRUE);
+}
+
+void lsh_interrupt_clear(void) {
+  InterlockedExchange(&lsh_interrupted, 0);
+  if (lsh_interrupt_event) ResetEvent(lsh_interrupt_event);
+}
+
+// Format a byte count as a short human readable string ("512", "1.4K", "3.0G")
+void lsh_format_size(unsigned long long bytes, char *out, size_t out_size) {
+  const char *units = "KMGTP";
+  double value = (double)bytes;
+  int unit = -1;
+
+  if (bytes < 1024) {
+    snprintf(out, out_size, "%llu", bytes);
+    return;
+  }
+  while (value >= 1024.0 && unit < 4) {
+    value /= 1024.0;
+    unit++;
+  }
+  snprintf(out, out_size, "%.1f%c", value, units[unit]);
+}
+
+// Build a path to a file in the user's profile directory (e.g. a cache file)
+int lsh_home_path(const char *name, char *out, size_t out_size) {
+  char home[MAX_PATH];
+  DWORD len = GetEnvironmentVariable("USERPROFILE", home, sizeof(home));
+
+  if (len == 0 || len >= sizeof(home)) {
+    return 0;
+  }
+  return snprintf(out, out_size, "%s\\%s", home, name) < (int)out_size;
+}
+
+// FNV-1a hash for strings used as hash table keys
+unsigned long long lsh_hash_str(const char *s) {
+  unsigned long long h = 1469598103934665603ULL;
+  while (*s) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Number of worker threads to use for parallel builtins
+int lsh_default_threads(void) {
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int n = (int)si.dwNumberOfProcessors;
+  if (n < 1) n = 1;
+  if (n > LSH_MAX_THREADS) n = LSH_MAX_THREADS;
+  return n;
+}
+
+
+/*
+ * Paths.
+ *
+ * lsh_path is a path that knows its length and grows as needed, so
+ * joining a component is one copy at the end rather than strcat scanning
+ * the whole string again, and a deep tree isn't cut off at a fixed
+ * buffer. lsh_path_win32 gives the form to hand to Win32, which needs the
+ * \\?\ prefix once an absolute path is longer than MAX_PATH.
+ */
+
+#define LSH_PATH_SHORT (MAX_PATH - 12)  // room for "\*" or an 8.3 name
+
+typedef struct lsh_path {
+  char *s;
+  size_t len, cap;
+} lsh_path;
+
+static void lsh_path_reserve(lsh_path *p, size_t len) {
+  if (len + 1 <= p->cap) return;
+  size_t cap = p->cap ? p->cap : 256;
+  while (cap < len + 1) cap *= 2;
+  char *grown = (char*)realloc(p->s, cap);
+  if (!grown) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  p->s = grown;
+  p->cap = cap;
+}
+
+static void lsh_path_set(lsh_path *p, const char *s, size_t len) {
+  lsh_path_reserve(p, len);
+  memmove(p->s, s, len);
+  p->len = len;
+  p->s[len] = '\0';
+}
+
+// Append a component, after a backslash unless p is empty or ends in one
+static void lsh_path_join(lsh_path *p, const char *name, size_t len) {
+  int sep = p->len > 0 && p->s[p->len - 1] != '\\' && p->s[p->len - 1] != '/';
+  lsh_path_reserve(p, p->len + sep + len);
+  if (sep) p->s[p->len++] = '\\';
+  memcpy(p->s + p->len, name, len);
+  p->len += len;
+  p->s[p->len] = '\0';
+}
+
+// Cut p back to a length saved before joining
+static void lsh_path_truncate(lsh_path *p, size_t len) {
+  if (len < p->len) {
+    p->len = len;
+    p->s[len] = '\0';
+  }
+}
+
+static void lsh_path_free(lsh_path *p) {
+  free(p->s);
+  p->s = NULL;
+  p->len = p->cap = 0;
+}
+
+// The current directory, however long. Returns 0 on failure.
+static int lsh_path_cwd(lsh_path *p) {
+  DWORD need = MAX_PATH;
+  while (1) {
+    lsh_path_reserve(p, need);
+    DWORD len = GetCurrentDirectory((DWORD)p->cap, p->s);
+    if (len == 0) return 0;
+    if (len < p->cap) {
+      p->len = len;
+      return 1;
+    }
+    need = len;                 // the size needed, counting the terminator
+  }
+}
+
+// The absolute form of path, however long. Returns 0 on failure.
+static int lsh_path_full(lsh_path *p, const char *path) {
+  DWORD need = MAX_PATH;
+  while (1) {
+    lsh_path_reserve(p, need);
+    DWORD len = GetFullPathName(path, (DWORD)p->cap, p->s, NULL);
+    if (len == 0) return 0;
+    if (len < p->cap) {
+      p->len = len;
+      return 1;
+    }
+    need = len;
+  }
+}
+
+// A file in the user's profile directory, however long. Returns 0 if
+// USERPROFILE isn't set.
+static int lsh_path_home(lsh_path *p, const char *name) {
+  DWORD need = MAX_PATH;
+  while (1) {
+    lsh_path_reserve(p, need);
+    DWORD len = GetEnvironmentVariable("USERPROFILE", p->s, (DWORD)p->cap);
+    if (len == 0) return 0;
+    if (len < p->cap) {
+      p->len = len;
+      break;
+    }
+    need = len;
+  }
+  lsh_path_join(p, name, strlen(name));
+  return 1;
+}
+
+// p for a Win32 call. A long absolute path is copied into tmp with the
+// \\?\ prefix (\\?\UNC\ for a share); anything else is p itself.
+static const char *lsh_path_win32(const lsh_path *p, lsh_path *tmp) {
+  const char *s = p->s;
+  if (p->len < LSH_PATH_SHORT || strncmp(s, "\\\\?\\", 4) == 0) return s;
+  int unc = s[0] == '\\' && s[1] == '\\';
+  int drive = isalpha((unsigned char)s[0]) && s[1] == ':' && (s[2] == '\\' || s[2] == '/');
+  if (!unc && !drive) return s;
+
+  const char *prefix = unc ? "\\\\?\\UNC" : "\\\\?\\";
+  size_t prefix_len = strlen(prefix), skip = unc ? 1 : 0;
+  lsh_path_reserve(tmp, prefix_len + p->len - skip);
+  memcpy(tmp->s, prefix, prefix_len);
+  memcpy(tmp->s + prefix_len, s + skip, p->len - skip + 1);
+  tmp->len = prefix_len + p->len - skip;
+  // The prefixed form is passed through as is, so it must use backslashes
+  for (char *c = tmp->s + prefix_len; *c; c++) {
+    if (*c == '/') *c = '\\';
+  }
+  return tmp->s;
+}
+
+/*
+ * Interned paths.
+ *
+ * lsh_path_pool keeps paths as (parent, name) nodes, so a directory is
+ * stored once however many entries sit under it, and an index of a
+ * million paths costs a node and a name per entry rather than a copy of
+ * every prefix. Nodes and names live in blocks that never move: interning
+ * takes the pool's lock, and any thread can read a node it was handed the
+ * id of. An id stays valid until the pool is freed; 0 is "no parent".
+ */
+
+#define LSH_PATH_BLOCK_NODES 4096
+#define LSH_PATH_MAX_BLOCKS 65536       // 256M nodes
+#define LSH_PATH_NAME_BLOCK (256 * 1024)
+
+typedef unsigned int lsh_path_id;
+
+typedef struct lsh_path_node {
+  const char *name;             // NUL-terminated, in the pool's name blocks
+  lsh_path_id parent;
+  unsigned int len;             // of the whole path
+  unsigned int name_len;
+  unsigned int hash;            // of (parent, name), for the table
+} lsh_path_node;
+
+typedef struct lsh_path_pool {
+  lsh_path_node **blocks;       // LSH_PATH_MAX_BLOCKS slots
+  unsigned int count;           // nodes, counting the unused node 0
+  char **name_blocks;
+  int num_name_blocks, cap_name_blocks;
+  size_t name_used;             // in the last name block
+  lsh_path_id *table;           // open addressing on (parent, name)
+  unsigned int table_cap;
+  size_t bytes;                 // allocated, for --bench-paths
+  CRITICAL_SECTION lock;
+} lsh_path_pool;
+
+static lsh_path_node *lsh_path_node_of(const lsh_path_pool *pool, lsh_path_id id) {
+  return &pool->blocks[id / LSH_PATH_BLOCK_NODES][id % LSH_PATH_BLOCK_NODES];
+}
+
+static void lsh_path_pool_init(lsh_path_pool *pool) {
+  memset(pool, 0, sizeof(*pool));
+  pool->blocks = (lsh_path_node**)calloc(LSH_PATH_MAX_BLOCKS, sizeof(lsh_path_node*));
+  if (!pool->blocks) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  pool->count = 1;
+  InitializeCriticalSection(&pool->lock);
+}
+
+static void lsh_path_pool_free(lsh_path_pool *pool) {
+  if (!pool->blocks) return;
+  for (int i = 0; i < LSH_PATH_MAX_BLOCKS && pool->blocks[i]; i++) free(pool->blocks[i]);
+  for (int i = 0; i < pool->num_name_blocks; i++) free(pool->name_blocks[i]);
+  free(pool->blocks);
+  free(pool->name_blocks);
+  free(pool->table);
+  DeleteCriticalSection(&pool->lock);
+  memset(pool, 0, sizeof(*pool));
+}
+
+static unsigned int lsh_path_hash(lsh_path_id parent, const char *name, size_t len) {
+  unsigned long long h = 1469598103934665603ULL ^ parent;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+  return (unsigned int)(h ^ (h >> 32));
+}
+
+static void lsh_path_table_grow(lsh_path_pool *pool) {
+  unsigned int cap = pool->table_cap ? pool->table_cap * 2 : 1024;
+  lsh_path_id *table = (lsh_path_id*)calloc(cap, sizeof(lsh_path_id));
+  if (!table) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (lsh_path_id id = 1; id < pool->count; id++) {
+    unsigned int j = lsh_path_node_of(pool, id)->hash & (cap - 1);
+    while (table[j]) j = (j + 1) & (cap - 1);
+    table[j] = id;
+  }
+  pool->bytes += (cap - pool->table_cap) * sizeof(lsh_path_id);
+  free(pool->table);
+  pool->table = table;
+  pool->table_cap = cap;
+}
+
+static const char *lsh_path_store_name(lsh_path_pool *pool, const char *name, size_t len) {
+  size_t block = len + 1 > LSH_PATH_NAME_BLOCK ? len + 1 : LSH_PATH_NAME_BLOCK;
+  if (pool->num_name_blocks == 0 || pool->name_used + len + 1 > LSH_PATH_NAME_BLOCK) {
+    if (pool->num_name_blocks == pool->cap_name_blocks) {
+      int cap = pool->cap_name_blocks ? pool->cap_name_blocks * 2 : 16;
+      char **grown = (char**)realloc(pool->name_blocks, cap * sizeof(char*));
+      if (!grown) return NULL;
+      pool->name_blocks = grown;
+      pool->cap_name_blocks = cap;
+    }
+    char *mem = (char*)malloc(block);
+    if (!mem) return NULL;
+    pool->name_blocks[pool->num_name_blocks++] = mem;
+    pool->name_used = 0;
+    pool->bytes += block;
+  }
+  char *copy = pool->name_blocks[pool->num_name_blocks - 1] + pool->name_used;
+  memcpy(copy, name, len);
+  copy[len] = '\0';
+  pool->name_used += len + 1;
+  return copy;
+}
+
+// The id of name under parent, adding it if it's new. Returns 0 if the
+// pool is out of memory.
+static lsh_path_id lsh_path_intern(lsh_path_pool *pool, lsh_path_id parent, const char *name, size_t len) {
+  unsigned int hash = lsh_path_hash(parent, name, len);
+  lsh_path_id id = 0;
+
+  EnterCriticalSection(&pool->lock);
+  if ((pool->count + 1) * 10 > pool->table_cap * 7) lsh_path_table_grow(pool);
+  unsigned int j = hash & (pool->table_cap - 1);
+  while (pool->table[j]) {
+    lsh_path_node *n = lsh_path_node_of(pool, pool->table[j]);
+    if (n->hash == hash && n->parent == parent && n->name_len == len && memcmp(n->name, name, len) == 0) {
+      id = pool->table[j];
+      break;
+    }
+    j = (j + 1) & (pool->table_cap - 1);
+  }
+
+  if (!id && pool->count < (unsigned int)LSH_PATH_MAX_BLOCKS * LSH_PATH_BLOCK_NODES) {
+    lsh_path_node **block = &pool->blocks[pool->count / LSH_PATH_BLOCK_NODES];
+    if (!*block) {
+      *block = (lsh_path_node*)malloc(LSH_PATH_BLOCK_NODES * sizeof(lsh_path_node));
+      if (*block) pool->bytes += LSH_PATH_BLOCK_NODES * sizeof(lsh_path_node);
+    }
+    const char *copy = *block ? lsh_path_store_name(pool, name, len) : NULL;
+    if (copy) {
+      id = pool->count++;
+      lsh_path_node *n = lsh_path_node_of(pool, id);
+      n->name = copy;
+      n->parent = parent;
+      n->name_len = (unsigned int)len;
+      n->hash = hash;
+      n->len = (unsigned int)len;
+      if (parent) {
+        lsh_path_node *p = lsh_path_node_of(pool, parent);
+        char last = p->name_len ? p->name[p->name_len - 1] : '\\';
+        n->len += p->len + (last != '\\' && last != '/');
+      }
+      pool->table[j] = id;
+    }
+  }
+  LeaveCriticalSection(&pool->lock);
+  return id;
+}
+
+// The full path of id, written back to front from the lengths in the
+// nodes, so each component is copied once
+static void lsh_path_build(const lsh_path_pool *pool, lsh_path_id id, lsh_path *out) {
+  out->len = 0;
+  if (!id) {
+    lsh_path_set(out, "", 0);
+    return;
+  }
+  const lsh_path_node *n = lsh_path_node_of(pool, id);
+  size_t pos = n->len;
+  lsh_path_reserve(out, pos);
+  out->len = pos;
+  out->s[pos] = '\0';
+  while (1) {
+    pos -= n->name_len;
+    memcpy(out->s + pos, n->name, n->name_len);
+    if (!n->parent) break;
+    n = lsh_path_node_of(pool, n->parent);
+    if (pos > n->len) out->s[--pos] = '\\';
+  }
+}
 
 int lsh_pwd(char **args){
-  char cwd[1024];
+  lsh_path cwd = { NULL, 0, 0 };
 
-  if (_getcwd(cwd, sizeof(cwd)) == NULL){
-    perror("lsh: pwd");
+  if (!lsh_path_cwd(&cwd)){
+    fprintf(stderr, "lsh: pwd: cannot get the current directory\n");
+    lsh_path_free(&cwd);
     return 1;
   }
 
-  printf("\n%s\n\n", cwd);
+  printf("\n%s\n\n", cwd.s);
+  lsh_path_free(&cwd);
   return 1;
 }
 
@@ -91,7 +1037,7 @@ int lsh_cat(char **args) {
   int i = 1;
   int success = 1;
   
-  while (args[i] != NULL) {
+  while (args[i] != NULL && !lsh_interrupted) {
     // Print filename and blank line before content
     printf("\n--- %s ---\n\n", args[i]);
     
@@ -110,8 +1056,9 @@ int lsh_cat(char **args) {
     char buffer[4096]; // Larger buffer for efficiency
     size_t bytes_read;
     
-    // Use fread instead of fgets to avoid line-based processing
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    // Use fread instead of fgets to avoid line-based processing.
+    // Ctrl-C is checked between buffers.
+    while (!lsh_interrupted && (bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
       fwrite(buffer, 1, bytes_read, stdout);
     }
     
@@ -134,1086 +1081,12340 @@ int lsh_cat(char **args) {
   return success;
 }
 
+/*
+ * Byte counting kernels shared by wc, head, tail and the pager.
+ *
+ * The SIMD versions compare 16 (or 32) bytes at a time and accumulate the
+ * matches in per-lane byte counters, which are folded into the total with
+ * a sum-of-absolute-differences every 255 blocks before they can overflow.
+ */
 
-int lsh_del(char **args) {
-  if (args[1] == NULL) {
-    fprintf(stderr, "lsh: expected file argument to \"del\"\n");
-    return 1;
+static inline int lsh_popcount32(unsigned int x) {
+#ifdef _MSC_VER
+  return (int)__popcnt(x);
+#else
+  return __builtin_popcount(x);
+#endif
+}
+
+static inline int lsh_ctz32(unsigned int x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, x);
+  return (int)index;
+#else
+  return __builtin_ctz(x);
+#endif
+}
+
+// Count occurrences of byte in buf
+size_t lsh_count_byte(const char *buf, size_t len, char byte) {
+  size_t count = 0, i = 0;
+#if defined(LSH_HAVE_AVX2)
+  const __m256i needle = _mm256_set1_epi8(byte);
+  const __m256i zero = _mm256_setzero_si256();
+  while (len - i >= 32) {
+    size_t blocks = (len - i) / 32;
+    if (blocks > 255) blocks = 255;
+    __m256i acc = zero;
+    for (size_t b = 0; b < blocks; b++, i += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+      acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, needle));
+    }
+    __m256i sums = _mm256_sad_epu8(acc, zero);
+    count += (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1) +
+             (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
   }
-  
-  // Handle multiple files
-  int i = 1;
-  int success = 1;
-  
-  while (args[i] != NULL) {
-    // Try deleting each file
-    if (DeleteFile(args[i]) == 0) {
-      // DeleteFile returns 0 on failure, non-zero on success
-      DWORD error = GetLastError();
-      fprintf(stderr, "lsh: failed to delete '%s': ", args[i]);
-      
-      switch (error) {
-        case ERROR_FILE_NOT_FOUND:
-          fprintf(stderr, "file not found\n");
-          break;
-        case ERROR_ACCESS_DENIED:
-          fprintf(stderr, "access denied\n");
-          break;
-        default:
-          fprintf(stderr, "error code %lu\n", error);
-          break;
-      }
-      
-      success = 0;
-    } else {
-      printf("Deleted '%s'\n", args[i]);
+#elif defined(LSH_HAVE_SSE2)
+  const __m128i needle = _mm_set1_epi8(byte);
+  const __m128i zero = _mm_setzero_si128();
+  while (len - i >= 16) {
+    size_t blocks = (len - i) / 16;
+    if (blocks > 255) blocks = 255;
+    __m128i acc = zero;
+    for (size_t b = 0; b < blocks; b++, i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+      acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, needle));
     }
-    
-    i++;
+    __m128i sums = _mm_sad_epu8(acc, zero);
+    count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
   }
-  
-  return success;
+#endif
+  for (; i < len; i++) {
+    count += buf[i] == byte;
+  }
+  return count;
 }
 
+#define LSH_COUNT_CHUNK 4096
 
-
-
-
-int lsh_mkdir(char **args){
-  if (args[1] == NULL){
-    fprintf(stderr, "lsh: expected argument to \"mkdir\"\n");
-    return 1;
+// Index of the nth (1-based) occurrence of byte, or -1 if there are fewer.
+// Whole chunks are skipped with the SIMD counter, only the last is scanned.
+long long lsh_find_nth_byte(const char *buf, size_t len, char byte, size_t n) {
+  size_t i = 0;
+  if (n == 0) return -1;
+  while (len - i > LSH_COUNT_CHUNK) {
+    size_t c = lsh_count_byte(buf + i, LSH_COUNT_CHUNK, byte);
+    if (c >= n) break;
+    n -= c;
+    i += LSH_COUNT_CHUNK;
   }
-
-  if (_mkdir(args[1]) != 0){
-    perror("lsh: mkdir");
+  for (; i < len; i++) {
+    if (buf[i] == byte && --n == 0) return (long long)i;
   }
-
-  return 1;
+  return -1;
 }
 
+// Like lsh_find_nth_byte, counting from the end of the buffer
+long long lsh_find_nth_byte_rev(const char *buf, size_t len, char byte, size_t n) {
+  size_t end = len;
+  if (n == 0) return -1;
+  while (end > LSH_COUNT_CHUNK) {
+    size_t c = lsh_count_byte(buf + end - LSH_COUNT_CHUNK, LSH_COUNT_CHUNK, byte);
+    if (c >= n) break;
+    n -= c;
+    end -= LSH_COUNT_CHUNK;
+  }
+  while (end > 0) {
+    end--;
+    if (buf[end] == byte && --n == 0) return (long long)end;
+  }
+  return -1;
+}
 
-int lsh_rmdir(char **args){
-  if (args[1] == NULL){
-    fprintf(stderr, "lsh: expected argument to \"rmdir\"\n");
-    return 1;
+// Count word starts the way wc does (runs of non-space after a space).
+// *prev_space carries whether the previous buffer ended in whitespace.
+size_t lsh_count_words(const char *buf, size_t len, int *prev_space) {
+  size_t count = 0, i = 0;
+  unsigned int carry = *prev_space ? 1 : 0;
+#ifdef LSH_HAVE_SSE2
+  const __m128i space = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i four = _mm_set1_epi8(4);
+  for (; len - i >= 16; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+    // '\t' '\n' '\v' '\f' '\r' are 9..13: (c - 9) as unsigned is at most 4
+    __m128i ctl = _mm_sub_epi8(v, tab);
+    __m128i is_ctl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl);
+    __m128i ws = _mm_or_si128(is_ctl, _mm_cmpeq_epi8(v, space));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(ws);
+    unsigned int starts = ~mask & ((mask << 1) | carry) & 0xFFFF;
+    count += lsh_popcount32(starts);
+    carry = (mask >> 15) & 1;
+  }
+#endif
+  for (; i < len; i++) {
+    unsigned char c = (unsigned char)buf[i];
+    unsigned int is_space = c == ' ' || (c >= '\t' && c <= '\r');
+    if (!is_space && carry) count++;
+    carry = is_space;
   }
+  *prev_space = (int)carry;
+  return count;
+}
 
+#define LSH_IO_BUFSIZE (1024 * 1024)
 
-  if (_rmdir(args[1]) != 0){
-    perror("lsh: rmdir");
+HANDLE lsh_open_read(const char *path, DWORD flags) {
+  return CreateFile(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | flags, NULL);
+}
+
+static void lsh_print_open_error(const char *cmd, const char *path) {
+  DWORD error = GetLastError();
+  fprintf(stderr, "lsh: %s: cannot open '%s': ", cmd, path);
+  switch (error) {
+    case ERROR_FILE_NOT_FOUND:
+      fprintf(stderr, "file not found\n");
+      break;
+    case ERROR_ACCESS_DENIED:
+      fprintf(stderr, "access denied\n");
+      break;
+    default:
+      fprintf(stderr, "error code %lu\n", error);
+      break;
+  }
+}
+
+// Copy from the current file position to EOF onto stdout, or until Ctrl-C
+static void lsh_copy_to_stdout(HANDLE hFile, char *buffer) {
+  DWORD bytes_read;
+  while (!lsh_interrupted && ReadFile(hFile, buffer, LSH_IO_BUFSIZE, &bytes_read, NULL) && bytes_read > 0) {
+    fwrite(buffer, 1, bytes_read, stdout);
   }
+}
+
+// Parse "-n N" or "-N" style line counts, returns the index of the last
+// argument consumed, or 0 if args[i] isn't a count option
+static int lsh_parse_count(char **args, int i, long long *count) {
+  if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+    *count = atoll(args[i + 1]);
+    return i + 1;
+  }
+  if (args[i][0] == '-' && isdigit((unsigned char)args[i][1])) {
+    *count = atoll(args[i] + 1);
+    return i;
+  }
+  return 0;
+}
+
+typedef struct lsh_wc_counts {
+  unsigned long long lines, words, bytes;
+} lsh_wc_counts;
+
+static int lsh_wc_file(const char *path, char *buffer, int want_words, lsh_wc_counts *out) {
+  HANDLE hFile = lsh_open_read(path, FILE_FLAG_SEQUENTIAL_SCAN);
+  DWORD bytes_read;
+  int prev_space = 1;
 
+  if (hFile == INVALID_HANDLE_VALUE) {
+    lsh_print_open_error("wc", path);
+    return 0;
+  }
+
+  memset(out, 0, sizeof(*out));
+  while (!lsh_interrupted && ReadFile(hFile, buffer, LSH_IO_BUFSIZE, &bytes_read, NULL) && bytes_read > 0) {
+    out->bytes += bytes_read;
+    out->lines += lsh_count_byte(buffer, bytes_read, '\n');
+    if (want_words) {
+      out->words += lsh_count_words(buffer, bytes_read, &prev_space);
+    }
+  }
+
+  CloseHandle(hFile);
   return 1;
 }
 
+static void lsh_wc_print(const lsh_wc_counts *c, int show_lines, int show_words,
+                         int show_bytes, const char *name) {
+  if (show_lines) printf("%10llu ", c->lines);
+  if (show_words) printf("%10llu ", c->words);
+  if (show_bytes) printf("%10llu ", c->bytes);
+  printf("%s\n", name);
+}
 
-int lsh_touch(char **args) {
-  if (args[1] == NULL) {
-    fprintf(stderr, "lsh: expected file argument to \"touch\"\n");
+static int lsh_wc_bench(const char *path);
+
+int lsh_wc(char **args) {
+  int show_lines = 0, show_words = 0, show_bytes = 0;
+  int first_file = 0, num_files = 0, success = 1;
+
+  for (int i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "--bench") == 0) {
+      if (args[i + 1] == NULL) {
+        fprintf(stderr, "lsh: expected file argument to \"wc --bench\"\n");
+        return 1;
+      }
+      return lsh_wc_bench(args[i + 1]);
+    } else if (args[i][0] == '-' && args[i][1] != '\0' && num_files == 0) {
+      for (char *f = args[i] + 1; *f; f++) {
+        if (*f == 'l') show_lines = 1;
+        else if (*f == 'w') show_words = 1;
+        else if (*f == 'c') show_bytes = 1;
+        else {
+          fprintf(stderr, "usage: wc [-lwc] file... | wc --bench file\n");
+          lsh_last_status = 1;
+          return 1;
+        }
+      }
+    } else {
+      if (num_files == 0) first_file = i;
+      num_files++;
+    }
+  }
+
+  if (num_files == 0) {
+    fprintf(stderr, "lsh: expected file argument to \"wc\"\n");
+    lsh_last_status = 1;
     return 1;
   }
-  
-  // Handle multiple files
-  int i = 1;
-  int success = 1;
-  
-  while (args[i] != NULL) {
-    // Check if file exists
-    HANDLE hFile = CreateFile(
-      args[i],                       // filename
-      FILE_WRITE_ATTRIBUTES,         // access mode
-      FILE_SHARE_READ | FILE_SHARE_WRITE, // share mode
-      NULL,                          // security attributes
-      OPEN_ALWAYS,                   // create if doesn't exist, open if does
-      FILE_ATTRIBUTE_NORMAL,         // file attributes
-      NULL                           // template file
-    );
-    
-    if (hFile == INVALID_HANDLE_VALUE) {
-      // Failed to create/open file
-      DWORD error = GetLastError();
-      fprintf(stderr, "lsh: failed to touch '%s': error code %lu\n", args[i], error);
+  if (!show_lines && !show_words && !show_bytes) {
+    show_lines = show_words = show_bytes = 1;
+  }
+
+  char *buffer = (char*)malloc(LSH_IO_BUFSIZE);
+  if (!buffer) {
+    fprintf(stderr, "lsh: allocation error\n");
+    return 1;
+  }
+
+  lsh_wc_counts total;
+  memset(&total, 0, sizeof(total));
+  for (int i = first_file; args[i] != NULL; i++) {
+    lsh_wc_counts counts;
+    if (!lsh_wc_file(args[i], buffer, show_words, &counts)) {
       success = 0;
-    } else {
-      // File was created or opened successfully
-      // Get current system time
-      SYSTEMTIME st;
-      FILETIME ft;
-      GetSystemTime(&st);
-      SystemTimeToFileTime(&st, &ft);
-      
-      // Update file times
-      if (!SetFileTime(hFile, &ft, &ft, &ft)) {
-        fprintf(stderr, "lsh: failed to update timestamps for '%s'\n", args[i]);
-        success = 0;
-      }
-      
-      // Close file handle
-      CloseHandle(hFile);
-      
-      printf("Created/updated '%s'\n", args[i]);
+      continue;
     }
-    
-    i++;
+    if (lsh_interrupted) break;   // the counts are partial
+    lsh_wc_print(&counts, show_lines, show_words, show_bytes, args[i]);
+    total.lines += counts.lines;
+    total.words += counts.words;
+    total.bytes += counts.bytes;
   }
-  
-  return success;
+  if (num_files > 1 && !lsh_interrupted) {
+    lsh_wc_print(&total, show_lines, show_words, show_bytes, "total");
+  }
+
+  free(buffer);
+  if (!success) lsh_last_status = 1;
+  return 1;
 }
 
+// Print the first `lines` lines, reading no further than needed
+static int lsh_head_file(const char *path, long long lines, char *buffer) {
+  HANDLE hFile = lsh_open_read(path, FILE_FLAG_SEQUENTIAL_SCAN);
+  DWORD bytes_read;
 
-int lsh_cd(char **args) {
-  if (args[1] == NULL) {
-    fprintf(stderr, "lsh: expected argument to \"cd\"\n");
-  } else {
-    if (_chdir(args[1]) != 0) {  // Use _chdir for Windows
-      perror("lsh");
+  if (hFile == INVALID_HANDLE_VALUE) {
+    lsh_print_open_error("head", path);
+    return 0;
+  }
+
+  while (lines > 0 && !lsh_interrupted && ReadFile(hFile, buffer, LSH_IO_BUFSIZE, &bytes_read, NULL) && bytes_read > 0) {
+    long long end = lsh_find_nth_byte(buffer, bytes_read, '\n', (size_t)lines);
+    if (end >= 0) {
+      fwrite(buffer, 1, (size_t)end + 1, stdout);
+      break;
     }
+    fwrite(buffer, 1, bytes_read, stdout);
+    lines -= (long long)lsh_count_byte(buffer, bytes_read, '\n');
   }
+
+  CloseHandle(hFile);
   return 1;
 }
 
-char **find_matches(const char *partial_path, int *num_matches) {
-    char cwd[1024];
-    char search_dir[1024] = "";
-    char search_pattern[256] = "";
-    char **matches = NULL;
-    int matches_capacity = 10;
-    *num_matches = 0;
-    
-    // Allocate initial array for matches
-    matches = (char**)malloc(sizeof(char*) * matches_capacity);
-    if (!matches) {
-        fprintf(stderr, "lsh: allocation error in tab completion\n");
-        return NULL;
-    }
-    
-    // Parse the partial path to separate directory and pattern
-    char *last_slash = strrchr(partial_path, '\\');
-    if (last_slash) {
-        // There's a directory part
-        int dir_len = last_slash - partial_path + 1;
-        strncpy(search_dir, partial_path, dir_len);
-        search_dir[dir_len] = '\0';
-        strcpy(search_pattern, last_slash + 1);
-    } else {
-        // No directory specified, use current directory
-        _getcwd(cwd, sizeof(cwd));
-        strcpy(search_dir, cwd);
-        strcat(search_dir, "\\");
-        strcpy(search_pattern, partial_path);
+// Find where the last `lines` lines start by reading blocks backwards from
+// the end of the file, so the cost depends on the output, not the file size
+static long long lsh_tail_offset(HANDLE hFile, long long lines, char *buffer) {
+  LARGE_INTEGER size, pos;
+  DWORD bytes_read;
+
+  size.QuadPart = 0;
+  if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0 || lines <= 0) {
+    return size.QuadPart;
+  }
+
+  // A trailing newline terminates the last line rather than starting a new one
+  size_t needed = (size_t)lines;
+  long long end = size.QuadPart;
+  pos.QuadPart = end - 1;
+  if (SetFilePointerEx(hFile, pos, NULL, FILE_BEGIN) &&
+      ReadFile(hFile, buffer, 1, &bytes_read, NULL) && bytes_read == 1 && buffer[0] == '\n') {
+    end--;
+  }
+
+  while (end > 0 && !lsh_interrupted) {
+    long long start = end > LSH_IO_BUFSIZE ? end - LSH_IO_BUFSIZE : 0;
+    DWORD len = (DWORD)(end - start);
+
+    pos.QuadPart = start;
+    if (!SetFilePointerEx(hFile, pos, NULL, FILE_BEGIN) ||
+        !ReadFile(hFile, buffer, len, &bytes_read, NULL) || bytes_read != len) {
+      return 0;
     }
-    
-    // Prepare for file searching
-    char search_path[1024];
-    strcpy(search_path, search_dir);
-    strcat(search_path, "*");
-    
-    WIN32_FIND_DATA findData;
-    HANDLE hFind = FindFirstFile(search_path, &findData);
-    
-    if (hFind == INVALID_HANDLE_VALUE) {
-        free(matches);
-        return NULL;
+
+    long long nl = lsh_find_nth_byte_rev(buffer, len, '\n', needed);
+    if (nl >= 0) {
+      return start + nl + 1;
     }
-    
-    // Find all matching files/directories
-    do {
-        // Skip . and .. directories
-        if (strcmp(findData.cFileName, ".") == 0 || strcmp(findData.cFileName, "..") == 0) {
-            continue;
-        }
-        
-        // Check if file matches our pattern
-        if (strncmp(findData.cFileName, search_pattern, strlen(search_pattern)) == 0) {
-            // Add to matches
-            if (*num_matches >= matches_capacity) {
-                matches_capacity *= 2;
-                matches = (char**)realloc(matches, sizeof(char*) * matches_capacity);
-                if (!matches) {
-                    fprintf(stderr, "lsh: allocation error in tab completion\n");
-                    FindClose(hFind);
-                    return NULL;
-                }
-            }
-            
-            matches[*num_matches] = _strdup(findData.cFileName);
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                // Append a backslash to directory names
-                size_t len = strlen(matches[*num_matches]);
-                matches[*num_matches] = (char*)realloc(matches[*num_matches], len + 2);
-                strcat(matches[*num_matches], "\\");
-            }
-            (*num_matches)++;
-        }
-    } while (FindNextFile(hFind, &findData));
-    
-    FindClose(hFind);
-    
-    return matches;
+    needed -= lsh_count_byte(buffer, len, '\n');
+    end = start;
+  }
+  return 0;
 }
 
-// New function to find the best match for current input
-char* find_best_match(const char* partial_text) {
-    // Start from the beginning of the current word
-    int len = strlen(partial_text);
-    if (len == 0) return NULL;
-    
-    // Find the start of the current word
-    int word_start = len - 1;
-    while (word_start >= 0 && partial_text[word_start] != ' ' && partial_text[word_start] != '\\') {
-        word_start--;
+// Wait for the file to grow and print what was appended, until a key is hit
+// or Ctrl-C. Change notifications on the parent directory wake us instead
+// of polling.
+static void lsh_tail_follow(const char *path, HANDLE hFile, char *buffer) {
+  char dir[MAX_PATH];
+  char *file_part = NULL;
+  HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+
+  if (GetFullPathName(path, sizeof(dir), dir, &file_part) == 0 || !file_part) {
+    return;
+  }
+  *file_part = '\0';
+
+  HANDLE hChange = FindFirstChangeNotification(dir, FALSE,
+                                               FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE);
+  if (hChange == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "lsh: tail: cannot watch '%s'\n", dir);
+    return;
+  }
+
+  fflush(stdout);
+  LARGE_INTEGER offset, zero;
+  zero.QuadPart = 0;
+  SetFilePointerEx(hFile, zero, &offset, FILE_CURRENT);
+
+  while (!lsh_interrupted) {
+    HANDLE handles[3] = { hChange, hInput, lsh_interrupt_event };
+    // NTFS can defer the directory's size update while a writer keeps the
+    // file open, so wake up once a second as a safety net
+    DWORD result = WaitForMultipleObjects(lsh_interrupt_event ? 3 : 2, handles, FALSE, 1000);
+
+    if (result == WAIT_OBJECT_0 + 1) {
+      if (_kbhit()) {
+        int c = _getch();
+        if (c == 'q' || c == KEY_ESC || c == 3) break;
+      } else {
+        // Mouse and focus events also signal the console, drop them
+        FlushConsoleInputBuffer(hInput);
+      }
+      continue;
     }
-    word_start++; // Move past the space or backslash
-    
-    // Extract the current word
-    char partial_path[1024] = "";
-    strncpy(partial_path, partial_text + word_start, len - word_start);
-    partial_path[len - word_start] = '\0';
-    
-    // Skip if we're not typing a path
-    if (strlen(partial_path) == 0) return NULL;
-    
-    // Find matches
-    int num_matches;
-    char **matches = find_matches(partial_path, &num_matches);
-    
-    if (matches && num_matches > 0) {
-        // Create the full suggestion by combining the prefix with the matched path
-        char* full_suggestion = (char*)malloc(len + strlen(matches[0]) - strlen(partial_path) + 1);
-        if (!full_suggestion) {
-            for (int i = 0; i < num_matches; i++) {
-                free(matches[i]);
-            }
-            free(matches);
-            return NULL;
-        }
-        
-        // Copy the prefix (everything before the current word)
-        strncpy(full_suggestion, partial_text, word_start);
-        full_suggestion[word_start] = '\0';
-        
-        // Append the matched path
-        strcat(full_suggestion, matches[0]);
-        
-        // Free matches array
-        for (int i = 0; i < num_matches; i++) {
-            free(matches[i]);
-        }
-        free(matches);
-        
-        return full_suggestion;
+    if (result == WAIT_FAILED || result == WAIT_OBJECT_0 + 2) break;
+    if (result == WAIT_OBJECT_0) {
+      FindNextChangeNotification(hChange);
     }
-    
-    return NULL;
-}
 
-int lsh_clear(char **args) {
-    // Get the handle to the console
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    
-    if (hConsole == INVALID_HANDLE_VALUE) {
-        perror("lsh: failed to get console handle");
-        return 1;
-    }
-    
-    // Get console information
-    CONSOLE_SCREEN_BUFFER_INFO csbi;
-    if (!GetConsoleScreenBufferInfo(hConsole, &csbi)) {
-        perror("lsh: failed to get console info");
-        return 1;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size)) break;
+    if (size.QuadPart < offset.QuadPart) {
+      // Truncated or rotated, start over from the beginning
+      offset.QuadPart = 0;
     }
-    
-    // Calculate total cells in console
-    DWORD cellCount = csbi.dwSize.X * csbi.dwSize.Y;
-    
-    // Fill the entire buffer with spaces
-    DWORD count;
-    COORD homeCoords = {0, 0};
-    
-    if (!FillConsoleOutputCharacter(hConsole, ' ', cellCount, homeCoords, &count)) {
-        perror("lsh: failed to fill console");
-        return 1;
+    if (size.QuadPart > offset.QuadPart) {
+      SetFilePointerEx(hFile, offset, NULL, FILE_BEGIN);
+      lsh_copy_to_stdout(hFile, buffer);
+      fflush(stdout);
+      SetFilePointerEx(hFile, zero, &offset, FILE_CURRENT);
     }
-    
-    // Fill the entire buffer with the current attributes
-    if (!FillConsoleOutputAttribute(hConsole, csbi.wAttributes, cellCount, homeCoords, &count)) {
-        perror("lsh: failed to set console attributes");
-        return 1;
+  }
+
+  FindCloseChangeNotification(hChange);
+}
+
+int lsh_head(char **args) {
+  long long lines = 10;
+  int first_file = 0, num_files = 0, success = 1;
+
+  for (int i = 1; args[i] != NULL; i++) {
+    int consumed = num_files == 0 ? lsh_parse_count(args, i, &lines) : 0;
+    if (consumed) {
+      i = consumed;
+    } else {
+      if (num_files == 0) first_file = i;
+      num_files++;
     }
-    
-    // Move the cursor to home position
-    SetConsoleCursorPosition(hConsole, homeCoords);
-    
+  }
+
+  if (num_files == 0) {
+    fprintf(stderr, "lsh: expected file argument to \"head\"\n");
+    lsh_last_status = 1;
+    return 1;
+  }
+
+  char *buffer = (char*)malloc(LSH_IO_BUFSIZE);
+  if (!buffer) {
+    fprintf(stderr, "lsh: allocation error\n");
     return 1;
+  }
+
+  for (int i = first_file; args[i] != NULL && !lsh_interrupted; i++) {
+    if (num_files > 1) printf("\n==> %s <==\n", args[i]);
+    if (!lsh_head_file(args[i], lines, buffer)) success = 0;
+  }
+
+  free(buffer);
+  if (!success) lsh_last_status = 1;
+  return 1;
 }
 
-int lsh_dir(char **args) {
-  char cwd[1024];
-  WIN32_FIND_DATA findData;
-  HANDLE hFind;
-  
-  // Get current directory
-  if (_getcwd(cwd, sizeof(cwd)) == NULL) {
-    perror("lsh");
+int lsh_tail(char **args) {
+  long long lines = 10;
+  int follow = 0, first_file = 0, num_files = 0, success = 1;
+
+  for (int i = 1; args[i] != NULL; i++) {
+    int consumed = num_files == 0 ? lsh_parse_count(args, i, &lines) : 0;
+    if (consumed) {
+      i = consumed;
+    } else if (num_files == 0 && strcmp(args[i], "-f") == 0) {
+      follow = 1;
+    } else {
+      if (num_files == 0) first_file = i;
+      num_files++;
+    }
+  }
+
+  if (num_files == 0) {
+    fprintf(stderr, "lsh: expected file argument to \"tail\"\n");
+    lsh_last_status = 1;
     return 1;
   }
-  
-  // Print current directory
-  // printf("Directory of %s\n\n", cwd);
-  
-  // Prepare search pattern for all files
-  char searchPath[1024];
-  strcpy(searchPath, cwd);
-  strcat(searchPath, "\\*");
-  
-  // Find first file
-  hFind = FindFirstFile(searchPath, &findData);
-  
-  if (hFind == INVALID_HANDLE_VALUE) {
-    fprintf(stderr, "lsh: Failed to list directory contents\n");
+  if (follow && num_files > 1) {
+    fprintf(stderr, "lsh: tail: -f takes a single file\n");
+    lsh_last_status = 1;
     return 1;
   }
-  
-  // List all files
-  do {
-    // Skip . and .. directories for cleaner output
-    if (strcmp(findData.cFileName, ".") != 0 && strcmp(findData.cFileName, "..") != 0) {
-      // Check if it's a directory
-      if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-        printf("<DIR>\t%s\n", findData.cFileName);
+
+  char *buffer = (char*)malloc(LSH_IO_BUFSIZE);
+  if (!buffer) {
+    fprintf(stderr, "lsh: allocation error\n");
+    return 1;
+  }
+
+  for (int i = first_file; args[i] != NULL && !lsh_interrupted; i++) {
+    HANDLE hFile = lsh_open_read(args[i], 0);
+    if (hFile == INVALID_HANDLE_VALUE) {
+      lsh_print_open_error("tail", args[i]);
+      success = 0;
+      continue;
+    }
+
+    if (num_files > 1) printf("\n==> %s <==\n", args[i]);
+
+    LARGE_INTEGER start;
+    start.QuadPart = lsh_tail_offset(hFile, lines, buffer);
+    SetFilePointerEx(hFile, start, NULL, FILE_BEGIN);
+    lsh_copy_to_stdout(hFile, buffer);
+
+    if (follow) {
+      lsh_tail_follow(args[i], hFile, buffer);
+    }
+    CloseHandle(hFile);
+  }
+
+  free(buffer);
+  if (!success) lsh_last_status = 1;
+  return 1;
+}
+
+// Time an external command with its output sent to NUL, in microseconds
+static unsigned long long lsh_time_external(char *command_line) {
+  SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+  HANDLE hNull = CreateFile("NUL", GENERIC_WRITE, FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+  STARTUPINFO si;
+  PROCESS_INFORMATION pi;
+  unsigned long long elapsed = 0;
+
+  ZeroMemory(&si, sizeof(si));
+  si.cb = sizeof(si);
+  si.dwFlags = STARTF_USESTDHANDLES;
+  si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+  si.hStdOutput = hNull;
+  si.hStdError = hNull;
+  ZeroMemory(&pi, sizeof(pi));
+
+  unsigned long long start = lsh_now_us();
+  if (CreateProcess(NULL, command_line, NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi)) {
+    WaitForSingleObject(pi.hProcess, INFINITE);
+    elapsed = lsh_now_us() - start;
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+  }
+  CloseHandle(hNull);
+  return elapsed;
+}
+
+// Line counting throughput: memchr loop vs the SIMD kernel vs coreutils wc
+static int lsh_wc_bench(const char *path) {
+  HANDLE hFile = lsh_open_read(path, 0);
+  LARGE_INTEGER size;
+
+  if (hFile == INVALID_HANDLE_VALUE) {
+    lsh_print_open_error("wc", path);
+    return 1;
+  }
+  if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0) {
+    fprintf(stderr, "lsh: wc: '%s' is empty\n", path);
+    CloseHandle(hFile);
+    return 1;
+  }
+
+  HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  const char *data = hMap ? (const char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (!data) {
+    fprintf(stderr, "lsh: wc: cannot map '%s'\n", path);
+    if (hMap) CloseHandle(hMap);
+    CloseHandle(hFile);
+    return 1;
+  }
+
+  size_t len = (size_t)size.QuadPart;
+  double gb = (double)len / 1e9;
+  unsigned long long best_memchr = ~0ULL, best_simd = ~0ULL;
+  size_t lines_memchr = 0, lines_simd = 0;
+
+  // First pass pulls the file into the cache, then take the best of 3
+  lsh_count_byte(data, len, '\n');
+  for (int run = 0; run < 3; run++) {
+    unsigned long long start = lsh_now_us();
+    const char *p = data, *end = data + len;
+    lines_memchr = 0;
+    while ((p = (const char*)memchr(p, '\n', end - p)) != NULL) {
+      lines_memchr++;
+      p++;
+    }
+    unsigned long long t = lsh_now_us() - start;
+    if (t < best_memchr) best_memchr = t;
+
+    start = lsh_now_us();
+    lines_simd = lsh_count_byte(data, len, '\n');
+    t = lsh_now_us() - start;
+    if (t < best_simd) best_simd = t;
+  }
+
+  printf("\n%s: %llu bytes, %llu lines\n", path, (unsigned long long)len, (unsigned long long)lines_simd);
+  printf("  memchr loop   %8.2f GB/s\n", gb / (best_memchr / 1e6 + 1e-9));
+#if defined(LSH_HAVE_AVX2)
+  printf("  avx2 kernel   %8.2f GB/s\n", gb / (best_simd / 1e6 + 1e-9));
+#elif defined(LSH_HAVE_SSE2)
+  printf("  sse2 kernel   %8.2f GB/s\n", gb / (best_simd / 1e6 + 1e-9));
+#else
+  printf("  scalar kernel %8.2f GB/s\n", gb / (best_simd / 1e6 + 1e-9));
+#endif
+  if (lines_memchr != lines_simd) {
+    printf("  warning: kernels disagree (%llu vs %llu lines)\n",
+           (unsigned long long)lines_memchr, (unsigned long long)lines_simd);
+  }
+
+  // Whole builtin path including reads, for comparison with a process
+  char *buffer = (char*)malloc(LSH_IO_BUFSIZE);
+  if (buffer) {
+    lsh_wc_counts counts;
+    unsigned long long start = lsh_now_us();
+    lsh_wc_file(path, buffer, 0, &counts);
+    printf("  builtin wc -l %8.2f GB/s\n", gb / ((lsh_now_us() - start) / 1e6 + 1e-9));
+    free(buffer);
+  }
+
+  char wc_path[MAX_PATH];
+  if (SearchPath(NULL, "wc.exe", NULL, sizeof(wc_path), wc_path, NULL)) {
+    char command[MAX_PATH * 2 + 16];
+    unsigned long long best = ~0ULL;
+    snprintf(command, sizeof(command), "\"%s\" -l \"%s\"", wc_path, path);
+    for (int run = 0; run < 3; run++) {
+      unsigned long long t = lsh_time_external(command);
+      if (t && t < best) best = t;
+    }
+    if (best != ~0ULL) {
+      printf("  coreutils wc  %8.2f GB/s (%s)\n", gb / (best / 1e6 + 1e-9), wc_path);
+    }
+  } else {
+    printf("  coreutils wc  not found on PATH\n");
+  }
+  printf("\n");
+
+  UnmapViewOfFile(data);
+  CloseHandle(hMap);
+  CloseHandle(hFile);
+  return 1;
+}
+
+static inline int lsh_clz32(unsigned int x) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanReverse(&index, x);
+  return 31 - (int)index;
+#else
+  return __builtin_clz(x);
+#endif
+}
+
+// Find needle in hay. The SIMD path tests the first and last needle bytes
+// for 16 candidate positions at once and only memcmps the survivors.
+const char *lsh_memmem(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+  if (nlen == 0) return hay;
+  if (nlen > hlen) return NULL;
+
+  size_t i = 0, last = hlen - nlen;  // last valid start position
+  size_t middle = nlen > 2 ? nlen - 2 : 0;
+#ifdef LSH_HAVE_SSE2
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i final = _mm_set1_epi8(needle[nlen - 1]);
+  for (; last >= 15 && i <= last - 15; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + nlen - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+    while (mask) {
+      int bit = lsh_ctz32(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, middle) == 0) return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i <= last; i++) {
+    if (hay[i] == needle[0] && memcmp(hay + i, needle, nlen) == 0) return hay + i;
+  }
+  return NULL;
+}
+
+// Last occurrence of needle in hay, same filtering as lsh_memmem
+const char *lsh_memrmem(const char *hay, size_t hlen, const char *needle, size_t nlen) {
+  if (nlen == 0) return hay + hlen;
+  if (nlen > hlen) return NULL;
+
+  size_t end = hlen - nlen + 1;  // candidate starts are [0, end)
+  size_t middle = nlen > 2 ? nlen - 2 : 0;
+#ifdef LSH_HAVE_SSE2
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i final = _mm_set1_epi8(needle[nlen - 1]);
+  while (end >= 16) {
+    size_t i = end - 16;
+    __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + nlen - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+    while (mask) {
+      int bit = 31 - lsh_clz32(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, middle) == 0) return hay + i + bit;
+      mask &= ~(1u << bit);
+    }
+    end = i;
+  }
+#endif
+  while (end > 0) {
+    end--;
+    if (hay[end] == needle[0] && memcmp(hay + end, needle, nlen) == 0) return hay + end;
+  }
+  return NULL;
+}
+
+/*
+ * view/less: pager for huge files.
+ *
+ * The file is mapped, never read into memory. A background thread builds a
+ * sparse index holding the offset of every VIEW_STRIDE-th line, but only
+ * runs VIEW_LOOKAHEAD bytes ahead of the screen (or up to a requested line)
+ * and then sleeps, so opening a file is instant. Any line the index covers
+ * is found with one lookup plus counting less than VIEW_STRIDE lines.
+ * The screen is drawn into a separate console buffer; scrolling by one
+ * line moves the buffer contents and draws only the new row.
+ */
+
+#define VIEW_STRIDE 1024
+#define VIEW_LOOKAHEAD (64ULL * 1024 * 1024)
+#define VIEW_INDEX_CHUNK (1024 * 1024)
+#define VIEW_SEARCH_CHUNK (64ULL * 1024 * 1024)
+#define VIEW_UNKNOWN (~0ULL)
+
+typedef struct view_state {
+  const char *data;
+  unsigned long long size;
+  const char *name;
+
+  // Sparse line index: index[k] is the offset of line k * VIEW_STRIDE
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE more;    // wakes the indexer when the target moves
+  CONDITION_VARIABLE ready;   // wakes the UI when new entries arrive
+  unsigned long long *index;
+  size_t index_len, index_cap;
+  unsigned long long indexed_bytes;
+  unsigned long long indexed_newlines;
+  unsigned long long want_offset;
+  unsigned long long want_line;
+  int done;
+  int quit;
+
+  // Screen
+  HANDLE hScreen;
+  int width;
+  int rows;                   // text rows, the status line is below them
+  unsigned long long top;     // offset of the first visible line
+  char *row_buf;
+  char message[128];
+  char search[256];
+} view_state;
+
+static unsigned __stdcall view_indexer(void *arg) {
+  view_state *v = (view_state*)arg;
+  unsigned long long *found = (unsigned long long*)malloc(
+      sizeof(unsigned long long) * (VIEW_INDEX_CHUNK / VIEW_STRIDE + 2));
+
+  EnterCriticalSection(&v->lock);
+  while (found && !v->quit && !v->done) {
+    if (v->indexed_bytes >= v->want_offset &&
+        (unsigned long long)v->index_len * VIEW_STRIDE > v->want_line) {
+      SleepConditionVariableCS(&v->more, &v->lock, INFINITE);
+      continue;
+    }
+
+    unsigned long long pos = v->indexed_bytes;
+    unsigned long long newlines = v->indexed_newlines;
+    unsigned long long next_line = (unsigned long long)v->index_len * VIEW_STRIDE;
+    LeaveCriticalSection(&v->lock);
+
+    // Scan one chunk without holding the lock
+    size_t len = (size_t)(v->size - pos < VIEW_INDEX_CHUNK ? v->size - pos : VIEW_INDEX_CHUNK);
+    const char *chunk = v->data + pos;
+    size_t base = 0, num_found = 0;
+    unsigned long long seen = newlines;
+    while (1) {
+      long long p = lsh_find_nth_byte(chunk + base, len - base, '\n', (size_t)(next_line - seen));
+      if (p < 0) break;
+      seen = next_line;
+      base += (size_t)p + 1;
+      found[num_found++] = pos + base;
+      next_line += VIEW_STRIDE;
+    }
+    newlines += lsh_count_byte(chunk, len, '\n');
+
+    EnterCriticalSection(&v->lock);
+    if (v->index_len + num_found > v->index_cap) {
+      size_t new_cap = (v->index_len + num_found) * 2;
+      unsigned long long *idx = (unsigned long long*)realloc(v->index, sizeof(unsigned long long) * new_cap);
+      if (!idx) {
+        v->done = 1;
+        break;
+      }
+      v->index = idx;
+      v->index_cap = new_cap;
+    }
+    memcpy(v->index + v->index_len, found, sizeof(unsigned long long) * num_found);
+    v->index_len += num_found;
+    v->indexed_bytes = pos + len;
+    v->indexed_newlines = newlines;
+    if (v->indexed_bytes >= v->size) {
+      v->done = 1;
+    }
+    WakeAllConditionVariable(&v->ready);
+  }
+  WakeAllConditionVariable(&v->ready);
+  LeaveCriticalSection(&v->lock);
+
+  free(found);
+  return 0;
+}
+
+// Ask the indexer to cover at least this offset and line
+static void view_request(view_state *v, unsigned long long offset, unsigned long long line) {
+  EnterCriticalSection(&v->lock);
+  if (offset > v->want_offset) v->want_offset = offset;
+  if (line != VIEW_UNKNOWN && line > v->want_line) v->want_line = line;
+  WakeConditionVariable(&v->more);
+  LeaveCriticalSection(&v->lock);
+}
+
+// Line number of the line starting at offset, or VIEW_UNKNOWN if not indexed yet
+static unsigned long long view_line_of(view_state *v, unsigned long long offset) {
+  unsigned long long base, line;
+
+  EnterCriticalSection(&v->lock);
+  if (offset > v->indexed_bytes) {
+    LeaveCriticalSection(&v->lock);
+    return VIEW_UNKNOWN;
+  }
+  size_t lo = 0, hi = v->index_len;
+  while (hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if (v->index[mid] <= offset) lo = mid; else hi = mid;
+  }
+  base = v->index[lo];
+  line = (unsigned long long)lo * VIEW_STRIDE;
+  LeaveCriticalSection(&v->lock);
+
+  return line + lsh_count_byte(v->data + base, (size_t)(offset - base), '\n');
+}
+
+// Offset of a line, or VIEW_UNKNOWN if the index doesn't reach it yet
+static unsigned long long view_offset_of(view_state *v, unsigned long long line) {
+  unsigned long long base;
+  size_t k = (size_t)(line / VIEW_STRIDE);
+
+  EnterCriticalSection(&v->lock);
+  if (k >= v->index_len) {
+    int done = v->done;
+    LeaveCriticalSection(&v->lock);
+    return done ? v->size : VIEW_UNKNOWN;
+  }
+  base = v->index[k];
+  LeaveCriticalSection(&v->lock);
+
+  size_t rest = (size_t)(line % VIEW_STRIDE);
+  if (rest == 0) return base;
+  long long p = lsh_find_nth_byte(v->data + base, (size_t)(v->size - base), '\n', rest);
+  return p < 0 ? v->size : base + p + 1;
+}
+
+static unsigned long long view_next_line(view_state *v, unsigned long long offset) {
+  const char *nl = (const char*)memchr(v->data + offset, '\n', (size_t)(v->size - offset));
+  return nl ? (unsigned long long)(nl - v->data) + 1 : v->size;
+}
+
+// Start of the line containing offset
+static unsigned long long view_line_start(view_state *v, unsigned long long offset) {
+  if (offset == 0) return 0;
+  long long p = lsh_find_nth_byte_rev(v->data, (size_t)offset, '\n', 1);
+  return p < 0 ? 0 : (unsigned long long)p + 1;
+}
+
+static unsigned long long view_prev_line(view_state *v, unsigned long long offset) {
+  return offset == 0 ? 0 : view_line_start(v, offset - 1);
+}
+
+static void view_draw_row(view_state *v, int row, unsigned long long offset) {
+  int col = 0;
+  DWORD written;
+  COORD pos = { 0, (SHORT)row };
+
+  // Past the end of the file rows are blank, except for a marker like less
+  if (offset >= v->size) {
+    memset(v->row_buf, ' ', v->width);
+    if (row > 0) v->row_buf[0] = '~';
+  } else {
+    const char *p = v->data + offset;
+    const char *end = v->data + v->size;
+    while (p < end && *p != '\n' && col < v->width) {
+      unsigned char c = (unsigned char)*p++;
+      if (c == '\t') {
+        do { v->row_buf[col++] = ' '; } while (col % 8 && col < v->width);
+      } else if (c == '\r') {
+        continue;
       } else {
-        // Print file name and size
-        printf("%u\t%s\n", findData.nFileSizeLow, findData.cFileName);
+        v->row_buf[col++] = (c < 32 || c == 127) ? '.' : (char)c;
       }
     }
-    printf("\n");
-  } while (FindNextFile(hFind, &findData));
+    memset(v->row_buf + col, ' ', v->width - col);
+  }
+  WriteConsoleOutputCharacter(v->hScreen, v->row_buf, v->width, pos, &written);
+}
+
+static void view_draw_status(view_state *v) {
+  char status[512];
+  char line_str[32], total_str[32];
+  DWORD written;
+  COORD pos = { 0, (SHORT)v->rows };
+  unsigned long long line = view_line_of(v, v->top);
+  int done;
+  unsigned long long total;
+
+  EnterCriticalSection(&v->lock);
+  done = v->done;
+  total = v->indexed_newlines;
+  LeaveCriticalSection(&v->lock);
+  if (done && v->size > 0 && v->data[v->size - 1] != '\n') total++;
+
+  if (line == VIEW_UNKNOWN) strcpy(line_str, "?"); else snprintf(line_str, sizeof(line_str), "%llu", line + 1);
+  if (!done) strcpy(total_str, "?"); else snprintf(total_str, sizeof(total_str), "%llu", total);
+
+  int len = snprintf(status, sizeof(status), " %s  line %s of %s  %d%%  %s", v->name, line_str, total_str,
+                     v->size ? (int)(v->top * 100 / v->size) : 100, v->message);
+  if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+  if (len > v->width) len = v->width;
+  if (len < 0) len = 0;
+  memset(status + len, ' ', sizeof(status) - len);
+  WriteConsoleOutputCharacter(v->hScreen, status, v->width < (int)sizeof(status) ? v->width : (int)sizeof(status),
+                              pos, &written);
+  FillConsoleOutputAttribute(v->hScreen, BACKGROUND_RED | BACKGROUND_GREEN | BACKGROUND_BLUE,
+                             v->width, pos, &written);
+  v->message[0] = '\0';
+}
+
+static void view_draw(view_state *v) {
+  unsigned long long offset = v->top;
+  for (int row = 0; row < v->rows; row++) {
+    view_draw_row(v, row, offset);
+    offset = offset < v->size ? view_next_line(v, offset) : v->size;
+  }
+  view_draw_status(v);
+}
+
+// Offset of the line `count` rows below offset
+static unsigned long long view_skip_lines(view_state *v, unsigned long long offset, int count) {
+  for (int i = 0; i < count && offset < v->size; i++) {
+    offset = view_next_line(v, offset);
+  }
+  return offset;
+}
+
+// Move the view by one line, shifting what is on screen instead of redrawing it
+static void view_scroll(view_state *v, int down) {
+  unsigned long long new_top = down ? view_next_line(v, v->top) : view_prev_line(v, v->top);
+  if (new_top == v->top || (down && new_top >= v->size)) return;
+  v->top = new_top;
+
+  SMALL_RECT area = { 0, 0, (SHORT)(v->width - 1), (SHORT)(v->rows - 1) };
+  COORD dest = { 0, (SHORT)(down ? -1 : 1) };
+  CHAR_INFO fill;
+  fill.Char.AsciiChar = ' ';
+  fill.Attributes = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+  ScrollConsoleScreenBuffer(v->hScreen, &area, &area, dest, &fill);
+
+  if (down) {
+    view_draw_row(v, v->rows - 1, view_skip_lines(v, v->top, v->rows - 1));
+  } else {
+    view_draw_row(v, 0, v->top);
+  }
+  view_draw_status(v);
+}
+
+// Read a short answer on the status line, returns 0 if cancelled with Esc
+static int view_prompt(view_state *v, const char *label, char *out, size_t out_size) {
+  size_t len = 0;
+  out[0] = '\0';
+
+  while (1) {
+    char line[512];
+    DWORD written;
+    COORD pos = { 0, (SHORT)v->rows };
+    int n = snprintf(line, sizeof(line), "%s%s", label, out);
+    if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+    if (n > v->width) n = v->width;
+    memset(line + n, ' ', sizeof(line) - n);
+    WriteConsoleOutputCharacter(v->hScreen, line, v->width < (int)sizeof(line) ? v->width : (int)sizeof(line),
+                                pos, &written);
+    pos.X = (SHORT)n;
+    SetConsoleCursorPosition(v->hScreen, pos);
+
+    int c = _getch();
+    if (c == KEY_ENTER) return 1;
+    if (c == KEY_ESC) return 0;
+    if (c == 0 || c == 224) {
+      _getch();
+    } else if (c == KEY_BACKSPACE) {
+      if (len > 0) out[--len] = '\0';
+    } else if (isprint(c) && len + 1 < out_size) {
+      out[len++] = (char)c;
+      out[len] = '\0';
+    }
+  }
+}
+
+// Wait until the indexer reaches a line. Esc or Ctrl-C gives up. Returns its offset.
+static unsigned long long view_wait_for_line(view_state *v, unsigned long long line) {
+  view_request(v, 0, line);
+  while (1) {
+    unsigned long long offset = view_offset_of(v, line);
+    if (offset != VIEW_UNKNOWN) return offset;
+
+    EnterCriticalSection(&v->lock);
+    SleepConditionVariableCS(&v->ready, &v->lock, 100);
+    int pct = v->size ? (int)(v->indexed_bytes * 100 / v->size) : 100;
+    LeaveCriticalSection(&v->lock);
+
+    snprintf(v->message, sizeof(v->message), "indexing... %d%% (Esc to stop)", pct);
+    view_draw_status(v);
+    if (lsh_interrupted || (_kbhit() && _getch() == KEY_ESC)) return VIEW_UNKNOWN;
+  }
+}
+
+// Search from the line after (or before) the top of the screen. Works in
+// large chunks so Esc or Ctrl-C can interrupt a search through a huge file.
+static void view_search(view_state *v, int forward) {
+  size_t nlen = strlen(v->search);
+  const char *hit = NULL;
+
+  if (nlen == 0) return;
+
+  if (forward) {
+    unsigned long long from = view_next_line(v, v->top);
+    while (from < v->size && !hit) {
+      unsigned long long len = v->size - from;
+      if (len > VIEW_SEARCH_CHUNK + nlen) len = VIEW_SEARCH_CHUNK + nlen;
+      hit = lsh_memmem(v->data + from, (size_t)len, v->search, nlen);
+      from += VIEW_SEARCH_CHUNK;
+      if (lsh_interrupted || (_kbhit() && _getch() == KEY_ESC)) break;
+    }
+  } else {
+    unsigned long long to = v->top;
+    while (to > 0 && !hit) {
+      unsigned long long start = to > VIEW_SEARCH_CHUNK ? to - VIEW_SEARCH_CHUNK : 0;
+      unsigned long long end = to + nlen - 1 < v->size ? to + nlen - 1 : v->size;
+      // Overlap by nlen - 1 so matches that straddle chunks are found
+      hit = lsh_memrmem(v->data + start, (size_t)(end - start), v->search, nlen);
+      to = start;
+      if (lsh_interrupted || (_kbhit() && _getch() == KEY_ESC)) break;
+    }
+  }
+
+  if (hit) {
+    v->top = view_line_start(v, (unsigned long long)(hit - v->data));
+  } else {
+    snprintf(v->message, sizeof(v->message), "pattern not found");
+    view_draw_status(v);
+  }
+}
+
+// Top offset that shows the last screenful of the file
+static unsigned long long view_last_page(view_state *v) {
+  unsigned long long offset = v->size;
+  if (offset > 0 && v->data[offset - 1] == '\n') offset--;
+  offset = view_line_start(v, offset);
+  for (int i = 1; i < v->rows; i++) offset = view_prev_line(v, offset);
+  return offset;
+}
+
+static void view_run(view_state *v) {
+  char answer[64];
+
+  view_draw(v);
+  while (1) {
+    unsigned long long old_top = v->top;
+    int status_only = 0;
+    // In the pager Ctrl-C only stops a search or a wait, like Esc
+    lsh_interrupt_clear();
+    int c = _getch();
+
+    if (c == 0 || c == 224) {
+      // Arrow and navigation keys come as a prefix plus a scan code
+      switch (_getch()) {
+        case 72: c = 'k'; break;
+        case 80: c = 'j'; break;
+        case 73: c = 'b'; break;
+        case 81: c = ' '; break;
+        case 71: c = 'g'; break;
+        case 79: c = 'G'; break;
+        default: continue;
+      }
+    }
+
+    switch (c) {
+      case 'q':
+      case 'Q':
+      case KEY_ESC:
+        return;
+      case 'j':
+      case KEY_ENTER:
+        view_scroll(v, 1);
+        break;
+      case 'k':
+        view_scroll(v, 0);
+        break;
+      case ' ':
+      case 'f': {
+        unsigned long long next = view_skip_lines(v, v->top, v->rows);
+        if (next < v->size) v->top = next;
+        break;
+      }
+      case 'b':
+        for (int i = 0; i < v->rows; i++) v->top = view_prev_line(v, v->top);
+        break;
+      case 'g':
+        v->top = 0;
+        break;
+      case 'G':
+        v->top = view_last_page(v);
+        break;
+      case ':':
+        if (view_prompt(v, ":", answer, sizeof(answer)) && atoll(answer) > 0) {
+          unsigned long long offset = view_wait_for_line(v, (unsigned long long)atoll(answer) - 1);
+          if (offset != VIEW_UNKNOWN) v->top = offset < v->size ? offset : view_last_page(v);
+        }
+        status_only = 1;
+        break;
+      case '%':
+      case 'p':
+        // Percentages map straight to an offset, no index needed
+        if (view_prompt(v, "%", answer, sizeof(answer))) {
+          int pct = atoi(answer);
+          if (pct < 0) pct = 0;
+          if (pct > 100) pct = 100;
+          v->top = view_line_start(v, v->size * pct / 100);
+        }
+        status_only = 1;
+        break;
+      case '/':
+      case '?':
+        if (view_prompt(v, c == '/' ? "/" : "?", v->search, sizeof(v->search))) {
+          view_search(v, c == '/');
+        }
+        status_only = 1;
+        break;
+      case 'n':
+        view_search(v, 1);
+        status_only = 1;
+        break;
+      case 'N':
+        view_search(v, 0);
+        status_only = 1;
+        break;
+      default:
+        break;
+    }
+
+    if (v->top != old_top) {
+      view_request(v, v->top + VIEW_LOOKAHEAD, VIEW_UNKNOWN);
+      if (c != 'j' && c != 'k' && c != KEY_ENTER) {
+        view_draw(v);
+      }
+    } else if (status_only) {
+      view_draw_status(v);
+    }
+  }
+}
+
+int lsh_view(char **args) {
+  view_state v;
+  LARGE_INTEGER size;
+  CONSOLE_SCREEN_BUFFER_INFO csbi;
+  HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected file argument to \"%s\"\n", args[0]);
+    return 1;
+  }
+
+  memset(&v, 0, sizeof(v));
+  v.name = args[1];
+
+  HANDLE hFile = lsh_open_read(args[1], FILE_FLAG_SEQUENTIAL_SCAN);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    lsh_print_open_error(args[0], args[1]);
+    return 1;
+  }
+  if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0) {
+    // Nothing to page through, and empty files can't be mapped
+    CloseHandle(hFile);
+    return 1;
+  }
+  v.size = (unsigned long long)size.QuadPart;
+
+  HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  v.data = hMap ? (const char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (!v.data) {
+    fprintf(stderr, "lsh: %s: cannot map '%s'\n", args[0], args[1]);
+    if (hMap) CloseHandle(hMap);
+    CloseHandle(hFile);
+    return 1;
+  }
+
+  GetConsoleScreenBufferInfo(hConsole, &csbi);
+  v.width = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+  v.rows = csbi.srWindow.Bottom - csbi.srWindow.Top;  // one row left for status
+  if (v.rows < 1) v.rows = 1;
+  v.row_buf = (char*)malloc(v.width);
+  v.index = (unsigned long long*)malloc(sizeof(unsigned long long) * 1024);
+  v.index_cap = 1024;
+  v.index_len = 1;
+  if (v.index) v.index[0] = 0;
+
+  // Draw on a separate screen buffer so the shell's output is left intact
+  v.hScreen = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                                        CONSOLE_TEXTMODE_BUFFER, NULL);
+  if (v.hScreen == INVALID_HANDLE_VALUE || !v.row_buf || !v.index) {
+    fprintf(stderr, "lsh: %s: cannot create screen buffer\n", args[0]);
+  } else {
+    COORD buf_size = { (SHORT)v.width, (SHORT)(v.rows + 1) };
+    SetConsoleScreenBufferSize(v.hScreen, buf_size);
+    SetConsoleActiveScreenBuffer(v.hScreen);
+
+    InitializeCriticalSection(&v.lock);
+    InitializeConditionVariable(&v.more);
+    InitializeConditionVariable(&v.ready);
+    v.want_offset = VIEW_LOOKAHEAD;
+
+    HANDLE hIndexer = (HANDLE)_beginthreadex(NULL, 0, view_indexer, &v, 0, NULL);
+    view_run(&v);
+
+    EnterCriticalSection(&v.lock);
+    v.quit = 1;
+    WakeConditionVariable(&v.more);
+    LeaveCriticalSection(&v.lock);
+    if (hIndexer) {
+      WaitForSingleObject(hIndexer, INFINITE);
+      CloseHandle(hIndexer);
+    }
+    DeleteCriticalSection(&v.lock);
+
+    SetConsoleActiveScreenBuffer(hConsole);
+    CloseHandle(v.hScreen);
+  }
+
+  free(v.index);
+  free(v.row_buf);
+  UnmapViewOfFile(v.data);
+  CloseHandle(hMap);
+  CloseHandle(hFile);
+  return 1;
+}
+
+
+int lsh_del(char **args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected file argument to \"del\"\n");
+    return 1;
+  }
   
-  // Close find handle
-  FindClose(hFind);
+  // Handle multiple files
+  int i = 1;
+  int success = 1;
+  
+  while (args[i] != NULL && !lsh_interrupted) {
+    // Try deleting each file
+    if (DeleteFile(args[i]) == 0) {
+      // DeleteFile returns 0 on failure, non-zero on success
+      DWORD error = GetLastError();
+      fprintf(stderr, "lsh: failed to delete '%s': ", args[i]);
+      
+      switch (error) {
+        case ERROR_FILE_NOT_FOUND:
+          fprintf(stderr, "file not found\n");
+          break;
+        case ERROR_ACCESS_DENIED:
+          fprintf(stderr, "access denied\n");
+          break;
+        default:
+          fprintf(stderr, "error code %lu\n", error);
+          break;
+      }
+      
+      success = 0;
+    } else {
+      printf("Deleted '%s'\n", args[i]);
+    }
+    
+    i++;
+  }
   
+  return success;
+}
+
+
+
+
+
+int lsh_mkdir(char **args){
+  if (args[1] == NULL){
+    fprintf(stderr, "lsh: expected argument to \"mkdir\"\n");
+    return 1;
+  }
+
+  if (_mkdir(args[1]) != 0){
+    perror("lsh: mkdir");
+  }
+
   return 1;
 }
 
-int lsh_help(char **args) {
-  int i;
-  printf("Marcus Denslow's LSH\n");
-  printf("Type program names and arguments, and hit enter.\n");
-  printf("The following are built in:\n");
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    printf("  %s\n", builtin_str[i]);
+
+int lsh_rmdir(char **args){
+  if (args[1] == NULL){
+    fprintf(stderr, "lsh: expected argument to \"rmdir\"\n");
+    return 1;
+  }
+
+
+  if (_rmdir(args[1]) != 0){
+    perror("lsh: rmdir");
+  }
+
+  return 1;
+}
+
+
+int lsh_touch(char **args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected file argument to \"touch\"\n");
+    return 1;
+  }
+  
+  // Handle multiple files
+  int i = 1;
+  int success = 1;
+  
+  while (args[i] != NULL && !lsh_interrupted) {
+    // Check if file exists
+    HANDLE hFile = CreateFile(
+      args[i],                       // filename
+      FILE_WRITE_ATTRIBUTES,         // access mode
+      FILE_SHARE_READ | FILE_SHARE_WRITE, // share mode
+      NULL,                          // security attributes
+      OPEN_ALWAYS,                   // create if doesn't exist, open if does
+      FILE_ATTRIBUTE_NORMAL,         // file attributes
+      NULL                           // template file
+    );
+    
+    if (hFile == INVALID_HANDLE_VALUE) {
+      // Failed to create/open file
+      DWORD error = GetLastError();
+      fprintf(stderr, "lsh: failed to touch '%s': error code %lu\n", args[i], error);
+      success = 0;
+    } else {
+      // File was created or opened successfully
+      // Get current system time
+      SYSTEMTIME st;
+      FILETIME ft;
+      GetSystemTime(&st);
+      SystemTimeToFileTime(&st, &ft);
+      
+      // Update file times
+      if (!SetFileTime(hFile, &ft, &ft, &ft)) {
+        fprintf(stderr, "lsh: failed to update timestamps for '%s'\n", args[i]);
+        success = 0;
+      }
+      
+      // Close file handle
+      CloseHandle(hFile);
+      
+      printf("Created/updated '%s'\n", args[i]);
+    }
+    
+    i++;
+  }
+  
+  return success;
+}
+
+
+/*
+ * Frecency database for z/j and the cd fallback.
+ *
+ * ~\.lsh_z holds fixed-size records sorted by lowercase path followed by a
+ * string table, and is mapped rather than read. Visits are appended to
+ * ~\.lsh_z.log, one short line each, and replayed into an in-memory
+ * overlay on load. Once the journal grows past Z_COMPACT_AFTER lines the
+ * two are merged into a new database that is swapped in with MoveFileEx,
+ * so readers never see a partial file.
+ *
+ * Several shells append to the one journal. The shell that compacts holds
+ * ~\.lsh_z.lock, moves the journal aside and rebuilds from the database
+ * and everything in that journal, not just what it has seen itself, so
+ * other shells' visits are kept; visits made meanwhile go to a new
+ * journal. Only the journal it merged is deleted.
+ *
+ * Each record carries a 64-bit mask of the characters in its path. A query
+ * first rejects every entry whose mask lacks one of the query's characters,
+ * which leaves few candidates for the substring checks.
+ */
+
+#define Z_DB_NAME ".lsh_z"
+#define Z_LOG_NAME ".lsh_z.log"
+#define Z_LOCK_NAME ".lsh_z.lock"
+#define Z_DB_MAGIC "LSHZ\001\000\000\000"
+#define Z_COMPACT_AFTER 512
+#define Z_MAX_RANK 9000.0
+#define Z_MAX_FRAGMENTS 16
+
+typedef struct z_rec {
+  unsigned int path_off;    // original path in the string table
+  unsigned int lower_off;   // lowercase copy used for matching
+  unsigned int path_len;
+  unsigned int reserved;
+  unsigned long long mask;
+  double rank;
+  long long time;
+} z_rec;
+
+typedef struct z_entry {
+  char *path;
+  char *lower;
+  unsigned long long mask;
+  double rank;
+  long long time;
+} z_entry;
+
+typedef struct z_db {
+  int loaded;
+  HANDLE hFile, hMap;
+  const char *view;
+  const z_rec *recs;
+  unsigned int num_recs;
+  const char *strings;
+  unsigned int strings_size;
+
+  // Visits since the last compaction, keyed by lowercase path
+  z_entry *overlay;
+  int num_overlay, cap_overlay;
+  int *overlay_table;       // index + 1 into overlay, 0 for empty
+  size_t overlay_cap;
+  int log_lines;
+} z_db;
+
+static z_db z_state;
+
+static long long z_now(void) {
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  return (long long)((((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10000000ULL);
+}
+
+static unsigned long long z_char_bit(unsigned char c) {
+  if (c >= 'a' && c <= 'z') return 1ULL << (c - 'a');
+  if (c >= '0' && c <= '9') return 1ULL << (26 + c - '0');
+  if (c == '\\' || c == ':') return 0;
+  return 1ULL << (36 + c % 28);
+}
+
+static unsigned long long z_mask(const char *lower) {
+  unsigned long long mask = 0;
+  while (*lower) mask |= z_char_bit((unsigned char)*lower++);
+  return mask;
+}
+
+static char *z_lower(const char *s) {
+  char *lower = _strdup(s);
+  if (lower) {
+    for (char *p = lower; *p; p++) *p = (char)tolower((unsigned char)*p);
+  }
+  return lower;
+}
+
+// Frecency: visit count weighted by how recently the directory was used
+static double z_score(double rank, long long time, long long now) {
+  long long age = now - time;
+  if (age < 3600) return rank * 4;
+  if (age < 86400) return rank * 2;
+  if (age < 604800) return rank / 2;
+  return rank / 4;
+}
+
+static int z_overlay_find(const char *lower) {
+  if (!z_state.overlay_cap) return -1;
+  size_t j = lsh_hash_str(lower) & (z_state.overlay_cap - 1);
+  while (z_state.overlay_table[j]) {
+    int idx = z_state.overlay_table[j] - 1;
+    if (strcmp(z_state.overlay[idx].lower, lower) == 0) return idx;
+    j = (j + 1) & (z_state.overlay_cap - 1);
+  }
+  return -1;
+}
+
+static int z_overlay_add(char *path, char *lower) {
+  z_db *z = &z_state;
+
+  if (z->num_overlay >= z->cap_overlay) {
+    int new_cap = z->cap_overlay ? z->cap_overlay * 2 : 64;
+    z_entry *e = (z_entry*)realloc(z->overlay, sizeof(z_entry) * new_cap);
+    if (!e) return -1;
+    z->overlay = e;
+    z->cap_overlay = new_cap;
+  }
+  if ((size_t)(z->num_overlay + 1) * 2 > z->overlay_cap) {
+    size_t new_cap = z->overlay_cap ? z->overlay_cap * 2 : 128;
+    int *table = (int*)calloc(new_cap, sizeof(int));
+    if (!table) return -1;
+    for (int i = 0; i < z->num_overlay; i++) {
+      size_t j = lsh_hash_str(z->overlay[i].lower) & (new_cap - 1);
+      while (table[j]) j = (j + 1) & (new_cap - 1);
+      table[j] = i + 1;
+    }
+    free(z->overlay_table);
+    z->overlay_table = table;
+    z->overlay_cap = new_cap;
+  }
+
+  int idx = z->num_overlay++;
+  z->overlay[idx].path = path;
+  z->overlay[idx].lower = lower;
+  z->overlay[idx].mask = z_mask(lower);
+  z->overlay[idx].rank = 0;
+  z->overlay[idx].time = 0;
+
+  size_t j = lsh_hash_str(lower) & (z->overlay_cap - 1);
+  while (z->overlay_table[j]) j = (j + 1) & (z->overlay_cap - 1);
+  z->overlay_table[j] = idx + 1;
+  return idx;
+}
+
+// Binary search of the sorted database records
+static const z_rec *z_db_find(const char *lower) {
+  unsigned int lo = 0, hi = z_state.num_recs;
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(z_state.strings + z_state.recs[mid].lower_off, lower);
+    if (cmp == 0) return &z_state.recs[mid];
+    if (cmp < 0) lo = mid + 1; else hi = mid;
+  }
+  return NULL;
+}
+
+static void z_apply_visit(const char *path, long long time) {
+  char *lower = z_lower(path);
+  if (!lower) return;
+
+  int idx = z_overlay_find(lower);
+  if (idx < 0) {
+    char *copy = _strdup(path);
+    idx = copy ? z_overlay_add(copy, lower) : -1;
+    if (idx < 0) {
+      free(copy);
+      free(lower);
+      return;
+    }
+    const z_rec *rec = z_db_find(lower);
+    if (rec) z_state.overlay[idx].rank = rec->rank;
+  } else {
+    free(lower);
+  }
+
+  z_state.overlay[idx].rank += 1;
+  // A journal put back after a failed compaction can be out of order
+  if (time > z_state.overlay[idx].time) z_state.overlay[idx].time = time;
+}
+
+static void z_overlay_clear(void) {
+  z_db *z = &z_state;
+  for (int i = 0; i < z->num_overlay; i++) {
+    free(z->overlay[i].path);
+    free(z->overlay[i].lower);
+  }
+  z->num_overlay = 0;
+  if (z->overlay_table) memset(z->overlay_table, 0, sizeof(int) * z->overlay_cap);
+}
+
+// Forget a directory that no longer exists
+static void z_forget(const char *path) {
+  char *lower = z_lower(path);
+  if (!lower) return;
+  int idx = z_overlay_find(lower);
+  if (idx < 0) {
+    char *copy = _strdup(path);
+    idx = copy ? z_overlay_add(copy, lower) : -1;
+    if (idx < 0) {
+      free(copy);
+      free(lower);
+      return;
+    }
+  } else {
+    free(lower);
+  }
+  z_state.overlay[idx].rank = 0;
+}
+
+// A file of the z database, in the form to hand to Win32
+static int z_home_path(lsh_path *p, const char *name) {
+  lsh_path tmp = { NULL, 0, 0 };
+  if (!lsh_path_home(p, name)) return 0;
+  const char *s = lsh_path_win32(p, &tmp);
+  if (s != p->s) lsh_path_set(p, tmp.s, tmp.len);
+  lsh_path_free(&tmp);
+  return 1;
+}
+
+static void z_unmap(void) {
+  if (z_state.view) UnmapViewOfFile(z_state.view);
+  if (z_state.hMap) CloseHandle(z_state.hMap);
+  if (z_state.hFile && z_state.hFile != INVALID_HANDLE_VALUE) CloseHandle(z_state.hFile);
+  z_state.view = NULL;
+  z_state.hMap = NULL;
+  z_state.hFile = NULL;
+  z_state.recs = NULL;
+  z_state.num_recs = 0;
+  z_state.strings = NULL;
+  z_state.strings_size = 0;
+}
+
+static void z_map(void) {
+  lsh_path path = { NULL, 0, 0 };
+  LARGE_INTEGER size;
+
+  if (!z_home_path(&path, Z_DB_NAME)) return;
+  z_state.hFile = lsh_open_read(path.s, 0);
+  lsh_path_free(&path);
+  if (z_state.hFile == INVALID_HANDLE_VALUE) return;
+
+  if (!GetFileSizeEx(z_state.hFile, &size) || size.QuadPart < 16) {
+    z_unmap();
+    return;
+  }
+  z_state.hMap = CreateFileMapping(z_state.hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  z_state.view = z_state.hMap ? (const char*)MapViewOfFile(z_state.hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (!z_state.view || memcmp(z_state.view, Z_DB_MAGIC, 8) != 0) {
+    z_unmap();
+    return;
+  }
+
+  unsigned int count, strings_size;
+  memcpy(&count, z_state.view + 8, sizeof(count));
+  memcpy(&strings_size, z_state.view + 12, sizeof(strings_size));
+  if (16 + (unsigned long long)count * sizeof(z_rec) + strings_size > (unsigned long long)size.QuadPart) {
+    z_unmap();
+    return;
+  }
+  z_state.recs = (const z_rec*)(z_state.view + 16);
+  z_state.num_recs = count;
+  z_state.strings = z_state.view + 16 + count * sizeof(z_rec);
+  z_state.strings_size = strings_size;
+}
+
+// Replay a journal of visits into the overlay. Returns the visits read.
+static int z_replay(const char *path) {
+  FILE *log = fopen(path, "r");
+  if (!log) return 0;
+
+  int lines = 0;
+  lsh_path line = { NULL, 0, 0 };
+  char chunk[512];
+  while (fgets(chunk, sizeof(chunk), log)) {
+    // Gather a line however long the directory in it is
+    size_t n = strlen(chunk);
+    lsh_path_reserve(&line, line.len + n);
+    memcpy(line.s + line.len, chunk, n + 1);
+    line.len += n;
+    if (chunk[n - 1] != '\n') continue;
+
+    char *tab = strchr(line.s, '\t');
+    line.s[line.len - 1] = '\0';
+    line.len = 0;
+    if (!tab) continue;
+    *tab = '\0';
+    z_apply_visit(tab + 1, atoll(line.s));
+    lines++;
+  }
+  fclose(log);
+  lsh_path_free(&line);
+  return lines;
+}
+
+// Add a journal's visits to the end of another and delete it
+static void z_journal_append(const char *from, const char *to) {
+  FILE *in = fopen(from, "rb");
+  if (!in) return;
+  FILE *out = fopen(to, "ab");
+  int ok = out != NULL;
+  char buffer[4096];
+  size_t n;
+  while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+    ok = fwrite(buffer, 1, n, out) == n;
+  }
+  if (out && fclose(out) != 0) ok = 0;
+  fclose(in);
+  if (ok) DeleteFile(from);
+}
+
+static void z_load(void) {
+  lsh_path path = { NULL, 0, 0 };
+
+  if (z_state.loaded) return;
+  z_state.loaded = 1;
+  z_map();
+
+  // Replay the journal of visits made since the last compaction
+  if (z_home_path(&path, Z_LOG_NAME)) z_state.log_lines += z_replay(path.s);
+  lsh_path_free(&path);
+}
+
+static int z_compare_lower(const void *a, const void *b) {
+  return strcmp(((const z_entry*)a)->lower, ((const z_entry*)b)->lower);
+}
+
+// Merge the database and the journal moved aside to merging_path into a
+// new database file. Called holding the compaction lock.
+static void z_merge(const char *path, const char *tmp_path, const char *log_path,
+                    const char *merging_path) {
+  z_db *z = &z_state;
+
+  // Take the journal as it stands, with a leftover from a compaction that
+  // didn't finish. A shell still writing to it keeps it from moving.
+  z_journal_append(merging_path, log_path);
+  if (!MoveFileEx(log_path, merging_path, MOVEFILE_REPLACE_EXISTING)) return;
+
+  // Start over from the database as it is now, which another shell may
+  // have rewritten, and every visit in the journal. Forgotten directories
+  // aren't journaled, so they are carried over.
+  char **forgotten = (char**)malloc(sizeof(char*) * (z->num_overlay ? z->num_overlay : 1));
+  int num_forgotten = 0;
+  for (int i = 0; forgotten && i < z->num_overlay; i++) {
+    if (z->overlay[i].rank <= 0) forgotten[num_forgotten++] = _strdup(z->overlay[i].path);
+  }
+  z_overlay_clear();
+  z_unmap();
+  z_map();
+  int merged = z_replay(merging_path);
+  for (int i = 0; i < num_forgotten; i++) {
+    if (forgotten[i]) z_forget(forgotten[i]);
+    free(forgotten[i]);
+  }
+  free(forgotten);
+
+  int total = (int)z->num_recs + z->num_overlay;
+  z_entry *all = (z_entry*)malloc(sizeof(z_entry) * (total ? total : 1));
+  if (!all) {
+    z_journal_append(merging_path, log_path);
+    z->log_lines = merged;
+    return;
+  }
+
+  int n = 0;
+  double rank_sum = 0;
+  for (unsigned int i = 0; i < z->num_recs; i++) {
+    const z_rec *r = &z->recs[i];
+    if (z_overlay_find(z->strings + r->lower_off) >= 0) continue;
+    all[n].path = (char*)(z->strings + r->path_off);
+    all[n].lower = (char*)(z->strings + r->lower_off);
+    all[n].mask = r->mask;
+    all[n].rank = r->rank;
+    all[n].time = r->time;
+    rank_sum += r->rank;
+    n++;
+  }
+  for (int i = 0; i < z->num_overlay; i++) {
+    if (z->overlay[i].rank <= 0) continue;
+    all[n++] = z->overlay[i];
+    rank_sum += z->overlay[i].rank;
+  }
+
+  // Age everything once the total gets large so stale entries fall out
+  double scale = rank_sum > Z_MAX_RANK ? 0.9 * Z_MAX_RANK / rank_sum : 1.0;
+  qsort(all, n, sizeof(z_entry), z_compare_lower);
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) {
+    free(all);
+    z_journal_append(merging_path, log_path);
+    z->log_lines = merged;
+    return;
+  }
+
+  unsigned int count = 0, strings_size = 0;
+  for (int i = 0; i < n; i++) {
+    if (all[i].rank * scale < 1.0 && scale < 1.0) continue;
+    count++;
+    strings_size += 2 * ((unsigned int)strlen(all[i].path) + 1);
+  }
+
+  fwrite(Z_DB_MAGIC, 1, 8, f);
+  fwrite(&count, sizeof(count), 1, f);
+  fwrite(&strings_size, sizeof(strings_size), 1, f);
+
+  unsigned int off = 0;
+  for (int i = 0; i < n; i++) {
+    if (all[i].rank * scale < 1.0 && scale < 1.0) continue;
+    z_rec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.path_len = (unsigned int)strlen(all[i].path);
+    rec.path_off = off;
+    rec.lower_off = off + rec.path_len + 1;
+    rec.mask = all[i].mask;
+    rec.rank = all[i].rank * scale;
+    rec.time = all[i].time;
+    fwrite(&rec, sizeof(rec), 1, f);
+    off += 2 * (rec.path_len + 1);
+  }
+  for (int i = 0; i < n; i++) {
+    if (all[i].rank * scale < 1.0 && scale < 1.0) continue;
+    fwrite(all[i].path, 1, strlen(all[i].path) + 1, f);
+    fwrite(all[i].lower, 1, strlen(all[i].lower) + 1, f);
+  }
+  int failed = ferror(f);
+  fclose(f);
+  free(all);
+
+  // The new file can't replace the old one while it is still mapped
+  z_unmap();
+  if (failed || !MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+    // Put the visits back for the next try
+    DeleteFile(tmp_path);
+    z_journal_append(merging_path, log_path);
+    z_map();
+    z->log_lines = merged;
+  } else {
+    DeleteFile(merging_path);
+    z_overlay_clear();
+    z_map();
+    // Visits other shells made while this one compacted
+    z->log_lines = z_replay(log_path);
+  }
+}
+
+static void z_compact(void) {
+  lsh_path path = { NULL, 0, 0 }, tmp_path = { NULL, 0, 0 };
+  lsh_path log_path = { NULL, 0, 0 }, merging_path = { NULL, 0, 0 }, lock_path = { NULL, 0, 0 };
+
+  if (z_home_path(&path, Z_DB_NAME) && z_home_path(&tmp_path, Z_DB_NAME ".tmp") &&
+      z_home_path(&log_path, Z_LOG_NAME) && z_home_path(&merging_path, Z_LOG_NAME ".merging") &&
+      z_home_path(&lock_path, Z_LOCK_NAME)) {
+    // One shell compacts at a time; the others keep appending and try later
+    HANDLE lock = CreateFile(lock_path.s, GENERIC_WRITE, 0, NULL, OPEN_ALWAYS,
+                             FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (lock != INVALID_HANDLE_VALUE) {
+      z_merge(path.s, tmp_path.s, log_path.s, merging_path.s);
+      CloseHandle(lock);
+    }
+  }
+  lsh_path_free(&path);
+  lsh_path_free(&tmp_path);
+  lsh_path_free(&log_path);
+  lsh_path_free(&merging_path);
+  lsh_path_free(&lock_path);
+}
+
+// Record a visit to a directory, called after every successful chdir
+void z_record_visit(const char *path) {
+  lsh_path log_path = { NULL, 0, 0 };
+  long long now = z_now();
+
+  z_load();
+  z_apply_visit(path, now);
+
+  if (z_home_path(&log_path, Z_LOG_NAME)) {
+    FILE *log = fopen(log_path.s, "a");
+    if (log) {
+      fprintf(log, "%lld\t%s\n", now, path);
+      fclose(log);
+      z_state.log_lines++;
+    }
+  }
+  lsh_path_free(&log_path);
+  if (z_state.log_lines >= Z_COMPACT_AFTER) {
+    z_compact();
+  }
+}
+
+typedef struct z_query {
+  char *frags[Z_MAX_FRAGMENTS];
+  int num_frags;
+  unsigned long long mask;
+} z_query;
+
+// Fragments must appear in order, and the last one in the last component
+static int z_matches(const z_query *q, const char *lower) {
+  const char *p = lower;
+  const char *last_component = strrchr(lower, '\\');
+  last_component = last_component ? last_component + 1 : lower;
+
+  for (int i = 0; i < q->num_frags; i++) {
+    const char *from = p;
+    if (i == q->num_frags - 1 && from < last_component) from = last_component;
+    const char *hit = strstr(from, q->frags[i]);
+    if (!hit) return 0;
+    p = hit + strlen(q->frags[i]);
+  }
+  return 1;
+}
+
+typedef struct z_candidate {
+  const char *path;
+  double score;
+} z_candidate;
+
+static int z_compare_score(const void *a, const void *b) {
+  double sa = ((const z_candidate*)a)->score, sb = ((const z_candidate*)b)->score;
+  return (sa < sb) - (sa > sb);
+}
+
+// Collect matching entries. With max_out == 1 only the best is kept.
+static int z_search(const z_query *q, z_candidate *out, int max_out) {
+  long long now = z_now();
+  int n = 0;
+
+  for (unsigned int i = 0; i < z_state.num_recs; i++) {
+    const z_rec *r = &z_state.recs[i];
+    if ((r->mask & q->mask) != q->mask) continue;
+    const char *lower = z_state.strings + r->lower_off;
+    if (!z_matches(q, lower) || z_overlay_find(lower) >= 0) continue;
+
+    z_candidate c = { z_state.strings + r->path_off, z_score(r->rank, r->time, now) };
+    if (n < max_out) out[n++] = c;
+    else if (max_out == 1 && c.score > out[0].score) out[0] = c;
+  }
+  for (int i = 0; i < z_state.num_overlay; i++) {
+    z_entry *e = &z_state.overlay[i];
+    if (e->rank <= 0 || (e->mask & q->mask) != q->mask || !z_matches(q, e->lower)) continue;
+
+    z_candidate c = { e->path, z_score(e->rank, e->time, now) };
+    if (n < max_out) out[n++] = c;
+    else if (max_out == 1 && c.score > out[0].score) out[0] = c;
+  }
+  return n;
+}
+
+static int z_parse_query(z_query *q, char **words) {
+  q->num_frags = 0;
+  q->mask = 0;
+  for (int i = 0; words[i] != NULL && q->num_frags < Z_MAX_FRAGMENTS; i++) {
+    char *frag = z_lower(words[i]);
+    if (!frag) break;
+    q->frags[q->num_frags++] = frag;
+    q->mask |= z_mask(frag);
+  }
+  return q->num_frags;
+}
+
+static void z_free_query(z_query *q) {
+  for (int i = 0; i < q->num_frags; i++) free(q->frags[i]);
+  q->num_frags = 0;
+}
+
+// Change to the best match for the fragments. Returns 1 on success.
+int z_jump(char **words, int verbose) {
+  z_query q;
+  z_candidate best;
+
+  z_load();
+  if (!z_parse_query(&q, words)) return 0;
+
+  int found = 0;
+  while (z_search(&q, &best, 1) == 1) {
+    if (_chdir(best.path) == 0) {
+      lsh_path cwd = { NULL, 0, 0 };
+      if (verbose) printf("%s\n", best.path);
+      if (lsh_path_cwd(&cwd)) z_record_visit(cwd.s);
+      lsh_path_free(&cwd);
+      found = 1;
+      break;
+    }
+    z_forget(best.path);
+  }
+
+  z_free_query(&q);
+  return found;
+}
+
+int lsh_z(char **args) {
+  int list = 0;
+  int first = 1;
+
+  if (args[1] && strcmp(args[1], "-l") == 0) {
+    list = 1;
+    first = 2;
+  }
+
+  z_load();
+
+  if (list || args[first] == NULL) {
+    z_query q;
+    int cap = (int)z_state.num_recs + z_state.num_overlay;
+    z_candidate *all = (z_candidate*)malloc(sizeof(z_candidate) * (cap ? cap : 1));
+    if (!all) {
+      fprintf(stderr, "lsh: allocation error\n");
+      return 1;
+    }
+
+    z_parse_query(&q, args + first);
+    unsigned long long start = lsh_now_us();
+    int n = z_search(&q, all, cap);
+    unsigned long long elapsed = lsh_now_us() - start;
+    z_free_query(&q);
+
+    qsort(all, n, sizeof(z_candidate), z_compare_score);
+    // Lowest scores first so the best match ends up next to the prompt
+    int shown = n < 20 ? n : 20;
+    for (int i = shown - 1; i >= 0; i--) {
+      printf("%10.1f  %s\n", all[i].score, all[i].path);
+    }
+    printf("%d of %d directories matched in %llu us\n", n, cap, elapsed);
+    free(all);
+    return 1;
+  }
+
+  if (!z_jump(args + first, 0)) {
+    fprintf(stderr, "lsh: %s: no match\n", args[0]);
+  }
+  return 1;
+}
+
+
+int lsh_cd(char **args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected argument to \"cd\"\n");
+  } else {
+    if (_chdir(args[1]) == 0) {  // Use _chdir for Windows
+      lsh_path cwd = { NULL, 0, 0 };
+      if (lsh_path_cwd(&cwd)) {
+        z_record_visit(cwd.s);
+      }
+      lsh_path_free(&cwd);
+    } else {
+      int saved_errno = errno;
+      // Not a path here, so try it as fragments of a directory visited before
+      if (strpbrk(args[1], "\\/:.") != NULL || !z_jump(args + 1, 1)) {
+        errno = saved_errno;
+        perror("lsh");
+      }
+    }
+  }
+  return 1;
+}
+
+/*
+ * Tab completion source.
+ *
+ * find_matches returns a cursor over the directory instead of a list of
+ * every match. Matches are read a page at a time into fixed slots, later
+ * pages are fetched as the user cycles past the current one, and the
+ * total for the "(n/total)" indicator is counted by a separate thread.
+ * Memory stays at one page however many entries the directory holds.
+ */
+
+#define COMPLETION_PAGE 64
+
+typedef struct completion_cursor {
+    lsh_path search_path;                // directory followed by "*"
+    lsh_path search_long;                // the same in \\?\ form, if it needs it
+    const char *search;                  // which of them FindFirstFile takes
+    char pattern[256];
+    size_t pattern_len;
+    HANDLE hFind;                        // position of the next page
+    WIN32_FIND_DATA findData;            // next entry, not yet looked at
+    char page[COMPLETION_PAGE][MAX_PATH + 1];
+    int page_len;
+    int page_start;                      // index of page[0] among all matches
+    int exhausted;                       // the enumeration has ended
+    volatile LONG total;                 // -1 until the count is known
+    volatile LONG cancel;
+    HANDLE hCounter;
+} completion_cursor;
+
+static int completion_accept(completion_cursor *c, WIN32_FIND_DATA *fd) {
+    // Skip . and .. directories
+    if (strcmp(fd->cFileName, ".") == 0 || strcmp(fd->cFileName, "..") == 0) {
+        return 0;
+    }
+    return strncmp(fd->cFileName, c->pattern, c->pattern_len) == 0;
+}
+
+static void completion_restart(completion_cursor *c) {
+    if (c->hFind != INVALID_HANDLE_VALUE) {
+        FindClose(c->hFind);
+    }
+    c->hFind = FindFirstFile(c->search, &c->findData);
+    c->exhausted = c->hFind == INVALID_HANDLE_VALUE;
+    c->page_start = 0;
+    c->page_len = 0;
+}
+
+// Read the next page of matches into the page slots
+static void completion_fill_page(completion_cursor *c) {
+    c->page_start += c->page_len;
+    c->page_len = 0;
+
+    // Ctrl-C leaves the page short; the enumeration resumes on the next fetch
+    while (c->page_len < COMPLETION_PAGE && !c->exhausted && !lsh_interrupted) {
+        WIN32_FIND_DATA *fd = &c->findData;
+        lsh_metric_count(LSH_M_COMPLETION_ENTRIES, 1);
+        if (completion_accept(c, fd)) {
+            char *slot = c->page[c->page_len++];
+            strcpy(slot, fd->cFileName);
+            if (fd->dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+                // Append a backslash to directory names
+                strcat(slot, "\\");
+            }
+        }
+        if (!FindNextFile(c->hFind, fd)) {
+            FindClose(c->hFind);
+            c->hFind = INVALID_HANDLE_VALUE;
+            c->exhausted = 1;
+        }
+    }
+
+    // Reaching the end tells us the total without waiting for the counter
+    if (c->exhausted) {
+        InterlockedExchange(&c->total, c->page_start + c->page_len);
+    }
+}
+
+static unsigned __stdcall completion_count_worker(void *arg) {
+    completion_cursor *c = (completion_cursor*)arg;
+    WIN32_FIND_DATA fd;
+    LONG count = 0;
+
+    HANDLE hFind = FindFirstFile(c->search, &fd);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    do {
+        if (completion_accept(c, &fd)) count++;
+        lsh_metric_count(LSH_M_COMPLETION_ENTRIES, 1);
+    } while (!c->cancel && !lsh_interrupted && FindNextFile(hFind, &fd));
+    FindClose(hFind);
+
+    if (!c->cancel && !lsh_interrupted) {
+        InterlockedCompareExchange(&c->total, count, -1);
+    }
+    return 0;
+}
+
+// Open a cursor over the entries matching partial_path. The first page is
+// read right away; count_total starts counting the rest in the background.
+completion_cursor *find_matches(const char *partial_path, int count_total) {
+    unsigned long long start = lsh_metric_start();
+    completion_cursor *c = (completion_cursor*)calloc(1, sizeof(completion_cursor));
+
+    if (!c) {
+        fprintf(stderr, "lsh: allocation error in tab completion\n");
+        return NULL;
+    }
+    c->hFind = INVALID_HANDLE_VALUE;
+    c->total = -1;
+
+    // Parse the partial path to separate directory and pattern
+    const char *last_slash = strrchr(partial_path, '\\');
+    if (last_slash) {
+        // There's a directory part
+        lsh_path_set(&c->search_path, partial_path, last_slash - partial_path + 1);
+        strncpy(c->pattern, last_slash + 1, sizeof(c->pattern) - 1);
+    } else {
+        // No directory specified, use current directory
+        if (!lsh_path_cwd(&c->search_path)) lsh_path_set(&c->search_path, "", 0);
+        strncpy(c->pattern, partial_path, sizeof(c->pattern) - 1);
+    }
+    c->pattern_len = strlen(c->pattern);
+    lsh_path_join(&c->search_path, "*", 1);
+    c->search = lsh_path_win32(&c->search_path, &c->search_long);
+
+    completion_restart(c);
+    completion_fill_page(c);
+
+    if (count_total && c->total < 0) {
+        c->hCounter = (HANDLE)_beginthreadex(NULL, 0, completion_count_worker, c, 0, NULL);
+    }
+    lsh_metric_stop(LSH_H_FIND_MATCHES, start);
+    return c;
+}
+
+// Match number index, fetching pages as needed. NULL if there is no such match.
+const char *completion_get(completion_cursor *c, int index) {
+    if (index < c->page_start) {
+        // Cycling wrapped around, enumerate from the top again
+        completion_restart(c);
+        completion_fill_page(c);
+    }
+    while (index >= c->page_start + c->page_len) {
+        if (c->exhausted || lsh_interrupted) return NULL;
+        completion_fill_page(c);
+    }
+    return c->page[index - c->page_start];
+}
+
+// Index after `index`, wrapping to 0 after the last match
+int completion_next(completion_cursor *c, int index) {
+    LONG total = c->total;
+    if (total >= 0) {
+        return (index + 1) % (total > 0 ? total : 1);
+    }
+    return completion_get(c, index + 1) ? index + 1 : 0;
+}
+
+void completion_close(completion_cursor *c) {
+    if (!c) return;
+    if (c->hCounter) {
+        lsh_ev_remove(c->hCounter);
+        InterlockedExchange(&c->cancel, 1);
+        WaitForSingleObject(c->hCounter, INFINITE);
+        CloseHandle(c->hCounter);
+    }
+    if (c->hFind != INVALID_HANDLE_VALUE) {
+        FindClose(c->hFind);
+    }
+    lsh_path_free(&c->search_path);
+    lsh_path_free(&c->search_long);
+    free(c);
+}
+
+// New function to find the best match for current input
+char* find_best_match(const char* partial_text) {
+    // Start from the beginning of the current word
+    int len = strlen(partial_text);
+    if (len == 0) return NULL;
+    
+    // Find the start of the current word
+    int word_start = len - 1;
+    while (word_start >= 0 && partial_text[word_start] != ' ' && partial_text[word_start] != '\\') {
+        word_start--;
+    }
+    word_start++; // Move past the space or backslash
+    
+    // The current word runs to the end of the text, so it needs no copy
+    const char *partial_path = partial_text + word_start;
+    
+    // Skip if we're not typing a path
+    if (word_start == len) return NULL;
+    
+    // Only the first match is needed, so don't count the rest
+    unsigned long long start = lsh_metric_start();
+    completion_cursor *matches = find_matches(partial_path, 0);
+    const char *first = matches ? completion_get(matches, 0) : NULL;
+    char* full_suggestion = NULL;
+    
+    if (first) {
+        // Create the full suggestion by combining the prefix with the matched path
+        size_t first_len = strlen(first);
+        full_suggestion = (char*)malloc(word_start + first_len + 1);
+        if (full_suggestion) {
+            // Copy the prefix (everything before the current word)
+            memcpy(full_suggestion, partial_text, word_start);
+            
+            // Append the matched path
+            memcpy(full_suggestion + word_start, first, first_len + 1);
+        }
+    }
+    
+    completion_close(matches);
+    if (full_suggestion) lsh_metric_count(LSH_M_SUGGESTION_HITS, 1);
+    lsh_metric_stop(LSH_H_FIND_BEST_MATCH, start);
+    return full_suggestion;
+}
+
+int lsh_clear(char **args) {
+    // Get the handle to the console
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    
+    if (hConsole == INVALID_HANDLE_VALUE) {
+        perror("lsh: failed to get console handle");
+        return 1;
+    }
+    
+    // Get console information
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    if (!GetConsoleScreenBufferInfo(hConsole, &csbi)) {
+        perror("lsh: failed to get console info");
+        return 1;
+    }
+    
+    // Calculate total cells in console
+    DWORD cellCount = csbi.dwSize.X * csbi.dwSize.Y;
+    
+    // Fill the entire buffer with spaces
+    DWORD count;
+    COORD homeCoords = {0, 0};
+    
+    if (!FillConsoleOutputCharacter(hConsole, ' ', cellCount, homeCoords, &count)) {
+        perror("lsh: failed to fill console");
+        return 1;
+    }
+    
+    // Fill the entire buffer with the current attributes
+    if (!FillConsoleOutputAttribute(hConsole, csbi.wAttributes, cellCount, homeCoords, &count)) {
+        perror("lsh: failed to set console attributes");
+        return 1;
+    }
+    
+    // Move the cursor to home position
+    SetConsoleCursorPosition(hConsole, homeCoords);
+    
+    return 1;
+}
+
+int lsh_dir(char **args) {
+  lsh_path searchPath = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+  WIN32_FIND_DATA findData;
+  HANDLE hFind;
+  
+  // Get current directory
+  if (!lsh_path_cwd(&searchPath)) {
+    fprintf(stderr, "lsh: dir: cannot get the current directory\n");
+    lsh_path_free(&searchPath);
+    return 1;
+  }
+  
+  // Print current directory
+  // printf("Directory of %s\n\n", cwd);
+  
+  // Prepare search pattern for all files
+  lsh_path_join(&searchPath, "*", 1);
+  
+  // Find first file
+  hFind = FindFirstFile(lsh_path_win32(&searchPath, &tmp), &findData);
+  lsh_path_free(&searchPath);
+  lsh_path_free(&tmp);
+  
+  if (hFind == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "lsh: Failed to list directory contents\n");
+    return 1;
+  }
+  
+  // List all files
+  do {
+    // Skip . and .. directories for cleaner output
+    if (strcmp(findData.cFileName, ".") != 0 && strcmp(findData.cFileName, "..") != 0) {
+      // Check if it's a directory
+      if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+        printf("<DIR>\t%s\n", findData.cFileName);
+      } else {
+        // Print file name and full 64-bit size
+        unsigned long long size = ((unsigned long long)findData.nFileSizeHigh << 32) | findData.nFileSizeLow;
+        printf("%llu\t%s\n", size, findData.cFileName);
+      }
+    }
+    printf("\n");
+  } while (!lsh_interrupted && FindNextFile(hFind, &findData));
+  
+  // Close find handle
+  FindClose(hFind);
+  
+  return 1;
+}
+
+/*
+ * Parallel directory walker.
+ *
+ * Directories are handed out to a pool of worker threads from a shared
+ * stack. Each directory is enumerated through an open handle with
+ * FileIdBothDirectoryInfo, which returns 64-bit sizes and file IDs for a
+ * whole batch of entries in one call, so no per-file stat is needed.
+ * A directory is only ever processed by one worker, so callbacks can
+ * update per-directory data without locking.
+ *
+ * Directory names are interned in the walker's path pool, so a node holds
+ * an id rather than its full path, and each parent is stored once. The
+ * worker builds the path when it opens the directory, in the \\?\ form
+ * when it is too long for the plain API.
+ */
+
+#define LSH_WALK_BUFSIZE (64 * 1024)
+
+typedef struct lsh_walk_dir {
+  const char *path;             // only set while callbacks run on the directory
+  lsh_path_id id;               // in the walker's path pool
+  struct lsh_walk_dir *parent;  // only set when the walker keeps directories
+  int depth;
+  void *data;                   // owned by the callbacks
+} lsh_walk_dir;
+
+typedef struct lsh_walker {
+  // Callbacks, all optional. on_dir returns 0 to skip enumerating the directory.
+  int (*on_dir)(struct lsh_walker *w, lsh_walk_dir *dir, HANDLE hDir);
+  void (*on_subdir)(struct lsh_walker *w, lsh_walk_dir *parent, lsh_walk_dir *child);
+  void (*on_file)(struct lsh_walker *w, lsh_walk_dir *dir, const char *name,
+                  const FILE_ID_BOTH_DIR_INFO *info);
+  void *ctx;
+  int num_threads;
+  int keep_dirs;                // keep directory nodes and parent links after the walk
+  lsh_path_pool paths;          // kept with the directories, for lsh_walk_path
+  volatile LONG dirs_walked;
+  volatile LONG errors;
+
+  // Work queue, private to the walker
+  CRITICAL_SECTION lock;
+  CONDITION_VARIABLE wake;
+  lsh_walk_dir **queue;
+  int queue_len, queue_cap;
+  int busy;                     // directories queued or being processed
+  lsh_walk_dir *root;
+} lsh_walker;
+
+void lsh_walk_push(lsh_walker *w, lsh_walk_dir *parent, const char *name) {
+  lsh_walk_dir *dir = (lsh_walk_dir*)calloc(1, sizeof(lsh_walk_dir));
+  if (!dir) {
+    InterlockedIncrement(&w->errors);
+    return;
+  }
+
+  dir->id = lsh_path_intern(&w->paths, parent ? parent->id : 0, name, strlen(name));
+  if (parent) {
+    dir->depth = parent->depth + 1;
+    dir->parent = w->keep_dirs ? parent : NULL;
+  }
+
+  if (!dir->id) {
+    free(dir);
+    InterlockedIncrement(&w->errors);
+    return;
+  }
+
+  if (w->on_subdir) {
+    w->on_subdir(w, parent, dir);
+  }
+  if (!parent) {
+    w->root = dir;
+  }
+
+  EnterCriticalSection(&w->lock);
+  if (w->queue_len >= w->queue_cap) {
+    int new_cap = w->queue_cap ? w->queue_cap * 2 : 256;
+    lsh_walk_dir **q = (lsh_walk_dir**)realloc(w->queue, sizeof(lsh_walk_dir*) * new_cap);
+    if (!q) {
+      LeaveCriticalSection(&w->lock);
+      InterlockedIncrement(&w->errors);
+      return;
+    }
+    w->queue = q;
+    w->queue_cap = new_cap;
+  }
+  w->queue[w->queue_len++] = dir;
+  w->busy++;
+  WakeConditionVariable(&w->wake);
+  LeaveCriticalSection(&w->lock);
+}
+
+// The full path of a directory, from the walker's path pool
+void lsh_walk_path(lsh_walker *w, lsh_walk_dir *dir, lsh_path *out) {
+  lsh_path_build(&w->paths, dir->id, out);
+}
+
+// The directory's own name
+const char *lsh_walk_name(lsh_walker *w, lsh_walk_dir *dir) {
+  return lsh_path_node_of(&w->paths, dir->id)->name;
+}
+
+static void lsh_walk_process(lsh_walker *w, lsh_walk_dir *dir, void *buffer, lsh_path *path, lsh_path *tmp) {
+  lsh_walk_path(w, dir, path);
+  HANDLE hDir = CreateFile(lsh_path_win32(path, tmp), FILE_LIST_DIRECTORY | FILE_READ_ATTRIBUTES,
+                           FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  if (hDir == INVALID_HANDLE_VALUE) {
+    InterlockedIncrement(&w->errors);
+    return;
+  }
+  dir->path = path->s;
+
+  InterlockedIncrement(&w->dirs_walked);
+
+  // The callback may satisfy the directory from a cache and skip enumeration
+  if (w->on_dir && !w->on_dir(w, dir, hDir)) {
+    CloseHandle(hDir);
+    return;
+  }
+
+  // Ctrl-C is checked once per batch of entries
+  while (!lsh_interrupted &&
+         GetFileInformationByHandleEx(hDir, FileIdBothDirectoryInfo, buffer, LSH_WALK_BUFSIZE)) {
+    FILE_ID_BOTH_DIR_INFO *info = (FILE_ID_BOTH_DIR_INFO*)buffer;
+
+    while (1) {
+      char name[MAX_PATH * 2];
+      int name_len = WideCharToMultiByte(CP_ACP, 0, info->FileName,
+                                         info->FileNameLength / sizeof(WCHAR),
+                                         name, sizeof(name) - 1, NULL, NULL);
+      name[name_len] = '\0';
+
+      if (name_len > 0 && strcmp(name, ".") != 0 && strcmp(name, "..") != 0) {
+        if (info->FileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+          // Don't follow junctions and symlinks, they can form cycles
+          if (!(info->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+            lsh_walk_push(w, dir, name);
+          }
+        } else if (w->on_file) {
+          w->on_file(w, dir, name, info);
+        }
+      }
+
+      if (info->NextEntryOffset == 0) break;
+      info = (FILE_ID_BOTH_DIR_INFO*)((char*)info + info->NextEntryOffset);
+    }
+  }
+
+  if (!lsh_interrupted && GetLastError() != ERROR_NO_MORE_FILES) {
+    InterlockedIncrement(&w->errors);
+  }
+
+  CloseHandle(hDir);
+}
+
+static unsigned __stdcall lsh_walk_worker(void *arg) {
+  lsh_walker *w = (lsh_walker*)arg;
+  void *buffer = malloc(LSH_WALK_BUFSIZE);
+  lsh_path path = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+
+  if (!buffer) {
+    InterlockedIncrement(&w->errors);
+  }
+
+  EnterCriticalSection(&w->lock);
+  while (1) {
+    while (w->queue_len == 0 && w->busy > 0) {
+      SleepConditionVariableCS(&w->wake, &w->lock, INFINITE);
+    }
+    if (w->queue_len == 0) {
+      // Nothing queued and nobody can queue more: the walk is finished
+      WakeAllConditionVariable(&w->wake);
+      break;
+    }
+
+    lsh_walk_dir *dir = w->queue[--w->queue_len];
+    LeaveCriticalSection(&w->lock);
+
+    // After Ctrl-C the queue is drained without opening anything
+    if (buffer && !lsh_interrupted) {
+      lsh_walk_process(w, dir, buffer, &path, &tmp);
+      dir->path = NULL;
+    }
+    if (!w->keep_dirs) {
+      free(dir);
+    }
+
+    EnterCriticalSection(&w->lock);
+    w->busy--;
+    if (w->busy == 0) {
+      WakeAllConditionVariable(&w->wake);
+    }
+  }
+  LeaveCriticalSection(&w->lock);
+
+  lsh_path_free(&path);
+  lsh_path_free(&tmp);
+  free(buffer);
+  return 0;
+}
+
+// Walk the tree under root_path using w->num_threads workers.
+// Returns the root directory node when w->keep_dirs is set; the caller
+// then frees w->paths along with the nodes.
+lsh_walk_dir *lsh_walk_run(lsh_walker *w, const char *root_path) {
+  HANDLE threads[LSH_MAX_THREADS];
+  int num_threads = w->num_threads;
+
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > LSH_MAX_THREADS) num_threads = LSH_MAX_THREADS;
+
+  InitializeCriticalSection(&w->lock);
+  InitializeConditionVariable(&w->wake);
+  w->queue = NULL;
+  w->queue_len = w->queue_cap = 0;
+  w->busy = 0;
+  w->root = NULL;
+  w->dirs_walked = 0;
+  w->errors = 0;
+  lsh_path_pool_init(&w->paths);
+
+  lsh_walk_push(w, NULL, root_path);
+
+  int started = 0;
+  for (int i = 0; i < num_threads; i++) {
+    threads[started] = (HANDLE)_beginthreadex(NULL, 0, lsh_walk_worker, w, 0, NULL);
+    if (threads[started]) started++;
+  }
+  if (started == 0) {
+    // Couldn't start any threads, walk on this one
+    lsh_walk_worker(w);
+  } else {
+    WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    for (int i = 0; i < started; i++) {
+      CloseHandle(threads[i]);
+    }
+  }
+
+  free(w->queue);
+  w->queue = NULL;
+  DeleteCriticalSection(&w->lock);
+
+  if (!w->keep_dirs) {
+    lsh_path_pool_free(&w->paths);
+    return NULL;
+  }
+  return w->root;
+}
+
+/*
+ * du: parallel disk usage with hard-link dedup and a per-directory cache.
+ *
+ * Every file is identified by its NTFS file ID (the walker doesn't follow
+ * reparse points, so the walk stays on one volume). The IDs go into a
+ * sharded set, and a file only adds to the totals the first time its ID
+ * is seen, so hard links are counted once.
+ *
+ * With -c, the file list and subdirectory names of every directory are
+ * saved to ~\.lsh_du_cache together with the directory's last write time.
+ * On the next run a directory whose last write time is unchanged is not
+ * enumerated at all: its files are replayed from the cache and its cached
+ * subdirectories are queued directly. Adding, removing or renaming an entry
+ * updates the directory time; growing a file in place does not, so cached
+ * sizes can lag behind files modified without being recreated.
+ */
+
+#define DU_CACHE_NAME ".lsh_du_cache"
+#define DU_CACHE_MAGIC "LSHDU\001\000\000"
+#define DU_ID_SHARDS 64
+
+typedef struct du_file {
+  unsigned long long id;
+  unsigned long long size;
+  unsigned long long alloc;
+} du_file;
+
+typedef struct du_cache_rec {
+  char *path;
+  unsigned long long mtime;
+  const char *files;            // packed du_file entries inside the cache blob
+  unsigned int num_files;
+  char **children;
+  unsigned int num_children;
+} du_cache_rec;
+
+typedef struct du_dir {
+  unsigned long long mtime;
+  unsigned long long direct;   // bytes of files first counted in this directory
+  unsigned long long total;    // direct plus all subdirectories
+  unsigned long long files;
+  du_file *entries;            // every file, kept for the cache
+  int num_entries, cap_entries;
+  lsh_walk_dir **children;
+  int num_children, cap_children;
+  int from_cache;
+} du_dir;
+
+typedef struct du_id_shard {
+  CRITICAL_SECTION lock;
+  unsigned long long *keys;
+  size_t cap, count;
+} du_id_shard;
+
+typedef struct du_state {
+  int apparent;                // count logical sizes instead of allocation
+  int use_cache;
+  du_cache_rec *cache;         // open addressing table keyed by path
+  size_t cache_cap;
+  unsigned int cache_count;
+  char *cache_blob;
+  du_id_shard shards[DU_ID_SHARDS];
+  volatile LONG cached_dirs;
+  volatile LONG dirs;
+} du_state;
+
+static unsigned long long du_mix(unsigned long long x) {
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+// Returns 1 if the file ID wasn't seen before during this run
+static int du_id_insert(du_state *st, unsigned long long id) {
+  if (id == 0) id = 1;  // 0 marks an empty slot
+
+  unsigned long long h = du_mix(id);
+  du_id_shard *shard = &st->shards[h % DU_ID_SHARDS];
+  int inserted = 1;
+
+  EnterCriticalSection(&shard->lock);
+  if ((shard->count + 1) * 2 > shard->cap) {
+    size_t new_cap = shard->cap ? shard->cap * 2 : 1024;
+    unsigned long long *keys = (unsigned long long*)calloc(new_cap, sizeof(unsigned long long));
+    if (keys) {
+      for (size_t i = 0; i < shard->cap; i++) {
+        if (shard->keys[i]) {
+          size_t j = (du_mix(shard->keys[i]) / DU_ID_SHARDS) & (new_cap - 1);
+          while (keys[j]) j = (j + 1) & (new_cap - 1);
+          keys[j] = shard->keys[i];
+        }
+      }
+      free(shard->keys);
+      shard->keys = keys;
+      shard->cap = new_cap;
+    }
+  }
+  if (shard->keys) {
+    size_t j = (h / DU_ID_SHARDS) & (shard->cap - 1);
+    while (shard->keys[j] && shard->keys[j] != id) j = (j + 1) & (shard->cap - 1);
+    if (shard->keys[j] == id) {
+      inserted = 0;
+    } else {
+      shard->keys[j] = id;
+      shard->count++;
+    }
+  }
+  LeaveCriticalSection(&shard->lock);
+
+  return inserted;
+}
+
+static du_cache_rec *du_cache_find(du_state *st, const char *path) {
+  if (!st->cache_cap) return NULL;
+  size_t j = lsh_hash_str(path) & (st->cache_cap - 1);
+  while (st->cache[j].path) {
+    if (strcmp(st->cache[j].path, path) == 0) return &st->cache[j];
+    j = (j + 1) & (st->cache_cap - 1);
+  }
+  return NULL;
+}
+
+static unsigned long long du_filetime(FILETIME ft) {
+  return ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+static void du_count_file(du_state *st, du_dir *d, unsigned long long id,
+                          unsigned long long size, unsigned long long alloc) {
+  d->files++;
+  if (du_id_insert(st, id)) {
+    d->direct += st->apparent ? size : alloc;
+  }
+
+  if (st->use_cache) {
+    if (d->num_entries >= d->cap_entries) {
+      int new_cap = d->cap_entries ? d->cap_entries * 2 : 16;
+      du_file *e = (du_file*)realloc(d->entries, sizeof(du_file) * new_cap);
+      if (!e) return;
+      d->entries = e;
+      d->cap_entries = new_cap;
+    }
+    d->entries[d->num_entries].id = id;
+    d->entries[d->num_entries].size = size;
+    d->entries[d->num_entries].alloc = alloc;
+    d->num_entries++;
+  }
+}
+
+static void du_on_subdir(lsh_walker *w, lsh_walk_dir *parent, lsh_walk_dir *child) {
+  child->data = calloc(1, sizeof(du_dir));
+  if (parent && child->data) {
+    du_dir *p = (du_dir*)parent->data;
+    if (p->num_children >= p->cap_children) {
+      int new_cap = p->cap_children ? p->cap_children * 2 : 8;
+      lsh_walk_dir **c = (lsh_walk_dir**)realloc(p->children, sizeof(lsh_walk_dir*) * new_cap);
+      if (!c) return;
+      p->children = c;
+      p->cap_children = new_cap;
+    }
+    p->children[p->num_children++] = child;
+  }
+}
+
+static int du_on_dir(lsh_walker *w, lsh_walk_dir *dir, HANDLE hDir) {
+  du_state *st = (du_state*)w->ctx;
+  du_dir *d = (du_dir*)dir->data;
+  BY_HANDLE_FILE_INFORMATION info;
+
+  if (!d) return 0;
+  InterlockedIncrement(&st->dirs);
+
+  if (!GetFileInformationByHandle(hDir, &info)) {
+    return 1;
+  }
+  d->mtime = du_filetime(info.ftLastWriteTime);
+
+  du_cache_rec *rec = st->use_cache ? du_cache_find(st, dir->path) : NULL;
+  if (!rec || rec->mtime != d->mtime) {
+    return 1;
+  }
+
+  // Unchanged since the cache was written: replay it instead of enumerating
+  d->from_cache = 1;
+  InterlockedIncrement(&st->cached_dirs);
+  for (unsigned int i = 0; i < rec->num_files; i++) {
+    du_file f;
+    memcpy(&f, rec->files + i * sizeof(du_file), sizeof(f));
+    du_count_file(st, d, f.id, f.size, f.alloc);
+  }
+  for (unsigned int i = 0; i < rec->num_children; i++) {
+    lsh_walk_push(w, dir, rec->children[i]);
+  }
+  return 0;
+}
+
+static void du_on_file(lsh_walker *w, lsh_walk_dir *dir, const char *name,
+                       const FILE_ID_BOTH_DIR_INFO *info) {
+  du_count_file((du_state*)w->ctx, (du_dir*)dir->data,
+                (unsigned long long)info->FileId.QuadPart,
+                (unsigned long long)info->EndOfFile.QuadPart,
+                (unsigned long long)info->AllocationSize.QuadPart);
+}
+
+// Read helpers for the cache blob; return 0 when the data runs out
+static int du_read(char **p, char *end, void *out, size_t n) {
+  if ((size_t)(end - *p) < n) return 0;
+  memcpy(out, *p, n);
+  *p += n;
+  return 1;
+}
+
+static char *du_read_str(char **p, char *end) {
+  unsigned int len;
+  if (!du_read(p, end, &len, sizeof(len)) || (size_t)(end - *p) < len) return NULL;
+  char *s = (char*)malloc(len + 1);
+  if (!s) return NULL;
+  memcpy(s, *p, len);
+  s[len] = '\0';
+  *p += len;
+  return s;
+}
+
+static void du_cache_load(du_state *st) {
+  char path[MAX_PATH];
+  if (!lsh_home_path(DU_CACHE_NAME, path, sizeof(path))) return;
+
+  FILE *f = fopen(path, "rb");
+  if (!f) return;
+
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *blob = (size > 12) ? (char*)malloc(size) : NULL;
+  if (!blob || fread(blob, 1, size, f) != (size_t)size) {
+    free(blob);
+    fclose(f);
+    return;
+  }
+  fclose(f);
+
+  char *p = blob, *end = blob + size;
+  unsigned int count;
+  if (memcmp(p, DU_CACHE_MAGIC, 8) != 0) {
+    free(blob);
+    return;
+  }
+  p += 8;
+  if (!du_read(&p, end, &count, sizeof(count))) {
+    free(blob);
+    return;
+  }
+
+  st->cache_cap = 16;
+  while (st->cache_cap < (size_t)count * 2) st->cache_cap *= 2;
+  st->cache = (du_cache_rec*)calloc(st->cache_cap, sizeof(du_cache_rec));
+  if (!st->cache) {
+    st->cache_cap = 0;
+    free(blob);
+    return;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    du_cache_rec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.path = du_read_str(&p, end);
+    if (!rec.path ||
+        !du_read(&p, end, &rec.mtime, sizeof(rec.mtime)) ||
+        !du_read(&p, end, &rec.num_files, sizeof(rec.num_files)) ||
+        (size_t)(end - p) / sizeof(du_file) < rec.num_files) {
+      free(rec.path);
+      break;
+    }
+    // File entries are read in place from the blob
+    rec.files = p;
+    p += sizeof(du_file) * rec.num_files;
+
+    if (!du_read(&p, end, &rec.num_children, sizeof(rec.num_children)) ||
+        (size_t)(end - p) / sizeof(unsigned int) < rec.num_children) {
+      free(rec.path);
+      break;
+    }
+    rec.children = (char**)calloc(rec.num_children + 1, sizeof(char*));
+    int ok = rec.children != NULL;
+    for (unsigned int c = 0; ok && c < rec.num_children; c++) {
+      rec.children[c] = du_read_str(&p, end);
+      ok = rec.children[c] != NULL;
+    }
+    if (!ok) {
+      for (unsigned int c = 0; rec.children && c < rec.num_children; c++) free(rec.children[c]);
+      free(rec.children);
+      free(rec.path);
+      break;
+    }
+
+    size_t j = lsh_hash_str(rec.path) & (st->cache_cap - 1);
+    while (st->cache[j].path) j = (j + 1) & (st->cache_cap - 1);
+    st->cache[j] = rec;
+    st->cache_count++;
+  }
+
+  // du_file entries point into the blob, keep it alive with the table
+  st->cache_blob = blob;
+}
+
+static void du_cache_free(du_state *st) {
+  for (size_t i = 0; i < st->cache_cap; i++) {
+    if (st->cache[i].path) {
+      for (unsigned int c = 0; c < st->cache[i].num_children; c++) free(st->cache[i].children[c]);
+      free(st->cache[i].children);
+      free(st->cache[i].path);
+    }
+  }
+  free(st->cache);
+  free(st->cache_blob);
+  st->cache = NULL;
+  st->cache_cap = 0;
+  st->cache_blob = NULL;
+}
+
+static void du_write_str(FILE *f, const char *s) {
+  unsigned int len = (unsigned int)strlen(s);
+  fwrite(&len, sizeof(len), 1, f);
+  fwrite(s, 1, len, f);
+}
+
+// path holds the directory's path; children are joined onto it and cut
+// off again, so no path is built from scratch
+static void du_write_tree(FILE *f, lsh_walker *w, lsh_walk_dir *dir, lsh_path *path, unsigned int *count) {
+  du_dir *d = (du_dir*)dir->data;
+  if (!d) return;
+
+  du_write_str(f, path->s);
+  fwrite(&d->mtime, sizeof(d->mtime), 1, f);
+  unsigned int n = (unsigned int)d->num_entries;
+  fwrite(&n, sizeof(n), 1, f);
+  fwrite(d->entries, sizeof(du_file), n, f);
+  n = (unsigned int)d->num_children;
+  fwrite(&n, sizeof(n), 1, f);
+  for (int i = 0; i < d->num_children; i++) {
+    du_write_str(f, lsh_walk_name(w, d->children[i]));
+  }
+  (*count)++;
+
+  size_t len = path->len;
+  for (int i = 0; i < d->num_children; i++) {
+    const char *name = lsh_walk_name(w, d->children[i]);
+    lsh_path_join(path, name, strlen(name));
+    du_write_tree(f, w, d->children[i], path, count);
+    lsh_path_truncate(path, len);
+  }
+}
+
+static int du_path_under(const char *path, const char *root) {
+  size_t len = strlen(root);
+  if (_strnicmp(path, root, len) != 0) return 0;
+  return path[len] == '\0' || path[len] == '\\' || (len > 0 && root[len - 1] == '\\');
+}
+
+// Write the walked tree plus cached entries for other trees, then swap the
+// new file into place so a crash never leaves a half written cache
+static void du_cache_save(du_state *st, lsh_walker *w, lsh_walk_dir *root) {
+  char path[MAX_PATH], tmp_path[MAX_PATH + 8];
+  if (!lsh_home_path(DU_CACHE_NAME, path, sizeof(path))) return;
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) return;
+
+  unsigned int count = 0;
+  fwrite(DU_CACHE_MAGIC, 1, 8, f);
+  fwrite(&count, sizeof(count), 1, f);
+
+  lsh_path root_path = { NULL, 0, 0 };
+  lsh_walk_path(w, root, &root_path);
+  du_write_tree(f, w, root, &root_path, &count);
+
+  for (size_t i = 0; i < st->cache_cap; i++) {
+    du_cache_rec *rec = &st->cache[i];
+    if (!rec->path || du_path_under(rec->path, root_path.s)) continue;
+    du_write_str(f, rec->path);
+    fwrite(&rec->mtime, sizeof(rec->mtime), 1, f);
+    fwrite(&rec->num_files, sizeof(rec->num_files), 1, f);
+    fwrite(rec->files, sizeof(du_file), rec->num_files, f);
+    fwrite(&rec->num_children, sizeof(rec->num_children), 1, f);
+    for (unsigned int c = 0; c < rec->num_children; c++) du_write_str(f, rec->children[c]);
+    count++;
+  }
+
+  lsh_path_free(&root_path);
+  fseek(f, 8, SEEK_SET);
+  fwrite(&count, sizeof(count), 1, f);
+  int failed = ferror(f);
+  fclose(f);
+
+  if (failed || !MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+    DeleteFile(tmp_path);
+  }
+}
+
+static unsigned long long du_sum_tree(lsh_walk_dir *dir) {
+  du_dir *d = (du_dir*)dir->data;
+  if (!d) return 0;
+  d->total = d->direct;
+  for (int i = 0; i < d->num_children; i++) {
+    d->total += du_sum_tree(d->children[i]);
+  }
+  return d->total;
+}
+
+static unsigned long long du_count_files(lsh_walk_dir *dir) {
+  du_dir *d = (du_dir*)dir->data;
+  if (!d) return 0;
+  unsigned long long n = d->files;
+  for (int i = 0; i < d->num_children; i++) n += du_count_files(d->children[i]);
+  return n;
+}
+
+static void du_collect(lsh_walk_dir *dir, int max_depth, lsh_walk_dir ***list, int *len, int *cap) {
+  du_dir *d = (du_dir*)dir->data;
+  if (!d) return;
+  if (dir->depth > 0) {
+    if (*len >= *cap) {
+      int new_cap = *cap ? *cap * 2 : 64;
+      lsh_walk_dir **l = (lsh_walk_dir**)realloc(*list, sizeof(lsh_walk_dir*) * new_cap);
+      if (!l) return;
+      *list = l;
+      *cap = new_cap;
+    }
+    (*list)[(*len)++] = dir;
+  }
+  if (dir->depth < max_depth) {
+    for (int i = 0; i < d->num_children; i++) {
+      du_collect(d->children[i], max_depth, list, len, cap);
+    }
+  }
+}
+
+static int du_compare_total(const void *a, const void *b) {
+  unsigned long long ta = ((du_dir*)(*(lsh_walk_dir**)a)->data)->total;
+  unsigned long long tb = ((du_dir*)(*(lsh_walk_dir**)b)->data)->total;
+  return (ta < tb) - (ta > tb);
+}
+
+static void du_free_tree(lsh_walk_dir *dir) {
+  du_dir *d = (du_dir*)dir->data;
+  if (d) {
+    for (int i = 0; i < d->num_children; i++) du_free_tree(d->children[i]);
+    free(d->children);
+    free(d->entries);
+    free(d);
+  }
+  free(dir);
+}
+
+int lsh_du(char **args) {
+  int top_n = 10;
+  int max_depth = 1;
+  const char *target = ".";
+  du_state st;
+  lsh_walker w;
+
+  memset(&st, 0, sizeof(st));
+  memset(&w, 0, sizeof(w));
+  w.num_threads = lsh_default_threads();
+
+  for (int i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "-n") == 0 && args[i + 1]) {
+      top_n = atoi(args[++i]);
+    } else if (strcmp(args[i], "-d") == 0 && args[i + 1]) {
+      max_depth = atoi(args[++i]);
+    } else if (strcmp(args[i], "-j") == 0 && args[i + 1]) {
+      w.num_threads = atoi(args[++i]);
+    } else if (strcmp(args[i], "-b") == 0) {
+      st.apparent = 1;
+    } else if (strcmp(args[i], "-c") == 0) {
+      st.use_cache = 1;
+    } else if (args[i][0] == '-') {
+      fprintf(stderr, "usage: du [-n top] [-d depth] [-j threads] [-b] [-c] [path]\n");
+      return 1;
+    } else {
+      target = args[i];
+    }
+  }
+
+  lsh_path root = { NULL, 0, 0 };
+  if (!lsh_path_full(&root, target)) {
+    fprintf(stderr, "lsh: du: invalid path '%s'\n", target);
+    lsh_path_free(&root);
+    return 1;
+  }
+  // Drop a trailing backslash unless the path is a drive root
+  if (root.len > 3 && root.s[root.len - 1] == '\\') {
+    lsh_path_truncate(&root, root.len - 1);
+  }
+
+  for (int i = 0; i < DU_ID_SHARDS; i++) {
+    InitializeCriticalSection(&st.shards[i].lock);
+  }
+  if (st.use_cache) {
+    du_cache_load(&st);
+  }
+
+  w.ctx = &st;
+  w.keep_dirs = 1;
+  w.on_dir = du_on_dir;
+  w.on_subdir = du_on_subdir;
+  w.on_file = du_on_file;
+
+  unsigned long long start = lsh_now_us();
+  lsh_walk_dir *tree = lsh_walk_run(&w, root.s);
+  unsigned long long elapsed = lsh_now_us() - start;
+
+  if (lsh_interrupted) {
+    // Partial totals would mislead, and must not go into the cache
+  } else if (!tree || !tree->data) {
+    fprintf(stderr, "lsh: du: cannot read '%s'\n", root.s);
+  } else {
+    unsigned long long total = du_sum_tree(tree);
+    lsh_walk_dir **list = NULL;
+    int list_len = 0, list_cap = 0;
+    char size_str[32];
+
+    du_collect(tree, max_depth, &list, &list_len, &list_cap);
+    if (list_len > 0) {
+      qsort(list, list_len, sizeof(lsh_walk_dir*), du_compare_total);
+    }
+
+    lsh_path path = { NULL, 0, 0 };
+    size_t root_len = root.len;
+    printf("\n");
+    for (int i = 0; i < list_len && i < top_n; i++) {
+      lsh_format_size(((du_dir*)list[i]->data)->total, size_str, sizeof(size_str));
+      lsh_walk_path(&w, list[i], &path);
+      const char *rel = path.s + (path.len >= root_len ? root_len : path.len);
+      if (*rel == '\\') rel++;
+      printf("%8s  %s\n", size_str, rel);
+    }
+    lsh_path_free(&path);
+    lsh_format_size(total, size_str, sizeof(size_str));
+    printf("%8s  total\n", size_str);
+    printf("\n%llu files, %ld dirs (%ld from cache), %.2fs, %d threads",
+           du_count_files(tree), st.dirs, st.cached_dirs, elapsed / 1e6, w.num_threads);
+    if (w.errors) {
+      printf(", %ld unreadable", w.errors);
+    }
+    printf("\n\n");
+
+    if (st.use_cache) {
+      du_cache_save(&st, &w, tree);
+    }
+    free(list);
+  }
+
+  if (tree) du_free_tree(tree);
+  lsh_path_pool_free(&w.paths);
+  lsh_path_free(&root);
+  du_cache_free(&st);
+  for (int i = 0; i < DU_ID_SHARDS; i++) {
+    free(st.shards[i].keys);
+    DeleteCriticalSection(&st.shards[i].lock);
+  }
+
+  return 1;
+}
+
+/*
+ * sum: parallel file checksums, and checking them against a manifest.
+ *
+ *   sum [-a xxh64|crc32c|sha256] [-r] [-j threads] [-o manifest] path...
+ *   sum -c manifest [-j threads]
+ *   sum --bench file
+ *
+ * Prints "<hex>  <path>" per file, the format of sha256sum and xxhsum, in
+ * the order given, with directories under -r walked by the parallel walker
+ * and their files sorted by path. The files are hashed by a pool of
+ * workers, the largest first so one big file doesn't finish last, each
+ * reading with 1MB sequential reads. XXH64 is the default; it keeps four
+ * independent lanes in flight and runs at memory speed. CRC32C uses the
+ * SSE4.2 crc32 instruction when built for it, and slice-by-8 tables when
+ * not. SHA-256 is for manifests checked by other tools. With -c, the
+ * algorithm of each line is told by the length of its hash.
+ */
+
+#define LSH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+#define LSH_SUM_XXH64 0
+#define LSH_SUM_CRC32C 1
+#define LSH_SUM_SHA256 2
+
+static const struct {
+  const char *name;
+  int size;           // bytes in the digest
+} lsh_sum_algos[] = {
+  { "xxh64", 8 },
+  { "crc32c", 4 },
+  { "sha256", 32 },
+};
+
+#define LSH_SUM_ALGOS (int)(sizeof(lsh_sum_algos) / sizeof(lsh_sum_algos[0]))
+
+typedef struct lsh_sum_state {
+  int algo;
+  unsigned long long total;
+  unsigned char buf[64];      // input short of a whole block
+  size_t buf_len;
+  union {
+    unsigned long long xxh[4];
+    unsigned int crc;
+    unsigned int sha[8];
+  } h;
+} lsh_sum_state;
+
+/* XXH64 */
+
+#define LSH_XXH_P1 0x9E3779B185EBCA87ULL
+#define LSH_XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define LSH_XXH_P3 0x165667B19E3779F9ULL
+#define LSH_XXH_P4 0x85EBCA77C2B2AE63ULL
+#define LSH_XXH_P5 0x27D4EB2F165667C5ULL
+
+static inline unsigned long long lsh_xxh_round(unsigned long long acc, unsigned long long input) {
+  acc += input * LSH_XXH_P2;
+  acc = LSH_ROTL64(acc, 31);
+  return acc * LSH_XXH_P1;
+}
+
+static inline unsigned long long lsh_xxh_merge(unsigned long long h, unsigned long long v) {
+  h ^= lsh_xxh_round(0, v);
+  return h * LSH_XXH_P1 + LSH_XXH_P4;
+}
+
+static inline unsigned long long lsh_read64(const unsigned char *p) {
+  unsigned long long v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static inline unsigned int lsh_read32(const unsigned char *p) {
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+// Whole 32-byte stripes of p, returns the bytes consumed
+static size_t lsh_xxh_stripes(unsigned long long *v, const unsigned char *p, size_t n) {
+  unsigned long long v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+  size_t done = 0;
+  for (; n - done >= 32; done += 32) {
+    v1 = lsh_xxh_round(v1, lsh_read64(p + done));
+    v2 = lsh_xxh_round(v2, lsh_read64(p + done + 8));
+    v3 = lsh_xxh_round(v3, lsh_read64(p + done + 16));
+    v4 = lsh_xxh_round(v4, lsh_read64(p + done + 24));
+  }
+  v[0] = v1;
+  v[1] = v2;
+  v[2] = v3;
+  v[3] = v4;
+  return done;
+}
+
+static void lsh_xxh_final(lsh_sum_state *st, unsigned char *out) {
+  const unsigned long long *v = st->h.xxh;
+  const unsigned char *p = st->buf, *end = st->buf + st->buf_len;
+  unsigned long long h;
+
+  if (st->total >= 32) {
+    h = LSH_ROTL64(v[0], 1) + LSH_ROTL64(v[1], 7) + LSH_ROTL64(v[2], 12) + LSH_ROTL64(v[3], 18);
+    for (int i = 0; i < 4; i++) h = lsh_xxh_merge(h, v[i]);
+  } else {
+    h = LSH_XXH_P5;   // seed 0
+  }
+  h += st->total;
+  for (; end - p >= 8; p += 8) {
+    h ^= lsh_xxh_round(0, lsh_read64(p));
+    h = LSH_ROTL64(h, 27) * LSH_XXH_P1 + LSH_XXH_P4;
+  }
+  if (end - p >= 4) {
+    h ^= (unsigned long long)lsh_read32(p) * LSH_XXH_P1;
+    h = LSH_ROTL64(h, 23) * LSH_XXH_P2 + LSH_XXH_P3;
+    p += 4;
+  }
+  for (; p < end; p++) {
+    h ^= *p * LSH_XXH_P5;
+    h = LSH_ROTL64(h, 11) * LSH_XXH_P1;
+  }
+  h ^= h >> 33;
+  h *= LSH_XXH_P2;
+  h ^= h >> 29;
+  h *= LSH_XXH_P3;
+  h ^= h >> 32;
+  // Big-endian, the way xxhsum prints it
+  for (int i = 0; i < 8; i++) out[i] = (unsigned char)(h >> (56 - i * 8));
+}
+
+/* CRC32C */
+
+static unsigned int lsh_crc32c_table[8][256];
+static int lsh_crc32c_ready = 0;
+
+// Called before any worker starts
+static void lsh_crc32c_init(void) {
+  if (lsh_crc32c_ready) return;
+  for (unsigned int i = 0; i < 256; i++) {
+    unsigned int c = i;
+    for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+    lsh_crc32c_table[0][i] = c;
+  }
+  for (unsigned int i = 0; i < 256; i++) {
+    for (int t = 1; t < 8; t++) {
+      unsigned int c = lsh_crc32c_table[t - 1][i];
+      lsh_crc32c_table[t][i] = (c >> 8) ^ lsh_crc32c_table[0][c & 0xFF];
+    }
+  }
+  lsh_crc32c_ready = 1;
+}
+
+// Slice-by-8: eight table lookups per 8 bytes
+static unsigned int lsh_crc32c_sw(unsigned int crc, const unsigned char *p, size_t n) {
+  for (; n >= 8; p += 8, n -= 8) {
+    unsigned int lo = lsh_read32(p) ^ crc, hi = lsh_read32(p + 4);
+    crc = lsh_crc32c_table[7][lo & 0xFF] ^ lsh_crc32c_table[6][(lo >> 8) & 0xFF] ^
+          lsh_crc32c_table[5][(lo >> 16) & 0xFF] ^ lsh_crc32c_table[4][lo >> 24] ^
+          lsh_crc32c_table[3][hi & 0xFF] ^ lsh_crc32c_table[2][(hi >> 8) & 0xFF] ^
+          lsh_crc32c_table[1][(hi >> 16) & 0xFF] ^ lsh_crc32c_table[0][hi >> 24];
+  }
+  for (; n > 0; p++, n--) crc = (crc >> 8) ^ lsh_crc32c_table[0][(crc ^ *p) & 0xFF];
+  return crc;
+}
+
+static unsigned int lsh_crc32c(unsigned int crc, const unsigned char *p, size_t n) {
+#if defined(LSH_HAVE_SSE42)
+#if defined(_M_X64) || defined(__x86_64__)
+  unsigned long long c = crc;
+  for (; n >= 8; p += 8, n -= 8) c = _mm_crc32_u64(c, lsh_read64(p));
+  crc = (unsigned int)c;
+#endif
+  for (; n >= 4; p += 4, n -= 4) crc = _mm_crc32_u32(crc, lsh_read32(p));
+  for (; n > 0; p++, n--) crc = _mm_crc32_u8(crc, *p);
+  return crc;
+#else
+  return lsh_crc32c_sw(crc, p, n);
+#endif
+}
+
+/* SHA-256 */
+
+static const unsigned int lsh_sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define LSH_ROTR32(x, r) (((x) >> (r)) | ((x) << (32 - (r))))
+
+static void lsh_sha256_blocks(unsigned int *h, const unsigned char *p, size_t blocks) {
+  unsigned int w[64];
+  for (; blocks > 0; blocks--, p += 64) {
+    for (int i = 0; i < 16; i++) {
+      w[i] = (unsigned int)p[i * 4] << 24 | (unsigned int)p[i * 4 + 1] << 16 | (unsigned int)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+      unsigned int s0 = LSH_ROTR32(w[i - 15], 7) ^ LSH_ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      unsigned int s1 = LSH_ROTR32(w[i - 2], 17) ^ LSH_ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    unsigned int a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+      unsigned int t1 = hh + (LSH_ROTR32(e, 6) ^ LSH_ROTR32(e, 11) ^ LSH_ROTR32(e, 25)) + ((e & f) ^ (~e & g)) +
+                        lsh_sha256_k[i] + w[i];
+      unsigned int t2 = (LSH_ROTR32(a, 2) ^ LSH_ROTR32(a, 13) ^ LSH_ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      hh = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += hh;
+  }
+}
+
+static void lsh_sha256_final(lsh_sum_state *st, unsigned char *out) {
+  unsigned long long bits = st->total * 8;
+  size_t n = st->buf_len;
+
+  st->buf[n++] = 0x80;
+  if (n > 56) {
+    memset(st->buf + n, 0, 64 - n);
+    lsh_sha256_blocks(st->h.sha, st->buf, 1);
+    n = 0;
+  }
+  memset(st->buf + n, 0, 56 - n);
+  for (int i = 0; i < 8; i++) st->buf[56 + i] = (unsigned char)(bits >> (56 - i * 8));
+  lsh_sha256_blocks(st->h.sha, st->buf, 1);
+  for (int i = 0; i < 32; i++) out[i] = (unsigned char)(st->h.sha[i / 4] >> (24 - (i % 4) * 8));
+}
+
+/* One interface over the three */
+
+static void lsh_sum_init(lsh_sum_state *st, int algo) {
+  static const unsigned int sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+  memset(st, 0, sizeof(*st));
+  st->algo = algo;
+  if (algo == LSH_SUM_XXH64) {
+    st->h.xxh[0] = LSH_XXH_P1 + LSH_XXH_P2;
+    st->h.xxh[1] = LSH_XXH_P2;
+    st->h.xxh[2] = 0;
+    st->h.xxh[3] = 0 - LSH_XXH_P1;
+  } else if (algo == LSH_SUM_CRC32C) {
+    st->h.crc = 0xFFFFFFFF;
+  } else {
+    memcpy(st->h.sha, sha256_iv, sizeof(sha256_iv));
+  }
+}
+
+static void lsh_sum_update(lsh_sum_state *st, const unsigned char *p, size_t n) {
+  st->total += n;
+  if (st->algo == LSH_SUM_CRC32C) {
+    st->h.crc = lsh_crc32c(st->h.crc, p, n);
+    return;
+  }
+
+  size_t block = st->algo == LSH_SUM_XXH64 ? 32 : 64;
+  if (st->buf_len) {
+    size_t take = block - st->buf_len < n ? block - st->buf_len : n;
+    memcpy(st->buf + st->buf_len, p, take);
+    st->buf_len += take;
+    p += take;
+    n -= take;
+    if (st->buf_len < block) return;
+    if (st->algo == LSH_SUM_XXH64) lsh_xxh_stripes(st->h.xxh, st->buf, block);
+    else lsh_sha256_blocks(st->h.sha, st->buf, 1);
+    st->buf_len = 0;
+  }
+  size_t done;
+  if (st->algo == LSH_SUM_XXH64) {
+    done = lsh_xxh_stripes(st->h.xxh, p, n);
+  } else {
+    done = n / 64 * 64;
+    lsh_sha256_blocks(st->h.sha, p, n / 64);
+  }
+  memcpy(st->buf, p + done, n - done);
+  st->buf_len = n - done;
+}
+
+static void lsh_sum_final(lsh_sum_state *st, unsigned char *out) {
+  if (st->algo == LSH_SUM_XXH64) {
+    lsh_xxh_final(st, out);
+  } else if (st->algo == LSH_SUM_CRC32C) {
+    unsigned int crc = ~st->h.crc;
+    for (int i = 0; i < 4; i++) out[i] = (unsigned char)(crc >> (24 - i * 8));
+  } else {
+    lsh_sha256_final(st, out);
+  }
+}
+
+/* Files and workers */
+
+enum {
+  LSH_SUM_PENDING,
+  LSH_SUM_DONE,
+  LSH_SUM_UNREADABLE,
+};
+
+typedef struct lsh_sum_file {
+  char *path;
+  unsigned long long size;
+  int algo;
+  int result;
+  DWORD error;                  // when unreadable
+  unsigned char digest[32];
+  unsigned char expected[32];   // -c
+} lsh_sum_file;
+
+typedef struct lsh_sum_list {
+  lsh_sum_file *files;
+  int count, cap;
+  CRITICAL_SECTION lock;        // the walker adds from several threads
+  int algo;
+  volatile LONG next;           // the next of order to hash
+  int *order;                   // largest first
+  volatile LONGLONG bytes;
+} lsh_sum_list;
+
+static void lsh_sum_add(lsh_sum_list *list, const char *path, unsigned long long size) {
+  char *copy = _strdup(path);
+  if (list->count == list->cap) {
+    int cap = list->cap ? list->cap * 2 : 256;
+    lsh_sum_file *files = (lsh_sum_file*)realloc(list->files, cap * sizeof(lsh_sum_file));
+    if (!files) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    list->files = files;
+    list->cap = cap;
+  }
+  if (!copy) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  lsh_sum_file *f = &list->files[list->count++];
+  memset(f, 0, sizeof(*f));
+  f->path = copy;
+  f->size = size;
+  f->algo = list->algo;
+}
+
+static void sum_on_file(lsh_walker *w, lsh_walk_dir *dir, const char *name, const FILE_ID_BOTH_DIR_INFO *info) {
+  lsh_sum_list *list = (lsh_sum_list*)w->ctx;
+  lsh_path path = { NULL, 0, 0 };
+  const char *base = dir->path;
+
+  // Under "." the paths are relative to it
+  if (strcmp(base, ".") == 0) base = "";
+  else if (strncmp(base, ".\\", 2) == 0) base += 2;
+  lsh_path_set(&path, base, strlen(base));
+  lsh_path_join(&path, name, strlen(name));
+  EnterCriticalSection(&list->lock);
+  lsh_sum_add(list, path.s, (unsigned long long)info->EndOfFile.QuadPart);
+  LeaveCriticalSection(&list->lock);
+  lsh_path_free(&path);
+}
+
+static int lsh_sum_compare_path(const void *a, const void *b) {
+  return strcmp(((const lsh_sum_file*)a)->path, ((const lsh_sum_file*)b)->path);
+}
+
+static lsh_sum_list *lsh_sum_sort_list;
+
+static int lsh_sum_compare_size(const void *a, const void *b) {
+  unsigned long long sa = lsh_sum_sort_list->files[*(const int*)a].size;
+  unsigned long long sb = lsh_sum_sort_list->files[*(const int*)b].size;
+  return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+// A listed path for a Win32 call. Paths stay relative in the list and the
+// manifest, so a long one is made absolute to take the \\?\ prefix.
+static const char *lsh_sum_win32_path(const char *name, lsh_path *path, lsh_path *tmp) {
+  size_t len = strlen(name);
+  if (len < LSH_PATH_SHORT || !lsh_path_full(path, name)) lsh_path_set(path, name, len);
+  return lsh_path_win32(path, tmp);
+}
+
+static void lsh_sum_hash_file(lsh_sum_list *list, lsh_sum_file *f, unsigned char *buffer) {
+  lsh_path path = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+  HANDLE hFile = lsh_open_read(lsh_sum_win32_path(f->path, &path, &tmp), FILE_FLAG_SEQUENTIAL_SCAN);
+  DWORD error = GetLastError();
+  lsh_sum_state st;
+  DWORD bytes_read;
+  BOOL ok = TRUE;
+
+  lsh_path_free(&path);
+  lsh_path_free(&tmp);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    f->error = error;
+    f->result = LSH_SUM_UNREADABLE;
+    return;
+  }
+  lsh_sum_init(&st, f->algo);
+  while (!lsh_interrupted && (ok = ReadFile(hFile, buffer, LSH_IO_BUFSIZE, &bytes_read, NULL)) && bytes_read > 0) {
+    lsh_sum_update(&st, buffer, bytes_read);
+  }
+  f->error = GetLastError();
+  CloseHandle(hFile);
+  if (!ok) {
+    f->result = LSH_SUM_UNREADABLE;
+    return;
+  }
+  if (lsh_interrupted) return;
+  InterlockedExchangeAdd64(&list->bytes, (LONGLONG)st.total);
+  lsh_sum_final(&st, f->digest);
+  f->result = LSH_SUM_DONE;
+}
+
+static unsigned __stdcall lsh_sum_worker(void *arg) {
+  lsh_sum_list *list = (lsh_sum_list*)arg;
+  unsigned char *buffer = (unsigned char*)malloc(LSH_IO_BUFSIZE);
+  LONG i;
+
+  if (!buffer) return 0;
+  while (!lsh_interrupted && (i = InterlockedIncrement(&list->next) - 1) < list->count) {
+    lsh_sum_hash_file(list, &list->files[list->order[i]], buffer);
+  }
+  free(buffer);
+  return 0;
+}
+
+// Hash every file in the list with up to num_threads workers
+static void lsh_sum_run(lsh_sum_list *list, int num_threads) {
+  HANDLE threads[LSH_MAX_THREADS];
+  int started = 0;
+
+  lsh_crc32c_init();
+  list->order = (int*)malloc((list->count + 1) * sizeof(int));
+  if (!list->order) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < list->count; i++) list->order[i] = i;
+  lsh_sum_sort_list = list;
+  qsort(list->order, list->count, sizeof(int), lsh_sum_compare_size);
+
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > LSH_MAX_THREADS) num_threads = LSH_MAX_THREADS;
+  if (num_threads > list->count) num_threads = list->count;
+  for (int i = 1; i < num_threads; i++) {
+    threads[started] = (HANDLE)_beginthreadex(NULL, 0, lsh_sum_worker, list, 0, NULL);
+    if (threads[started]) started++;
+  }
+  lsh_sum_worker(list);
+  if (started > 0) {
+    WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    for (int i = 0; i < started; i++) CloseHandle(threads[i]);
+  }
+}
+
+static void lsh_sum_free(lsh_sum_list *list) {
+  for (int i = 0; i < list->count; i++) free(list->files[i].path);
+  free(list->files);
+  free(list->order);
+}
+
+static void lsh_sum_print_hex(FILE *out, const unsigned char *digest, int size) {
+  for (int i = 0; i < size; i++) fprintf(out, "%02x", digest[i]);
+}
+
+static int lsh_sum_hex_value(int c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  c = tolower(c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Read a manifest into the list. Returns the number of lines that aren't
+// "<hex>  <path>" with a known hash length, or -1 if it can't be read.
+static int lsh_sum_read_manifest(lsh_sum_list *list, const char *path) {
+  FILE *f = fopen(path, "r");
+  lsh_path text = { NULL, 0, 0 };
+  char chunk[512];
+  int bad = 0;
+
+  if (!f) return -1;
+  while (fgets(chunk, sizeof(chunk), f)) {
+    // Gather a line however long the path in it is
+    size_t n = strlen(chunk);
+    lsh_path_reserve(&text, text.len + n);
+    memcpy(text.s + text.len, chunk, n + 1);
+    text.len += n;
+    if (chunk[n - 1] != '\n' && !feof(f)) continue;
+    char *line = text.s;
+    size_t len = strcspn(line, "\r\n");
+    line[len] = '\0';
+    text.len = 0;
+    if (len == 0 || line[0] == '#') continue;
+
+    size_t hex = 0;
+    while (lsh_sum_hex_value((unsigned char)line[hex]) >= 0) hex++;
+    int algo = -1;
+    for (int a = 0; a < LSH_SUM_ALGOS; a++) {
+      if (hex == (size_t)lsh_sum_algos[a].size * 2) algo = a;
+    }
+    // Two spaces, or a space and '*' for a file hashed in binary mode
+    if (algo < 0 || line[hex] != ' ' || (line[hex + 1] != ' ' && line[hex + 1] != '*') || !line[hex + 2]) {
+      bad++;
+      continue;
+    }
+    list->algo = algo;
+    lsh_sum_add(list, line + hex + 2, 0);
+    lsh_sum_file *entry = &list->files[list->count - 1];
+    for (size_t i = 0; i < hex / 2; i++) {
+      entry->expected[i] = (unsigned char)(lsh_sum_hex_value((unsigned char)line[i * 2]) << 4 |
+                                           lsh_sum_hex_value((unsigned char)line[i * 2 + 1]));
+    }
+  }
+  fclose(f);
+  lsh_path_free(&text);
+  return bad;
+}
+
+static void lsh_sum_report_unreadable(const lsh_sum_file *f) {
+  SetLastError(f->error);
+  lsh_print_open_error("sum", f->path);
+}
+
+static int lsh_sum_verify(const char *manifest, int num_threads) {
+  lsh_sum_list list;
+  int ok = 0, failed = 0, unreadable = 0;
+
+  memset(&list, 0, sizeof(list));
+  int bad = lsh_sum_read_manifest(&list, manifest);
+  if (bad < 0) {
+    lsh_print_open_error("sum", manifest);
+    lsh_last_status = 1;
+    return 1;
+  }
+  lsh_path path = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+  for (int i = 0; i < list.count; i++) {
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (GetFileAttributesEx(lsh_sum_win32_path(list.files[i].path, &path, &tmp), GetFileExInfoStandard, &attr)) {
+      list.files[i].size = ((unsigned long long)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+    }
+  }
+  lsh_path_free(&path);
+  lsh_path_free(&tmp);
+  lsh_sum_run(&list, num_threads);
+
+  for (int i = 0; i < list.count && !lsh_interrupted; i++) {
+    lsh_sum_file *f = &list.files[i];
+    if (f->result == LSH_SUM_UNREADABLE) {
+      lsh_sum_report_unreadable(f);
+      unreadable++;
+    } else if (memcmp(f->digest, f->expected, lsh_sum_algos[f->algo].size) != 0) {
+      printf("%s: FAILED\n", f->path);
+      failed++;
+    } else {
+      ok++;
+    }
+  }
+  if (!lsh_interrupted) {
+    printf("%d OK, %d FAILED, %d unreadable", ok, failed, unreadable);
+    if (bad) printf(", %d lines not understood", bad);
+    printf("\n");
+  }
+  lsh_last_status = failed || unreadable || bad || lsh_interrupted ? 1 : 0;
+  lsh_sum_free(&list);
+  return 1;
+}
+
+static int lsh_sum_bench(const char *path);
+
+int lsh_sum(char **args) {
+  int num_threads = lsh_default_threads(), recurse = 0;
+  const char *manifest_out = NULL, *check = NULL;
+  lsh_sum_list list;
+  int i;
+
+  memset(&list, 0, sizeof(list));
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    if (strcmp(args[i], "--bench") == 0 && args[i + 1] != NULL) {
+      return lsh_sum_bench(args[i + 1]);
+    } else if (strcmp(args[i], "-a") == 0 && args[i + 1] != NULL) {
+      i++;
+      list.algo = -1;
+      for (int a = 0; a < LSH_SUM_ALGOS; a++) {
+        if (_stricmp(args[i], lsh_sum_algos[a].name) == 0) list.algo = a;
+      }
+      if (list.algo < 0) {
+        fprintf(stderr, "lsh: sum: unknown algorithm '%s', use xxh64, crc32c or sha256\n", args[i]);
+        lsh_last_status = 2;
+        return 1;
+      }
+    } else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+      num_threads = atoi(args[++i]);
+    } else if (strcmp(args[i], "-o") == 0 && args[i + 1] != NULL) {
+      manifest_out = args[++i];
+    } else if (strcmp(args[i], "-c") == 0 && args[i + 1] != NULL) {
+      check = args[++i];
+    } else if (strcmp(args[i], "-r") == 0) {
+      recurse = 1;
+    } else {
+      break;
+    }
+  }
+  if (check) return lsh_sum_verify(check, num_threads);
+  if (args[i] == NULL || args[i][0] == '-') {
+    fprintf(stderr, "usage: sum [-a xxh64|crc32c|sha256] [-r] [-j threads] [-o manifest] path...\n"
+                    "       sum -c manifest [-j threads] | sum --bench file\n");
+    lsh_last_status = 2;
+    return 1;
+  }
+
+  InitializeCriticalSection(&list.lock);
+  for (; args[i] != NULL; i++) {
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesEx(args[i], GetFileExInfoStandard, &attr)) {
+      lsh_print_open_error("sum", args[i]);
+      lsh_last_status = 1;
+      continue;
+    }
+    if (!(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+      lsh_sum_add(&list, args[i], ((unsigned long long)attr.nFileSizeHigh << 32) | attr.nFileSizeLow);
+      continue;
+    }
+    if (!recurse) {
+      fprintf(stderr, "lsh: sum: '%s' is a directory, use -r\n", args[i]);
+      lsh_last_status = 1;
+      continue;
+    }
+    lsh_walker w;
+    int first = list.count;
+    memset(&w, 0, sizeof(w));
+    w.num_threads = num_threads;
+    w.ctx = &list;
+    w.on_file = sum_on_file;
+    lsh_walk_run(&w, args[i]);
+    qsort(list.files + first, list.count - first, sizeof(lsh_sum_file), lsh_sum_compare_path);
+    if (w.errors) {
+      fprintf(stderr, "lsh: sum: %ld directories under '%s' could not be read\n", w.errors, args[i]);
+      lsh_last_status = 1;
+    }
+  }
+  DeleteCriticalSection(&list.lock);
+
+  FILE *out = stdout;
+  if (manifest_out && !(out = fopen(manifest_out, "w"))) {
+    fprintf(stderr, "lsh: sum: cannot create '%s'\n", manifest_out);
+    lsh_last_status = 1;
+    lsh_sum_free(&list);
+    return 1;
+  }
+
+  unsigned long long start = lsh_now_us();
+  lsh_sum_run(&list, num_threads);
+  unsigned long long elapsed = lsh_now_us() - start;
+
+  for (int f = 0; f < list.count && !lsh_interrupted; f++) {
+    lsh_sum_file *file = &list.files[f];
+    if (file->result == LSH_SUM_UNREADABLE) {
+      lsh_sum_report_unreadable(file);
+      lsh_last_status = 1;
+      continue;
+    }
+    lsh_sum_print_hex(out, file->digest, lsh_sum_algos[file->algo].size);
+    fprintf(out, "  %s\n", file->path);
+  }
+  if (out != stdout) {
+    int failed = ferror(out);
+    fclose(out);
+    if (failed) {
+      fprintf(stderr, "lsh: sum: error writing '%s'\n", manifest_out);
+      lsh_last_status = 1;
+    } else if (!lsh_interrupted) {
+      char size[32];
+      lsh_format_size((unsigned long long)list.bytes, size, sizeof(size));
+      printf("%d files, %s in %.2fs (%.0f MB/s), %d threads\n", list.count, size, elapsed / 1e6,
+             list.bytes / (elapsed + 1.0), num_threads);
+    }
+  }
+  if (lsh_interrupted) lsh_last_status = 130;
+  lsh_sum_free(&list);
+  return 1;
+}
+
+// Hashing throughput of each algorithm over a file already in memory, and
+// sha256sum for comparison when it is on PATH
+static int lsh_sum_bench(const char *path) {
+  HANDLE hFile = lsh_open_read(path, 0);
+  LARGE_INTEGER size;
+
+  if (hFile == INVALID_HANDLE_VALUE) {
+    lsh_print_open_error("sum", path);
+    return 1;
+  }
+  if (!GetFileSizeEx(hFile, &size) || size.QuadPart == 0) {
+    fprintf(stderr, "lsh: sum: '%s' is empty\n", path);
+    CloseHandle(hFile);
+    return 1;
+  }
+  HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  const unsigned char *data = hMap ? (const unsigned char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+  if (!data) {
+    fprintf(stderr, "lsh: sum: cannot map '%s'\n", path);
+    if (hMap) CloseHandle(hMap);
+    CloseHandle(hFile);
+    return 1;
+  }
+
+  size_t len = (size_t)size.QuadPart;
+  double gb = (double)len / 1e9;
+  unsigned char digest[32];
+  lsh_crc32c_init();
+  printf("\n%s: %llu bytes\n", path, (unsigned long long)len);
+  for (int a = 0; a < LSH_SUM_ALGOS && !lsh_interrupted; a++) {
+    unsigned long long best = ~0ULL;
+    for (int run = 0; run < 3; run++) {
+      lsh_sum_state st;
+      unsigned long long start = lsh_now_us();
+      lsh_sum_init(&st, a);
+      lsh_sum_update(&st, data, len);
+      lsh_sum_final(&st, digest);
+      unsigned long long t = lsh_now_us() - start;
+      if (t < best) best = t;
+    }
+    printf("  %-12s %8.2f GB/s  ", a == LSH_SUM_CRC32C ?
+#if defined(LSH_HAVE_SSE42)
+           "crc32c sse42" :
+#else
+           "crc32c table" :
+#endif
+           lsh_sum_algos[a].name, gb / (best / 1e6 + 1e-9));
+    lsh_sum_print_hex(stdout, digest, lsh_sum_algos[a].size);
+    printf("\n");
+  }
+#if defined(LSH_HAVE_SSE42)
+  unsigned long long start = lsh_now_us();
+  lsh_crc32c_sw(0xFFFFFFFF, data, len);
+  printf("  %-12s %8.2f GB/s\n", "crc32c table", gb / ((lsh_now_us() - start) / 1e6 + 1e-9));
+#endif
+
+  char tool[MAX_PATH];
+  if (SearchPath(NULL, "sha256sum.exe", NULL, sizeof(tool), tool, NULL)) {
+    char command[MAX_PATH * 2 + 16];
+    unsigned long long best = ~0ULL;
+    snprintf(command, sizeof(command), "\"%s\" \"%s\"", tool, path);
+    for (int run = 0; run < 3; run++) {
+      unsigned long long t = lsh_time_external(command);
+      if (t && t < best) best = t;
+    }
+    if (best != ~0ULL) printf("  %-12s %8.2f GB/s (%s)\n", "sha256sum", gb / (best / 1e6 + 1e-9), tool);
+  } else {
+    printf("  sha256sum    not found on PATH\n");
+  }
+  printf("\n");
+
+  UnmapViewOfFile(data);
+  CloseHandle(hMap);
+  CloseHandle(hFile);
+  return 1;
+}
+
+/*
+ * sort: sort lines, in parallel, and through temporary files when they
+ * don't fit in memory.
+ *
+ *   sort [-k N[,M]] [-t SEP] [-n] [-r] [-u] [-j threads] [-m MB] [-o file] [-v] [file...]
+ *   sort --bench [-m MB] [-s MB]
+ *
+ * Input is read into one block of the memory budget (-m, default
+ * LSH_SORT_MEMORY), the text growing from the front and a record per line
+ * growing down from the back, until they meet. The records are split
+ * among the workers, each sorting its part with qsort, and the parts are
+ * merged through a heap as they are written. If all the input fit, that
+ * is the output; otherwise each block becomes a sorted run in a temporary
+ * file, and the runs are merged the same way at the end, each read
+ * through its own share of the budget.
+ *
+ * Records carry the first 8 bytes of their key as a big-endian integer,
+ * or the key's number with -n, so most comparisons don't touch the text.
+ * Keys follow GNU sort: -k N is field N to the end of the line, -k N,M
+ * fields N to M; fields are split at SEP, or else at runs of blanks, and
+ * a key's leading blanks are skipped. Lines with equal keys are ordered by
+ * the whole line, except with -u, which keeps the first line of each key.
+ * Comparison is by bytes. A "\r\n" line end is read as "\n".
+ */
+
+#define LSH_SORT_MEMORY (256 * 1024 * 1024)
+#define LSH_SORT_READ_BLOCK (1024 * 1024)
+#define LSH_SORT_MIN_RUN_BUFFER (64 * 1024)
+#define LSH_SORT_MERGE_WAY 64           // most runs open at once when merging
+#define LSH_SORT_PART_RECORDS 65536     // records a qsort works on at a time
+
+typedef struct lsh_sort_rec {
+  const char *line;
+  unsigned int len;
+  unsigned int key_off, key_len;
+  union {
+    unsigned long long prefix;    // first 8 bytes of the key, big-endian
+    double num;                   // with -n
+  } k;
+} lsh_sort_rec;
+
+typedef struct lsh_sort_opts {
+  int field_start, field_end;     // 1-based, 0 for the whole line / to the end
+  int sep;                        // -t, or -1 for blanks
+  int numeric, reverse, unique;
+} lsh_sort_opts;
+
+// qsort has no context argument; a sort runs one at a time
+static lsh_sort_opts lsh_sort_opt;
+
+static int lsh_sort_blank(char c) {
+  return c == ' ' || c == '\t';
+}
+
+// Start of field n (1-based) in p..end
+static const char *lsh_sort_field(const char *p, const char *end, int n) {
+  const lsh_sort_opts *o = &lsh_sort_opt;
+  for (int f = 1; f < n && p < end; f++) {
+    if (o->sep >= 0) {
+      const char *s = (const char*)memchr(p, o->sep, end - p);
+      p = s ? s + 1 : end;
+    } else {
+      while (p < end && lsh_sort_blank(*p)) p++;
+      while (p < end && !lsh_sort_blank(*p)) p++;
+    }
+  }
+  return p;
+}
+
+// A leading number the way sort -n reads one: blanks, '-', digits, a '.'
+// and more digits. Anything else counts as 0.
+static double lsh_sort_number(const char *p, const char *end) {
+  double value = 0, scale = 1;
+  int negative = 0;
+  while (p < end && lsh_sort_blank(*p)) p++;
+  if (p < end && *p == '-') {
+    negative = 1;
+    p++;
+  }
+  for (; p < end && *p >= '0' && *p <= '9'; p++) value = value * 10 + (*p - '0');
+  if (p < end && *p == '.') {
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++) {
+      scale /= 10;
+      value += (*p - '0') * scale;
+    }
+  }
+  return negative ? -value : value;
+}
+
+static void lsh_sort_set_key(lsh_sort_rec *r) {
+  const lsh_sort_opts *o = &lsh_sort_opt;
+  const char *start = r->line, *end = r->line + r->len;
+
+  if (o->field_start > 0) {
+    start = lsh_sort_field(r->line, end, o->field_start);
+    if (o->sep < 0) {
+      while (start < end && lsh_sort_blank(*start)) start++;
+    }
+    if (o->field_end >= o->field_start) {
+      // Up to the end of field M
+      const char *stop = lsh_sort_field(start, end, o->field_end - o->field_start + 1);
+      if (o->sep >= 0) {
+        const char *s = (const char*)memchr(stop, o->sep, end - stop);
+        if (s) end = s;
+      } else {
+        while (stop < end && lsh_sort_blank(*stop)) stop++;
+        while (stop < end && !lsh_sort_blank(*stop)) stop++;
+        end = stop;
+      }
+    }
+  }
+  r->key_off = (unsigned int)(start - r->line);
+  r->key_len = (unsigned int)(end - start);
+  if (o->numeric) {
+    r->k.num = lsh_sort_number(start, end);
+  } else {
+    unsigned long long prefix = 0;
+    for (int i = 0; i < 8; i++) {
+      prefix = (prefix << 8) | (i < (int)r->key_len ? (unsigned char)start[i] : 0);
+    }
+    r->k.prefix = prefix;
+  }
+}
+
+static int lsh_sort_bytes(const char *a, size_t alen, const char *b, size_t blen) {
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  if (c) return c;
+  return alen < blen ? -1 : alen > blen;
+}
+
+// Keys only, as -u sees them
+static int lsh_sort_compare_keys(const lsh_sort_rec *a, const lsh_sort_rec *b) {
+  if (lsh_sort_opt.numeric) {
+    return a->k.num < b->k.num ? -1 : a->k.num > b->k.num;
+  }
+  if (a->k.prefix != b->k.prefix) return a->k.prefix < b->k.prefix ? -1 : 1;
+  return lsh_sort_bytes(a->line + a->key_off, a->key_len, b->line + b->key_off, b->key_len);
+}
+
+static int lsh_sort_compare(const lsh_sort_rec *a, const lsh_sort_rec *b) {
+  int c = lsh_sort_compare_keys(a, b);
+  if (c == 0 && !lsh_sort_opt.unique && (lsh_sort_opt.field_start > 0 || lsh_sort_opt.numeric)) {
+    c = lsh_sort_bytes(a->line, a->len, b->line, b->len);
+  }
+  return lsh_sort_opt.reverse ? -c : c;
+}
+
+// Within a block, lines lie in input order, so equal keys (which only
+// -u leaves) keep it, as they do in GNU sort
+static int lsh_sort_compare_in_block(const lsh_sort_rec *a, const lsh_sort_rec *b) {
+  int c = lsh_sort_compare(a, b);
+  if (c == 0) c = a->line < b->line ? -1 : a->line > b->line;
+  return c;
+}
+
+static int lsh_sort_qsort_compare(const void *a, const void *b) {
+  return lsh_sort_compare_in_block((const lsh_sort_rec*)a, (const lsh_sort_rec*)b);
+}
+
+/* Merging: a binary heap of sources by their current record */
+
+typedef struct lsh_sort_heap {
+  int *items;
+  int count;
+  const lsh_sort_rec **cur;       // current record of each source
+  int in_block;                   // sources share one block
+} lsh_sort_heap;
+
+static int lsh_sort_heap_less(const lsh_sort_heap *h, int a, int b) {
+  int c = h->in_block ? lsh_sort_compare_in_block(h->cur[a], h->cur[b]) : lsh_sort_compare(h->cur[a], h->cur[b]);
+  return c < 0 || (c == 0 && a < b);    // runs are in input order
+}
+
+static void lsh_sort_heap_down(lsh_sort_heap *h, int i) {
+  while (1) {
+    int least = i, l = i * 2 + 1, r = l + 1;
+    if (l < h->count && lsh_sort_heap_less(h, h->items[l], h->items[least])) least = l;
+    if (r < h->count && lsh_sort_heap_less(h, h->items[r], h->items[least])) least = r;
+    if (least == i) return;
+    int t = h->items[i];
+    h->items[i] = h->items[least];
+    h->items[least] = t;
+    i = least;
+  }
+}
+
+static void lsh_sort_heap_build(lsh_sort_heap *h) {
+  for (int i = h->count / 2 - 1; i >= 0; i--) lsh_sort_heap_down(h, i);
+}
+
+// Copy r into *dst with its own copy of the line, for records that have
+// to outlive the buffer they were read into
+static void lsh_sort_keep(lsh_sort_rec *dst, char **line, size_t *cap, const lsh_sort_rec *r) {
+  if (r->len + 1 > *cap) {
+    size_t grown_cap = *cap ? *cap : 256;
+    while (grown_cap < r->len + 1) grown_cap *= 2;
+    char *grown = (char*)realloc(*line, grown_cap);
+    if (!grown) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    *line = grown;
+    *cap = grown_cap;
+  }
+  memcpy(*line, r->line, r->len);
+  *dst = *r;
+  dst->line = *line;
+}
+
+typedef struct lsh_sort_out {
+  FILE *f;
+  int have_last;
+  lsh_sort_rec last;              // for -u
+  char *last_line;
+  size_t last_cap;
+  unsigned long long lines;
+} lsh_sort_out;
+
+static void lsh_sort_put(lsh_sort_out *out, const lsh_sort_rec *r) {
+  if (lsh_sort_opt.unique) {
+    if (out->have_last && lsh_sort_compare_keys(&out->last, r) == 0) return;
+    lsh_sort_keep(&out->last, &out->last_line, &out->last_cap, r);
+    out->have_last = 1;
+  }
+  fwrite(r->line, 1, r->len, out->f);
+  putc('\n', out->f);
+  out->lines++;
+}
+
+/* Sorting a block in memory */
+
+typedef struct lsh_sort_part {
+  lsh_sort_rec *recs;
+  size_t count;
+} lsh_sort_part;
+
+typedef struct lsh_sort_parts {
+  lsh_sort_part part[LSH_MAX_THREADS];
+  int count;
+  volatile LONG next;
+} lsh_sort_parts;
+
+static unsigned __stdcall lsh_sort_part_worker(void *arg) {
+  lsh_sort_parts *parts = (lsh_sort_parts*)arg;
+  LONG i;
+  while ((i = InterlockedIncrement(&parts->next) - 1) < parts->count) {
+    qsort(parts->part[i].recs, parts->part[i].count, sizeof(lsh_sort_rec), lsh_sort_qsort_compare);
+  }
+  return 0;
+}
+
+// Sort count records with up to num_threads workers and write them out.
+// Even on one thread the block is cut into parts of about
+// LSH_SORT_PART_RECORDS and merged, which keeps each qsort in cache.
+static void lsh_sort_block(lsh_sort_rec *recs, size_t count, int num_threads, lsh_sort_out *out) {
+  lsh_sort_parts parts;
+  HANDLE threads[LSH_MAX_THREADS];
+  const lsh_sort_rec *cur[LSH_MAX_THREADS];
+  int items[LSH_MAX_THREADS], started = 0;
+  size_t pos[LSH_MAX_THREADS];
+
+  if (num_threads > LSH_MAX_THREADS) num_threads = LSH_MAX_THREADS;
+  if (num_threads < 1) num_threads = 1;
+  parts.count = (int)(count / LSH_SORT_PART_RECORDS) + 1;
+  if (parts.count < num_threads) parts.count = num_threads;
+  if (parts.count > LSH_MAX_THREADS) parts.count = LSH_MAX_THREADS;
+  if (count < LSH_SORT_PART_RECORDS) parts.count = 1;
+  parts.next = 0;
+  for (int t = 0; t < parts.count; t++) {
+    parts.part[t].recs = recs + count * t / parts.count;
+    parts.part[t].count = count * (t + 1) / parts.count - count * t / parts.count;
+  }
+  if (num_threads > parts.count) num_threads = parts.count;
+  for (int t = 1; t < num_threads; t++) {
+    threads[started] = (HANDLE)_beginthreadex(NULL, 0, lsh_sort_part_worker, &parts, 0, NULL);
+    if (threads[started]) started++;
+  }
+  lsh_sort_part_worker(&parts);
+  if (started > 0) {
+    WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    for (int i = 0; i < started; i++) CloseHandle(threads[i]);
+  }
+
+  lsh_sort_heap h = { items, 0, cur, 1 };
+  for (int t = 0; t < parts.count; t++) {
+    pos[t] = 0;
+    if (parts.part[t].count == 0) continue;
+    cur[t] = &parts.part[t].recs[0];
+    items[h.count++] = t;
+  }
+  lsh_sort_heap_build(&h);
+  while (h.count > 0 && !lsh_interrupted) {
+    int t = h.items[0];
+    lsh_sort_put(out, cur[t]);
+    if (++pos[t] < parts.part[t].count) {
+      cur[t] = &parts.part[t].recs[pos[t]];
+    } else {
+      h.items[0] = h.items[--h.count];
+    }
+    lsh_sort_heap_down(&h, 0);
+  }
+}
+
+/* Reading input into blocks */
+
+typedef struct lsh_sort_input {
+  char **files;                   // NULL-terminated, or NULL for stdin
+  FILE *f;
+  int next;
+  int eof;
+  char last;                      // last byte read from the current file
+  const char *error;              // a file that couldn't be opened
+} lsh_sort_input;
+
+// Read up to n bytes from the inputs, ending each file with a newline
+static size_t lsh_sort_input_read(lsh_sort_input *in, char *dst, size_t n) {
+  while (!in->eof) {
+    if (!in->f) {
+      if (!in->files) {
+        in->f = stdin;
+      } else if (!in->files[in->next]) {
+        in->eof = 1;
+        break;
+      } else if (!(in->f = fopen(in->files[in->next], "rb"))) {
+        in->error = in->files[in->next];
+        in->eof = 1;
+        break;
+      }
+      in->last = '\n';
+    }
+    size_t got = fread(dst, 1, n, in->f);
+    if (got > 0) {
+      in->last = dst[got - 1];
+      return got;
+    }
+    if (in->f != stdin) fclose(in->f);
+    in->f = NULL;
+    if (!in->files) in->eof = 1;
+    else in->next++;
+    if (in->last != '\n') {
+      in->last = '\n';
+      dst[0] = '\n';
+      return 1;
+    }
+  }
+  return 0;
+}
+
+typedef struct lsh_sort_block_buf {
+  char *mem;
+  size_t size;
+  size_t len;                     // text at the front
+  size_t parsed;                  // of which split into records
+  size_t count;                   // records, growing down from the back
+} lsh_sort_block_buf;
+
+static lsh_sort_rec *lsh_sort_recs(lsh_sort_block_buf *b) {
+  return (lsh_sort_rec*)(b->mem + b->size) - b->count;
+}
+
+// Split the complete lines after b->parsed into records. Returns 0 when
+// the records would run into the text.
+static int lsh_sort_split(lsh_sort_block_buf *b) {
+  const char *p = b->mem + b->parsed, *end = b->mem + b->len, *nl;
+  while ((nl = (const char*)memchr(p, '\n', end - p)) != NULL) {
+    if (b->len + (b->count + 1) * sizeof(lsh_sort_rec) > b->size) return 0;
+    lsh_sort_rec *r = (lsh_sort_rec*)(b->mem + b->size) - ++b->count;
+    r->line = p;
+    r->len = (unsigned int)(nl - p);
+    if (r->len > 0 && p[r->len - 1] == '\r') r->len--;
+    lsh_sort_set_key(r);
+    p = nl + 1;
+    b->parsed = p - b->mem;
+  }
+  return 1;
+}
+
+// Fill the block with whole lines, until their text and records meet.
+// Returns 0 if the line carried over fills the block on its own.
+static int lsh_sort_fill(lsh_sort_block_buf *b, lsh_sort_input *in) {
+  // Carry over the part line the last block ended with
+  size_t rest = b->len - b->parsed;
+  memmove(b->mem, b->mem + b->parsed, rest);
+  b->len = rest;
+  b->parsed = 0;
+  b->count = 0;
+
+  // A full block spills as a run; lsh_sort_split stops where it is full
+  while (!lsh_interrupted && lsh_sort_split(b)) {
+    // Read at most half the free space, so the records of the lines it
+    // brings in still fit
+    size_t room = (b->size - b->len - b->count * sizeof(lsh_sort_rec)) / 2;
+    if (room > LSH_SORT_READ_BLOCK) room = LSH_SORT_READ_BLOCK;
+    if (room == 0 || (room < 4096 && b->count > 0)) break;
+    size_t got = lsh_sort_input_read(in, b->mem + b->len, room);
+    if (got == 0) break;
+    b->len += got;
+  }
+  return b->count > 0 || b->parsed == b->len || lsh_interrupted;
+}
+
+/* Runs in temporary files */
+
+typedef struct lsh_sort_run {
+  char path[MAX_PATH];
+  FILE *f;
+  char *buf;
+  size_t cap, start, end;
+  int eof;
+  int error;                      // reading it back failed
+  lsh_sort_rec rec;
+} lsh_sort_run;
+
+// Step a run to its next line. Returns 0 at the end, or with run->error
+// set if it couldn't be read.
+static int lsh_sort_run_next(lsh_sort_run *run) {
+  while (1) {
+    char *nl = (char*)memchr(run->buf + run->start, '\n', run->end - run->start);
+    if (nl) {
+      run->rec.line = run->buf + run->start;
+      run->rec.len = (unsigned int)(nl - run->rec.line);
+      lsh_sort_set_key(&run->rec);
+      run->start = nl + 1 - run->buf;
+      return 1;
+    }
+    if (run->eof) return 0;     // runs are written with a newline after every line
+    memmove(run->buf, run->buf + run->start, run->end - run->start);
+    run->end -= run->start;
+    run->start = 0;
+    if (run->end == run->cap) {
+      char *grown = (char*)realloc(run->buf, run->cap * 2);
+      if (!grown) {
+        run->error = 1;
+        return 0;
+      }
+      run->buf = grown;
+      run->cap *= 2;
+    }
+    size_t got = fread(run->buf + run->end, 1, run->cap - run->end, run->f);
+    if (got == 0) {
+      if (ferror(run->f)) {
+        run->error = 1;
+        return 0;
+      }
+      run->eof = 1;
+    }
+    run->end += got;
+  }
+}
+
+// Merge num_runs runs into out. Returns 0, having said why, if a run
+// can't be read back: its lines would be missing.
+static int lsh_sort_merge_runs(lsh_sort_run *runs, int num_runs, size_t memory, lsh_sort_out *out) {
+  const lsh_sort_rec **cur = (const lsh_sort_rec**)malloc(num_runs * sizeof(lsh_sort_rec*));
+  int *items = (int*)malloc(num_runs * sizeof(int));
+  size_t share = memory / num_runs;
+
+  if (share < LSH_SORT_MIN_RUN_BUFFER) share = LSH_SORT_MIN_RUN_BUFFER;
+  if (!cur || !items) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  lsh_sort_heap h = { items, 0, cur, 0 };
+  lsh_sort_run *failed = NULL;
+  for (int i = 0; i < num_runs; i++) {
+    lsh_sort_run *run = &runs[i];
+    run->f = fopen(run->path, "rb");
+    run->buf = (char*)malloc(share);
+    run->cap = share;
+    run->start = run->end = 0;
+    run->eof = run->error = 0;
+    if (!run->f || !run->buf) {
+      failed = run;
+      break;
+    }
+    if (lsh_sort_run_next(run)) {
+      cur[i] = &run->rec;
+      items[h.count++] = i;
+    } else if (run->error) {
+      failed = run;
+      break;
+    }
+  }
+  if (!failed) {
+    lsh_sort_heap_build(&h);
+    while (h.count > 0 && !lsh_interrupted) {
+      int i = h.items[0];
+      lsh_sort_put(out, cur[i]);
+      if (!lsh_sort_run_next(&runs[i])) {
+        if (runs[i].error) {
+          failed = &runs[i];
+          break;
+        }
+        h.items[0] = h.items[--h.count];
+      }
+      lsh_sort_heap_down(&h, 0);
+    }
+  }
+  if (failed) fprintf(stderr, "lsh: sort: cannot read back '%s'\n", failed->path);
+  for (int i = 0; i < num_runs; i++) {
+    if (runs[i].f) fclose(runs[i].f);
+    runs[i].f = NULL;
+    free(runs[i].buf);
+    runs[i].buf = NULL;
+  }
+  free(cur);
+  free(items);
+  return failed == NULL;
+}
+
+// A new temporary file for a run, its name in path. NULL, having said
+// why, if it can't be created.
+static FILE *lsh_sort_spill(const char *dir, char *path) {
+  GetTempFileName(dir, "lsr", 0, path);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "lsh: sort: cannot write a temporary file in %s\n", dir);
+    DeleteFile(path);
+    return NULL;
+  }
+  setvbuf(f, NULL, _IOFBF, LSH_SORT_READ_BLOCK);
+  return f;
+}
+
+// Merge groups of runs into longer runs, each group in one pass, until
+// few enough are left to open at once for the final merge. Each merge
+// opens at most LSH_SORT_MERGE_WAY runs, fewer when the budget can't give
+// each its minimum buffer. Groups are consecutive, so runs stay in input
+// order. Returns 0 on failure; the runs left to delete are in *runs.
+static int lsh_sort_merge_down(lsh_sort_run **runs, int *num_runs, const char *dir, size_t memory) {
+  int way = (int)(memory / LSH_SORT_MIN_RUN_BUFFER);
+  if (way > LSH_SORT_MERGE_WAY) way = LSH_SORT_MERGE_WAY;
+  if (way < 2) way = 2;
+
+  while (*num_runs > way && !lsh_interrupted) {
+    int groups = (*num_runs + way - 1) / way, made = 0, ok = 1;
+    lsh_sort_run *next = (lsh_sort_run*)calloc(groups, sizeof(lsh_sort_run));
+    if (!next) {
+      fprintf(stderr, "lsh: allocation error\n");
+      return 0;
+    }
+    for (int g = 0; g < groups && ok && !lsh_interrupted; g++) {
+      int first = g * way, count = *num_runs - first < way ? *num_runs - first : way;
+      lsh_sort_out spill;
+      memset(&spill, 0, sizeof(spill));
+      spill.f = lsh_sort_spill(dir, next[g].path);
+      if (!spill.f) {
+        ok = 0;
+        break;
+      }
+      made++;
+      ok = lsh_sort_merge_runs(*runs + first, count, memory, &spill);
+      if (ok && ferror(spill.f)) {
+        fprintf(stderr, "lsh: sort: error writing a temporary file in %s\n", dir);
+        ok = 0;
+      }
+      fclose(spill.f);
+      free(spill.last_line);
+    }
+    if (!ok || lsh_interrupted) {
+      for (int g = 0; g < made; g++) DeleteFile(next[g].path);
+      free(next);
+      return 0;
+    }
+    for (int i = 0; i < *num_runs; i++) DeleteFile((*runs)[i].path);
+    free(*runs);
+    *runs = next;
+    *num_runs = groups;
+  }
+  return 1;
+}
+
+typedef struct lsh_sort_stats {
+  unsigned long long bytes, lines_in, lines_out;
+  int runs;
+} lsh_sort_stats;
+
+// Sort the inputs into out_path, or stdout if NULL. Returns 0 on failure.
+static int lsh_sort_files(char **files, const char *out_path, size_t memory, int num_threads,
+                          lsh_sort_stats *stats) {
+  lsh_sort_input in;
+  lsh_sort_block_buf b;
+  lsh_sort_run *runs = NULL;
+  lsh_sort_out out;
+  char dir[MAX_PATH];
+  int ok = 1, runs_cap = 0, num_runs = 0;
+
+  memset(&in, 0, sizeof(in));
+  memset(&b, 0, sizeof(b));
+  memset(&out, 0, sizeof(out));
+  memset(stats, 0, sizeof(*stats));
+  in.files = files;
+  b.size = memory & ~(size_t)(sizeof(lsh_sort_rec) - 1);
+  b.mem = (char*)malloc(b.size);
+  if (!b.mem) {
+    fprintf(stderr, "lsh: sort: cannot allocate %llu MB, try a smaller -m\n", (unsigned long long)(memory >> 20));
+    return 0;
+  }
+  GetTempPath(sizeof(dir), dir);
+
+  while (!lsh_interrupted) {
+    if (!lsh_sort_fill(&b, &in)) {
+      fprintf(stderr, "lsh: sort: a line is longer than the memory budget\n");
+      ok = 0;
+      break;
+    }
+    if (in.error) {
+      lsh_print_open_error("sort", in.error);
+      ok = 0;
+      break;
+    }
+    if (lsh_interrupted) break;
+    stats->lines_in += b.count;
+    stats->bytes += b.parsed;
+    int last = in.eof && b.parsed == b.len;
+    if (last && stats->runs == 0) {
+      // It all fit: sort straight to the output
+      out.f = out_path ? fopen(out_path, "wb") : stdout;
+      if (!out.f) break;
+      lsh_sort_block(lsh_sort_recs(&b), b.count, num_threads, &out);
+      break;
+    }
+    if (b.count > 0) {
+      if (num_runs == runs_cap) {
+        runs_cap = runs_cap ? runs_cap * 2 : 16;
+        lsh_sort_run *grown = (lsh_sort_run*)realloc(runs, runs_cap * sizeof(lsh_sort_run));
+        if (!grown) {
+          ok = 0;
+          break;
+        }
+        runs = grown;
+      }
+      lsh_sort_run *run = &runs[num_runs];
+      memset(run, 0, sizeof(*run));
+      lsh_sort_out spill;
+      memset(&spill, 0, sizeof(spill));
+      spill.f = lsh_sort_spill(dir, run->path);
+      if (!spill.f) {
+        ok = 0;
+        break;
+      }
+      num_runs++;
+      stats->runs++;
+      lsh_sort_block(lsh_sort_recs(&b), b.count, num_threads, &spill);
+      int failed = ferror(spill.f);
+      fclose(spill.f);
+      free(spill.last_line);
+      if (failed) {
+        fprintf(stderr, "lsh: sort: error writing a temporary file in %s\n", dir);
+        ok = 0;
+        break;
+      }
+    }
+    if (last) {
+      // The input is gone, so the block's memory goes to the run buffers
+      free(b.mem);
+      b.mem = NULL;
+      if (!lsh_sort_merge_down(&runs, &num_runs, dir, memory)) {
+        ok = 0;
+        break;
+      }
+      out.f = out_path ? fopen(out_path, "wb") : stdout;
+      if (out.f) ok = lsh_sort_merge_runs(runs, num_runs, memory, &out);
+      break;
+    }
+  }
+
+  if (ok && !out.f && !lsh_interrupted) {
+    fprintf(stderr, "lsh: sort: cannot create '%s'\n", out_path);
+    ok = 0;
+  }
+  if (out.f && out.f != stdout) {
+    if (ferror(out.f)) {
+      fprintf(stderr, "lsh: sort: error writing '%s'\n", out_path);
+      ok = 0;
+    }
+    fclose(out.f);
+  }
+  if (in.f && in.f != stdin) fclose(in.f);
+  for (int i = 0; i < num_runs; i++) DeleteFile(runs[i].path);
+  free(runs);
+  free(b.mem);
+  free(out.last_line);
+  stats->lines_out = out.lines;
+  return ok && !lsh_interrupted;
+}
+
+static int lsh_sort_bench(int memory_mb, int size_mb);
+
+int lsh_sort(char **args) {
+  size_t memory = LSH_SORT_MEMORY;
+  int num_threads = lsh_default_threads(), verbose = 0, bench = 0, bench_mb = 256, memory_set = 0, i;
+  const char *out_path = NULL;
+
+  memset(&lsh_sort_opt, 0, sizeof(lsh_sort_opt));
+  lsh_sort_opt.sep = -1;
+  for (i = 1; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+    char *a = args[i];
+    if (strcmp(a, "-k") == 0 && args[i + 1] != NULL) {
+      char *comma;
+      lsh_sort_opt.field_start = atoi(args[++i]);
+      comma = strchr(args[i], ',');
+      lsh_sort_opt.field_end = comma ? atoi(comma + 1) : 0;
+      if (lsh_sort_opt.field_start < 1 || (comma && lsh_sort_opt.field_end < lsh_sort_opt.field_start)) {
+        fprintf(stderr, "lsh: sort: bad key '%s'\n", args[i]);
+        lsh_last_status = 2;
+        return 1;
+      }
+    } else if (strcmp(a, "-t") == 0 && args[i + 1] != NULL && strlen(args[i + 1]) == 1) {
+      lsh_sort_opt.sep = (unsigned char)args[++i][0];
+    } else if (strcmp(a, "-j") == 0 && args[i + 1] != NULL) {
+      num_threads = atoi(args[++i]);
+    } else if (strcmp(a, "-m") == 0 && args[i + 1] != NULL) {
+      memory = (size_t)atoi(args[++i]) << 20;
+      memory_set = 1;
+    } else if (strcmp(a, "-s") == 0 && args[i + 1] != NULL) {
+      bench_mb = atoi(args[++i]);
+    } else if (strcmp(a, "-o") == 0 && args[i + 1] != NULL) {
+      out_path = args[++i];
+    } else if (strcmp(a, "--bench") == 0) {
+      bench = 1;
+    } else if (a[1] != '-' && strspn(a + 1, "nruv") == strlen(a + 1)) {
+      for (char *f = a + 1; *f; f++) {
+        if (*f == 'n') lsh_sort_opt.numeric = 1;
+        else if (*f == 'r') lsh_sort_opt.reverse = 1;
+        else if (*f == 'u') lsh_sort_opt.unique = 1;
+        else verbose = 1;
+      }
+    } else {
+      fprintf(stderr, "usage: sort [-k N[,M]] [-t SEP] [-n] [-r] [-u] [-j threads] [-m MB] [-o file] [-v] [file...]\n"
+                      "       sort --bench [-m MB] [-s MB]\n");
+      lsh_last_status = 2;
+      return 1;
+    }
+  }
+  if (memory < (1 << 20)) memory = 1 << 20;
+  // The bench spills by default, so its budget is smaller unless given
+  if (bench) return lsh_sort_bench(memory_set ? (int)(memory >> 20) : 64, bench_mb);
+
+  lsh_sort_stats stats;
+  unsigned long long start = lsh_now_us();
+  int ok = lsh_sort_files(args[i] ? args + i : NULL, out_path, memory, num_threads, &stats);
+  fflush(stdout);
+  if (lsh_interrupted) {
+    lsh_last_status = 130;
+  } else if (!ok) {
+    lsh_last_status = 2;
+  }
+  if (verbose && ok) {
+    char size[32];
+    unsigned long long elapsed = lsh_now_us() - start;
+    lsh_format_size(stats.bytes, size, sizeof(size));
+    fprintf(stderr, "sort: %llu lines (%s) in %.2fs, %.0f MB/s, %d runs, %d threads\n", stats.lines_in, size,
+            elapsed / 1e6, stats.bytes / (elapsed + 1.0), stats.runs, num_threads);
+  }
+  return 1;
+}
+
+// Check out_path is in order, returns the number of lines
+static unsigned long long sortbench_check(const char *path, int *in_order) {
+  lsh_sort_run run;
+  lsh_sort_rec prev;
+  char *prev_line = NULL;
+  size_t prev_cap = 0;
+  unsigned long long lines = 0;
+
+  memset(&run, 0, sizeof(run));
+  *in_order = 1;
+  run.f = fopen(path, "rb");
+  run.cap = LSH_SORT_READ_BLOCK;
+  run.buf = (char*)malloc(run.cap);
+  if (!run.f || !run.buf) {
+    if (run.f) fclose(run.f);
+    free(run.buf);
+    *in_order = 0;
+    return 0;
+  }
+  while (lsh_sort_run_next(&run)) {
+    if (lines > 0 && lsh_sort_compare(&prev, &run.rec) > 0) *in_order = 0;
+    lsh_sort_keep(&prev, &prev_line, &prev_cap, &run.rec);
+    lines++;
+  }
+  fclose(run.f);
+  free(run.buf);
+  free(prev_line);
+  return lines;
+}
+
+/*
+ * sort --bench [-m MB] [-s MB]
+ *
+ * Generates SIZE megabytes of log lines (default 256) and sorts them with
+ * a budget of MB megabytes (default 64), so they spill to runs, by whole
+ * line and numerically by a field; then whole lines again with the budget
+ * large enough to sort in memory. Each output is checked to be in order.
+ * sort.exe on PATH is timed on the same file, with its own defaults, for
+ * comparison.
+ */
+static int lsh_sort_bench(int memory_mb, int size_mb) {
+  char dir[MAX_PATH], in_path[MAX_PATH], out_path[MAX_PATH];
+  char *files[2] = { in_path, NULL };
+
+  if (size_mb < 1) size_mb = 256;
+  GetTempPath(sizeof(dir), dir);
+  GetTempFileName(dir, "lsb", 0, in_path);
+  GetTempFileName(dir, "lsb", 0, out_path);
+
+  FILE *f = fopen(in_path, "wb");
+  if (!f) {
+    fprintf(stderr, "lsh: sort: cannot create %s\n", in_path);
+    return 1;
+  }
+  static const char *levels[] = { "INFO", "WARN", "ERROR", "DEBUG" };
+  unsigned long long bytes = 0, target = (unsigned long long)size_mb << 20;
+  unsigned int seed = 2463534242u;
+  while (bytes < target) {
+    unsigned int a, b;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    a = seed;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    b = seed;
+    int n = fprintf(f, "host%02u %s %u.%03u user%05u GET /api/v1/items/%u\n", a % 50, levels[b % 4], b % 100000,
+                    a % 1000, (a >> 10) % 100000, b >> 8);
+    if (n < 0) break;
+    bytes += (unsigned long long)n;
+  }
+  fclose(f);
+
+  static const struct {
+    const char *name;
+    int field, numeric, in_memory;
+  } cases[] = {
+    { "lines", 0, 0, 0 },
+    { "-k 3 -n", 3, 1, 0 },
+    { "lines, in memory", 0, 0, 1 },
+  };
+  printf("\n%llu MB of log lines, budget %d MB, %d threads\n", bytes >> 20, memory_mb, lsh_default_threads());
+  for (int c = 0; c < 3 && !lsh_interrupted; c++) {
+    lsh_sort_stats stats;
+    int in_order;
+    memset(&lsh_sort_opt, 0, sizeof(lsh_sort_opt));
+    lsh_sort_opt.sep = -1;
+    lsh_sort_opt.field_start = cases[c].field;
+    lsh_sort_opt.numeric = cases[c].numeric;
+    size_t memory = cases[c].in_memory ? (size_t)(bytes * 2 + (64 << 20)) : (size_t)memory_mb << 20;
+    unsigned long long start = lsh_now_us();
+    if (!lsh_sort_files(files, out_path, memory, lsh_default_threads(), &stats)) {
+      printf("  %-18s failed\n", cases[c].name);
+      continue;
+    }
+    unsigned long long elapsed = lsh_now_us() - start;
+    unsigned long long lines = sortbench_check(out_path, &in_order);
+    printf("  %-18s %8.2fs %8.0f MB/s %10.0f lines/s %4d runs%s\n", cases[c].name, elapsed / 1e6,
+           bytes / (elapsed + 1.0), stats.lines_in / (elapsed / 1e6 + 1e-9), stats.runs,
+           in_order && lines == stats.lines_in ? "" : "  NOT SORTED");
+  }
+
+  char tool[MAX_PATH];
+  if (!lsh_interrupted && SearchPath(NULL, "sort.exe", NULL, sizeof(tool), tool, NULL)) {
+    char command[MAX_PATH * 2 + 16];
+    snprintf(command, sizeof(command), "\"%s\" \"%s\"", tool, in_path);
+    unsigned long long t = lsh_time_external(command);
+    if (t) printf("  %-18s %8.2fs %8.0f MB/s (%s)\n", "sort.exe", t / 1e6, bytes / (t + 1.0), tool);
+  } else if (!lsh_interrupted) {
+    printf("  sort.exe           not found on PATH\n");
+  }
+  printf("\n");
+  DeleteFile(in_path);
+  DeleteFile(out_path);
+  memset(&lsh_sort_opt, 0, sizeof(lsh_sort_opt));
+  return 1;
+}
+
+int lsh_help(char **args) {
+  int i;
+  printf("Marcus Denslow's LSH\n");
+  printf("Type program names and arguments, and hit enter.\n");
+  printf("The following are built in:\n");
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    printf("  %s\n", builtin_str[i]);
+  }
+  printf("Use the command for information on other programs.\n");
+  return 1;
+}
+
+/*
+ * Prompt segments.
+ *
+ * The prompt is drawn straight away from what is already known: user,
+ * directory, the last command's exit status and duration, and whatever git
+ * state is cached for the current repository. Git state is computed by a
+ * worker thread and kept per repository root, along with the mtimes of
+ * .git/HEAD and .git/index it was computed against. When the worker
+ * finishes it sets prompt_ready_event, and lsh_read_line repaints the git
+ * segment in place at the right edge of the prompt line.
+ */
+
+#define PROMPT_CACHE_SIZE 32
+#define PROMPT_GIT_TIMEOUT_MS 2000
+#define PROMPT_GIT_MAX_AGE_MS 5000
+#define PROMPT_SLOW_COMMAND_US 1000000ULL
+
+typedef struct prompt_git_entry {
+    lsh_path root;                  // working tree root, empty if the slot is free
+    lsh_path git_dir;
+    char branch[128];
+    int dirty;                      // 1 dirty, 0 clean, -1 unknown (timed out)
+    unsigned long long head_mtime;
+    unsigned long long index_mtime;
+    ULONGLONG computed_at;
+    ULONGLONG last_used;
+} prompt_git_entry;
+
+unsigned long long lsh_last_duration_us = 0;
+
+HANDLE prompt_ready_event = NULL;   // set when the worker has new results
+static HANDLE prompt_request_event = NULL;
+static CRITICAL_SECTION prompt_lock;
+static prompt_git_entry prompt_cache[PROMPT_CACHE_SIZE];
+static lsh_path prompt_request_root;
+static lsh_path prompt_request_git_dir;
+static char prompt_username[256];
+static lsh_path prompt_current_root;
+static lsh_path prompt_current_git_dir;
+static SHORT prompt_row = -1;
+
+static unsigned long long prompt_file_mtime(const lsh_path *dir, const char *name) {
+    lsh_path path = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    unsigned long long mtime = 0;
+
+    lsh_path_set(&path, dir->s, dir->len);
+    lsh_path_join(&path, name, strlen(name));
+    if (GetFileAttributesEx(lsh_path_win32(&path, &tmp), GetFileExInfoStandard, &data)) {
+        mtime = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32) |
+                data.ftLastWriteTime.dwLowDateTime;
+    }
+    lsh_path_free(&path);
+    lsh_path_free(&tmp);
+    return mtime;
+}
+
+// Point git_dir at the directory named by the "gitdir: " line of the .git
+// file at path, relative to root unless it is absolute
+static int prompt_read_gitdir(const lsh_path *path, const lsh_path *root, lsh_path *git_dir) {
+    lsh_path tmp = { NULL, 0, 0 }, line = { NULL, 0, 0 };
+    char chunk[512];
+    int found = 0;
+
+    FILE *f = fopen(lsh_path_win32(path, &tmp), "r");
+    // The first line, however long
+    while (f && fgets(chunk, sizeof(chunk), f)) {
+        size_t n = strlen(chunk);
+        lsh_path_reserve(&line, line.len + n);
+        memcpy(line.s + line.len, chunk, n + 1);
+        line.len += n;
+        if (chunk[n - 1] == '\n') break;
+    }
+    if (line.len > 8 && strncmp(line.s, "gitdir: ", 8) == 0) {
+        line.len = strcspn(line.s, "\r\n");
+        line.s[line.len] = '\0';
+        if (line.s[8] && line.s[9] == ':') {
+            lsh_path_set(git_dir, line.s + 8, line.len - 8);
+        } else {
+            lsh_path_set(git_dir, root->s, root->len);
+            lsh_path_join(git_dir, line.s + 8, line.len - 8);
+        }
+        for (char *p = git_dir->s; *p; p++) if (*p == '/') *p = '\\';
+        found = 1;
+    }
+    if (f) fclose(f);
+    lsh_path_free(&line);
+    lsh_path_free(&tmp);
+    return found;
+}
+
+// Walk up from cwd to the nearest directory containing .git. A .git file
+// (worktrees, submodules) points at the real git directory.
+static int prompt_find_repo(const char *cwd, lsh_path *root, lsh_path *git_dir) {
+    lsh_path path = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+    int found = 0;
+
+    lsh_path_set(root, cwd, strlen(cwd));
+    while (root->len > 0) {
+        lsh_path_set(&path, root->s, root->len);
+        lsh_path_join(&path, ".git", 4);
+        DWORD attrs = GetFileAttributes(lsh_path_win32(&path, &tmp));
+        if (attrs != INVALID_FILE_ATTRIBUTES) {
+            if (attrs & FILE_ATTRIBUTE_DIRECTORY) {
+                lsh_path_set(git_dir, path.s, path.len);
+                found = 1;
+            } else {
+                found = prompt_read_gitdir(&path, root, git_dir);
+            }
+            break;
+        }
+
+        char *slash = root->s + root->len;
+        while (slash > root->s && slash[-1] != '\\') slash--;
+        if (slash == root->s) break;
+        slash--;
+        if (slash == root->s || slash[-1] == ':') {
+            // Check the drive root itself once, then stop
+            if (slash[1] == '\0') break;
+            lsh_path_truncate(root, slash - root->s + 1);
+            continue;
+        }
+        lsh_path_truncate(root, slash - root->s);
+    }
+    if (!found) lsh_path_truncate(root, 0);
+    lsh_path_free(&path);
+    lsh_path_free(&tmp);
+    return found;
+}
+
+static prompt_git_entry *prompt_cache_find(const char *root, size_t len) {
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        lsh_path *r = &prompt_cache[i].root;
+        if (r->len > 0 && r->len == len && memcmp(r->s, root, len) == 0) {
+            return &prompt_cache[i];
+        }
+    }
+    return NULL;
+}
+
+static prompt_git_entry *prompt_cache_slot(const char *root, size_t len) {
+    prompt_git_entry *slot = prompt_cache_find(root, len);
+    if (slot) return slot;
+
+    // Reuse the least recently used slot, keeping its path buffers
+    slot = &prompt_cache[0];
+    for (int i = 1; i < PROMPT_CACHE_SIZE; i++) {
+        if (prompt_cache[i].last_used < slot->last_used) slot = &prompt_cache[i];
+    }
+    lsh_path slot_root = slot->root, slot_git_dir = slot->git_dir;
+    memset(slot, 0, sizeof(*slot));
+    slot->root = slot_root;
+    slot->git_dir = slot_git_dir;
+    lsh_path_set(&slot->root, root, len);
+    lsh_path_truncate(&slot->git_dir, 0);
+    slot->dirty = -1;
+    return slot;
+}
+
+static void prompt_read_branch(const lsh_path *git_dir, char *branch, size_t size) {
+    lsh_path path = { NULL, 0, 0 }, tmp = { NULL, 0, 0 };
+    char line[256];
+    branch[0] = '\0';
+
+    lsh_path_set(&path, git_dir->s, git_dir->len);
+    lsh_path_join(&path, "HEAD", 4);
+    FILE *f = fopen(lsh_path_win32(&path, &tmp), "r");
+    lsh_path_free(&path);
+    lsh_path_free(&tmp);
+    if (!f) return;
+    if (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strncmp(line, "ref: refs/heads/", 16) == 0) {
+            snprintf(branch, size, "%s", line + 16);
+        } else {
+            // Detached HEAD, show the short hash
+            snprintf(branch, size, "%.8s", line);
+        }
+    }
+    fclose(f);
+}
+
+// Run git status and report whether it printed anything. The pipe is
+// drained while waiting so git never blocks on a full pipe, and git is
+// killed if it takes longer than the timeout. --no-optional-locks keeps it
+// from writing the index, so killing it can't leave index.lock behind.
+static int prompt_git_dirty(const char *root) {
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    HANDLE hRead, hWrite;
+    STARTUPINFO si;
+    PROCESS_INFORMATION pi;
+    char command[] = "git --no-optional-locks status --porcelain --untracked-files=no";
+    int dirty = 0;
+
+    if (!CreatePipe(&hRead, &hWrite, &sa, 0)) return -1;
+    SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdOutput = hWrite;
+    si.hStdError = hWrite;
+    si.hStdInput = NULL;
+    ZeroMemory(&pi, sizeof(pi));
+
+    if (!CreateProcess(NULL, command, NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, root, &si, &pi)) {
+        CloseHandle(hRead);
+        CloseHandle(hWrite);
+        return -1;
+    }
+    CloseHandle(hWrite);
+
+    ULONGLONG deadline = GetTickCount64() + PROMPT_GIT_TIMEOUT_MS;
+    while (1) {
+        DWORD available = 0, bytes_read;
+        char drain[4096];
+        while (PeekNamedPipe(hRead, NULL, 0, NULL, &available, NULL) && available > 0) {
+            dirty = 1;
+            ReadFile(hRead, drain, sizeof(drain), &bytes_read, NULL);
+        }
+        if (WaitForSingleObject(pi.hProcess, 20) == WAIT_OBJECT_0) {
+            if (PeekNamedPipe(hRead, NULL, 0, NULL, &available, NULL) && available > 0) dirty = 1;
+            DWORD exit_code = 0;
+            GetExitCodeProcess(pi.hProcess, &exit_code);
+            if (exit_code != 0) dirty = -1;
+            break;
+        }
+        if (GetTickCount64() > deadline) {
+            TerminateProcess(pi.hProcess, 1);
+            dirty = -1;
+            break;
+        }
+    }
+
+    CloseHandle(hRead);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+    return dirty;
+}
+
+static unsigned __stdcall prompt_worker(void *arg) {
+    lsh_path root = { NULL, 0, 0 }, git_dir = { NULL, 0, 0 };
+
+    while (WaitForSingleObject(prompt_request_event, INFINITE) == WAIT_OBJECT_0) {
+        EnterCriticalSection(&prompt_lock);
+        lsh_path_set(&root, prompt_request_root.s, prompt_request_root.len);
+        lsh_path_set(&git_dir, prompt_request_git_dir.s, prompt_request_git_dir.len);
+        LeaveCriticalSection(&prompt_lock);
+        if (!root.len) continue;
+
+        // Record the mtimes before looking, so changes made meanwhile
+        // leave the entry stale rather than wrongly fresh
+        unsigned long long head_mtime = prompt_file_mtime(&git_dir, "HEAD");
+        unsigned long long index_mtime = prompt_file_mtime(&git_dir, "index");
+        char branch[128];
+        prompt_read_branch(&git_dir, branch, sizeof(branch));
+        int dirty = prompt_git_dirty(root.s);
+
+        EnterCriticalSection(&prompt_lock);
+        prompt_git_entry *e = prompt_cache_slot(root.s, root.len);
+        lsh_path_set(&e->git_dir, git_dir.s, git_dir.len);
+        strcpy(e->branch, branch);
+        e->dirty = dirty;
+        e->head_mtime = head_mtime;
+        e->index_mtime = index_mtime;
+        e->computed_at = GetTickCount64();
+        e->last_used = e->computed_at;
+        LeaveCriticalSection(&prompt_lock);
+
+        SetEvent(prompt_ready_event);
+    }
+    return 0;
+}
+
+void prompt_repaint_git(void);
+
+// The worker has new results while a line is being read
+static void prompt_ready(void *data, HANDLE h) {
+    prompt_repaint_git();
+}
+
+static void prompt_init(void) {
+    DWORD username_len = sizeof(prompt_username);
+
+    // Get the Windows username once (doesn't change during execution)
+    if (!GetUserName(prompt_username, &username_len)) {
+        strcpy(prompt_username, "user");
+    }
+
+    InitializeCriticalSection(&prompt_lock);
+    prompt_ready_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    prompt_request_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    HANDLE hWorker = (HANDLE)_beginthreadex(NULL, 0, prompt_worker, NULL, 0, NULL);
+    if (hWorker) CloseHandle(hWorker);
+    lsh_ev_add(prompt_ready_event, prompt_ready, NULL, LSH_EV_PROMPT);
+}
+
+// Format the git segment for the current repository from the cache.
+// Returns 0 if there is nothing to show yet.
+static int prompt_git_segment(char *out, size_t size, WORD *attributes) {
+    int shown = 0;
+
+    if (!prompt_current_root.len) return 0;
+
+    EnterCriticalSection(&prompt_lock);
+    prompt_git_entry *e = prompt_cache_find(prompt_current_root.s, prompt_current_root.len);
+    if (e && e->branch[0]) {
+        const char *state = e->dirty == 1 ? "*" : e->dirty < 0 ? "?" : "";
+        snprintf(out, size, "git:%s%s", e->branch, state);
+        *attributes = e->dirty == 0 ? FOREGROUND_GREEN
+                                    : FOREGROUND_RED | FOREGROUND_GREEN;
+        shown = 1;
+    }
+    LeaveCriticalSection(&prompt_lock);
+    return shown;
+}
+
+// Draw the git segment right-aligned on the prompt line without moving the
+// cursor. Skipped if the input already reaches that far.
+void prompt_repaint_git(void) {
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    char segment[200];
+    WORD attributes;
+    DWORD written;
+
+    if (prompt_row < 0 || !GetConsoleScreenBufferInfo(hConsole, &info)) return;
+    if (!prompt_git_segment(segment, sizeof(segment), &attributes)) return;
+
+    int len = (int)strlen(segment);
+    int width = info.srWindow.Right - info.srWindow.Left + 1;
+    COORD pos = { (SHORT)(width - len - 1), prompt_row };
+    if (pos.X <= 0 || (info.dwCursorPosition.Y == prompt_row && info.dwCursorPosition.X + 2 >= pos.X)) {
+        return;
+    }
+    // Clear a little to the left in case the previous segment was longer
+    COORD clear = { (SHORT)(pos.X > 4 ? pos.X - 4 : 0), prompt_row };
+    if (info.dwCursorPosition.Y != prompt_row || info.dwCursorPosition.X + 2 < clear.X) {
+        FillConsoleOutputCharacter(hConsole, ' ', pos.X - clear.X, clear, &written);
+    }
+    WriteConsoleOutputCharacter(hConsole, segment, len, pos, &written);
+    FillConsoleOutputAttribute(hConsole, attributes, len, pos, &written);
+}
+
+// Print the prompt and schedule a git refresh if the cached state is stale
+void prompt_draw(void) {
+    lsh_path cwd = { NULL, 0, 0 };
+    char prompt_path[1024];
+
+    if (!prompt_ready_event) {
+        prompt_init();
+    }
+
+    // Get current directory for the prompt
+    if (!lsh_path_cwd(&cwd)) {
+        fprintf(stderr, "lsh: cannot get the current directory\n");
+        strcpy(prompt_path, "unknown_path"); // Fallback in case of error
+        lsh_path_truncate(&prompt_current_root, 0);
+    } else {
+        prompt_find_repo(cwd.s, &prompt_current_root, &prompt_current_git_dir);
+
+        // Find the last directory in the path, scanning back from its end.
+        // The prompt keeps 64 bytes for the status and timing after it.
+        const char *last_dir = cwd.s + cwd.len;
+        while (last_dir > cwd.s && last_dir[-1] != '\\') last_dir--;
+        
+        if (last_dir > cwd.s) {
+            const char *parent_dir = last_dir - 1;
+            while (parent_dir > cwd.s && parent_dir[-1] != '\\') parent_dir--;
+            
+            if (parent_dir > cwd.s) {
+                // We have at least two levels deep
+                snprintf(prompt_path, sizeof(prompt_path) - 64, "%s in %s", prompt_username, parent_dir);
+            } else {
+                // We're at top level (like C:)
+                snprintf(prompt_path, sizeof(prompt_path) - 64, "%s in %s", prompt_username, last_dir);
+            }
+        } else {
+            // No backslash found (rare case)
+            snprintf(prompt_path, sizeof(prompt_path) - 64, "%s in %s", prompt_username, cwd.s);
+        }
+    }
+    lsh_path_free(&cwd);
+
+    // Exit status and duration of the previous command when worth showing
+    if (lsh_last_status != 0) {
+        sprintf(prompt_path + strlen(prompt_path), " [%d]", lsh_last_status);
+    }
+    if (lsh_last_duration_us >= PROMPT_SLOW_COMMAND_US) {
+        sprintf(prompt_path + strlen(prompt_path), " took %.1fs", lsh_last_duration_us / 1e6);
+    }
+
+    // Print prompt with username and shortened directory
+    printf("%s> ", prompt_path);
+    fflush(stdout);
+
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    prompt_row = GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &info)
+                 ? info.dwCursorPosition.Y : -1;
+
+    if (!prompt_current_root.len) return;
+
+    // Show what we have now, then refresh in the background if it is stale
+    int stale = 1;
+    EnterCriticalSection(&prompt_lock);
+    prompt_git_entry *e = prompt_cache_find(prompt_current_root.s, prompt_current_root.len);
+    if (e) {
+        e->last_used = GetTickCount64();
+        stale = e->head_mtime != prompt_file_mtime(&prompt_current_git_dir, "HEAD") ||
+                e->index_mtime != prompt_file_mtime(&prompt_current_git_dir, "index") ||
+                GetTickCount64() - e->computed_at > PROMPT_GIT_MAX_AGE_MS;
+    }
+    if (stale) {
+        lsh_path_set(&prompt_request_root, prompt_current_root.s, prompt_current_root.len);
+        lsh_path_set(&prompt_request_git_dir, prompt_current_git_dir.s, prompt_current_git_dir.len);
+    }
+    LeaveCriticalSection(&prompt_lock);
+
+    prompt_repaint_git();
+    if (stale) {
+        SetEvent(prompt_request_event);
+    }
+}
+
+/*
+ * Per-command timing and resource usage.
+ *
+ * For external commands lsh_launch reads the child's CPU times, peak
+ * working set and I/O counters before closing its handle. Builtins run in
+ * the shell process, so they are measured as the difference in the shell's
+ * own counters; process rather than thread CPU times are used so builtins
+ * that fan out to worker threads (du) are fully counted. Peak working set
+ * for a builtin is the shell's peak so far.
+ */
+
+typedef struct lsh_cmd_stats {
+  unsigned long long wall_us;
+  unsigned long long user_us;
+  unsigned long long sys_us;
+  unsigned long long max_rss;       // peak working set, bytes
+  unsigned long long read_bytes, write_bytes;
+  unsigned long long read_ops, write_ops;
+  int status;
+  int external;
+} lsh_cmd_stats;
+
+typedef struct lsh_measure {
+  unsigned long long start_us;
+  unsigned long long user_100ns, kernel_100ns;
+  IO_COUNTERS io;
+} lsh_measure;
+
+lsh_cmd_stats lsh_last_stats;       // last command run from the prompt
+static lsh_cmd_stats lsh_child_stats;
+static int lsh_child_stats_valid = 0;
+static int lsh_timing_always = 0;
+static FILE *lsh_timing_log = NULL;
+
+static unsigned long long lsh_filetime_100ns(FILETIME ft) {
+  return ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+static void lsh_process_cpu(HANDLE hProcess, unsigned long long *user, unsigned long long *kernel) {
+  FILETIME created, exited, kernel_ft, user_ft;
+  *user = *kernel = 0;
+  if (GetProcessTimes(hProcess, &created, &exited, &kernel_ft, &user_ft)) {
+    *user = lsh_filetime_100ns(user_ft);
+    *kernel = lsh_filetime_100ns(kernel_ft);
+  }
+}
+
+// Collect usage of a finished child, called by lsh_launch before it closes
+// the process handle
+static void lsh_record_child(HANDLE hProcess, int status) {
+  PROCESS_MEMORY_COUNTERS mem;
+  IO_COUNTERS io;
+  unsigned long long user, kernel;
+
+  memset(&lsh_child_stats, 0, sizeof(lsh_child_stats));
+  lsh_process_cpu(hProcess, &user, &kernel);
+  lsh_child_stats.user_us = user / 10;
+  lsh_child_stats.sys_us = kernel / 10;
+  if (GetProcessMemoryInfo(hProcess, &mem, sizeof(mem))) {
+    lsh_child_stats.max_rss = mem.PeakWorkingSetSize;
+  }
+  if (GetProcessIoCounters(hProcess, &io)) {
+    lsh_child_stats.read_bytes = io.ReadTransferCount;
+    lsh_child_stats.write_bytes = io.WriteTransferCount;
+    lsh_child_stats.read_ops = io.ReadOperationCount;
+    lsh_child_stats.write_ops = io.WriteOperationCount;
+  }
+  lsh_child_stats.status = status;
+  lsh_child_stats.external = 1;
+  lsh_child_stats_valid = 1;
+}
+
+void lsh_measure_begin(lsh_measure *m) {
+  lsh_child_stats_valid = 0;
+  lsh_process_cpu(GetCurrentProcess(), &m->user_100ns, &m->kernel_100ns);
+  if (!GetProcessIoCounters(GetCurrentProcess(), &m->io)) {
+    memset(&m->io, 0, sizeof(m->io));
+  }
+  m->start_us = lsh_now_us();
+}
+
+void lsh_measure_end(const lsh_measure *m, lsh_cmd_stats *out) {
+  unsigned long long wall = lsh_now_us() - m->start_us;
+
+  if (lsh_child_stats_valid) {
+    *out = lsh_child_stats;
+  } else {
+    unsigned long long user, kernel;
+    IO_COUNTERS io;
+    PROCESS_MEMORY_COUNTERS mem;
+
+    memset(out, 0, sizeof(*out));
+    lsh_process_cpu(GetCurrentProcess(), &user, &kernel);
+    out->user_us = (user - m->user_100ns) / 10;
+    out->sys_us = (kernel - m->kernel_100ns) / 10;
+    if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+      out->read_bytes = io.ReadTransferCount - m->io.ReadTransferCount;
+      out->write_bytes = io.WriteTransferCount - m->io.WriteTransferCount;
+      out->read_ops = io.ReadOperationCount - m->io.ReadOperationCount;
+      out->write_ops = io.WriteOperationCount - m->io.WriteOperationCount;
+    }
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &mem, sizeof(mem))) {
+      out->max_rss = mem.PeakWorkingSetSize;
+    }
+    out->status = lsh_last_status;
+  }
+  out->wall_us = wall;
+}
+
+void lsh_print_stats(FILE *out, const lsh_cmd_stats *st) {
+  char rss[32], rd[32], wr[32];
+  lsh_format_size(st->max_rss, rss, sizeof(rss));
+  lsh_format_size(st->read_bytes, rd, sizeof(rd));
+  lsh_format_size(st->write_bytes, wr, sizeof(wr));
+  fprintf(out, "\nreal %.3fs  user %.3fs  sys %.3fs  maxrss %s  read %s (%llu ops)  write %s (%llu ops)%s\n",
+          st->wall_us / 1e6, st->user_us / 1e6, st->sys_us / 1e6, rss,
+          rd, st->read_ops, wr, st->write_ops, st->external ? "" : "  [builtin]");
+}
+
+static void lsh_json_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '"' || c == '\\') {
+      fputc('\\', out);
+      fputc(c, out);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+// One JSON object per line, so logs can be filtered with standard tools
+void lsh_log_stats(char **args, const lsh_cmd_stats *st) {
+  FILETIME now;
+  if (!lsh_timing_log || !args[0]) return;
+
+  GetSystemTimeAsFileTime(&now);
+  // FILETIME counts from 1601, shift to the Unix epoch
+  unsigned long long unix_ms = (lsh_filetime_100ns(now) - 116444736000000000ULL) / 10000;
+
+  fprintf(lsh_timing_log, "{\"time_ms\":%llu,\"argv\":[", unix_ms);
+  for (int i = 0; args[i] != NULL; i++) {
+    if (i) fputc(',', lsh_timing_log);
+    lsh_json_string(lsh_timing_log, args[i]);
+  }
+  fprintf(lsh_timing_log,
+          "],\"external\":%s,\"status\":%d,\"wall_us\":%llu,\"user_us\":%llu,\"sys_us\":%llu,"
+          "\"max_rss\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu,\"read_ops\":%llu,\"write_ops\":%llu}\n",
+          st->external ? "true" : "false", st->status, st->wall_us, st->user_us, st->sys_us,
+          st->max_rss, st->read_bytes, st->write_bytes, st->read_ops, st->write_ops);
+  fflush(lsh_timing_log);
+}
+
+// Called by lsh_loop after every command
+void lsh_finish_command(char **args, const lsh_cmd_stats *st) {
+  lsh_last_stats = *st;
+  lsh_last_duration_us = st->wall_us;
+  if (lsh_timing_always && args[0] != NULL && strcmp(args[0], "time") != 0) {
+    lsh_print_stats(stderr, st);
+  }
+  lsh_log_stats(args, st);
+}
+
+int lsh_execute(char **args);
+int lsh_dispatch(char **argv);
+
+int lsh_time(char **args) {
+  lsh_measure m;
+  lsh_cmd_stats st;
+
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected command argument to \"time\"\n");
+    return 1;
+  }
+
+  lsh_measure_begin(&m);
+  int status = lsh_dispatch(args + 1);
+  lsh_measure_end(&m, &st);
+  lsh_print_stats(stderr, &st);
+  return status;
+}
+
+int lsh_timing(char **args) {
+  if (args[1] == NULL) {
+    printf("timing is %s", lsh_timing_always ? "on" : "off");
+    printf(lsh_timing_log ? ", logging\n" : "\n");
+    if (lsh_last_stats.wall_us) {
+      printf("last command:");
+      lsh_print_stats(stdout, &lsh_last_stats);
+    }
+  } else if (strcmp(args[1], "on") == 0) {
+    lsh_timing_always = 1;
+  } else if (strcmp(args[1], "off") == 0) {
+    lsh_timing_always = 0;
+  } else if (strcmp(args[1], "log") == 0) {
+    if (lsh_timing_log) {
+      fclose(lsh_timing_log);
+      lsh_timing_log = NULL;
+    }
+    if (args[2] != NULL && strcmp(args[2], "off") != 0) {
+      lsh_timing_log = fopen(args[2], "a");
+      if (!lsh_timing_log) {
+        fprintf(stderr, "lsh: timing: cannot open '%s': ", args[2]);
+        perror("");
+      }
+    }
+  } else {
+    fprintf(stderr, "usage: timing [on|off|log FILE|log off]\n");
+  }
+  return 1;
+}
+
+// Append an argument to a command line, quoted the way the C runtime's
+// argv parsing will take apart again
+static char *lsh_quote_arg(char *out, const char *arg) {
+    if (*arg && !strpbrk(arg, " \t\"")) {
+        size_t len = strlen(arg);
+        memcpy(out, arg, len);
+        return out + len;
+    }
+    *out++ = '"';
+    for (const char *p = arg; ; p++) {
+        int slashes = 0;
+        while (*p == '\\') {
+            slashes++;
+            p++;
+        }
+        if (*p == '\0') {
+            // Backslashes before the closing quote are doubled
+            for (int i = 0; i < slashes * 2; i++) *out++ = '\\';
+            break;
+        }
+        if (*p == '"') {
+            for (int i = 0; i < slashes * 2 + 1; i++) *out++ = '\\';
+        } else {
+            for (int i = 0; i < slashes; i++) *out++ = '\\';
+        }
+        *out++ = *p;
+    }
+    *out++ = '"';
+    return out;
+}
+
+char *lsh_env_block(void);
+int lsh_out_program_handles(HANDLE *out, HANDLE *err);
+void lsh_out_sync(void);
+
+// Command line string for CreateProcess, to be freed
+static char *lsh_command_line(char **args) {
+    size_t size = 1;
+    for (int i = 0; args[i] != NULL; i++) {
+        size += strlen(args[i]) * 2 + 3;
+    }
+    char *command = malloc(size);
+    if (!command) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    char *end = command;
+    for (int i = 0; args[i] != NULL; i++) {
+        if (i) *end++ = ' ';
+        end = lsh_quote_arg(end, args[i]);
+    }
+    *end = '\0';
+    return command;
+}
+
+// Run a program in the foreground and wait for it. It reads `input`, or
+// the console if that is NULL.
+int lsh_launch_input(char **args, HANDLE input) {
+    char *command = lsh_command_line(args);
+    HANDLE output, error;
+    int captured = lsh_out_program_handles(&output, &error);
+    STARTUPINFO si;
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    if (input || captured) {
+        // The handles not replaced are the ones it would get anyway
+        si.dwFlags = STARTF_USESTDHANDLES;
+        si.hStdInput = input ? input : GetStdHandle(STD_INPUT_HANDLE);
+        si.hStdOutput = captured ? output : GetStdHandle(STD_OUTPUT_HANDLE);
+        si.hStdError = captured ? error : GetStdHandle(STD_ERROR_HANDLE);
+    }
+    ZeroMemory(&pi, sizeof(pi));
+    // Builtin output so far goes first. Through the program's own handles
+    // that is down to the pipe; to the console, the relay must be done.
+    if (captured) {
+        fflush(stdout);
+    } else {
+        lsh_out_sync();
+    }
+    // Create a new process
+    lsh_metric_count(LSH_M_SPAWNS, 1);
+    BOOL created = CreateProcess(NULL, command, NULL, NULL, si.dwFlags != 0, 0, lsh_env_block(), NULL, &si, &pi);
+    free(command);
+    if (captured) {
+        CloseHandle(output);
+        CloseHandle(error);
+    }
+    if (!created) {
+        fprintf(stderr, "lsh: failed to execute %s\n", args[0]);
+        lsh_last_status = 127;
+        return 1;
+    }
+    // Wait for the process to finish, noticing background jobs meanwhile
+    while (!lsh_ev_run(pi.hProcess, 0, INFINITE));
+    DWORD exit_code = 0;
+    GetExitCodeProcess(pi.hProcess, &exit_code);
+    lsh_last_status = (int)exit_code;
+    lsh_record_child(pi.hProcess, lsh_last_status);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+    return 1;
+}
+
+int lsh_launch(char **args) {
+    return lsh_launch_input(args, NULL);
+}
+
+/*
+ * Background jobs: `command &` starts the program and goes on without
+ * waiting. Anything but a plain program (a builtin, function, alias or
+ * compound command) runs in a child lsh, which is given the functions and
+ * aliases but, like any child, only sees exported variables. The process
+ * handle is an event loop source, so a job is noticed finishing at the
+ * prompt or while a foreground program runs, and reported before the next
+ * prompt. A job reads NUL rather than the console, and is in a process
+ * group of its own, out of reach of Ctrl-C at the console.
+ */
+
+#define LSH_MAX_JOBS 32
+
+typedef struct lsh_job {
+    int id;                 // 0 = free slot
+    HANDLE process;
+    DWORD pid;
+    int done;
+    int status;
+    char *text;             // the command as typed, for reports
+} lsh_job;
+
+static lsh_job lsh_job_table[LSH_MAX_JOBS];
+
+static void lsh_job_exited(void *data, HANDLE h) {
+    lsh_job *job = (lsh_job*)data;
+    DWORD exit_code = 0;
+    GetExitCodeProcess(h, &exit_code);
+    lsh_ev_remove(h);
+    job->status = (int)exit_code;
+    job->done = 1;
+}
+
+static void lsh_job_free(lsh_job *job) {
+    lsh_ev_remove(job->process);
+    CloseHandle(job->process);
+    free(job->text);
+    memset(job, 0, sizeof(lsh_job));
+}
+
+char *lsh_job_script(const char *text);
+
+// Start args in the background, or with args NULL, a child lsh running
+// text. Sets $? to 0 if it started.
+int lsh_job_start(char **args, const char *text) {
+    char exe[MAX_PATH];
+    char *shell[] = { exe, "-c", NULL, NULL };
+    lsh_job *job = NULL;
+    int id = 1;
+
+    if (!args) {
+        if (!GetModuleFileName(NULL, exe, sizeof(exe))) strcpy(exe, "lsh");
+        args = shell;
+    }
+    for (int i = 0; i < LSH_MAX_JOBS; i++) {
+        if (!lsh_job_table[i].id && !job) job = &lsh_job_table[i];
+        if (lsh_job_table[i].id >= id) id = lsh_job_table[i].id + 1;
+    }
+    if (!job) {
+        fprintf(stderr, "lsh: too many background jobs\n");
+        lsh_last_status = 1;
+        return 1;
+    }
+
+    if (args == shell) shell[2] = lsh_job_script(text);
+    char *command = lsh_command_line(args);
+    free(shell[2]);
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+    STARTUPINFO si;
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&si, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = CreateFile("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+    si.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+    ZeroMemory(&pi, sizeof(pi));
+    lsh_metric_count(LSH_M_SPAWNS, 1);
+    BOOL created = CreateProcess(NULL, command, NULL, NULL, TRUE, CREATE_NEW_PROCESS_GROUP, lsh_env_block(), NULL,
+                                 &si, &pi);
+    free(command);
+    if (si.hStdInput != INVALID_HANDLE_VALUE) CloseHandle(si.hStdInput);
+    if (!created) {
+        fprintf(stderr, "lsh: failed to execute %s\n", args == shell ? text : args[0]);
+        lsh_last_status = 127;
+        return 1;
+    }
+    CloseHandle(pi.hThread);
+
+    job->id = id;
+    job->process = pi.hProcess;
+    job->pid = pi.dwProcessId;
+    job->text = _strdup(text);
+    if (!lsh_ev_add(pi.hProcess, lsh_job_exited, job, 0)) {
+        // The loop is full; the job is still checked for at the prompt
+        fprintf(stderr, "lsh: [%d] not watched, too many events\n", id);
+    }
+    printf("[%d] %lu\n", id, (unsigned long)job->pid);
+    fflush(stdout);
+    lsh_last_status = 0;
+    return 1;
+}
+
+// Collect jobs that finished unnoticed, and if `report`, print and free
+// the finished ones
+void lsh_jobs_notify(int report) {
+    for (int i = 0; i < LSH_MAX_JOBS; i++) {
+        lsh_job *job = &lsh_job_table[i];
+        if (!job->id) continue;
+        if (!job->done && WaitForSingleObject(job->process, 0) == WAIT_OBJECT_0) {
+            lsh_job_exited(job, job->process);
+        }
+        if (report && job->done) {
+            if (job->status == 0) {
+                printf("[%d] Done       %s\n", job->id, job->text ? job->text : "");
+            } else {
+                printf("[%d] Exit %-5d %s\n", job->id, job->status, job->text ? job->text : "");
+            }
+            lsh_job_free(job);
+        }
+    }
+}
+
+int lsh_execute(char **args) {
+  int i, status;
+  if (args[0] == NULL) {
+    return 1;
+  }
+  unsigned long long start = lsh_metric_start();
+  for (i = 0; i < lsh_num_builtins(); i++) {
+    if (strcmp(args[0], builtin_str[i]) == 0) {
+      lsh_last_status = 0;
+      status = (*builtin_func[i])(args);
+      lsh_metric_stop(LSH_H_EXECUTE, start);
+      return status;
+    }
+  }
+  status = lsh_launch(args);
+  lsh_metric_stop(LSH_H_EXECUTE, start);
+  return status;
+}
+
+/*
+ * Parsing and running command lines.
+ *
+ * A line is lexed (quotes, `;`, `&`, `&&`, `||`, `(`, `)`) and parsed into a
+ * small tree allocated from an arena, so a parsed line is one or two blocks
+ * freed together. Trees are never changed once built, which lets them be
+ * shared: the parse cache keeps the trees of recent lines by hash, so
+ * running a history entry again skips lexing and parsing, and alias and
+ * function bodies are parsed once, when they are defined.
+ *
+ *   name() { cmd; cmd; }     define a function, $1... $9, $# and $@ in it
+ *   alias name='cmd args'    the arguments after name are appended
+ *   a && b || c; d           run b if a succeeded, c if that failed, then d
+ *   a & b                    start a in the background and run b; see jobs and wait
+ *   NAME=value               set a variable, used as $NAME or ${NAME}
+ *   if a; then b; elif c; then d; else e; fi
+ *   while a; do b; done      also until; break and continue work in loops
+ *   for NAME in words; do b; done
+ *   $((expr))                integer arithmetic, variables by bare name
+ *
+ * Quotes group words and '...' keeps `$` literal. Backslash has no special
+ * meaning, it is the path separator. Expanded variables are not split into
+ * words.
+ */
+
+#define LSH_PARSE_CACHE 64
+#define LSH_ARENA_BLOCK 256
+#define LSH_MAX_DEPTH 200
+#define LSH_LITERAL_DOLLAR '\x01'   // a quoted '$', not to be expanded
+
+enum {
+  LSH_NODE_COMMAND,
+  LSH_NODE_SEQ,
+  LSH_NODE_AND,
+  LSH_NODE_OR,
+  LSH_NODE_GROUP,
+  LSH_NODE_FUNCTION,
+  LSH_NODE_IF,
+  LSH_NODE_WHILE,
+  LSH_NODE_UNTIL,
+  LSH_NODE_FOR,
+  LSH_NODE_BACKGROUND,
+};
+
+typedef struct lsh_word {
+  const char *text;
+  int expand;           // has `$` or a quoted `$`, so is compiled into parts
+} lsh_word;
+
+typedef struct lsh_node lsh_node;
+struct lsh_node {
+  int kind;
+  int argc;             // LSH_NODE_COMMAND, or the list of LSH_NODE_FOR
+  int nassign;          // leading NAME=value words of a command
+  lsh_word *argv;
+  lsh_node *left;       // first part, condition, group or loop/function body
+  lsh_node *right;      // second part, or the body of an if or a while
+  lsh_node *other;      // else branch
+  const char *name;     // LSH_NODE_FUNCTION, or the variable of LSH_NODE_FOR
+  const char *text;     // source of LSH_NODE_FUNCTION and LSH_NODE_BACKGROUND, for child shells
+};
+
+typedef struct lsh_arena_block {
+  struct lsh_arena_block *next;
+  size_t used, cap;
+} lsh_arena_block;      // the data follows
+
+typedef struct lsh_code lsh_code;
+
+typedef struct lsh_ast {
+  int refs;
+  lsh_node *root;       // NULL for an empty line
+  lsh_arena_block *blocks;
+  size_t bytes;
+  lsh_code *code;       // compiled on first run, in the same arena
+} lsh_ast;
+
+static lsh_arena_block *lsh_arena_grow(lsh_ast *ast, size_t cap) {
+  lsh_arena_block *b = malloc(sizeof(lsh_arena_block) + cap);
+  if (!b) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  b->used = 0;
+  b->cap = cap;
+  b->next = ast->blocks;
+  ast->blocks = b;
+  ast->bytes += sizeof(lsh_arena_block) + cap;
+  lsh_metric_count(LSH_M_ARENA_BLOCKS, 1);
+  return b;
+}
+
+static void *lsh_arena_alloc(lsh_ast *ast, size_t size) {
+  lsh_arena_block *b = ast->blocks;
+
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if (!b || b->used + size > b->cap) {
+    b = lsh_arena_grow(ast, size > LSH_ARENA_BLOCK ? size : LSH_ARENA_BLOCK);
+  }
+  void *p = (char*)(b + 1) + b->used;
+  b->used += size;
+  return p;
+}
+
+static lsh_ast *lsh_ast_new(void) {
+  lsh_ast *ast = calloc(1, sizeof(lsh_ast));
+  if (!ast) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  ast->refs = 1;
+  return ast;
+}
+
+static lsh_ast *lsh_ast_ref(lsh_ast *ast) {
+  ast->refs++;
+  return ast;
+}
+
+static void lsh_ast_release(lsh_ast *ast) {
+  if (!ast || --ast->refs > 0) return;
+  while (ast->blocks) {
+    lsh_arena_block *next = ast->blocks->next;
+    free(ast->blocks);
+    ast->blocks = next;
+  }
+  free(ast);
+}
+
+static char *lsh_arena_strdup(lsh_ast *ast, const char *s) {
+  size_t len = strlen(s);
+  char *copy = lsh_arena_alloc(ast, len + 1);
+  memcpy(copy, s, len + 1);
+  return copy;
+}
+
+// Copy a subtree into another arena, e.g. a function body out of its line
+static lsh_node *lsh_node_copy(lsh_ast *ast, const lsh_node *n) {
+  if (!n) return NULL;
+  lsh_node *copy = lsh_arena_alloc(ast, sizeof(lsh_node));
+  *copy = *n;
+  if (n->argc) {
+    copy->argv = lsh_arena_alloc(ast, n->argc * sizeof(lsh_word));
+    for (int i = 0; i < n->argc; i++) {
+      copy->argv[i].text = lsh_arena_strdup(ast, n->argv[i].text);
+      copy->argv[i].expand = n->argv[i].expand;
+    }
+  }
+  if (n->name) copy->name = lsh_arena_strdup(ast, n->name);
+  if (n->text) copy->text = lsh_arena_strdup(ast, n->text);
+  copy->left = lsh_node_copy(ast, n->left);
+  copy->right = lsh_node_copy(ast, n->right);
+  copy->other = lsh_node_copy(ast, n->other);
+  return copy;
+}
+
+static const char *lsh_reserved[] = {
+  "{", "}", "if", "then", "elif", "else", "fi", "while", "until", "do", "done", "for",
+};
+
+// Words with a meaning of their own at the start of a command
+int lsh_is_reserved(const char *word) {
+  for (size_t i = 0; i < sizeof(lsh_reserved) / sizeof(lsh_reserved[0]); i++) {
+    if (strcmp(word, lsh_reserved[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+// Reserved words after which another command starts
+int lsh_reserved_opens(const char *word) {
+  return lsh_is_reserved(word) && strcmp(word, "}") != 0 && strcmp(word, "fi") != 0 &&
+         strcmp(word, "done") != 0 && strcmp(word, "for") != 0;
+}
+
+// A variable name: letters, digits and '_', not starting with a digit
+static int lsh_name_length(const char *s) {
+  int n = 0;
+  if (!isalpha((unsigned char)*s) && *s != '_') return 0;
+  while (isalnum((unsigned char)s[n]) || s[n] == '_') n++;
+  return n;
+}
+
+enum {
+  LSH_TOK_END,
+  LSH_TOK_WORD,
+  LSH_TOK_SEMI,         // ';' or a newline
+  LSH_TOK_AND,
+  LSH_TOK_OR,
+  LSH_TOK_AMP,          // a single '&'
+  LSH_TOK_LPAREN,
+  LSH_TOK_RPAREN,
+  LSH_TOK_ERROR,
+};
+
+typedef struct lsh_parser {
+  const char *p;
+  lsh_ast *ast;
+  int tok;
+  char *text;           // LSH_TOK_WORD: the word with quotes removed, in the arena
+  int expand;
+  int quoted;           // part of the word was quoted, so it is never reserved
+  const char *tok_start;
+  int error;
+} lsh_parser;
+
+static int lsh_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\a';
+}
+
+static int lsh_word_ends(const char *p) {
+  return *p == '\0' || *p == '\n' || lsh_is_space(*p) || *p == ';' || *p == '(' || *p == ')' ||
+         *p == '&' || (p[0] == '|' && p[1] == '|');
+}
+
+static void lsh_next_token(lsh_parser *ps) {
+  const char *p = ps->p;
+
+  while (lsh_is_space(*p)) p++;
+  if (*p == '#') {
+    while (*p && *p != '\n') p++;
+  }
+  ps->tok_start = p;
+  ps->text = NULL;
+  ps->expand = ps->quoted = 0;
+
+  if (*p == '\0') {
+    ps->tok = LSH_TOK_END;
+  } else if (*p == ';' || *p == '\n') {
+    ps->tok = LSH_TOK_SEMI;
+    p++;
+  } else if (p[0] == '&' && p[1] == '&') {
+    ps->tok = LSH_TOK_AND;
+    p += 2;
+  } else if (*p == '&') {
+    ps->tok = LSH_TOK_AMP;
+    p++;
+  } else if (p[0] == '|' && p[1] == '|') {
+    ps->tok = LSH_TOK_OR;
+    p += 2;
+  } else if (*p == '(') {
+    ps->tok = LSH_TOK_LPAREN;
+    p++;
+  } else if (*p == ')') {
+    ps->tok = LSH_TOK_RPAREN;
+    p++;
+  } else {
+    // Find the end first: the word without its quotes is no longer
+    const char *end = p;
+    while (!lsh_word_ends(end)) {
+      if (end[0] == '$' && (end[1] == '(' || end[1] == '{')) {
+        // $((...)) and ${...} may hold spaces and parentheses
+        char open = end[1], close = open == '(' ? ')' : '}';
+        int depth = 0;
+        end++;
+        do {
+          if (*end == open) depth++;
+          else if (*end == close) depth--;
+          end++;
+        } while (depth > 0 && *end);
+        if (depth > 0) {
+          fprintf(stderr, "lsh: syntax error: unterminated $%c\n", open);
+          ps->tok = LSH_TOK_ERROR;
+          ps->error = 1;
+          return;
+        }
+      } else if (*end == '"' || *end == '\'') {
+        const char *close = strchr(end + 1, *end);
+        if (!close) {
+          fprintf(stderr, "lsh: syntax error: unterminated %c\n", *end);
+          ps->tok = LSH_TOK_ERROR;
+          ps->error = 1;
+          return;
+        }
+        end = close + 1;
+      } else {
+        end++;
+      }
+    }
+
+    char *out = lsh_arena_alloc(ps->ast, end - p + 1);
+    ps->text = out;
+    while (p < end) {
+      if (p[0] == '$' && (p[1] == '(' || p[1] == '{')) {
+        // Copied as is, quotes included
+        char open = p[1], close = open == '(' ? ')' : '}';
+        int depth = 0;
+        ps->expand = 1;
+        *out++ = *p++;
+        do {
+          if (*p == open) depth++;
+          else if (*p == close) depth--;
+          *out++ = *p++;
+        } while (depth > 0);
+      } else if (*p == '"' || *p == '\'') {
+        char quote = *p++;
+        ps->quoted = 1;
+        while (*p != quote) {
+          if (*p == '$') {
+            ps->expand = 1;
+            *out++ = quote == '\'' ? LSH_LITERAL_DOLLAR : '$';
+          } else {
+            *out++ = *p;
+          }
+          p++;
+        }
+        p++;
+      } else {
+        if (*p == '$') ps->expand = 1;
+        *out++ = *p++;
+      }
+    }
+    *out = '\0';
+    ps->tok = LSH_TOK_WORD;
+  }
+  ps->p = p;
+}
+
+static void lsh_syntax_error(lsh_parser *ps) {
+  if (ps->error) return;
+  ps->error = 1;
+  if (ps->tok == LSH_TOK_END) {
+    fprintf(stderr, "lsh: syntax error: unexpected end of line\n");
+  } else {
+    const char *end = ps->tok_start;
+    while (*end && !lsh_is_space(*end) && *end != '\n' && end - ps->tok_start < 20) end++;
+    fprintf(stderr, "lsh: syntax error near '%.*s'\n", (int)(end - ps->tok_start), ps->tok_start);
+  }
+}
+
+// The source from start up to the current token, in the arena
+static const char *lsh_source_text(lsh_parser *ps, const char *start) {
+  size_t len = ps->tok_start - start;
+  while (len > 0 && (lsh_is_space(start[len - 1]) || start[len - 1] == '\n')) len--;
+  char *text = lsh_arena_alloc(ps->ast, len + 1);
+  memcpy(text, start, len);
+  text[len] = '\0';
+  return text;
+}
+
+static int lsh_at_reserved(lsh_parser *ps, const char *word) {
+  return ps->tok == LSH_TOK_WORD && !ps->quoted && strcmp(ps->text, word) == 0;
+}
+
+static lsh_node *lsh_new_node(lsh_parser *ps, int kind, lsh_node *left, lsh_node *right) {
+  lsh_node *n = lsh_arena_alloc(ps->ast, sizeof(lsh_node));
+  memset(n, 0, sizeof(lsh_node));
+  n->kind = kind;
+  n->left = left;
+  n->right = right;
+  return n;
+}
+
+static void lsh_skip_separators(lsh_parser *ps) {
+  while (ps->tok == LSH_TOK_SEMI) lsh_next_token(ps);
+}
+
+static lsh_node *lsh_parse_list(lsh_parser *ps);
+
+// Words up to the next operator. Leading NAME=value words are counted in
+// *nassign if it is given.
+static lsh_word *lsh_parse_words(lsh_parser *ps, int *argc_out, int *nassign) {
+  lsh_word small[16], *words = small;
+  int argc = 0, cap = 16;
+
+  while (ps->tok == LSH_TOK_WORD) {
+    if (argc == cap) {
+      lsh_word *grown = malloc(cap * 2 * sizeof(lsh_word));
+      if (!grown) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      memcpy(grown, words, argc * sizeof(lsh_word));
+      if (words != small) free(words);
+      words = grown;
+      cap *= 2;
+    }
+    if (nassign && *nassign == argc) {
+      int len = lsh_name_length(ps->tok_start);
+      if (len && ps->tok_start[len] == '=') (*nassign)++;
+    }
+    words[argc].text = ps->text;
+    words[argc].expand = ps->expand;
+    argc++;
+    lsh_next_token(ps);
+  }
+
+  lsh_word *out = lsh_arena_alloc(ps->ast, (argc ? argc : 1) * sizeof(lsh_word));
+  memcpy(out, words, argc * sizeof(lsh_word));
+  if (words != small) free(words);
+  *argc_out = argc;
+  return out;
+}
+
+static lsh_node *lsh_parse_simple(lsh_parser *ps) {
+  int argc, nassign = 0;
+  lsh_word *words = lsh_parse_words(ps, &argc, &nassign);
+
+  if (argc == 0) {
+    lsh_syntax_error(ps);
+    return NULL;
+  }
+  lsh_node *n = lsh_new_node(ps, LSH_NODE_COMMAND, NULL, NULL);
+  n->argc = argc;
+  n->nassign = nassign;
+  n->argv = words;
+  return n;
+}
+
+// A non-empty list followed by the reserved word `end`, which is skipped
+static lsh_node *lsh_parse_list_until(lsh_parser *ps, const char *end) {
+  lsh_node *list = lsh_parse_list(ps);
+  if (ps->error) return NULL;
+  if (!list || !lsh_at_reserved(ps, end)) {
+    lsh_syntax_error(ps);
+    return NULL;
+  }
+  lsh_next_token(ps);
+  return list;
+}
+
+// After the `if` or `elif`: condition, then-part and the rest
+static lsh_node *lsh_parse_if(lsh_parser *ps) {
+  lsh_node *cond = lsh_parse_list_until(ps, "then");
+  if (!cond) return NULL;
+  lsh_node *body = lsh_parse_list(ps);
+  if (ps->error) return NULL;
+  if (!body) {
+    lsh_syntax_error(ps);
+    return NULL;
+  }
+
+  lsh_node *n = lsh_new_node(ps, LSH_NODE_IF, cond, body);
+  if (lsh_at_reserved(ps, "elif")) {
+    lsh_next_token(ps);
+    n->other = lsh_parse_if(ps);
+    return n->other ? n : NULL;
+  }
+  if (lsh_at_reserved(ps, "else")) {
+    lsh_next_token(ps);
+    n->other = lsh_parse_list(ps);
+    if (ps->error) return NULL;
+    if (!n->other) {
+      lsh_syntax_error(ps);
+      return NULL;
+    }
+  }
+  if (!lsh_at_reserved(ps, "fi")) {
+    lsh_syntax_error(ps);
+    return NULL;
+  }
+  lsh_next_token(ps);
+  return n;
+}
+
+static lsh_node *lsh_parse_for(lsh_parser *ps) {
+  if (ps->tok != LSH_TOK_WORD || ps->quoted || lsh_name_length(ps->text) != (int)strlen(ps->text)) {
+    lsh_syntax_error(ps);
+    return NULL;
+  }
+  lsh_node *n = lsh_new_node(ps, LSH_NODE_FOR, NULL, NULL);
+  n->name = ps->text;
+  lsh_next_token(ps);
+
+  if (lsh_at_reserved(ps, "in")) {
+    lsh_next_token(ps);
+    n->argv = lsh_parse_words(ps, &n->argc, NULL);
+  } else {
+    // No list: the arguments
+    n->argv = lsh_arena_alloc(ps->ast, sizeof(lsh_word));
+    n->argv[0].text = "$@";
+    n->argv[0].expand = 1;
+    n->argc = 1;
+  }
+  lsh_skip_separators(ps);
+  if (!lsh_at_reserved(ps, "do")) {
+    lsh_syntax_error(ps);
+    return NULL;
+  }
+  lsh_next_token(ps);
+  n->left = lsh_parse_list_until(ps, "done");
+  return n->left ? n : NULL;
+}
+
+static lsh_node *lsh_parse_command(lsh_parser *ps) {
+  if (lsh_at_reserved(ps, "if")) {
+    lsh_next_token(ps);
+    return lsh_parse_if(ps);
+  }
+  if (lsh_at_reserved(ps, "while") || lsh_at_reserved(ps, "until")) {
+    int kind = strcmp(ps->text, "while") == 0 ? LSH_NODE_WHILE : LSH_NODE_UNTIL;
+    lsh_next_token(ps);
+    lsh_node *cond = lsh_parse_list_until(ps, "do");
+    if (!cond) return NULL;
+    lsh_node *body = lsh_parse_list_until(ps, "done");
+    return body ? lsh_new_node(ps, kind, cond, body) : NULL;
+  }
+  if (lsh_at_reserved(ps, "for")) {
+    lsh_next_token(ps);
+    return lsh_parse_for(ps);
+  }
+
+  if (lsh_at_reserved(ps, "{")) {
+    lsh_next_token(ps);
+    lsh_node *body = lsh_parse_list(ps);
+    if (ps->error) return NULL;
+    if (!body || !lsh_at_reserved(ps, "}")) {
+      lsh_syntax_error(ps);
+      return NULL;
+    }
+    lsh_next_token(ps);
+    return lsh_new_node(ps, LSH_NODE_GROUP, body, NULL);
+  }
+
+  if (ps->tok == LSH_TOK_WORD && !ps->quoted && !lsh_is_reserved(ps->text)) {
+    // name() body
+    const char *p = ps->p;
+    while (lsh_is_space(*p)) p++;
+    if (*p == '(') {
+      const char *name = ps->text, *start = ps->tok_start;
+      lsh_next_token(ps);
+      lsh_next_token(ps);
+      if (ps->tok != LSH_TOK_RPAREN) {
+        lsh_syntax_error(ps);
+        return NULL;
+      }
+      lsh_next_token(ps);
+      lsh_skip_separators(ps);
+      lsh_node *body = lsh_parse_command(ps);
+      if (!body) return NULL;
+      lsh_node *n = lsh_new_node(ps, LSH_NODE_FUNCTION, body, NULL);
+      n->name = name;
+      n->text = lsh_source_text(ps, start);
+      return n;
+    }
+  }
+
+  if (ps->tok == LSH_TOK_WORD && !ps->quoted && lsh_is_reserved(ps->text)) {
+    lsh_syntax_error(ps);
+    return NULL;
+  }
+  return lsh_parse_simple(ps);
+}
+
+static lsh_node *lsh_parse_and_or(lsh_parser *ps) {
+  lsh_node *left = lsh_parse_command(ps);
+
+  while (left && (ps->tok == LSH_TOK_AND || ps->tok == LSH_TOK_OR)) {
+    int kind = ps->tok == LSH_TOK_AND ? LSH_NODE_AND : LSH_NODE_OR;
+    lsh_next_token(ps);
+    while (ps->tok == LSH_TOK_SEMI && *ps->tok_start == '\n') lsh_next_token(ps);
+    lsh_node *right = lsh_parse_command(ps);
+    if (!right) return NULL;
+    left = lsh_new_node(ps, kind, left, right);
+  }
+  return left;
+}
+
+// Reserved words that end a list, left for the caller to check
+static int lsh_at_list_end(lsh_parser *ps) {
+  return lsh_at_reserved(ps, "}") || lsh_at_reserved(ps, "then") || lsh_at_reserved(ps, "elif") ||
+         lsh_at_reserved(ps, "else") || lsh_at_reserved(ps, "fi") || lsh_at_reserved(ps, "do") ||
+         lsh_at_reserved(ps, "done");
+}
+
+// Commands separated by ';', '&' or newlines up to the end or a closing
+// reserved word
+static lsh_node *lsh_parse_list(lsh_parser *ps) {
+  lsh_node *list = NULL;
+
+  lsh_skip_separators(ps);
+  while (ps->tok != LSH_TOK_END && !lsh_at_list_end(ps)) {
+    const char *start = ps->tok_start;
+    lsh_node *n = lsh_parse_and_or(ps);
+    if (!n) return NULL;
+    int background = ps->tok == LSH_TOK_AMP;
+    if (background) {
+      n = lsh_new_node(ps, LSH_NODE_BACKGROUND, n, NULL);
+      n->text = lsh_source_text(ps, start);
+      lsh_next_token(ps);
+    }
+    list = list ? lsh_new_node(ps, LSH_NODE_SEQ, list, n) : n;
+    if (!background && ps->tok != LSH_TOK_SEMI) break;
+    lsh_skip_separators(ps);
+  }
+  return list;
+}
+
+// Parse a line or script. Returns NULL after printing a syntax error.
+lsh_ast *lsh_parse(const char *text) {
+  lsh_parser ps;
+  unsigned long long start = lsh_metric_start();
+  lsh_ast *ast = lsh_ast_new();
+
+  // Sized so a typical line takes one block: its words, which are never
+  // longer than the text, plus room for a node every few bytes
+  lsh_arena_grow(ast, strlen(text) * 8 + 128);
+
+  memset(&ps, 0, sizeof(ps));
+  ps.p = text;
+  ps.ast = ast;
+  lsh_next_token(&ps);
+  ast->root = lsh_parse_list(&ps);
+  if (!ps.error && ps.tok != LSH_TOK_END) {
+    lsh_syntax_error(&ps);
+  }
+  if (ps.error) {
+    lsh_ast_release(ast);
+    ast = NULL;
+  }
+  lsh_metric_stop(LSH_H_PARSE, start);
+  return ast;
+}
+
+/*
+ * Aliases and functions: name -> parsed body, in chained hash tables.
+ */
+
+typedef struct lsh_def {
+  struct lsh_def *next;
+  unsigned long long hash;
+  char *name;
+  char *text;           // alias value as given, or the function's definition
+  lsh_ast *body;
+} lsh_def;
+
+typedef struct lsh_def_table {
+  lsh_def **buckets;
+  size_t mask;
+  size_t count;
+} lsh_def_table;
+
+lsh_def_table lsh_aliases, lsh_functions;
+
+lsh_def *lsh_def_find(const lsh_def_table *t, const char *name) {
+  if (!t->buckets) return NULL;
+  unsigned long long h = lsh_hash_str(name);
+  for (lsh_def *d = t->buckets[h & t->mask]; d; d = d->next) {
+    if (d->hash == h && strcmp(d->name, name) == 0) return d;
+  }
+  return NULL;
+}
+
+static void lsh_def_set(lsh_def_table *t, const char *name, const char *text, lsh_ast *body) {
+  lsh_def *d = lsh_def_find(t, name);
+
+  if (d) {
+    lsh_ast_release(d->body);
+    free(d->text);
+  } else {
+    if (t->count + 1 > t->mask) {
+      size_t cap = t->buckets ? (t->mask + 1) * 2 : 32;
+      lsh_def **buckets = calloc(cap, sizeof(lsh_def*));
+      if (!buckets) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      for (size_t i = 0; t->buckets && i <= t->mask; i++) {
+        while (t->buckets[i]) {
+          lsh_def *move = t->buckets[i];
+          t->buckets[i] = move->next;
+          move->next = buckets[move->hash & (cap - 1)];
+          buckets[move->hash & (cap - 1)] = move;
+        }
+      }
+      free(t->buckets);
+      t->buckets = buckets;
+      t->mask = cap - 1;
+    }
+    d = calloc(1, sizeof(lsh_def));
+    if (!d) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    d->name = _strdup(name);
+    d->hash = lsh_hash_str(name);
+    d->next = t->buckets[d->hash & t->mask];
+    t->buckets[d->hash & t->mask] = d;
+    t->count++;
+  }
+  d->text = text ? _strdup(text) : NULL;
+  d->body = body;
+}
+
+static int lsh_def_remove(lsh_def_table *t, const char *name) {
+  if (!t->buckets) return 0;
+  unsigned long long h = lsh_hash_str(name);
+  for (lsh_def **link = &t->buckets[h & t->mask]; *link; link = &(*link)->next) {
+    lsh_def *d = *link;
+    if (d->hash == h && strcmp(d->name, name) == 0) {
+      *link = d->next;
+      lsh_ast_release(d->body);
+      free(d->text);
+      free(d->name);
+      free(d);
+      t->count--;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Running parsed lines.
+ */
+
+// Variables to put back afterwards: a function's locals, or those set
+// for one command by env
+typedef struct lsh_saved_var {
+  int slot;
+  char *value;          // NULL if it was unset
+  int exported;
+} lsh_saved_var;
+
+typedef struct lsh_saved_vars {
+  lsh_saved_var *v;
+  int num, max;
+} lsh_saved_vars;
+
+// Arguments of the function being run, for $1... $#, $@
+typedef struct lsh_frame {
+  int argc;
+  char **argv;
+  lsh_saved_vars locals;
+} lsh_frame;
+
+static lsh_frame *lsh_frame_top = NULL;
+static int lsh_depth = 0;
+static const char *lsh_alias_active[16];   // aliases being expanded, not expanded again
+static int lsh_num_alias_active = 0;
+
+// Time and log each command, as the interactive loop does
+int lsh_track_commands = 0;
+
+// Commands that reached lsh_execute, checked by the benchmarks
+unsigned long long lsh_commands_run = 0;
+int lsh_parse_cache_enabled = 1;
+
+typedef struct lsh_parse_entry {
+  unsigned long long hash;
+  char *line;
+  lsh_ast *ast;
+} lsh_parse_entry;
+
+static lsh_parse_entry lsh_parse_cache[LSH_PARSE_CACHE];
+
+// Parse through the cache. The caller releases the tree.
+lsh_ast *lsh_parse_cached(const char *line) {
+  unsigned long long h = lsh_hash_str(line);
+  lsh_parse_entry *e = &lsh_parse_cache[h & (LSH_PARSE_CACHE - 1)];
+
+  if (lsh_parse_cache_enabled && e->ast && e->hash == h && strcmp(e->line, line) == 0) {
+    lsh_metric_count(LSH_M_PARSE_HITS, 1);
+    return lsh_ast_ref(e->ast);
+  }
+  lsh_metric_count(LSH_M_PARSE_MISSES, 1);
+  lsh_ast *ast = lsh_parse(line);
+  if (ast && lsh_parse_cache_enabled) {
+    char *copy = _strdup(line);
+    if (copy) {
+      lsh_ast_release(e->ast);
+      free(e->line);
+      e->hash = h;
+      e->line = copy;
+      e->ast = lsh_ast_ref(ast);
+    }
+  }
+  return ast;
+}
+
+typedef struct lsh_strbuf {
+  char *s;
+  size_t len, cap;
+} lsh_strbuf;
+
+static void lsh_strbuf_add(lsh_strbuf *b, const char *s, size_t n) {
+  if (b->len + n + 1 > b->cap) {
+    size_t cap = b->cap ? b->cap * 2 : 64;
+    while (cap < b->len + n + 1) cap *= 2;
+    char *grown = realloc(b->s, cap);
+    if (!grown) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    b->s = grown;
+    b->cap = cap;
+  }
+  memcpy(b->s + b->len, s, n);
+  b->len += n;
+  b->s[b->len] = '\0';
+}
+
+// Format n into out, which has room for 24 bytes. Returns the length.
+static int lsh_format_num(long long n, char *out) {
+  char digits[24];
+  unsigned long long u = n < 0 ? 0ULL - (unsigned long long)n : (unsigned long long)n;
+  int len = 0, k = 0;
+  do {
+    digits[k++] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  if (n < 0) out[len++] = '-';
+  while (k) out[len++] = digits[--k];
+  out[len] = '\0';
+  return len;
+}
+
+/*
+ * Shell variables and the environment.
+ *
+ * Each name gets a slot when first seen, compiled code refers to variables
+ * by slot, so running it never hashes a name. A value that came from
+ * arithmetic keeps its number alongside the text. Names are compared
+ * without case, as Windows does for the environment, so $PATH is Path.
+ *
+ * The environment is read into the table on first use, marked exported.
+ * Children get a block built from the exported variables, kept between
+ * spawns and only rebuilt after an exported variable changes; exported
+ * changes are also made to the shell's own environment, which is what
+ * the command search and the highlighter read PATH from.
+ */
+
+typedef struct lsh_var {
+  char *name;
+  char *value;          // NULL while unset
+  size_t cap;
+  long long num;
+  int has_num;
+  int exported;
+} lsh_var;
+
+static lsh_var *lsh_vars = NULL;
+static int lsh_num_vars = 0, lsh_max_vars = 0;
+static int *lsh_var_index = NULL;      // open addressing, slot + 1, 0 = empty
+static size_t lsh_var_mask = 0;
+static int lsh_env_imported = 0;
+
+static char *lsh_env = NULL;           // block for CreateProcess, NULL = rebuild
+
+static unsigned long long lsh_hash_name(const char *s, int len) {
+  unsigned long long h = 1469598103934665603ULL;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)tolower((unsigned char)s[i]);
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+void lsh_var_set(int slot, const char *value, size_t len);
+static void lsh_env_import(void);
+
+// Slot of the variable, created if need be
+int lsh_var_slot(const char *name, int len) {
+  if (!lsh_env_imported) lsh_env_import();
+  if ((size_t)(lsh_num_vars + 1) * 2 > lsh_var_mask) {
+    size_t cap = lsh_var_mask ? (lsh_var_mask + 1) * 2 : 64;
+    int *index = calloc(cap, sizeof(int));
+    if (!index) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < lsh_num_vars; i++) {
+      size_t j = lsh_hash_name(lsh_vars[i].name, (int)strlen(lsh_vars[i].name)) & (cap - 1);
+      while (index[j]) j = (j + 1) & (cap - 1);
+      index[j] = i + 1;
+    }
+    free(lsh_var_index);
+    lsh_var_index = index;
+    lsh_var_mask = cap - 1;
+  }
+
+  size_t j = lsh_hash_name(name, len) & lsh_var_mask;
+  while (lsh_var_index[j]) {
+    lsh_var *v = &lsh_vars[lsh_var_index[j] - 1];
+    if (_strnicmp(v->name, name, len) == 0 && v->name[len] == '\0') return lsh_var_index[j] - 1;
+    j = (j + 1) & lsh_var_mask;
+  }
+
+  if (lsh_num_vars == lsh_max_vars) {
+    int max = lsh_max_vars ? lsh_max_vars * 2 : 32;
+    lsh_var *vars = realloc(lsh_vars, max * sizeof(lsh_var));
+    if (!vars) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    lsh_vars = vars;
+    lsh_max_vars = max;
+  }
+  lsh_var *v = &lsh_vars[lsh_num_vars];
+  memset(v, 0, sizeof(lsh_var));
+  v->name = malloc(len + 1);
+  if (!v->name) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(v->name, name, len);
+  v->name[len] = '\0';
+  lsh_var_index[j] = ++lsh_num_vars;
+  return lsh_num_vars - 1;
+}
+
+// Read the environment the shell started with
+static void lsh_env_import(void) {
+  lsh_env_imported = 1;
+  char *block = GetEnvironmentStrings();
+  if (!block) return;
+  for (char *e = block; *e; e += strlen(e) + 1) {
+    // "=C:=C:\dir" entries are per-drive directories, not variables
+    char *eq = strchr(e + 1, '=');
+    if (e[0] == '=' || !eq) continue;
+    int slot = lsh_var_slot(e, (int)(eq - e));
+    lsh_var_set(slot, eq + 1, strlen(eq + 1));
+    lsh_vars[slot].exported = 1;
+  }
+  FreeEnvironmentStrings(block);
+}
+
+// An exported variable changed, or stopped being exported
+static void lsh_env_changed(const lsh_var *v) {
+  free(lsh_env);
+  lsh_env = NULL;
+  if (lsh_env_imported) {
+    SetEnvironmentVariable(v->name, v->exported ? v->value : NULL);
+  }
+}
+
+static int lsh_env_compare(const void *a, const void *b) {
+  return _stricmp((*(const lsh_var**)a)->name, (*(const lsh_var**)b)->name);
+}
+
+// The environment block for a child: NAME=value strings sorted by name,
+// each ending in NUL, and a NUL after the last
+char *lsh_env_block(void) {
+  if (!lsh_env_imported) lsh_env_import();
+  if (lsh_env) {
+    lsh_metric_count(LSH_M_ENV_REUSES, 1);
+    return lsh_env;
+  }
+
+  lsh_var **exported = malloc((lsh_num_vars + 1) * sizeof(lsh_var*));
+  if (!exported) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  int count = 0;
+  size_t size = 2;
+  for (int i = 0; i < lsh_num_vars; i++) {
+    if (lsh_vars[i].exported && lsh_vars[i].value) {
+      exported[count++] = &lsh_vars[i];
+      size += strlen(lsh_vars[i].name) + strlen(lsh_vars[i].value) + 2;
+    }
+  }
+  qsort(exported, count, sizeof(lsh_var*), lsh_env_compare);
+
+  lsh_env = malloc(size);
+  if (!lsh_env) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  char *p = lsh_env;
+  for (int i = 0; i < count; i++) {
+    p += sprintf(p, "%s=%s", exported[i]->name, exported[i]->value) + 1;
+  }
+  *p++ = '\0';
+  if (count == 0) *p = '\0';   // an empty block is two NULs
+  lsh_metric_count(LSH_M_ENV_BUILDS, 1);
+  free(exported);
+  return lsh_env;
+}
+
+const char *lsh_var_get(int slot) {
+  return lsh_vars[slot].value;
+}
+
+void lsh_var_set(int slot, const char *value, size_t len) {
+  lsh_var *v = &lsh_vars[slot];
+  if (!v->value || v->cap < len + 1) {
+    size_t cap = len + 1 < 16 ? 16 : len + 1;
+    char *grown = realloc(v->value, cap);
+    if (!grown) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    v->value = grown;
+    v->cap = cap;
+  }
+  memcpy(v->value, value, len);
+  v->value[len] = '\0';
+  v->has_num = 0;
+  if (v->exported) lsh_env_changed(v);
+}
+
+void lsh_var_unset(int slot) {
+  lsh_var *v = &lsh_vars[slot];
+  free(v->value);
+  v->value = NULL;
+  v->cap = 0;
+  v->has_num = 0;
+  if (v->exported) {
+    lsh_env_changed(v);
+    v->exported = 0;
+  }
+}
+
+void lsh_var_export(int slot, int exported) {
+  lsh_var *v = &lsh_vars[slot];
+  if (v->exported == exported) return;
+  v->exported = exported;
+  if (v->value) lsh_env_changed(v);
+}
+
+static void lsh_var_set_num(int slot, long long num) {
+  char text[24];
+  lsh_var_set(slot, text, lsh_format_num(num, text));
+  lsh_vars[slot].num = num;
+  lsh_vars[slot].has_num = 1;
+}
+
+static long long lsh_var_num(int slot) {
+  lsh_var *v = &lsh_vars[slot];
+  if (v->has_num) return v->num;
+  return v->value ? strtoll(v->value, NULL, 10) : 0;
+}
+
+// Remember a variable's value to restore later, once per list
+static void lsh_saved_push(lsh_saved_vars *saved, int slot) {
+  for (int i = 0; i < saved->num; i++) {
+    if (saved->v[i].slot == slot) return;
+  }
+  if (saved->num == saved->max) {
+    int max = saved->max ? saved->max * 2 : 8;
+    lsh_saved_var *v = realloc(saved->v, max * sizeof(lsh_saved_var));
+    if (!v) {
+      fprintf(stderr, "lsh: allocation error\n");
+      exit(EXIT_FAILURE);
+    }
+    saved->v = v;
+    saved->max = max;
+  }
+  lsh_saved_var *s = &saved->v[saved->num++];
+  s->slot = slot;
+  s->value = lsh_vars[slot].value ? _strdup(lsh_vars[slot].value) : NULL;
+  s->exported = lsh_vars[slot].exported;
+}
+
+static void lsh_saved_restore(lsh_saved_vars *saved) {
+  while (saved->num > 0) {
+    lsh_saved_var *s = &saved->v[--saved->num];
+    if (s->value) {
+      lsh_var_set(s->slot, s->value, strlen(s->value));
+      free(s->value);
+    } else {
+      lsh_var_unset(s->slot);
+    }
+    lsh_var_export(s->slot, s->exported);
+  }
+  free(saved->v);
+  saved->v = NULL;
+  saved->max = 0;
+}
+
+/*
+ * Compiling trees to bytecode.
+ *
+ * A tree is compiled the first time it runs, into a flat array of
+ * instructions kept in the tree's own arena, so a cached line or a loop
+ * body runs again without walking the tree or looking at its text. Words
+ * are split into parts up front (literal text, a variable by slot, a
+ * positional parameter, arithmetic compiled to postfix) and a command
+ * named after a builtin calls it directly rather than through the
+ * name lookup in lsh_execute.
+ */
+
+enum {
+  LSH_OP_RUN,           // a = first word, b = words: run a command
+  LSH_OP_BUILTIN,       // the same, c = builtin
+  LSH_OP_ASSIGN,        // a = slot, b = word
+  LSH_OP_JUMP,          // a = target
+  LSH_OP_JUMP_FAIL,     // jump if the last status is not 0
+  LSH_OP_JUMP_OK,       // jump if it is 0
+  LSH_OP_STATUS,        // a = status
+  LSH_OP_FOR,           // a = first word, b = words: push the expanded list
+  LSH_OP_NEXT,          // a = slot, b = target: assign the next item, or pop the list and jump
+  LSH_OP_POP_LOOPS,     // a = lists to keep, for break and continue
+  LSH_OP_DEFINE,        // a = node of the function definition
+  LSH_OP_RETURN,        // a = word of the status, or -1
+  LSH_OP_BACKGROUND,    // a = first word, b = words or 0, c = node: start a job
+  LSH_OP_END,
+};
+
+#define LSH_RUN_TAIL  1   // the last command, which gets an alias's arguments
+#define LSH_RUN_TRACK 2   // not inside a loop: timed and logged
+
+typedef struct lsh_op {
+  short op;
+  short flags;
+  int a, b, c;
+} lsh_op;
+
+enum {
+  LSH_PART_TEXT,        // text, n bytes
+  LSH_PART_VAR,         // n = slot
+  LSH_PART_ARG,         // $n
+  LSH_PART_ARGC,        // $#
+  LSH_PART_ALL,         // $@ or $* inside a word: arguments joined by spaces
+  LSH_PART_STATUS,      // $?
+  LSH_PART_ARITH,       // arith
+};
+
+enum {
+  LSH_A_NUM, LSH_A_VAR, LSH_A_NEG, LSH_A_NOT,
+  LSH_A_MUL, LSH_A_DIV, LSH_A_MOD, LSH_A_ADD, LSH_A_SUB,
+  LSH_A_LT, LSH_A_LE, LSH_A_GT, LSH_A_GE, LSH_A_EQ, LSH_A_NE, LSH_A_AND, LSH_A_OR,
+};
+
+typedef struct lsh_aop {
+  int op;
+  long long value;      // number, or slot
+} lsh_aop;
+
+typedef struct lsh_part {
+  int kind;
+  int n;
+  const char *text;
+  const lsh_aop *arith;
+} lsh_part;
+
+typedef struct lsh_cword {
+  const char *text;     // no expansion: the argument itself
+  int split;            // "$@": one argument per parameter
+  int num_parts;
+  lsh_part *parts;
+} lsh_cword;
+
+struct lsh_code {
+  lsh_op *ops;
+  lsh_cword *words;
+  const lsh_node **nodes;
+  int num_ops, num_words, num_nodes;
+};
+
+#define LSH_MAX_LOOP_NESTING 32
+#define LSH_ARITH_STACK 64
+
+typedef struct lsh_loop_ctx {
+  int continue_pc;
+  int lists_outside;    // for-lists alive outside the loop
+  int lists_inside;     // and inside it
+  int *breaks;          // jumps to patch to the end
+  int num_breaks, max_breaks;
+} lsh_loop_ctx;
+
+typedef struct lsh_compiler {
+  lsh_ast *ast;
+  lsh_op *ops;
+  int num_ops, max_ops;
+  lsh_cword *words;
+  int num_words, max_words;
+  const lsh_node **nodes;
+  int num_nodes, max_nodes;
+  lsh_loop_ctx loops[LSH_MAX_LOOP_NESTING];
+  int num_loops;
+  int lists;            // for-lists alive at this point
+  int function;         // `return` allowed
+  int error;
+} lsh_compiler;
+
+static void *lsh_grow(void *p, int *max, size_t size) {
+  int n = *max ? *max * 2 : 16;
+  void *grown = realloc(p, n * size);
+  if (!grown) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  *max = n;
+  return grown;
+}
+
+static int lsh_emit(lsh_compiler *c, int op, int flags, int a, int b, int x) {
+  if (c->num_ops == c->max_ops) c->ops = lsh_grow(c->ops, &c->max_ops, sizeof(lsh_op));
+  lsh_op *o = &c->ops[c->num_ops];
+  o->op = (short)op;
+  o->flags = (short)flags;
+  o->a = a;
+  o->b = b;
+  o->c = x;
+  return c->num_ops++;
+}
+
+// Arithmetic: precedence climbing straight to postfix
+typedef struct lsh_arith_parser {
+  const char *p;
+  lsh_aop *ops;
+  int num_ops, max_ops;
+  int depth, max_depth;
+  int error;
+} lsh_arith_parser;
+
+static void lsh_arith_emit(lsh_arith_parser *ap, int op, long long value, int stack) {
+  if (ap->num_ops == ap->max_ops) ap->ops = lsh_grow(ap->ops, &ap->max_ops, sizeof(lsh_aop));
+  ap->ops[ap->num_ops].op = op;
+  ap->ops[ap->num_ops].value = value;
+  ap->num_ops++;
+  ap->depth += stack;
+  if (ap->depth > ap->max_depth) ap->max_depth = ap->depth;
+}
+
+static void lsh_arith_skip(lsh_arith_parser *ap) {
+  while (lsh_is_space(*ap->p) || *ap->p == '\n') ap->p++;
+}
+
+static void lsh_arith_expr(lsh_arith_parser *ap, int level);
+
+static void lsh_arith_primary(lsh_arith_parser *ap) {
+  lsh_arith_skip(ap);
+  const char *p = ap->p;
+  if (*p == '(') {
+    ap->p++;
+    lsh_arith_expr(ap, 0);
+    lsh_arith_skip(ap);
+    if (*ap->p != ')') {
+      ap->error = 1;
+      return;
+    }
+    ap->p++;
+  } else if (*p == '-' || *p == '!' || *p == '+') {
+    ap->p++;
+    lsh_arith_primary(ap);
+    if (*p == '-') lsh_arith_emit(ap, LSH_A_NEG, 0, 0);
+    if (*p == '!') lsh_arith_emit(ap, LSH_A_NOT, 0, 0);
+  } else if (isdigit((unsigned char)*p)) {
+    char *end;
+    long long value = strtoll(p, &end, 0);
+    ap->p = end;
+    lsh_arith_emit(ap, LSH_A_NUM, value, 1);
+  } else {
+    if (*p == '$') p++;
+    int len = lsh_name_length(p);
+    if (len == 0) {
+      ap->error = 1;
+      return;
+    }
+    lsh_arith_emit(ap, LSH_A_VAR, lsh_var_slot(p, len), 1);
+    ap->p = p + len;
+  }
+}
+
+// Binary operators by level, loosest first
+static const struct {
+  const char *text;
+  int level;
+  int op;
+} lsh_arith_ops[] = {
+  { "||", 0, LSH_A_OR }, { "&&", 1, LSH_A_AND },
+  { "==", 2, LSH_A_EQ }, { "!=", 2, LSH_A_NE },
+  { "<=", 3, LSH_A_LE }, { ">=", 3, LSH_A_GE }, { "<", 3, LSH_A_LT }, { ">", 3, LSH_A_GT },
+  { "+", 4, LSH_A_ADD }, { "-", 4, LSH_A_SUB },
+  { "*", 5, LSH_A_MUL }, { "/", 5, LSH_A_DIV }, { "%", 5, LSH_A_MOD },
+};
+
+static void lsh_arith_expr(lsh_arith_parser *ap, int level) {
+  if (level > 5) {
+    lsh_arith_primary(ap);
+    return;
+  }
+  lsh_arith_expr(ap, level + 1);
+  while (!ap->error) {
+    lsh_arith_skip(ap);
+    int op = -1;
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(lsh_arith_ops) / sizeof(lsh_arith_ops[0]); i++) {
+      len = strlen(lsh_arith_ops[i].text);
+      if (lsh_arith_ops[i].level == level && strncmp(ap->p, lsh_arith_ops[i].text, len) == 0) {
+        op = lsh_arith_ops[i].op;
+        break;
+      }
+    }
+    if (op < 0) return;
+    ap->p += len;
+    lsh_arith_expr(ap, level + 1);
+    lsh_arith_emit(ap, op, 0, -1);
+  }
+}
+
+// Compile the inside of $((...)), len bytes at text
+static const lsh_aop *lsh_compile_arith(lsh_compiler *c, const char *text, int len) {
+  lsh_arith_parser ap;
+  char *expr = malloc(len + 1);
+  if (!expr) {
+    fprintf(stderr, "lsh: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(expr, text, len);
+  expr[len] = '\0';
+
+  memset(&ap, 0, sizeof(ap));
+  ap.p = expr;
+  lsh_arith_expr(&ap, 0);
+  lsh_arith_skip(&ap);
+  if (ap.error || *ap.p || ap.max_depth > LSH_ARITH_STACK) {
+    fprintf(stderr, "lsh: bad arithmetic expression: %s\n", expr);
+    c->error = 1;
+  }
+  lsh_aop *ops = lsh_arena_alloc(c->ast, (ap.num_ops + 1) * sizeof(lsh_aop));
+  memcpy(ops, ap.ops, ap.num_ops * sizeof(lsh_aop));
+  ops[ap.num_ops].op = -1;
+  free(ap.ops);
+  free(expr);
+  return ops;
+}
+
+// Compile a word into parts. Returns its index.
+static int lsh_compile_word(lsh_compiler *c, const lsh_word *w) {
+  if (c->num_words == c->max_words) c->words = lsh_grow(c->words, &c->max_words, sizeof(lsh_cword));
+  lsh_cword *cw = &c->words[c->num_words];
+  memset(cw, 0, sizeof(lsh_cword));
+  if (!w->expand) {
+    cw->text = w->text;
+    return c->num_words++;
+  }
+  if (strcmp(w->text, "$@") == 0) {
+    cw->split = 1;
+    return c->num_words++;
+  }
+
+  // A part per '$' and per stretch of text between them, at most
+  int max_parts = 1;
+  for (const char *p = w->text; *p; p++) {
+    if (*p == '$' || *p == LSH_LITERAL_DOLLAR) max_parts += 2;
+  }
+  lsh_part *parts = lsh_arena_alloc(c->ast, max_parts * sizeof(lsh_part));
+  int n = 0;
+  const char *p = w->text;
+  while (*p) {
+    lsh_part *part = &parts[n++];
+    memset(part, 0, sizeof(lsh_part));
+    if (*p != '$' || p[1] == '\0') {
+      // Literal text, with quoted dollars put back
+      const char *run = p;
+      int len = 0;
+      do {
+        len++;
+        p++;
+      } while (*p && (*p != '$' || p[1] == '\0'));
+      char *text = lsh_arena_alloc(c->ast, len + 1);
+      for (int i = 0; i < len; i++) {
+        text[i] = run[i] == LSH_LITERAL_DOLLAR ? '$' : run[i];
+      }
+      text[len] = '\0';
+      part->kind = LSH_PART_TEXT;
+      part->text = text;
+      part->n = len;
+      continue;
+    }
+
+    p++;
+    if (p[0] == '(' && p[1] == '(') {
+      // $((expr)): find the matching "))"
+      const char *start = p + 2;
+      int depth = 0;
+      const char *q = start;
+      while (*q && !(depth == 0 && q[0] == ')' && q[1] == ')')) {
+        if (*q == '(') depth++;
+        else if (*q == ')') depth--;
+        q++;
+      }
+      part->kind = LSH_PART_ARITH;
+      part->arith = lsh_compile_arith(c, start, (int)(q - start));
+      p = *q ? q + 2 : q;
+    } else if (*p == '(') {
+      fprintf(stderr, "lsh: command substitution is not supported\n");
+      c->error = 1;
+      while (*p && *p != ')') p++;
+      if (*p) p++;
+    } else if (*p == '?') {
+      part->kind = LSH_PART_STATUS;
+      p++;
+    } else if (*p == '#') {
+      part->kind = LSH_PART_ARGC;
+      p++;
+    } else if (*p == '@' || *p == '*') {
+      part->kind = LSH_PART_ALL;
+      p++;
+    } else if (isdigit((unsigned char)*p)) {
+      part->kind = LSH_PART_ARG;
+      part->n = *p++ - '0';
+    } else {
+      int braced = *p == '{';
+      if (braced) p++;
+      int len = lsh_name_length(p);
+      if (len == 0 || (braced && p[len] != '}')) {
+        // Not a variable after all: keep the text
+        char *text = lsh_arena_alloc(c->ast, 3);
+        strcpy(text, braced ? "${" : "$");
+        part->kind = LSH_PART_TEXT;
+        part->text = text;
+        part->n = (int)strlen(text);
+        continue;
+      }
+      part->kind = LSH_PART_VAR;
+      part->n = lsh_var_slot(p, len);
+      p += len + braced;
+    }
+  }
+  cw->parts = parts;
+  cw->num_parts = n;
+  return c->num_words++;
+}
+
+static int lsh_compile_words(lsh_compiler *c, const lsh_word *words, int count) {
+  int first = c->num_words;
+  for (int i = 0; i < count; i++) lsh_compile_word(c, &words[i]);
+  return first;
+}
+
+static int lsh_find_builtin(const char *name) {
+  for (int i = 0; i < lsh_num_builtins(); i++) {
+    if (strcmp(name, builtin_str[i]) == 0) return i;
+  }
+  return -1;
+}
+
+static void lsh_loop_break(lsh_compiler *c, lsh_loop_ctx *loop) {
+  if (c->lists > loop->lists_outside) lsh_emit(c, LSH_OP_POP_LOOPS, 0, loop->lists_outside, 0, 0);
+  int jump = lsh_emit(c, LSH_OP_JUMP, 0, -1, 0, 0);
+  if (loop->num_breaks == loop->max_breaks) {
+    loop->breaks = lsh_grow(loop->breaks, &loop->max_breaks, sizeof(int));
+  }
+  loop->breaks[loop->num_breaks++] = jump;
+}
+
+static void lsh_loop_begin(lsh_compiler *c, int continue_pc) {
+  lsh_loop_ctx *loop = &c->loops[c->num_loops++];
+  memset(loop, 0, sizeof(lsh_loop_ctx));
+  loop->continue_pc = continue_pc;
+  loop->lists_outside = loop->lists_inside = c->lists;
+}
+
+static void lsh_loop_end(lsh_compiler *c) {
+  lsh_loop_ctx *loop = &c->loops[--c->num_loops];
+  for (int i = 0; i < loop->num_breaks; i++) c->ops[loop->breaks[i]].a = c->num_ops;
+  free(loop->breaks);
+}
+
+static void lsh_compile_node(lsh_compiler *c, const lsh_node *n, int tail);
+
+static void lsh_compile_command(lsh_compiler *c, const lsh_node *n, int tail) {
+  int flags = (tail ? LSH_RUN_TAIL : 0) | (c->num_loops == 0 ? LSH_RUN_TRACK : 0);
+
+  for (int i = 0; i < n->nassign; i++) {
+    // NAME=value: the word minus "NAME="
+    lsh_word value = n->argv[i];
+    int len = lsh_name_length(value.text);
+    value.text += len + 1;
+    int word = lsh_compile_word(c, &value);
+    lsh_emit(c, LSH_OP_ASSIGN, 0, lsh_var_slot(n->argv[i].text, len), word, 0);
+  }
+  if (n->nassign == n->argc) return;
+
+  const lsh_word *name = &n->argv[n->nassign];
+  int count = n->argc - n->nassign;
+  if (!name->expand && (strcmp(name->text, "break") == 0 || strcmp(name->text, "continue") == 0) &&
+      c->num_loops > 0 && (count == 1 || (count == 2 && !n->argv[n->nassign + 1].expand))) {
+    // break / continue [n]: jumps
+    int levels = count == 2 ? atoi(n->argv[n->nassign + 1].text) : 1;
+    if (levels < 1) levels = 1;
+    if (levels > c->num_loops) levels = c->num_loops;
+    lsh_loop_ctx *loop = &c->loops[c->num_loops - levels];
+    lsh_emit(c, LSH_OP_STATUS, 0, 0, 0, 0);
+    if (name->text[0] == 'b') {
+      lsh_loop_break(c, loop);
+    } else {
+      if (c->lists > loop->lists_inside) lsh_emit(c, LSH_OP_POP_LOOPS, 0, loop->lists_inside, 0, 0);
+      lsh_emit(c, LSH_OP_JUMP, 0, loop->continue_pc, 0, 0);
+    }
+    return;
+  }
+  if (!name->expand && strcmp(name->text, "return") == 0 && c->function && count <= 2) {
+    int word = count == 2 ? lsh_compile_word(c, &n->argv[n->nassign + 1]) : -1;
+    lsh_emit(c, LSH_OP_RETURN, 0, word, 0, 0);
+    return;
+  }
+
+  int first = lsh_compile_words(c, name, count);
+  int builtin = name->expand ? -1 : lsh_find_builtin(name->text);
+  if (builtin >= 0) {
+    lsh_emit(c, LSH_OP_BUILTIN, flags, first, count, builtin);
+  } else {
+    lsh_emit(c, LSH_OP_RUN, flags, first, count, 0);
+  }
+}
+
+static void lsh_compile_node(lsh_compiler *c, const lsh_node *n, int tail) {
+  int jump, top;
+
+  switch (n->kind) {
+  case LSH_NODE_COMMAND:
+    lsh_compile_command(c, n, tail);
+    break;
+  case LSH_NODE_SEQ:
+    lsh_compile_node(c, n->left, 0);
+    lsh_compile_node(c, n->right, tail);
+    break;
+  case LSH_NODE_AND:
+  case LSH_NODE_OR:
+    lsh_compile_node(c, n->left, 0);
+    jump = lsh_emit(c, n->kind == LSH_NODE_AND ? LSH_OP_JUMP_FAIL : LSH_OP_JUMP_OK, 0, -1, 0, 0);
+    lsh_compile_node(c, n->right, tail);
+    c->ops[jump].a = c->num_ops;
+    break;
+  case LSH_NODE_GROUP:
+    lsh_compile_node(c, n->left, tail);
+    break;
+  case LSH_NODE_FUNCTION:
+    if (c->num_nodes == c->max_nodes) c->nodes = lsh_grow(c->nodes, &c->max_nodes, sizeof(lsh_node*));
+    c->nodes[c->num_nodes] = n;
+    lsh_emit(c, LSH_OP_DEFINE, 0, c->num_nodes++, 0, 0);
+    break;
+  case LSH_NODE_IF: {
+    lsh_compile_node(c, n->left, 0);
+    jump = lsh_emit(c, LSH_OP_JUMP_FAIL, 0, -1, 0, 0);
+    lsh_compile_node(c, n->right, 0);
+    int skip = lsh_emit(c, LSH_OP_JUMP, 0, -1, 0, 0);
+    c->ops[jump].a = c->num_ops;
+    if (n->other) {
+      lsh_compile_node(c, n->other, 0);
+    } else {
+      lsh_emit(c, LSH_OP_STATUS, 0, 0, 0, 0);
+    }
+    c->ops[skip].a = c->num_ops;
+    break;
+  }
+  case LSH_NODE_WHILE:
+  case LSH_NODE_UNTIL:
+    if (c->num_loops == LSH_MAX_LOOP_NESTING) {
+      fprintf(stderr, "lsh: loops nested too deeply\n");
+      c->error = 1;
+      break;
+    }
+    top = c->num_ops;
+    lsh_loop_begin(c, top);
+    lsh_compile_node(c, n->left, 0);
+    jump = lsh_emit(c, n->kind == LSH_NODE_WHILE ? LSH_OP_JUMP_FAIL : LSH_OP_JUMP_OK, 0, -1, 0, 0);
+    lsh_compile_node(c, n->right, 0);
+    lsh_emit(c, LSH_OP_JUMP, 0, top, 0, 0);
+    c->ops[jump].a = c->num_ops;
+    lsh_loop_end(c);
+    lsh_emit(c, LSH_OP_STATUS, 0, 0, 0, 0);
+    break;
+  case LSH_NODE_FOR: {
+    if (c->num_loops == LSH_MAX_LOOP_NESTING) {
+      fprintf(stderr, "lsh: loops nested too deeply\n");
+      c->error = 1;
+      break;
+    }
+    int first = lsh_compile_words(c, n->argv, n->argc);
+    lsh_emit(c, LSH_OP_FOR, 0, first, n->argc, 0);
+    top = lsh_emit(c, LSH_OP_NEXT, 0, lsh_var_slot(n->name, (int)strlen(n->name)), -1, 0);
+    lsh_loop_begin(c, top);
+    c->loops[c->num_loops - 1].lists_inside = ++c->lists;
+    lsh_compile_node(c, n->left, 0);
+    lsh_emit(c, LSH_OP_JUMP, 0, top, 0, 0);
+    c->lists--;
+    c->ops[top].b = c->num_ops;
+    lsh_loop_end(c);
+    lsh_emit(c, LSH_OP_STATUS, 0, 0, 0, 0);
+    break;
+  }
+  case LSH_NODE_BACKGROUND: {
+    // A plain command is started directly, with its words expanded here;
+    // anything else goes to a child shell as text
+    const lsh_node *cmd = n->left;
+    int first = 0, count = 0;
+    if (cmd->kind == LSH_NODE_COMMAND && cmd->nassign == 0) {
+      count = cmd->argc;
+      first = lsh_compile_words(c, cmd->argv, count);
+    }
+    if (c->num_nodes == c->max_nodes) c->nodes = lsh_grow(c->nodes, &c->max_nodes, sizeof(lsh_node*));
+    c->nodes[c->num_nodes] = n;
+    lsh_emit(c, LSH_OP_BACKGROUND, 0, first, count, c->num_nodes++);
+    break;
+  }
+  }
+}
+
+// Compile a tree, if not done already. Returns NULL after an error.
+static lsh_code *lsh_compile(lsh_ast *ast, int function) {
+  lsh_compiler c;
+
+  if (ast->code) return ast->code;
+  memset(&c, 0, sizeof(c));
+  c.ast = ast;
+  c.function = function;
+  if (ast->root) lsh_compile_node(&c, ast->root, 1);
+  lsh_emit(&c, LSH_OP_END, 0, 0, 0, 0);
+
+  if (!c.error) {
+    // Everything moves into the tree's arena and is freed with it
+    lsh_code *code = lsh_arena_alloc(ast, sizeof(lsh_code));
+    code->num_ops = c.num_ops;
+    code->num_words = c.num_words;
+    code->num_nodes = c.num_nodes;
+    code->ops = lsh_arena_alloc(ast, c.num_ops * sizeof(lsh_op));
+    memcpy(code->ops, c.ops, c.num_ops * sizeof(lsh_op));
+    code->words = lsh_arena_alloc(ast, (c.num_words + 1) * sizeof(lsh_cword));
+    memcpy(code->words, c.words, c.num_words * sizeof(lsh_cword));
+    code->nodes = lsh_arena_alloc(ast, (c.num_nodes + 1) * sizeof(lsh_node*));
+    memcpy(code->nodes, c.nodes, c.num_nodes * sizeof(lsh_node*));
+    ast->code = code;
+  }
+  for (int i = 0; i < c.num_loops; i++) free(c.loops[i].breaks);
+  free(c.ops);
+  free(c.words);
+  free(c.nodes);
+  return ast->code;
+}
+
+/*
+ * The virtual machine.
+ */
+
+// Items of a running for loop
+typedef struct lsh_for_list {
+  char **items;
+  int count, next;
+} lsh_for_list;
+
+typedef struct lsh_vm {
+  lsh_strbuf buf;       // expanded text of the current command
+  char **argv;
+  unsigned char *in_buf;   // argv[i] is an offset into buf until the command is complete
+  int argc, max_argv;
+  lsh_for_list *lists;
+  int num_lists, max_lists;
+} lsh_vm;
+
+static long long lsh_arith_eval(const lsh_aop *op) {
+  long long stack[LSH_ARITH_STACK];
+  int sp = 0;
+
+  for (; op->op >= 0; op++) {
+    long long b = sp > 0 ? stack[sp - 1] : 0;
+    long long a = sp > 1 ? stack[sp - 2] : 0;
+    switch (op->op) {
+    case LSH_A_NUM: stack[sp++] = op->value; continue;
+    case LSH_A_VAR: stack[sp++] = lsh_var_num((int)op->value); continue;
+    case LSH_A_NEG: stack[sp - 1] = -b; continue;
+    case LSH_A_NOT: stack[sp - 1] = !b; continue;
+    case LSH_A_MUL: a = a * b; break;
+    case LSH_A_DIV:
+    case LSH_A_MOD:
+      if (b == 0) {
+        fprintf(stderr, "lsh: division by zero\n");
+        a = 0;
+      } else if (b == -1) {
+        // LLONG_MIN / -1 overflows and traps on x86; the quotient wraps to
+        // LLONG_MIN and the remainder is 0
+        a = op->op == LSH_A_DIV ? (long long)(0ULL - (unsigned long long)a) : 0;
+      } else {
+        a = op->op == LSH_A_DIV ? a / b : a % b;
+      }
+      break;
+    case LSH_A_ADD: a = a + b; break;
+    case LSH_A_SUB: a = a - b; break;
+    case LSH_A_LT: a = a < b; break;
+    case LSH_A_LE: a = a <= b; break;
+    case LSH_A_GT: a = a > b; break;
+    case LSH_A_GE: a = a >= b; break;
+    case LSH_A_EQ: a = a == b; break;
+    case LSH_A_NE: a = a != b; break;
+    case LSH_A_AND: a = a && b; break;
+    case LSH_A_OR: a = a || b; break;
+    }
+    stack[--sp - 1] = a;
+  }
+  return sp ? stack[0] : 0;
+}
+
+static void lsh_vm_push(lsh_vm *vm, char *arg, int in_buf) {
+  if (vm->argc + 1 >= vm->max_argv) {
+    int max = vm->max_argv;
+    vm->argv = lsh_grow(vm->argv, &vm->max_argv, sizeof(char*));
+    vm->in_buf = lsh_grow(vm->in_buf, &max, 1);
+  }
+  vm->argv[vm->argc] = arg;
+  vm->in_buf[vm->argc++] = (unsigned char)in_buf;
+}
+
+// Expand a word to text at the end of vm->buf
+static void lsh_vm_expand(lsh_vm *vm, const lsh_cword *w) {
+  char num[24];
+
+  for (int i = 0; i < w->num_parts; i++) {
+    const lsh_part *part = &w->parts[i];
+    const char *value = NULL;
+    switch (part->kind) {
+    case LSH_PART_TEXT:
+      lsh_strbuf_add(&vm->buf, part->text, part->n);
+      break;
+    case LSH_PART_VAR:
+      value = lsh_var_get(part->n);
+      break;
+    case LSH_PART_ARG:
+      if (lsh_frame_top && part->n < lsh_frame_top->argc) value = lsh_frame_top->argv[part->n];
+      break;
+    case LSH_PART_ARGC:
+      lsh_format_num(lsh_frame_top ? lsh_frame_top->argc - 1 : 0, num);
+      value = num;
+      break;
+    case LSH_PART_STATUS:
+      lsh_format_num(lsh_last_status, num);
+      value = num;
+      break;
+    case LSH_PART_ARITH:
+      lsh_format_num(lsh_arith_eval(part->arith), num);
+      value = num;
+      break;
+    case LSH_PART_ALL:
+      for (int k = 1; lsh_frame_top && k < lsh_frame_top->argc; k++) {
+        if (k > 1) lsh_strbuf_add(&vm->buf, " ", 1);
+        lsh_strbuf_add(&vm->buf, lsh_frame_top->argv[k], strlen(lsh_frame_top->argv[k]));
+      }
+      break;
+    }
+    if (value) lsh_strbuf_add(&vm->buf, value, strlen(value));
+  }
+  if (!vm->buf.s) lsh_strbuf_add(&vm->buf, "", 0);
+}
+
+// Build the argument vector of words [first, first + count) plus extra
+static void lsh_vm_args(lsh_vm *vm, const lsh_code *code, int first, int count, char **extra) {
+  vm->argc = 0;
+  vm->buf.len = 0;
+  for (int i = first; i < first + count; i++) {
+    const lsh_cword *w = &code->words[i];
+    if (w->text) {
+      lsh_vm_push(vm, (char*)w->text, 0);
+    } else if (w->split) {
+      for (int k = 1; lsh_frame_top && k < lsh_frame_top->argc; k++) {
+        lsh_vm_push(vm, lsh_frame_top->argv[k], 0);
+      }
+    } else {
+      size_t start = vm->buf.len;
+      lsh_vm_expand(vm, w);
+      lsh_strbuf_add(&vm->buf, "", 1);   // keep the NUL, the next word follows it
+      lsh_vm_push(vm, (char*)(uintptr_t)start, 1);
+    }
+  }
+  for (int i = 0; extra && extra[i]; i++) {
+    lsh_vm_push(vm, extra[i], 0);
+  }
+  for (int i = 0; i < vm->argc; i++) {
+    if (vm->in_buf[i]) vm->argv[i] = vm->buf.s + (uintptr_t)vm->argv[i];
+  }
+  vm->argv[vm->argc] = NULL;
+}
+
+static void lsh_vm_pop_lists(lsh_vm *vm, int keep) {
+  while (vm->num_lists > keep) {
+    lsh_for_list *l = &vm->lists[--vm->num_lists];
+    for (int i = 0; i < l->count; i++) free(l->items[i]);
+    free(l->items);
+  }
+}
+
+static int lsh_run_command(char **argv, int track);
+
+static int lsh_vm_run(lsh_code *code, char **extra, int track) {
+  lsh_vm vm;
+  int status = 1;
+  const lsh_op *op = code->ops;
+
+  memset(&vm, 0, sizeof(vm));
+  while (op->op != LSH_OP_END) {
+    switch (op->op) {
+    case LSH_OP_RUN:
+    case LSH_OP_BUILTIN:
+      lsh_vm_args(&vm, code, op->a, op->b, (op->flags & LSH_RUN_TAIL) ? extra : NULL);
+      if (vm.argc == 0) {
+        status = 1;
+      } else if (op->op == LSH_OP_BUILTIN && !(track && (op->flags & LSH_RUN_TRACK)) &&
+                 (lsh_functions.count == 0 || !lsh_def_find(&lsh_functions, vm.argv[0])) &&
+                 (lsh_aliases.count == 0 || !lsh_def_find(&lsh_aliases, vm.argv[0]))) {
+        // Straight to the builtin
+        lsh_commands_run++;
+        lsh_last_status = 0;
+        status = builtin_func[op->c](vm.argv);
+      } else {
+        status = lsh_run_command(vm.argv, track && (op->flags & LSH_RUN_TRACK));
+      }
+      if (!status) goto done;
+      if (lsh_interrupted) {
+        // Ctrl-C ends the whole line, not just the command it hit
+        lsh_last_status = 130;
+        goto done;
+      }
+      break;
+    case LSH_OP_ASSIGN: {
+      const lsh_cword *w = &code->words[op->b];
+      if (w->num_parts == 1 && w->parts[0].kind == LSH_PART_ARITH) {
+        lsh_var_set_num(op->a, lsh_arith_eval(w->parts[0].arith));
+      } else if (w->text) {
+        lsh_var_set(op->a, w->text, strlen(w->text));
+      } else {
+        vm.buf.len = 0;
+        lsh_vm_expand(&vm, w);
+        lsh_var_set(op->a, vm.buf.s, vm.buf.len);
+      }
+      lsh_last_status = 0;
+      break;
+    }
+    case LSH_OP_JUMP:
+      // Loops jump back, so a loop of assignments alone still stops on Ctrl-C
+      if (lsh_interrupted) {
+        lsh_last_status = 130;
+        goto done;
+      }
+      op = code->ops + op->a;
+      continue;
+    case LSH_OP_JUMP_FAIL:
+      if (lsh_last_status != 0) {
+        op = code->ops + op->a;
+        continue;
+      }
+      break;
+    case LSH_OP_JUMP_OK:
+      if (lsh_last_status == 0) {
+        op = code->ops + op->a;
+        continue;
+      }
+      break;
+    case LSH_OP_STATUS:
+      lsh_last_status = op->a;
+      break;
+    case LSH_OP_FOR: {
+      // The items are copied: the loop may change what they came from
+      lsh_vm_args(&vm, code, op->a, op->b, NULL);
+      if (vm.num_lists == vm.max_lists) {
+        vm.lists = lsh_grow(vm.lists, &vm.max_lists, sizeof(lsh_for_list));
+      }
+      lsh_for_list *l = &vm.lists[vm.num_lists++];
+      l->items = malloc((vm.argc ? vm.argc : 1) * sizeof(char*));
+      if (!l->items) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+      }
+      for (int i = 0; i < vm.argc; i++) l->items[i] = _strdup(vm.argv[i]);
+      l->count = vm.argc;
+      l->next = 0;
+      break;
+    }
+    case LSH_OP_NEXT: {
+      lsh_for_list *l = &vm.lists[vm.num_lists - 1];
+      if (l->next == l->count) {
+        lsh_vm_pop_lists(&vm, vm.num_lists - 1);
+        op = code->ops + op->b;
+        continue;
+      }
+      const char *item = l->items[l->next++];
+      lsh_var_set(op->a, item, strlen(item));
+      break;
+    }
+    case LSH_OP_POP_LOOPS:
+      lsh_vm_pop_lists(&vm, op->a);
+      break;
+    case LSH_OP_DEFINE: {
+      const lsh_node *n = code->nodes[op->a];
+      lsh_ast *body = lsh_ast_new();
+      body->root = lsh_node_copy(body, n->left);
+      lsh_def_set(&lsh_functions, n->name, n->text, body);
+      lsh_last_status = 0;
+      break;
+    }
+    case LSH_OP_RETURN:
+      if (op->a >= 0) {
+        lsh_vm_args(&vm, code, op->a, 1, NULL);
+        lsh_last_status = vm.argc ? atoi(vm.argv[0]) : 0;
+      }
+      goto done;
+    case LSH_OP_BACKGROUND: {
+      // Builtins, functions and aliases only exist in a shell
+      const char *text = code->nodes[op->c]->text;
+      if (op->b) lsh_vm_args(&vm, code, op->a, op->b, NULL);
+      if (op->b && vm.argc && lsh_find_builtin(vm.argv[0]) < 0 &&
+          !lsh_def_find(&lsh_functions, vm.argv[0]) && !lsh_def_find(&lsh_aliases, vm.argv[0])) {
+        lsh_job_start(vm.argv, text);
+      } else {
+        lsh_job_start(NULL, text);
+      }
+      break;
+    }
+    }
+    op++;
+  }
+
+done:
+  lsh_vm_pop_lists(&vm, 0);
+  free(vm.lists);
+  free(vm.argv);
+  free(vm.in_buf);
+  free(vm.buf.s);
+  return status;
+}
+
+// Compile if need be and run. Returns 0 when the shell should exit.
+static int lsh_run_ast(lsh_ast *ast, char **extra, int function, int track) {
+  lsh_code *code = lsh_compile(ast, function);
+  if (!code) {
+    lsh_last_status = 2;
+    return 1;
+  }
+  return lsh_vm_run(code, extra, track);
+}
+
+// Run one command by name: a function, an alias, a builtin or a program
+static int lsh_run_command(char **argv, int track) {
+  lsh_def *d;
+
+  if (argv[0] == NULL) return 1;
+
+  if ((d = lsh_def_find(&lsh_functions, argv[0])) != NULL) {
+    if (lsh_depth >= LSH_MAX_DEPTH) {
+      fprintf(stderr, "lsh: %s: functions nested too deeply\n", argv[0]);
+      lsh_last_status = 1;
+      return 1;
+    }
+    lsh_frame frame, *saved = lsh_frame_top;
+    lsh_ast *body = lsh_ast_ref(d->body);   // the function may redefine itself
+    memset(&frame, 0, sizeof(frame));
+    frame.argv = argv;
+    for (frame.argc = 0; argv[frame.argc]; frame.argc++);
+    lsh_frame_top = &frame;
+    lsh_depth++;
+    int status = lsh_run_ast(body, NULL, 1, 0);
+    lsh_depth--;
+    lsh_saved_restore(&frame.locals);
+    lsh_frame_top = saved;
+    lsh_ast_release(body);
+    return status;
+  }
+
+  if ((d = lsh_def_find(&lsh_aliases, argv[0])) != NULL &&
+      lsh_num_alias_active < (int)(sizeof(lsh_alias_active) / sizeof(lsh_alias_active[0]))) {
+    int active = 0;
+    for (int i = 0; i < lsh_num_alias_active; i++) {
+      if (strcmp(lsh_alias_active[i], argv[0]) == 0) active = 1;
+    }
+    if (!active && d->body->root) {
+      lsh_ast *body = lsh_ast_ref(d->body);
+      lsh_alias_active[lsh_num_alias_active++] = d->name;
+      int status = lsh_run_ast(body, argv + 1, 0, track);
+      lsh_num_alias_active--;
+      lsh_ast_release(body);
+      return status;
+    }
+  }
+
+  lsh_commands_run++;
+  if (track) {
+    lsh_measure measure;
+    lsh_cmd_stats stats;
+    lsh_measure_begin(&measure);
+    int status = lsh_execute(argv);
+    lsh_measure_end(&measure, &stats);
+    lsh_finish_command(argv, &stats);
+    return status;
+  }
+  return lsh_execute(argv);
+}
+
+int lsh_dispatch(char **argv) {
+  return lsh_run_command(argv, 0);
+}
+
+// Parse (through the cache) and run a line. Returns 0 when the shell
+// should exit.
+int lsh_run_line(const char *line) {
+  lsh_ast *ast = lsh_parse_cached(line);
+  if (!ast) {
+    lsh_last_status = 2;
+    return 1;
+  }
+  int status = lsh_run_ast(ast, NULL, 0, lsh_track_commands);
+  lsh_ast_release(ast);
+  return status;
+}
+
+// Parse and run a whole script, bypassing the cache
+int lsh_run_text(const char *text) {
+  lsh_ast *ast = lsh_parse(text);
+  if (!ast) {
+    lsh_last_status = 2;
+    return 1;
+  }
+  int status = lsh_run_ast(ast, NULL, 0, 0);
+  lsh_ast_release(ast);
+  return status;
+}
+
+// Print an alias so it can be read back in
+static void lsh_print_alias(const lsh_def *d) {
+  printf("alias %s='", d->name);
+  for (const char *p = d->text; *p; p++) {
+    if (*p == '\'') printf("'\"'\"'");
+    else putchar(*p);
+  }
+  printf("'\n");
+}
+
+// The script a background job's child shell runs for `text`: the
+// functions and aliases defined here first, as the child starts without
+char *lsh_job_script(const char *text) {
+  lsh_strbuf b = { NULL, 0, 0 };
+
+  for (size_t i = 0; lsh_functions.buckets && i <= lsh_functions.mask; i++) {
+    for (lsh_def *d = lsh_functions.buckets[i]; d; d = d->next) {
+      if (!d->text) continue;
+      lsh_strbuf_add(&b, d->text, strlen(d->text));
+      lsh_strbuf_add(&b, "\n", 1);
+    }
+  }
+  for (size_t i = 0; lsh_aliases.buckets && i <= lsh_aliases.mask; i++) {
+    for (lsh_def *d = lsh_aliases.buckets[i]; d; d = d->next) {
+      lsh_strbuf_add(&b, "alias ", 6);
+      lsh_strbuf_add(&b, d->name, strlen(d->name));
+      lsh_strbuf_add(&b, "='", 2);
+      for (const char *p = d->text; *p; p++) {
+        if (*p == '\'') lsh_strbuf_add(&b, "'\"'\"'", 5);
+        else lsh_strbuf_add(&b, p, 1);
+      }
+      lsh_strbuf_add(&b, "'\n", 2);
+    }
+  }
+  lsh_strbuf_add(&b, text, strlen(text));
+  return b.s;
+}
+
+int lsh_alias(char **args) {
+  if (args[1] == NULL) {
+    for (size_t i = 0; lsh_aliases.buckets && i <= lsh_aliases.mask; i++) {
+      for (lsh_def *d = lsh_aliases.buckets[i]; d; d = d->next) {
+        lsh_print_alias(d);
+      }
+    }
+    return 1;
+  }
+  for (int i = 1; args[i] != NULL; i++) {
+    char *eq = strchr(args[i], '=');
+    if (!eq) {
+      lsh_def *d = lsh_def_find(&lsh_aliases, args[i]);
+      if (d) {
+        lsh_print_alias(d);
+      } else {
+        fprintf(stderr, "lsh: alias: %s: not found\n", args[i]);
+        lsh_last_status = 1;
+      }
+      continue;
+    }
+
+    *eq = '\0';
+    if (args[i][0] == '\0' || lsh_is_reserved(args[i])) {
+      fprintf(stderr, "lsh: alias: invalid name '%s'\n", args[i]);
+      lsh_last_status = 1;
+    } else {
+      lsh_ast *body = lsh_parse(eq + 1);
+      if (body) {
+        lsh_def_set(&lsh_aliases, args[i], eq + 1, body);
+      } else {
+        lsh_last_status = 1;
+      }
+    }
+    *eq = '=';
+  }
+  return 1;
+}
+
+int lsh_unalias(char **args) {
+  if (args[1] == NULL) {
+    fprintf(stderr, "lsh: expected argument to \"unalias\"\n");
+    lsh_last_status = 1;
+    return 1;
+  }
+  for (int i = 1; args[i] != NULL; i++) {
+    if (!lsh_def_remove(&lsh_aliases, args[i])) {
+      fprintf(stderr, "lsh: unalias: %s: not found\n", args[i]);
+      lsh_last_status = 1;
+    }
+  }
+  return 1;
+}
+
+int lsh_true(char **args) {
+  return 1;
+}
+
+int lsh_false(char **args) {
+  lsh_last_status = 1;
+  return 1;
+}
+
+// exit [n]
+int lsh_exit(char **args) {
+  if (args[1] != NULL) lsh_last_status = atoi(args[1]);
+  return 0;
+}
+
+// One primary of test: the words from args[*i], which is advanced.
+// Returns 1 or 0, or -1 after an error.
+static int lsh_test_primary(char **args, int *i, int end) {
+  WIN32_FILE_ATTRIBUTE_DATA info;
+  const char *a = args[*i];
+
+  if (*i >= end) return -1;
+  if (strcmp(a, "!") == 0) {
+    (*i)++;
+    int r = lsh_test_primary(args, i, end);
+    return r < 0 ? r : !r;
+  }
+
+  // Binary operators
+  if (*i + 2 < end) {
+    const char *op = args[*i + 1];
+    const char *b = args[*i + 2];
+    static const char *ops[] = { "=", "==", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    for (int k = 0; k < (int)(sizeof(ops) / sizeof(ops[0])); k++) {
+      if (strcmp(op, ops[k]) != 0) continue;
+      *i += 3;
+      if (k < 3) return (strcmp(a, b) == 0) == (k < 2);
+      char *end_a, *end_b;
+      long long x = strtoll(a, &end_a, 10), y = strtoll(b, &end_b, 10);
+      if (*a == '\0' || *end_a || *b == '\0' || *end_b) {
+        fprintf(stderr, "lsh: test: integer expected\n");
+        return -1;
+      }
+      switch (k) {
+      case 3: return x == y;
+      case 4: return x != y;
+      case 5: return x < y;
+      case 6: return x <= y;
+      case 7: return x > y;
+      default: return x >= y;
+      }
+    }
+  }
+
+  // Unary operators
+  if (a[0] == '-' && a[1] && !a[2] && strchr("efdszn", a[1]) && *i + 1 < end) {
+    const char *b = args[*i + 1];
+    *i += 2;
+    switch (a[1]) {
+    case 'z': return b[0] == '\0';
+    case 'n': return b[0] != '\0';
+    }
+    if (!GetFileAttributesEx(b, GetFileExInfoStandard, &info)) return 0;
+    switch (a[1]) {
+    case 'f': return !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+    case 'd': return (info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    case 's': return info.nFileSizeHigh != 0 || info.nFileSizeLow != 0;
+    default: return 1;
+    }
+  }
+
+  // A lone string: true if not empty
+  (*i)++;
+  return a[0] != '\0';
+}
+
+// test EXPR, [ EXPR ]: file tests -e -f -d -s, strings -z -n = != and
+// integers -eq -ne -lt -le -gt -ge, joined with ! -a -o
+int lsh_test(char **args) {
+  int end = 1, i = 1, result = 0;
+
+  while (args[end] != NULL) end++;
+  if (strcmp(args[0], "[") == 0) {
+    if (end < 2 || strcmp(args[end - 1], "]") != 0) {
+      fprintf(stderr, "lsh: [: missing ]\n");
+      lsh_last_status = 2;
+      return 1;
+    }
+    end--;
+  }
+
+  if (i < end) {
+    // -a binds tighter than -o
+    int any = 0;
+    while (i <= end) {
+      int all = 1;
+      for (;;) {
+        int r = lsh_test_primary(args, &i, end);
+        if (r < 0) {
+          lsh_last_status = 2;
+          return 1;
+        }
+        all = all && r;
+        if (i < end && strcmp(args[i], "-a") == 0) {
+          i++;
+          continue;
+        }
+        break;
+      }
+      any = any || all;
+      if (i < end && strcmp(args[i], "-o") == 0) {
+        i++;
+        continue;
+      }
+      break;
+    }
+    if (i < end) {
+      fprintf(stderr, "lsh: test: unexpected argument: %s\n", args[i]);
+      lsh_last_status = 2;
+      return 1;
+    }
+    result = any;
+  }
+  lsh_last_status = result ? 0 : 1;
+  return 1;
+}
+
+// break and continue inside a loop, and return inside a function, are
+// compiled into jumps; getting here means there was nothing to leave
+int lsh_break(char **args) {
+  fprintf(stderr, "lsh: %s: only meaningful in a loop\n", args[0]);
+  lsh_last_status = 1;
+  return 1;
+}
+
+int lsh_return(char **args) {
+  fprintf(stderr, "lsh: return: can only return from a function\n");
+  lsh_last_status = 1;
+  return 1;
+}
+
+// Slot for NAME or NAME=value in arg, or -1 with an error if the name is
+// not valid. *value is set to what follows '=', or NULL.
+static int lsh_var_arg(const char *cmd, const char *arg, const char **value) {
+  const char *eq = strchr(arg, '=');
+  int len = eq ? (int)(eq - arg) : (int)strlen(arg);
+  if (len == 0 || lsh_name_length(arg) != len) {
+    fprintf(stderr, "lsh: %s: '%s': not a valid name\n", cmd, arg);
+    lsh_last_status = 1;
+    return -1;
+  }
+  *value = eq ? eq + 1 : NULL;
+  return lsh_var_slot(arg, len);
+}
+
+// Print the environment block, prefixed for export or not
+static void lsh_print_env(int as_export) {
+  for (const char *e = lsh_env_block(); *e; e += strlen(e) + 1) {
+    if (!as_export) {
+      printf("%s\n", e);
+      continue;
+    }
+    const char *eq = strchr(e, '=');
+    printf("export %.*s='", (int)(eq - e), e);
+    for (const char *p = eq + 1; *p; p++) {
+      if (*p == '\'') printf("'\"'\"'");
+      else putchar(*p);
+    }
+    printf("'\n");
+  }
+}
+
+// export [-n] [NAME[=value]...]
+int lsh_export(char **args) {
+  int i = 1, exported = 1;
+  const char *value;
+
+  if (args[1] && strcmp(args[1], "-n") == 0) {
+    exported = 0;
+    i++;
+  }
+  if (args[i] == NULL) {
+    lsh_print_env(1);
+    return 1;
+  }
+  for (; args[i] != NULL; i++) {
+    int slot = lsh_var_arg("export", args[i], &value);
+    if (slot < 0) continue;
+    if (value) lsh_var_set(slot, value, strlen(value));
+    lsh_var_export(slot, exported);
+  }
+  return 1;
+}
+
+int lsh_unset(char **args) {
+  const char *value;
+  for (int i = 1; args[i] != NULL; i++) {
+    int slot = lsh_var_arg("unset", args[i], &value);
+    if (slot >= 0) lsh_var_unset(slot);
+  }
+  return 1;
+}
+
+// env [NAME=value...] [command [args]]: print the environment, or run the
+// command with those variables exported for it alone
+int lsh_env_cmd(char **args) {
+  lsh_saved_vars saved;
+  const char *value;
+  int i;
+
+  memset(&saved, 0, sizeof(saved));
+  for (i = 1; args[i] != NULL && strchr(args[i], '='); i++) {
+    int slot = lsh_var_arg("env", args[i], &value);
+    if (slot < 0) {
+      lsh_saved_restore(&saved);
+      return 1;
+    }
+    lsh_saved_push(&saved, slot);
+    lsh_var_set(slot, value, strlen(value));
+    lsh_var_export(slot, 1);
+  }
+
+  int status = 1;
+  if (args[i] == NULL) {
+    lsh_print_env(0);
+  } else {
+    status = lsh_dispatch(args + i);
+  }
+  lsh_saved_restore(&saved);
+  return status;
+}
+
+// local NAME[=value]...: variables restored when the function returns
+int lsh_local(char **args) {
+  const char *value;
+
+  if (lsh_depth == 0) {
+    fprintf(stderr, "lsh: local: can only be used in a function\n");
+    lsh_last_status = 1;
+    return 1;
+  }
+  for (int i = 1; args[i] != NULL; i++) {
+    int slot = lsh_var_arg("local", args[i], &value);
+    if (slot < 0) continue;
+    lsh_saved_push(&lsh_frame_top->locals, slot);
+    if (value) {
+      lsh_var_set(slot, value, strlen(value));
+    } else {
+      int exported = lsh_vars[slot].exported;
+      lsh_var_unset(slot);
+      lsh_var_export(slot, exported);
+    }
+  }
+  return 1;
+}
+
+// stats [-o FILE] [-x FILE] [-r]: print the metrics, write them to FILE
+// now (-o) or when the shell exits (-x), or reset them (-r)
+int lsh_stats(char **args) {
+  if (args[1] == NULL) {
+    lsh_stats_print();
+    return 1;
+  }
+  for (int i = 1; args[i] != NULL; i++) {
+    if (strcmp(args[i], "-r") == 0) {
+      lsh_metrics_init();
+      EnterCriticalSection(&lsh_metrics_lock);
+      for (lsh_metric_shard *s = lsh_metric_shards; s; s = s->next) {
+        memset(s->counters, 0, sizeof(s->counters));
+        memset(s->histograms, 0, sizeof(s->histograms));
+      }
+      LeaveCriticalSection(&lsh_metrics_lock);
+    } else if ((strcmp(args[i], "-o") == 0 || strcmp(args[i], "-x") == 0) && args[i + 1]) {
+      if (args[i][1] == 'x') {
+        lsh_stats_dump_at_exit(args[i + 1]);
+      } else if (!lsh_stats_write(args[i + 1])) {
+        lsh_last_status = 1;
+      }
+      i++;
+    } else {
+      fprintf(stderr, "lsh: stats: usage: stats [-o FILE] [-x FILE] [-r]\n");
+      lsh_last_status = 1;
+      return 1;
+    }
+  }
+  return 1;
+}
+
+// jobs: list background jobs; finished ones are reported and forgotten
+int lsh_jobs(char **args) {
+  lsh_jobs_notify(0);
+  for (int i = 0; i < LSH_MAX_JOBS; i++) {
+    lsh_job *job = &lsh_job_table[i];
+    if (job->id && !job->done) printf("[%d] Running    %s\n", job->id, job->text ? job->text : "");
+  }
+  lsh_jobs_notify(1);
+  return 1;
+}
+
+// wait [%N | PID]...: wait for the given jobs, or all of them. $? is the
+// status of the last one.
+int lsh_wait(char **args) {
+  int all = args[1] == NULL;
+
+  for (int i = 0; i < LSH_MAX_JOBS; i++) {
+    lsh_job *job = &lsh_job_table[i];
+    if (!job->id) continue;
+    int wanted = all;
+    for (int k = 1; args[k] != NULL && !wanted; k++) {
+      wanted = args[k][0] == '%' ? atoi(args[k] + 1) == job->id : strtoul(args[k], NULL, 10) == job->pid;
+    }
+    if (!wanted) continue;
+    while (!job->done && !lsh_interrupted) {
+      if (lsh_ev_run(job->process, 0, INFINITE)) lsh_job_exited(job, job->process);
+    }
+    if (!job->done) {
+      // Ctrl-C stops the waiting; the job keeps running
+      lsh_last_status = 130;
+      break;
+    }
+    lsh_last_status = job->status;
+    lsh_job_free(job);
+  }
+  return 1;
+}
+
+/*
+ * Scrollback: what recent command lines printed, for the out builtin.
+ *
+ * While a line typed at the prompt runs, the C runtime's stdout (fd 1) is
+ * a pipe. A relay thread copies whatever comes out of it to the real
+ * stdout and keeps a copy, so builtins are captured as they print. The
+ * process's standard output handle stays the console, so console calls
+ * work as before and programs still write to the console directly; with
+ * `out -x on` they get the pipe as well, for stdout and stderr. That is
+ * off by default because a program writing to a pipe may drop colours,
+ * hold back prompts or refuse to go full screen.
+ *
+ * A pipe would make stdout fully buffered, so it is unbuffered while
+ * captured and builtin output reaches the relay as it is printed. A
+ * program that writes to the console is only started once the relay has
+ * passed on everything before it, so the two don't interleave.
+ *
+ * Each line's output is one entry in a ring. The latest entry is kept as
+ * it is; when the next one arrives it is compressed with a small LZ77
+ * codec (LZ4-style sequences, 64K window), which typically takes command
+ * output to a fifth of its size at several hundred MB/s. The oldest
+ * entries go to stay under LSH_OUT_BUDGET, and an entry keeps only the
+ * last LSH_OUT_ENTRY_MAX bytes of its output. Line ends are stored as \n.
+ */
+
+#define LSH_OUT_ENTRIES 64
+#define LSH_OUT_BUDGET (32 * 1024 * 1024)       // bytes kept over all entries
+#define LSH_OUT_ENTRY_MAX (8 * 1024 * 1024)     // output kept per line, the end wins
+#define LSH_OUT_RELAY_BUFSIZE (64 * 1024)
+#define LSH_OUT_DRAIN_MS 200
+#define LSH_OUT_STDIO_BUFSIZE 4096      // stdout's buffer when not captured and not a console
+
+#define LSH_LZ_MIN_MATCH 4
+#define LSH_LZ_HASH_BITS 14
+#define LSH_LZ_WINDOW 65535
+
+static unsigned char *lsh_lz_put_len(unsigned char *op, size_t len) {
+  for (; len >= 255; len -= 255) *op++ = 255;
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+static int lsh_lz_get_len(const unsigned char **ip, const unsigned char *end, size_t *len) {
+  unsigned char b;
+  do {
+    if (*ip == end) return 0;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 1;
+}
+
+// Compress n bytes into dst. Returns the compressed size, or 0 if it
+// doesn't fit in cap bytes.
+size_t lsh_lz_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+  unsigned int table[1 << LSH_LZ_HASH_BITS];
+  unsigned char *op = dst, *end = dst + cap;
+  size_t ip = 0, anchor = 0, lit;
+
+  memset(table, 0, sizeof(table));
+  while (n >= LSH_LZ_MIN_MATCH && ip <= n - LSH_LZ_MIN_MATCH) {
+    unsigned int seq;
+    memcpy(&seq, src + ip, sizeof(seq));
+    unsigned int h = (seq * 2654435761u) >> (32 - LSH_LZ_HASH_BITS);
+    size_t ref = table[h];
+    table[h] = (unsigned int)ip;
+    if (ref >= ip || ip - ref > LSH_LZ_WINDOW || memcmp(src + ref, src + ip, LSH_LZ_MIN_MATCH) != 0) {
+      // Take longer strides through data that doesn't compress
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+    size_t len = LSH_LZ_MIN_MATCH;
+    while (ip + len < n && src[ref + len] == src[ip + len]) len++;
+
+    // A sequence: token, literals, 16-bit offset, then any length bytes
+    size_t extra = len - LSH_LZ_MIN_MATCH;
+    lit = ip - anchor;
+    if ((size_t)(end - op) < lit + lit / 255 + extra / 255 + 5) return 0;
+    unsigned char *token = op++;
+    *token = (unsigned char)(((lit < 15 ? lit : 15) << 4) | (extra < 15 ? extra : 15));
+    if (lit >= 15) op = lsh_lz_put_len(op, lit - 15);
+    memcpy(op, src + anchor, lit);
+    op += lit;
+    *op++ = (unsigned char)(ip - ref);
+    *op++ = (unsigned char)((ip - ref) >> 8);
+    if (extra >= 15) op = lsh_lz_put_len(op, extra - 15);
+    ip += len;
+    anchor = ip;
+  }
+
+  // The rest are literals, in a last sequence that ends the input
+  lit = n - anchor;
+  if ((size_t)(end - op) < lit + lit / 255 + 2) return 0;
+  *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+  if (lit >= 15) op = lsh_lz_put_len(op, lit - 15);
+  memcpy(op, src + anchor, lit);
+  op += lit;
+  return (size_t)(op - dst);
+}
+
+// Returns 1 if src (len bytes) decompresses to exactly n bytes at dst
+int lsh_lz_decompress(const unsigned char *src, size_t len, unsigned char *dst, size_t n) {
+  const unsigned char *ip = src, *end = src + len;
+  size_t op = 0;
+
+  while (ip < end) {
+    unsigned int token = *ip++;
+    size_t lit = token >> 4, match = token & 15;
+    if (lit == 15 && !lsh_lz_get_len(&ip, end, &lit)) return 0;
+    if (lit > (size_t)(end - ip) || lit > n - op) return 0;
+    memcpy(dst + op, ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == end) break;
+
+    if (end - ip < 2) return 0;
+    size_t offset = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (match == 15 && !lsh_lz_get_len(&ip, end, &match)) return 0;
+    match += LSH_LZ_MIN_MATCH;
+    if (offset == 0 || offset > op || match > n - op) return 0;
+    const unsigned char *from = dst + op - offset;
+    if (offset >= match) {
+      memcpy(dst + op, from, match);
+    } else {
+      // Overlapping: the match repeats the last `offset` bytes
+      for (size_t i = 0; i < match; i++) dst[op + i] = from[i];
+    }
+    op += match;
+  }
+  return op == n;
+}
+
+typedef struct lsh_out_entry {
+  char *command;                // the line as typed
+  unsigned char *data;
+  size_t size;                  // bytes at data
+  size_t raw_size;              // bytes of output kept
+  unsigned long long dropped;   // bytes cut from the front
+  unsigned long long lines;
+  int compressed;
+  int status;
+} lsh_out_entry;
+
+static lsh_out_entry lsh_out_ring[LSH_OUT_ENTRIES];
+static int lsh_out_next = 0;        // slot for the next entry
+static int lsh_out_count = 0;
+static size_t lsh_out_bytes = 0;    // sum of the entries' sizes
+int lsh_out_programs = 0;           // relay programs' output too (out -x on)
+
+int lsh_out_redirected = 0;         // captures programs must write to, such as memo's
+
+typedef struct lsh_out_capture {
+  int fd;                       // 1 or 2
+  int saved_fd;                 // what fd was, -1 when not capturing
+  HANDLE target;                // and its handle, where the relay writes
+  HANDLE std;                   // the process's standard handle, left as it was
+  HANDLE read;
+  HANDLE thread;
+  volatile LONG waiting;        // the relay is blocked reading the pipe
+  volatile LONG stopping;       // lsh_out_stop is waiting for the relay to end
+  HANDLE drained;               // set when the relay has passed on all it read
+  int exact;                    // keep the bytes as they are, the first max of them
+  size_t max;
+  int skip;                     // the line only looked at the scrollback
+  char *command;
+  lsh_strbuf text;
+  unsigned long long dropped;
+} lsh_out_capture;
+
+static lsh_out_capture lsh_out_cap = { 1, -1 };
+static int lsh_out_stdout_captures = 0;
+static char lsh_out_stdio_buffer[LSH_OUT_STDIO_BUFSIZE];
+
+static void lsh_out_trim(lsh_out_capture *cap, size_t keep) {
+  size_t drop = cap->text.len - keep;
+  memmove(cap->text.s, cap->text.s + drop, keep + 1);
+  cap->text.len = keep;
+  cap->dropped += drop;
+}
+
+// Add relayed output. "\r\n" is kept as "\n", and past twice max the
+// front is cut back to max, so a flood of output costs time linear in its
+// size and bounded memory. An exact capture keeps what came, up to max.
+static void lsh_out_keep(lsh_out_capture *cap, const char *buf, size_t n) {
+  const char *p = buf, *end = buf + n;
+
+  if (cap->exact) {
+    if (cap->dropped || cap->text.len + n > cap->max) {
+      cap->dropped += n;
+    } else {
+      lsh_strbuf_add(&cap->text, buf, n);
+    }
+    return;
+  }
+  if (cap->text.len + n > 2 * cap->max) lsh_out_trim(cap, cap->max);
+  if (n && *p == '\n' && cap->text.len && cap->text.s[cap->text.len - 1] == '\r') {
+    cap->text.s[--cap->text.len] = '\0';    // the pair was split between reads
+  }
+  while (p < end) {
+    const char *cr = (const char*)memchr(p, '\r', end - p);
+    if (!cr) {
+      lsh_strbuf_add(&cap->text, p, end - p);
+      break;
+    }
+    int pair = cr + 1 < end && cr[1] == '\n';
+    lsh_strbuf_add(&cap->text, p, cr - p + !pair);
+    p = cr + 1;
+  }
+}
+
+static unsigned __stdcall lsh_out_relay(void *arg) {
+  lsh_out_capture *cap = (lsh_out_capture*)arg;
+  char buffer[LSH_OUT_RELAY_BUFSIZE];
+  DWORD got, written;
+
+  while (1) {
+    InterlockedExchange(&cap->waiting, 1);
+    DWORD available = 0;
+    if (PeekNamedPipe(cap->read, NULL, 0, NULL, &available, NULL) && available == 0) {
+      SetEvent(cap->drained);
+    }
+    BOOL ok = ReadFile(cap->read, buffer, sizeof(buffer), &got, NULL);
+    InterlockedExchange(&cap->waiting, 0);
+    // lsh_out_sync cancels the read to have the relay look again
+    if (!ok && GetLastError() == ERROR_OPERATION_ABORTED && !cap->stopping) continue;
+    if (!ok || got == 0) break;
+    WriteFile(cap->target, buffer, got, &written, NULL);
+    lsh_out_keep(cap, buffer, got);
+    lsh_metric_count(LSH_M_OUT_BYTES, got);
+  }
+  return 0;
+}
+
+// Point fd (1 or 2) at a pipe whose relay copies everything to where fd
+// went before, keeping it in cap->text. Returns 0 if it can't.
+static int lsh_out_start(lsh_out_capture *cap, int fd) {
+  DWORD which = fd == 1 ? STD_OUTPUT_HANDLE : STD_ERROR_HANDLE;
+  HANDLE hRead, hWrite;
+
+  if (!CreatePipe(&hRead, &hWrite, NULL, LSH_OUT_RELAY_BUFSIZE)) return 0;
+  fflush(fd == 1 ? stdout : stderr);
+  HANDLE drained = CreateEvent(NULL, TRUE, FALSE, NULL);
+  int pipe_fd = drained ? _open_osfhandle((intptr_t)hWrite, _O_TEXT) : -1;
+  if (pipe_fd < 0) {
+    if (drained) CloseHandle(drained);
+    CloseHandle(hRead);
+    CloseHandle(hWrite);
+    return 0;
+  }
+  cap->fd = fd;
+  cap->std = GetStdHandle(which);
+  cap->saved_fd = _dup(fd);
+  if (cap->saved_fd < 0 || _dup2(pipe_fd, fd) != 0) {
+    if (cap->saved_fd >= 0) _close(cap->saved_fd);
+    cap->saved_fd = -1;
+    _close(pipe_fd);
+    CloseHandle(drained);
+    CloseHandle(hRead);
+    return 0;
+  }
+  _close(pipe_fd);
+  cap->target = (HANDLE)_get_osfhandle(cap->saved_fd);
+  // _dup2 made the pipe the process's standard handle too, and inheritable.
+  // Only the runtime's fd should change, and background jobs must not
+  // hold the pipe open.
+  SetStdHandle(which, cap->std);
+  SetHandleInformation((HANDLE)_get_osfhandle(fd), HANDLE_FLAG_INHERIT, 0);
+
+  cap->read = hRead;
+  cap->drained = drained;
+  cap->waiting = 0;
+  cap->stopping = 0;
+  cap->dropped = 0;
+  cap->text.len = 0;
+  cap->thread = (HANDLE)_beginthreadex(NULL, 0, lsh_out_relay, cap, 0, NULL);
+  if (!cap->thread) {
+    _dup2(cap->saved_fd, fd);
+    SetStdHandle(which, cap->std);
+    _close(cap->saved_fd);
+    cap->saved_fd = -1;
+    CloseHandle(drained);
+    CloseHandle(hRead);
+    return 0;
+  }
+  if (fd == 1 && lsh_out_stdout_captures++ == 0) setvbuf(stdout, NULL, _IONBF, 0);
+  return 1;
+}
+
+// Put fd back and wait for the relay to pass on the rest
+static void lsh_out_stop(lsh_out_capture *cap) {
+  fflush(cap->fd == 1 ? stdout : stderr);
+  _dup2(cap->saved_fd, cap->fd);    // closes the shell's end of the pipe
+  SetStdHandle(cap->fd == 1 ? STD_OUTPUT_HANDLE : STD_ERROR_HANDLE, cap->std);
+  // The relay stops once the last writer is gone. A program the command
+  // started and left running may still hold the pipe: when the relay is
+  // only waiting on it, stop waiting.
+  InterlockedExchange(&cap->stopping, 1);
+  while (WaitForSingleObject(cap->thread, LSH_OUT_DRAIN_MS) == WAIT_TIMEOUT) {
+    if (cap->waiting) CancelSynchronousIo(cap->thread);
+  }
+  CloseHandle(cap->thread);
+  CloseHandle(cap->read);
+  CloseHandle(cap->drained);
+  _close(cap->saved_fd);
+  cap->saved_fd = -1;
+  // Back to how the runtime buffers stdout once nothing captures it
+  if (cap->fd == 1 && --lsh_out_stdout_captures == 0) {
+    setvbuf(stdout, lsh_out_stdio_buffer, _isatty(1) ? _IONBF : _IOFBF, sizeof(lsh_out_stdio_buffer));
+  }
+}
+
+// Wait until the relay has passed on everything printed so far, so a
+// program started next and writing to the console comes after it. The
+// relay may be blocked on an empty pipe, where it has nothing left: its
+// read is cancelled so it checks again and says so. Bounded, since a
+// program left running may keep the pipe busy.
+void lsh_out_sync(void) {
+  lsh_out_capture *cap = &lsh_out_cap;
+
+  fflush(stdout);
+  if (cap->saved_fd < 0) return;
+  ResetEvent(cap->drained);
+  ULONGLONG deadline = GetTickCount64() + LSH_OUT_DRAIN_MS;
+  do {
+    if (cap->waiting) CancelSynchronousIo(cap->thread);
+  } while (WaitForSingleObject(cap->drained, 1) == WAIT_TIMEOUT && GetTickCount64() < deadline);
+}
+
+// Start capturing the output of a line read at the prompt
+void lsh_out_begin(const char *line) {
+  lsh_out_capture *cap = &lsh_out_cap;
+
+  while (*line == ' ' || *line == '\t') line++;
+  if (*line == '\0' || cap->saved_fd >= 0) return;
+  cap->exact = 0;
+  cap->max = LSH_OUT_ENTRY_MAX;
+  if (!lsh_out_start(cap, 1)) return;
+  cap->skip = 0;
+  cap->command = _strdup(line);
+}
+
+static HANDLE lsh_out_inheritable(int fd) {
+  HANDLE h;
+  if (!DuplicateHandle(GetCurrentProcess(), (HANDLE)_get_osfhandle(fd), GetCurrentProcess(), &h,
+                       0, TRUE, DUPLICATE_SAME_ACCESS)) {
+    return NULL;
+  }
+  return h;
+}
+
+// Handles for a program's stdout and stderr when programs write into a
+// capture: memo's, or the scrollback's with out -x on, where both go to
+// the one pipe. Inheritable, for the caller to close. Returns 0 when the
+// program should get the usual handles.
+int lsh_out_program_handles(HANDLE *out, HANDLE *err) {
+  *out = *err = NULL;
+  if (!lsh_out_redirected && (lsh_out_cap.saved_fd < 0 || !lsh_out_programs)) return 0;
+  *out = lsh_out_inheritable(1);
+  *err = lsh_out_inheritable(lsh_out_redirected ? 2 : 1);
+  if (!*out || !*err) {
+    if (*out) CloseHandle(*out);
+    if (*err) CloseHandle(*err);
+    return 0;
+  }
+  return 1;
+}
+
+// Entry n back, 1 being the latest, or NULL
+static lsh_out_entry *lsh_out_get(int n) {
+  if (n < 1 || n > lsh_out_count) return NULL;
+  return &lsh_out_ring[(lsh_out_next - n + LSH_OUT_ENTRIES) % LSH_OUT_ENTRIES];
+}
+
+static void lsh_out_compress(lsh_out_entry *e) {
+  unsigned long long start = lsh_metric_start();
+  unsigned char *packed = (unsigned char*)malloc(e->size);
+  size_t size = packed ? lsh_lz_compress(e->data, e->size, packed, e->size) : 0;
+
+  if (size) {
+    unsigned char *fit = (unsigned char*)realloc(packed, size);
+    free(e->data);
+    e->data = fit ? fit : packed;
+    lsh_out_bytes -= e->size - size;
+    e->size = size;
+    e->compressed = 1;
+  } else {
+    free(packed);     // doesn't compress, keep it as it is
+  }
+  lsh_metric_stop(LSH_H_OUT_COMPRESS, start);
+}
+
+static void lsh_out_drop_oldest(void) {
+  lsh_out_entry *e = lsh_out_get(lsh_out_count);
+  lsh_out_bytes -= e->size;
+  free(e->command);
+  free(e->data);
+  memset(e, 0, sizeof(*e));
+  lsh_out_count--;
+}
+
+static void lsh_out_store(lsh_out_capture *cap, int status) {
+  lsh_out_entry *latest = lsh_out_get(1);
+  if (latest && !latest->compressed) lsh_out_compress(latest);
+
+  if (cap->text.len > LSH_OUT_ENTRY_MAX) lsh_out_trim(cap, LSH_OUT_ENTRY_MAX);
+  while (lsh_out_count == LSH_OUT_ENTRIES ||
+         (lsh_out_count > 0 && lsh_out_bytes + cap->text.len > LSH_OUT_BUDGET)) {
+    lsh_out_drop_oldest();
+  }
+
+  lsh_out_entry *e = &lsh_out_ring[lsh_out_next];
+  lsh_out_next = (lsh_out_next + 1) % LSH_OUT_ENTRIES;
+  lsh_out_count++;
+  char *fit = (char*)realloc(cap->text.s, cap->text.len + 1);
+  e->data = (unsigned char*)(fit ? fit : cap->text.s);
+  e->size = e->raw_size = cap->text.len;
+  e->dropped = cap->dropped;
+  e->lines = lsh_count_byte((const char*)e->data, e->size, '\n');
+  e->compressed = 0;
+  e->status = status;
+  e->command = cap->command;
+  cap->command = NULL;
+  memset(&cap->text, 0, sizeof(cap->text));
+  lsh_out_bytes += e->size;
+}
+
+// Stop capturing and keep what the line printed as the latest entry
+void lsh_out_end(int status) {
+  lsh_out_capture *cap = &lsh_out_cap;
+  if (cap->saved_fd < 0) return;
+
+  lsh_out_stop(cap);
+  if (!cap->skip && cap->text.len > 0) lsh_out_store(cap, status);
+  free(cap->command);
+  cap->command = NULL;
+  cap->text.len = 0;
+}
+
+// The entry's output, to be freed, or NULL if it can't be read back
+static char *lsh_out_load(const lsh_out_entry *e) {
+  char *text = (char*)malloc(e->raw_size + 1);
+  if (!text) return NULL;
+  if (!e->compressed) {
+    memcpy(text, e->data, e->raw_size);
+  } else if (!lsh_lz_decompress(e->data, e->size, (unsigned char*)text, e->raw_size)) {
+    free(text);
+    return NULL;
+  }
+  text[e->raw_size] = '\0';
+  return text;
+}
+
+static void lsh_out_list(void) {
+  char raw[32], kept[32];
+  size_t total = 0;
+
+  for (int n = lsh_out_count; n >= 1; n--) {
+    lsh_out_entry *e = lsh_out_get(n);
+    lsh_format_size(e->raw_size, raw, sizeof(raw));
+    printf("%4d  %8llu lines %7s  %s\n", n, e->lines, raw, e->command);
+    total += e->raw_size;
+  }
+  lsh_format_size(total, raw, sizeof(raw));
+  lsh_format_size(lsh_out_bytes, kept, sizeof(kept));
+  printf("%d of %d entries, %s of output kept in %s%s\n", lsh_out_count, LSH_OUT_ENTRIES, raw, kept,
+         lsh_out_programs ? ", programs included" : "");
+}
+
+// Print the lines of entry n containing needle, prefixed with n
+static void lsh_out_search(int n, const char *needle) {
+  char *text = lsh_out_load(lsh_out_get(n));
+  size_t nlen = strlen(needle);
+  if (!text) return;
+
+  const char *p = text, *end = text + strlen(text), *hit;
+  while (p < end && !lsh_interrupted && (hit = lsh_memmem(p, end - p, needle, nlen)) != NULL) {
+    const char *start = hit, *stop = (const char*)memchr(hit, '\n', end - hit);
+    while (start > p && start[-1] != '\n') start--;
+    if (!stop) stop = end;
+    printf("%4d: %.*s\n", n, (int)(stop - start), start);
+    p = stop + 1;
+  }
+  free(text);
+}
+
+typedef struct lsh_out_feed {
+  HANDLE pipe;
+  char *text;
+  size_t len;
+} lsh_out_feed;
+
+static unsigned __stdcall lsh_out_feeder(void *arg) {
+  lsh_out_feed *feed = (lsh_out_feed*)arg;
+  DWORD written;
+  for (size_t done = 0; done < feed->len; done += written) {
+    DWORD chunk = feed->len - done > LSH_OUT_RELAY_BUFSIZE ? LSH_OUT_RELAY_BUFSIZE : (DWORD)(feed->len - done);
+    if (!WriteFile(feed->pipe, feed->text + done, chunk, &written, NULL)) break;   // it stopped reading
+  }
+  CloseHandle(feed->pipe);
+  return 0;
+}
+
+// Run a program with entry n's output as its input
+static int lsh_out_pipe(int n, char **args) {
+  SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+  lsh_out_feed feed;
+  HANDLE hRead;
+
+  feed.text = lsh_out_load(lsh_out_get(n));
+  if (!feed.text) {
+    fprintf(stderr, "lsh: out: cannot read back entry %d\n", n);
+    lsh_last_status = 1;
+    return 1;
+  }
+  feed.len = strlen(feed.text);
+  if (!CreatePipe(&hRead, &feed.pipe, &sa, 0)) {
+    fprintf(stderr, "lsh: out: cannot create a pipe\n");
+    free(feed.text);
+    lsh_last_status = 1;
+    return 1;
+  }
+  SetHandleInformation(feed.pipe, HANDLE_FLAG_INHERIT, 0);
+
+  // Written from another thread: the program may not read until it has
+  // written, and we wait for it here
+  HANDLE feeder = (HANDLE)_beginthreadex(NULL, 0, lsh_out_feeder, &feed, 0, NULL);
+  if (!feeder) {
+    CloseHandle(feed.pipe);
+  }
+  lsh_launch_input(args, hRead);
+  CloseHandle(hRead);   // a feeder still writing finds nobody reading
+  if (feeder) {
+    WaitForSingleObject(feeder, INFINITE);
+    CloseHandle(feeder);
+  }
+  free(feed.text);
+  return 1;
+}
+
+// out: list the kept output of recent lines. out N prints what the Nth
+// line back printed, out -s TEXT [N] the lines containing TEXT, and out -p
+// N PROGRAM [ARGS] runs a program with it as input. out -x on|off turns
+// capturing programs' output on or off. Lines using out are not kept.
+int lsh_out(char **args) {
+  lsh_out_cap.skip = 1;
+
+  if (args[1] == NULL) {
+    lsh_out_list();
+    return 1;
+  }
+  if (strcmp(args[1], "-x") == 0 && args[2] != NULL) {
+    lsh_out_programs = strcmp(args[2], "on") == 0;
+    return 1;
+  }
+  if (strcmp(args[1], "-s") == 0 && args[2] != NULL && args[2][0] != '\0') {
+    if (args[3] != NULL) {
+      if (!lsh_out_get(atoi(args[3]))) goto missing;
+      lsh_out_search(atoi(args[3]), args[2]);
+    } else {
+      for (int n = lsh_out_count; n >= 1 && !lsh_interrupted; n--) lsh_out_search(n, args[2]);
+    }
+    return 1;
+  }
+  if (strcmp(args[1], "-p") == 0 && args[2] != NULL && args[3] != NULL) {
+    if (!lsh_out_get(atoi(args[2]))) goto missing;
+    return lsh_out_pipe(atoi(args[2]), args + 3);
+  }
+  if (isdigit((unsigned char)args[1][0]) && args[2] == NULL) {
+    lsh_out_entry *e = lsh_out_get(atoi(args[1]));
+    char *text = e ? lsh_out_load(e) : NULL;
+    if (!e) goto missing;
+    if (!text) {
+      fprintf(stderr, "lsh: out: cannot read back entry %s\n", args[1]);
+      lsh_last_status = 1;
+      return 1;
+    }
+    if (e->dropped) {
+      char size[32];
+      lsh_format_size(e->dropped, size, sizeof(size));
+      fprintf(stderr, "lsh: out: the first %s were not kept\n", size);
+    }
+    fwrite(text, 1, e->raw_size, stdout);
+    free(text);
+    return 1;
+  }
+  fprintf(stderr, "usage: out [N] | out -s TEXT [N] | out -p N PROGRAM [ARGS...] | out -x on|off\n");
+  lsh_last_status = 2;
+  return 1;
+
+missing:
+  fprintf(stderr, "lsh: out: no such entry\n");
+  lsh_last_status = 1;
+  return 1;
+}
+
+/*
+ * memo: run a command once per set of inputs.
+ *
+ *   memo [-i FILE]... [-e NAME]... [-t] [-f] [-v] COMMAND [ARGS...]
+ *
+ * The key is a 128-bit hash of the command's words, the current directory,
+ * PATH and the variables named with -e, and the contents of the files
+ * named with -i (with -t, just their sizes and modification times). The
+ * first run is captured as it prints, through the scrollback's relays on
+ * fd 1 and 2, with programs writing into them too. Its stdout, stderr and
+ * exit status are then stored under %USERPROFILE%\.lsh_memo: the outputs
+ * as blobs named by the hash of their contents, so identical output is
+ * kept once, and a small record named by the key. A later run with the
+ * same key writes the blobs back and sets the status, without running
+ * anything. -f runs the command anyway and stores the new result.
+ *
+ * The key doesn't cover what a function or alias named by the command
+ * does, or files it reads that aren't named with -i. Stdout and stderr are
+ * replayed one after the other rather than interleaved. Runs that were
+ * interrupted, or printed more than LSH_MEMO_MAX, aren't stored.
+ *
+ *   memo            list what is stored
+ *   memo -c         remove it all
+ */
+
+#define LSH_MEMO_DIR ".lsh_memo"
+#define LSH_MEMO_MAGIC "LSHMEMO\001"
+#define LSH_MEMO_MAX (64 * 1024 * 1024)      // per output
+#define LSH_MEMO_MAX_INPUTS 64
+#define LSH_MEMO_READ_BUFSIZE (256 * 1024)
+
+// MurmurHash3's x64 128-bit hash, taking its input in pieces
+typedef struct lsh_digest {
+  unsigned long long h1, h2;
+  unsigned long long total;
+  unsigned char tail[16];
+  size_t tail_len;
+} lsh_digest;
+
+static const unsigned long long lsh_digest_c1 = 0x87c37b91114253d5ULL;
+static const unsigned long long lsh_digest_c2 = 0x4cf5ad432745937fULL;
+
+static unsigned long long lsh_digest_fmix(unsigned long long k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static void lsh_digest_block(lsh_digest *d, const unsigned char *p) {
+  unsigned long long k1, k2;
+  memcpy(&k1, p, 8);
+  memcpy(&k2, p + 8, 8);
+
+  k1 *= lsh_digest_c1;
+  k1 = LSH_ROTL64(k1, 31);
+  k1 *= lsh_digest_c2;
+  d->h1 ^= k1;
+  d->h1 = LSH_ROTL64(d->h1, 27);
+  d->h1 += d->h2;
+  d->h1 = d->h1 * 5 + 0x52dce729;
+
+  k2 *= lsh_digest_c2;
+  k2 = LSH_ROTL64(k2, 33);
+  k2 *= lsh_digest_c1;
+  d->h2 ^= k2;
+  d->h2 = LSH_ROTL64(d->h2, 31);
+  d->h2 += d->h1;
+  d->h2 = d->h2 * 5 + 0x38495ab5;
+}
+
+static void lsh_digest_init(lsh_digest *d) {
+  memset(d, 0, sizeof(*d));
+}
+
+static void lsh_digest_add(lsh_digest *d, const void *data, size_t n) {
+  const unsigned char *p = (const unsigned char*)data;
+  d->total += n;
+  if (d->tail_len) {
+    size_t take = 16 - d->tail_len < n ? 16 - d->tail_len : n;
+    memcpy(d->tail + d->tail_len, p, take);
+    d->tail_len += take;
+    p += take;
+    n -= take;
+    if (d->tail_len < 16) return;
+    lsh_digest_block(d, d->tail);
+    d->tail_len = 0;
+  }
+  for (; n >= 16; p += 16, n -= 16) lsh_digest_block(d, p);
+  memcpy(d->tail, p, n);
+  d->tail_len = n;
+}
+
+// A string and its terminating NUL, so neighbouring strings stay apart
+static void lsh_digest_str(lsh_digest *d, const char *s) {
+  lsh_digest_add(d, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+static void lsh_digest_final(lsh_digest *d, unsigned char out[16]) {
+  unsigned long long k1 = 0, k2 = 0, h1 = d->h1, h2 = d->h2;
+  for (size_t i = d->tail_len; i > 8; i--) k2 = (k2 << 8) | d->tail[i - 1];
+  for (size_t i = d->tail_len < 8 ? d->tail_len : 8; i > 0; i--) k1 = (k1 << 8) | d->tail[i - 1];
+  if (d->tail_len > 8) {
+    k2 *= lsh_digest_c2;
+    k2 = LSH_ROTL64(k2, 33);
+    k2 *= lsh_digest_c1;
+    h2 ^= k2;
+  }
+  if (d->tail_len > 0) {
+    k1 *= lsh_digest_c1;
+    k1 = LSH_ROTL64(k1, 31);
+    k1 *= lsh_digest_c2;
+    h1 ^= k1;
+  }
+  h1 ^= d->total;
+  h2 ^= d->total;
+  h1 += h2;
+  h2 += h1;
+  h1 = lsh_digest_fmix(h1);
+  h2 = lsh_digest_fmix(h2);
+  h1 += h2;
+  h2 += h1;
+  memcpy(out, &h1, 8);
+  memcpy(out + 8, &h2, 8);
+}
+
+static void lsh_digest_hex(const unsigned char digest[16], char out[33]) {
+  for (int i = 0; i < 16; i++) sprintf(out + i * 2, "%02x", digest[i]);
+}
+
+// Add an input file to the key, by contents or with -t by size and mtime
+static int lsh_memo_add_input(lsh_digest *d, const char *path, int by_time) {
+  lsh_digest_str(d, path);
+  if (by_time) {
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attr)) return 0;
+    unsigned long long stamp[2] = {
+      ((unsigned long long)attr.nFileSizeHigh << 32) | attr.nFileSizeLow,
+      lsh_filetime_100ns(attr.ftLastWriteTime),
+    };
+    lsh_digest_add(d, stamp, sizeof(stamp));
+    return 1;
+  }
+
+  FILE *f = fopen(path, "rb");
+  char *buffer = f ? (char*)malloc(LSH_MEMO_READ_BUFSIZE) : NULL;
+  size_t n;
+  if (!buffer) {
+    if (f) fclose(f);
+    return 0;
+  }
+  lsh_digest file;
+  unsigned char sum[16];
+  lsh_digest_init(&file);
+  while ((n = fread(buffer, 1, LSH_MEMO_READ_BUFSIZE, f)) > 0) lsh_digest_add(&file, buffer, n);
+  int failed = ferror(f);
+  fclose(f);
+  free(buffer);
+  lsh_digest_final(&file, sum);
+  lsh_digest_add(d, sum, sizeof(sum));
+  return !failed;
+}
+
+typedef struct lsh_memo_record {
+  char magic[8];
+  int status;
+  unsigned int command_len;       // the command, for listing, follows the record
+  unsigned long long run_us;      // how long the run took
+  unsigned long long size[2];     // of stdout and stderr
+  unsigned char digest[2][16];    // and their hashes, which name their blobs
+} lsh_memo_record;
+
+static int lsh_memo_path(const char *name, char *out, size_t out_size) {
+  char dir[MAX_PATH];
+  if (!lsh_home_path(LSH_MEMO_DIR, dir, sizeof(dir))) return 0;
+  if (!name) return snprintf(out, out_size, "%s", dir) < (int)out_size;
+  return snprintf(out, out_size, "%s\\%s", dir, name) < (int)out_size;
+}
+
+// Write a file in the store through a temporary one, so a reader never
+// sees half of it
+static int lsh_memo_write(const char *name, const void *a, size_t a_len, const void *b, size_t b_len) {
+  char path[MAX_PATH], tmp_path[MAX_PATH + 16];
+  if (!lsh_memo_path(name, path, sizeof(path))) return 0;
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId());
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) return 0;
+  fwrite(a, 1, a_len, f);
+  if (b_len) fwrite(b, 1, b_len, f);
+  int failed = ferror(f);
+  fclose(f);
+  if (failed || !MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+    DeleteFile(tmp_path);
+    return 0;
+  }
+  return 1;
+}
+
+static int lsh_memo_store_blob(const lsh_strbuf *text, unsigned char digest[16]) {
+  char hex[33], path[MAX_PATH];
+  lsh_digest d;
+
+  lsh_digest_init(&d);
+  lsh_digest_add(&d, text->s, text->len);
+  lsh_digest_final(&d, digest);
+  if (text->len == 0) return 1;
+  lsh_digest_hex(digest, hex);
+  if (lsh_memo_path(hex, path, sizeof(path)) && GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES) {
+    return 1;   // the same output is stored already
+  }
+  return lsh_memo_write(hex, text->s, text->len, NULL, 0);
+}
+
+static void lsh_memo_store(const char *key, char **args, const lsh_out_capture cap[2], int status,
+                           unsigned long long run_us) {
+  char path[MAX_PATH];
+  lsh_memo_record rec;
+
+  if (!lsh_memo_path(NULL, path, sizeof(path))) return;
+  CreateDirectory(path, NULL);
+  memset(&rec, 0, sizeof(rec));
+  memcpy(rec.magic, LSH_MEMO_MAGIC, 8);
+  rec.status = status;
+  rec.run_us = run_us;
+  for (int i = 0; i < 2; i++) {
+    rec.size[i] = cap[i].text.len;
+    if (!lsh_memo_store_blob(&cap[i].text, rec.digest[i])) return;
+  }
+  char *command = lsh_command_line(args);
+  rec.command_len = (unsigned int)strlen(command);
+  lsh_memo_write(key, &rec, sizeof(rec), command, rec.command_len);
+  free(command);
+}
+
+// Read a blob and check it is what the record says, or NULL
+static char *lsh_memo_load_blob(const unsigned char digest[16], unsigned long long size) {
+  char hex[33], path[MAX_PATH];
+  unsigned char check[16];
+  lsh_digest d;
+
+  lsh_digest_hex(digest, hex);
+  if (size > LSH_MEMO_MAX || !lsh_memo_path(hex, path, sizeof(path))) return NULL;
+  FILE *f = fopen(path, "rb");
+  if (!f) return NULL;
+  char *data = (char*)malloc((size_t)size + 1);
+  if (!data || fread(data, 1, (size_t)size, f) != size || fgetc(f) != EOF) {
+    free(data);
+    fclose(f);
+    return NULL;
+  }
+  fclose(f);
+  lsh_digest_init(&d);
+  lsh_digest_add(&d, data, (size_t)size);
+  lsh_digest_final(&d, check);
+  if (memcmp(check, digest, 16) != 0) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+static void lsh_memo_write_fd(int fd, const char *data, size_t len) {
+  HANDLE h = (HANDLE)_get_osfhandle(fd);
+  DWORD written;
+  fflush(fd == 1 ? stdout : stderr);
+  for (size_t done = 0; done < len; done += written) {
+    DWORD chunk = len - done > (1u << 30) ? (1u << 30) : (DWORD)(len - done);
+    if (!WriteFile(h, data + done, chunk, &written, NULL) || written == 0) break;
+  }
+}
+
+// Replay a stored run. Returns 0 if there is none, or it can't be read.
+static int lsh_memo_replay(const char *key, lsh_memo_record *rec) {
+  char path[MAX_PATH];
+  char *out[2] = { NULL, NULL };
+
+  if (!lsh_memo_path(key, path, sizeof(path))) return 0;
+  FILE *f = fopen(path, "rb");
+  if (!f) return 0;
+  int ok = fread(rec, sizeof(*rec), 1, f) == 1 && memcmp(rec->magic, LSH_MEMO_MAGIC, 8) == 0;
+  fclose(f);
+  for (int i = 0; ok && i < 2; i++) {
+    if (rec->size[i] == 0) continue;
+    out[i] = lsh_memo_load_blob(rec->digest[i], rec->size[i]);
+    if (!out[i]) ok = 0;
+  }
+  if (ok) {
+    lsh_memo_write_fd(1, out[0], (size_t)rec->size[0]);
+    lsh_memo_write_fd(2, out[1], (size_t)rec->size[1]);
+    lsh_last_status = rec->status;
+  }
+  free(out[0]);
+  free(out[1]);
+  return ok;
+}
+
+// memo with no command: list the stored runs, or with -c remove them
+static int lsh_memo_list(int clear) {
+  char dir[MAX_PATH], pattern[MAX_PATH + 4], path[MAX_PATH * 2], size[32];
+  WIN32_FIND_DATA fd;
+  unsigned long long bytes = 0, records = 0, blobs = 0, removed = 0;
+
+  if (!lsh_memo_path(NULL, dir, sizeof(dir))) return 1;
+  snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+  HANDLE find = FindFirstFile(pattern, &fd);
+  if (find == INVALID_HANDLE_VALUE) {
+    if (!clear) printf("nothing memoized\n");
+    return 1;
+  }
+  do {
+    if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+    snprintf(path, sizeof(path), "%s\\%s", dir, fd.cFileName);
+    if (clear) {
+      if (DeleteFile(path)) removed++;
+      continue;
+    }
+    bytes += ((unsigned long long)fd.nFileSizeHigh << 32) | fd.nFileSizeLow;
+    FILE *f = fopen(path, "rb");
+    lsh_memo_record rec;
+    if (!f) continue;
+    if (fread(&rec, sizeof(rec), 1, f) != 1 || memcmp(rec.magic, LSH_MEMO_MAGIC, 8) != 0) {
+      blobs++;
+      fclose(f);
+      continue;
+    }
+    records++;
+    char *command = (char*)malloc(rec.command_len + 1);
+    if (command) {
+      size_t n = fread(command, 1, rec.command_len, f);
+      command[n] = '\0';
+      lsh_format_size(rec.size[0] + rec.size[1], size, sizeof(size));
+      printf("%.8s  %8.1f ms  status %-3d %7s  %s\n", fd.cFileName, rec.run_us / 1000.0, rec.status, size,
+             command);
+      free(command);
+    }
+    fclose(f);
+  } while (FindNextFile(find, &fd) && !lsh_interrupted);
+  FindClose(find);
+
+  if (clear) {
+    printf("removed %llu files from %s\n", removed, dir);
+  } else {
+    lsh_format_size(bytes, size, sizeof(size));
+    printf("%llu runs, %llu outputs, %s in %s\n", records, blobs, size, dir);
+  }
+  return 1;
+}
+
+int lsh_memo(char **args) {
+  const char *inputs[LSH_MEMO_MAX_INPUTS], *names[LSH_MEMO_MAX_INPUTS];
+  int num_inputs = 0, num_names = 0, by_time = 0, force = 0, verbose = 0, i;
+
+  for (i = 1; args[i] != NULL && args[i][0] == '-'; i++) {
+    if (strcmp(args[i], "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(args[i], "-i") == 0 && args[i + 1] != NULL && num_inputs < LSH_MEMO_MAX_INPUTS) {
+      inputs[num_inputs++] = args[++i];
+    } else if (strcmp(args[i], "-e") == 0 && args[i + 1] != NULL && num_names < LSH_MEMO_MAX_INPUTS) {
+      names[num_names++] = args[++i];
+    } else if (strcmp(args[i], "-t") == 0) {
+      by_time = 1;
+    } else if (strcmp(args[i], "-f") == 0) {
+      force = 1;
+    } else if (strcmp(args[i], "-v") == 0) {
+      verbose = 1;
+    } else if (strcmp(args[i], "-c") == 0 && args[i + 1] == NULL) {
+      return lsh_memo_list(1);
+    } else {
+      fprintf(stderr, "usage: memo [-i FILE]... [-e NAME]... [-t] [-f] [-v] COMMAND [ARGS...] | memo [-c]\n");
+      lsh_last_status = 2;
+      return 1;
+    }
+  }
+  if (args[i] == NULL) return lsh_memo_list(0);
+
+  unsigned long long start = lsh_now_us();
+  char cwd[MAX_PATH], key[33];
+  unsigned char digest[16];
+  lsh_digest d;
+  lsh_digest_init(&d);
+  lsh_digest_str(&d, LSH_MEMO_MAGIC);
+  for (int a = i; args[a] != NULL; a++) lsh_digest_str(&d, args[a]);
+  lsh_digest_str(&d, _getcwd(cwd, sizeof(cwd)) ? cwd : "");
+  lsh_digest_str(&d, lsh_var_get(lsh_var_slot("PATH", 4)));
+  for (int n = 0; n < num_names; n++) {
+    lsh_digest_str(&d, names[n]);
+    lsh_digest_str(&d, lsh_var_get(lsh_var_slot(names[n], (int)strlen(names[n]))));
+  }
+  for (int n = 0; n < num_inputs; n++) {
+    if (!lsh_memo_add_input(&d, inputs[n], by_time)) {
+      fprintf(stderr, "lsh: memo: %s: cannot read\n", inputs[n]);
+      lsh_last_status = 1;
+      return 1;
+    }
+  }
+  lsh_digest_final(&d, digest);
+  lsh_digest_hex(digest, key);
+
+  lsh_memo_record rec;
+  if (!force && lsh_memo_replay(key, &rec)) {
+    lsh_metric_count(LSH_M_MEMO_HITS, 1);
+    if (verbose) {
+      fprintf(stderr, "lsh: memo: replayed in %.1f ms, the run took %.1f ms\n", (lsh_now_us() - start) / 1000.0,
+              rec.run_us / 1000.0);
+    }
+    return 1;
+  }
+  lsh_metric_count(LSH_M_MEMO_MISSES, 1);
+
+  // Run it with fd 1 and 2, and programs' stdout and stderr, captured
+  lsh_out_capture cap[2];
+  memset(cap, 0, sizeof(cap));
+  int captured = 0;
+  for (int fd = 1; fd <= 2; fd++) {
+    cap[fd - 1].saved_fd = -1;
+    cap[fd - 1].exact = 1;
+    cap[fd - 1].max = LSH_MEMO_MAX;
+    if (lsh_out_start(&cap[fd - 1], fd)) captured++;
+  }
+  if (captured == 2) lsh_out_redirected++;
+  start = lsh_now_us();
+  int status = lsh_dispatch(args + i);
+  unsigned long long run_us = lsh_now_us() - start;
+  if (captured == 2) lsh_out_redirected--;
+  for (int c = 0; c < 2; c++) {
+    if (cap[c].saved_fd >= 0) lsh_out_stop(&cap[c]);
+  }
+
+  if (captured == 2 && status && !lsh_interrupted && !cap[0].dropped && !cap[1].dropped) {
+    lsh_memo_store(key, args + i, cap, lsh_last_status, run_us);
+    if (verbose) fprintf(stderr, "lsh: memo: stored %.8s\n", key);
+  } else if (verbose) {
+    fprintf(stderr, "lsh: memo: not stored\n");
+  }
+  free(cap[0].text.s);
+  free(cap[1].text.s);
+  return status;
+}
+
+/*
+ * Terminal backend for the line editor.
+ *
+ * lsh_read_line draws through `term` instead of calling the console API
+ * directly, so it can be driven without a console: the in-memory backend
+ * below replays a keystroke script into a simulated screen buffer and is
+ * what --bench-keys uses to measure the editor.
+ */
+
+typedef struct lsh_term lsh_term;
+struct lsh_term {
+    // Read at least one key (none if !wait and nothing is queued) plus
+    // whatever else has already arrived, up to cap bytes
+    int (*read_input)(lsh_term *t, unsigned char *buf, int cap, int wait);
+    BOOL (*get_info)(lsh_term *t, CONSOLE_SCREEN_BUFFER_INFO *info);
+    void (*set_cursor)(lsh_term *t, COORD pos);
+    void (*write)(lsh_term *t, const char *s, DWORD len);
+    void (*fill)(lsh_term *t, COORD pos, DWORD len, WORD attributes);   // blank len cells
+    void (*set_attr)(lsh_term *t, WORD attributes);
+    BOOL (*show_cursor)(lsh_term *t, BOOL visible);                     // returns previous state
+    int live;   // real input: wait on stdin and background events before reading
+};
+
+static int console_read_input(lsh_term *t, unsigned char *buf, int cap, int wait) {
+    int n = 0;
+    if (!wait && !_kbhit()) return 0;
+    buf[n++] = (unsigned char)_getch();
+    // A paste, or keys typed while a command ran, are all queued already:
+    // take them in one go so they are handled as a single edit
+    while (n < cap && _kbhit()) {
+        buf[n++] = (unsigned char)_getch();
+    }
+    return n;
+}
+
+// True if the console input queue holds a keystroke _getch would return.
+// Events that carry no character (key releases, modifier presses, focus
+// and mouse events) are dropped so they don't keep the handle signaled.
+static int console_key_ready(void) {
+    HANDLE hInput = GetStdHandle(STD_INPUT_HANDLE);
+    INPUT_RECORD record;
+    DWORD count;
+
+    while (PeekConsoleInput(hInput, &record, 1, &count) && count == 1) {
+        if (record.EventType == KEY_EVENT && record.Event.KeyEvent.bKeyDown) {
+            WORD vk = record.Event.KeyEvent.wVirtualKeyCode;
+            if (record.Event.KeyEvent.uChar.AsciiChar != 0 ||
+                (vk != VK_SHIFT && vk != VK_CONTROL && vk != VK_MENU && vk != VK_CAPITAL &&
+                 vk != VK_NUMLOCK && vk != VK_SCROLL && vk != VK_LWIN && vk != VK_RWIN)) {
+                return 1;
+            }
+        }
+        ReadConsoleInput(hInput, &record, 1, &count);
+    }
+    return 0;
+}
+
+static BOOL console_get_info(lsh_term *t, CONSOLE_SCREEN_BUFFER_INFO *info) {
+    return GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), info);
+}
+
+static void console_set_cursor(lsh_term *t, COORD pos) {
+    SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), pos);
+}
+
+static void console_write(lsh_term *t, const char *s, DWORD len) {
+    DWORD written;
+    if (!WriteConsole(GetStdHandle(STD_OUTPUT_HANDLE), s, len, &written, NULL)) {
+        // Not a console (output redirected), fall back to stdio
+        fwrite(s, 1, len, stdout);
+        fflush(stdout);
+    }
+}
+
+static void console_fill(lsh_term *t, COORD pos, DWORD len, WORD attributes) {
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD written;
+    FillConsoleOutputCharacter(hConsole, ' ', len, pos, &written);
+    FillConsoleOutputAttribute(hConsole, attributes, len, pos, &written);
+}
+
+static void console_set_attr(lsh_term *t, WORD attributes) {
+    SetConsoleTextAttribute(GetStdHandle(STD_OUTPUT_HANDLE), attributes);
+}
+
+static BOOL console_show_cursor(lsh_term *t, BOOL visible) {
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_CURSOR_INFO cursorInfo;
+    GetConsoleCursorInfo(hConsole, &cursorInfo);
+    BOOL previous = cursorInfo.bVisible;
+    cursorInfo.bVisible = visible;
+    SetConsoleCursorInfo(hConsole, &cursorInfo);
+    return previous;
+}
+
+lsh_term lsh_console_term = {
+    console_read_input, console_get_info, console_set_cursor, console_write,
+    console_fill, console_set_attr, console_show_cursor, 1
+};
+
+lsh_term *term = &lsh_console_term;
+
+static void term_puts(const char *s) {
+    term->write(term, s, strlen(s));
+}
+
+// In-memory backend. Output is applied to a simulated screen and counted
+// as the bytes an equivalent VT sequence stream would take, so the numbers
+// stay meaningful for a terminal that is not the Windows console.
+#define MEM_TERM_COLS 120
+#define MEM_TERM_ROWS 50
+
+typedef struct mem_term {
+    lsh_term base;
+    char cells[MEM_TERM_ROWS][MEM_TERM_COLS];
+    WORD attrs[MEM_TERM_ROWS][MEM_TERM_COLS];
+    COORD cursor;
+    WORD attributes;
+    BOOL cursor_visible;
+
+    const unsigned char *keys;  // script being replayed
+    size_t num_keys, next_key;
+    size_t paste_left;          // bytes of a bracketed paste still to deliver
+    int exhausted;              // script ran out mid-line, Enter is fed
+
+    unsigned long long bytes;   // VT-equivalent output bytes
+    unsigned long long calls;   // backend calls that produce output
+    void (*on_read)(struct mem_term *m, const unsigned char *buf, int n);  // called before input is returned
+    void *ctx;
+} mem_term;
+
+static void mem_scroll(mem_term *m) {
+    memmove(m->cells[0], m->cells[1], sizeof(m->cells[0]) * (MEM_TERM_ROWS - 1));
+    memmove(m->attrs[0], m->attrs[1], sizeof(m->attrs[0]) * (MEM_TERM_ROWS - 1));
+    memset(m->cells[MEM_TERM_ROWS - 1], ' ', MEM_TERM_COLS);
+    for (int i = 0; i < MEM_TERM_COLS; i++) {
+        m->attrs[MEM_TERM_ROWS - 1][i] = m->attributes;
+    }
+    m->cursor.Y = MEM_TERM_ROWS - 1;
+}
+
+// Keys arrive one per read, as typed; a bracketed paste arrives whole, as
+// a terminal would write it
+static int mem_read_input(lsh_term *t, unsigned char *buf, int cap, int wait) {
+    mem_term *m = (mem_term*)t;
+    size_t n = 1;
+
+    if (!wait) return 0;
+    if (m->next_key >= m->num_keys) {
+        m->exhausted = 1;
+        buf[0] = KEY_ENTER;
+    } else {
+        if (m->paste_left == 0 && m->num_keys - m->next_key >= 6 &&
+            memcmp(m->keys + m->next_key, "\x1b[200~", 6) == 0) {
+            const unsigned char *end = (const unsigned char*)lsh_memmem(
+                (const char*)m->keys + m->next_key, m->num_keys - m->next_key, "\x1b[201~", 6);
+            m->paste_left = end ? (size_t)(end - m->keys) + 6 - m->next_key : m->num_keys - m->next_key;
+        }
+        if (m->paste_left) {
+            n = m->paste_left < (size_t)cap ? m->paste_left : (size_t)cap;
+            m->paste_left -= n;
+        }
+        memcpy(buf, m->keys + m->next_key, n);
+        m->next_key += n;
+    }
+    if (m->on_read) m->on_read(m, buf, (int)n);
+    return (int)n;
+}
+
+static BOOL mem_get_info(lsh_term *t, CONSOLE_SCREEN_BUFFER_INFO *info) {
+    mem_term *m = (mem_term*)t;
+    memset(info, 0, sizeof(*info));
+    info->dwSize.X = MEM_TERM_COLS;
+    info->dwSize.Y = MEM_TERM_ROWS;
+    info->dwCursorPosition = m->cursor;
+    info->wAttributes = m->attributes;
+    info->srWindow.Right = MEM_TERM_COLS - 1;
+    info->srWindow.Bottom = MEM_TERM_ROWS - 1;
+    info->dwMaximumWindowSize = info->dwSize;
+    return TRUE;
+}
+
+static void mem_set_cursor(lsh_term *t, COORD pos) {
+    mem_term *m = (mem_term*)t;
+    char seq[32];
+    m->cursor = pos;
+    m->bytes += snprintf(seq, sizeof(seq), "\x1b[%d;%dH", pos.Y + 1, pos.X + 1);
+    m->calls++;
+}
+
+static void mem_write(lsh_term *t, const char *s, DWORD len) {
+    mem_term *m = (mem_term*)t;
+    for (DWORD i = 0; i < len; i++) {
+        char ch = s[i];
+        if (ch == '\n') {
+            m->cursor.X = 0;
+            if (++m->cursor.Y >= MEM_TERM_ROWS) mem_scroll(m);
+        } else if (ch == '\r') {
+            m->cursor.X = 0;
+        } else if (ch == '\b') {
+            if (m->cursor.X > 0) m->cursor.X--;
+        } else {
+            m->cells[m->cursor.Y][m->cursor.X] = ch;
+            m->attrs[m->cursor.Y][m->cursor.X] = m->attributes;
+            if (++m->cursor.X >= MEM_TERM_COLS) {
+                m->cursor.X = 0;
+                if (++m->cursor.Y >= MEM_TERM_ROWS) mem_scroll(m);
+            }
+        }
+    }
+    m->bytes += len;
+    m->calls++;
+}
+
+static void mem_fill(lsh_term *t, COORD pos, DWORD len, WORD attributes) {
+    mem_term *m = (mem_term*)t;
+    char seq[32];
+    size_t start = (size_t)pos.Y * MEM_TERM_COLS + pos.X;
+    size_t end = start + len;
+    if (end > (size_t)MEM_TERM_ROWS * MEM_TERM_COLS) end = (size_t)MEM_TERM_ROWS * MEM_TERM_COLS;
+    for (size_t i = start; i < end; i++) {
+        m->cells[i / MEM_TERM_COLS][i % MEM_TERM_COLS] = ' ';
+        m->attrs[i / MEM_TERM_COLS][i % MEM_TERM_COLS] = attributes;
+    }
+    // Position plus erase-characters
+    m->bytes += snprintf(seq, sizeof(seq), "\x1b[%d;%dH\x1b[%luX", pos.Y + 1, pos.X + 1, (unsigned long)len);
+    m->calls++;
+}
+
+static void mem_set_attr(lsh_term *t, WORD attributes) {
+    mem_term *m = (mem_term*)t;
+    m->attributes = attributes;
+    m->bytes += 5;  // "\x1b[90m"
+    m->calls++;
+}
+
+static BOOL mem_show_cursor(lsh_term *t, BOOL visible) {
+    mem_term *m = (mem_term*)t;
+    BOOL previous = m->cursor_visible;
+    m->cursor_visible = visible;
+    m->bytes += 6;  // "\x1b[?25l"
+    m->calls++;
+    return previous;
+}
+
+void mem_term_init(mem_term *m, const unsigned char *keys, size_t num_keys) {
+    memset(m, 0, sizeof(*m));
+    m->base.read_input = mem_read_input;
+    m->base.get_info = mem_get_info;
+    m->base.set_cursor = mem_set_cursor;
+    m->base.write = mem_write;
+    m->base.fill = mem_fill;
+    m->base.set_attr = mem_set_attr;
+    m->base.show_cursor = mem_show_cursor;
+    m->base.live = 0;
+    memset(m->cells, ' ', sizeof(m->cells));
+    m->attributes = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+    m->cursor_visible = TRUE;
+    m->keys = keys;
+    m->num_keys = num_keys;
+}
+
+#define LSH_RL_BUFSIZE 1024
+#define LSH_INPUT_QUEUE 4096
+#define LSH_SUGGEST_IDLE_MS 30
+
+// Keys read but not handled yet. The queue outlives a single line, so keys
+// typed after an Enter are kept for the next prompt.
+static unsigned char input_queue[LSH_INPUT_QUEUE];
+static int input_head = 0, input_tail = 0;
+static int input_in_paste = 0;     // between bracketed paste markers
+unsigned long suggestion_scans = 0; // find_best_match calls made for inline suggestions
+
+static int input_fill(int wait) {
+    if (input_head == input_tail) {
+        input_head = input_tail = 0;
+    } else if (input_head > 0) {
+        memmove(input_queue, input_queue + input_head, input_tail - input_head);
+        input_tail -= input_head;
+        input_head = 0;
+    }
+    if (input_tail == LSH_INPUT_QUEUE) return 0;
+    int n = term->read_input(term, input_queue + input_tail, LSH_INPUT_QUEUE - input_tail, wait);
+    input_tail += n;
+    return n;
+}
+
+static int input_starts_with(const char *seq, int len) {
+    if (input_tail - input_head < len) {
+        input_fill(0);  // the sequence may be split across reads
+    }
+    return input_tail - input_head >= len && memcmp(input_queue + input_head, seq, len) == 0;
+}
+
+// Map a queued key as the editor should see it: inside a bracketed paste,
+// line breaks and tabs become spaces so pasted text is inserted, never run
+static int input_map(int c) {
+    if (input_in_paste && (c == '\r' || c == '\n' || c == '\t')) return ' ';
+    return c;
+}
+
+// Keys as VT terminals send them
+static const struct { const char *seq; int key; } input_vt_keys[] = {
+    { "\x1b[D", KEY_LEFT }, { "\x1b[C", KEY_RIGHT }, { "\x1b[A", KEY_UP }, { "\x1b[B", KEY_DOWN },
+    { "\x1b[H", KEY_HOME }, { "\x1b[F", KEY_END }, { "\x1b[3~", KEY_DELETE },
+    { "\x1b[1;5D", KEY_CTRL_LEFT }, { "\x1b[1;5C", KEY_CTRL_RIGHT },
+};
+
+// Second code of a key _getch reports as 0 or 224 plus a scan code
+static int input_scan_key(int code) {
+    switch (code) {
+    case 75: return KEY_LEFT;
+    case 77: return KEY_RIGHT;
+    case 72: return KEY_UP;
+    case 80: return KEY_DOWN;
+    case 71: return KEY_HOME;
+    case 79: return KEY_END;
+    case 83: return KEY_DELETE;
+    case 115: return KEY_CTRL_LEFT;
+    case 116: return KEY_CTRL_RIGHT;
+    default: return 0;
+    }
+}
+
+// Next key, blocking if the queue is empty. Paste markers are consumed
+// here, and keys without a character are decoded to the KEY_ codes.
+static int input_next(void) {
+    while (1) {
+        if (input_head == input_tail) {
+            input_fill(1);
+        }
+        int c = input_queue[input_head];
+        if (c == KEY_ESC) {
+            if (input_starts_with("\x1b[200~", 6)) {
+                input_head += 6;
+                input_in_paste = 1;
+                continue;
+            }
+            if (input_starts_with("\x1b[201~", 6)) {
+                input_head += 6;
+                input_in_paste = 0;
+                continue;
+            }
+            for (size_t i = 0; i < sizeof(input_vt_keys) / sizeof(input_vt_keys[0]); i++) {
+                int len = strlen(input_vt_keys[i].seq);
+                if (input_starts_with(input_vt_keys[i].seq, len)) {
+                    input_head += len;
+                    return input_vt_keys[i].key;
+                }
+            }
+        } else if ((c == 0 || c == 224) && !input_in_paste) {
+            input_head++;
+            if (input_head == input_tail) {
+                input_fill(1);
+            }
+            c = input_scan_key(input_queue[input_head++]);
+            if (c == 0) continue;   // a key the editor has no use for
+            return c;
+        }
+        input_head++;
+        return input_map(c);
+    }
+}
+
+// Move the printable keys already queued (up to max) into out, without
+// blocking, so a paste is inserted and echoed as one chunk
+static int input_take_printable(char *out, int max) {
+    int n = 0;
+    while (n < max && input_head < input_tail) {
+        if (input_queue[input_head] == KEY_ESC) {
+            // Step over paste markers here too, so the queue reads as empty
+            // (and the suggestion is due) right after a paste ends
+            if (!input_starts_with(input_in_paste ? "\x1b[201~" : "\x1b[200~", 6)) break;
+            input_head += 6;
+            input_in_paste = !input_in_paste;
+            continue;
+        }
+        int c = input_map(input_queue[input_head]);
+        if (!isprint(c)) break;
+        out[n++] = (char)c;
+        input_head++;
+    }
+    return n;
+}
+
+/*
+ * Syntax highlighting support: what the highlighter knows about command
+ * names and paths.
+ *
+ * Command names on PATH go into a hash set built by a background thread,
+ * so a lookup per keystroke is one probe. It is rebuilt when PATH changes
+ * or the set is a minute old. Whether a path exists is answered from a
+ * small cache with a short TTL; misses are left pending while typing and
+ * checked together once input goes idle. A change notification on the
+ * current directory drops the cache early, so a file created or deleted
+ * there recolors the line straight away.
+ */
+
+#define HL_TABLE_MAX_AGE_MS 60000
+#define HL_PATH_TTL_MS 2000
+#define HL_PATH_CACHE 256
+
+int lsh_highlight = 1;
+
+typedef struct hl_table {
+    unsigned long long *slots;  // hashes of lower-cased names, 0 = empty
+    size_t mask;
+    size_t count;
+    unsigned long long path_hash;
+    unsigned long long built_ms;
+} hl_table;
+
+static hl_table *hl_commands = NULL;    // ready for lookups, main thread only
+static hl_table *hl_table_built = NULL; // handed over by the builder thread
+static HANDLE hl_table_thread = NULL;
+
+typedef struct hl_path_entry {
+    unsigned long long hash;    // of the text as typed, 0 = empty
+    unsigned long long checked_ms;
+    int exists;
+} hl_path_entry;
+
+static hl_path_entry hl_paths[HL_PATH_CACHE];
+static unsigned long long hl_paths_cwd = 0;
+static HANDLE hl_cwd_watch = NULL;      // names created or deleted in cwd
+
+// Highlighter cost, reported by --bench-keys
+unsigned long long hl_edit_ticks = 0, hl_edit_count = 0, hl_edit_max_ticks = 0;
+unsigned long long hl_idle_ticks = 0, hl_idle_count = 0, hl_stat_count = 0;
+
+static unsigned long long hl_hash_lower(const char *s, size_t len) {
+    unsigned long long h = 1469598103934665603ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)tolower((unsigned char)s[i]);
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static void hl_table_add(hl_table *t, unsigned long long h) {
+    if ((t->count + 1) * 2 > t->mask + 1) {
+        size_t cap = (t->mask + 1) * 2;
+        unsigned long long *slots = calloc(cap, sizeof(unsigned long long));
+        if (!slots) return;
+        for (size_t i = 0; i <= t->mask; i++) {
+            if (t->slots[i]) {
+                size_t j = t->slots[i] & (cap - 1);
+                while (slots[j]) j = (j + 1) & (cap - 1);
+                slots[j] = t->slots[i];
+            }
+        }
+        free(t->slots);
+        t->slots = slots;
+        t->mask = cap - 1;
+    }
+    size_t j = h & t->mask;
+    while (t->slots[j]) {
+        if (t->slots[j] == h) return;
+        j = (j + 1) & t->mask;
+    }
+    t->slots[j] = h;
+    t->count++;
+}
+
+static int hl_table_has(const hl_table *t, unsigned long long h) {
+    size_t j = h & t->mask;
+    while (t->slots[j]) {
+        if (t->slots[j] == h) return 1;
+        j = (j + 1) & t->mask;
+    }
+    return 0;
+}
+
+static void hl_table_free(hl_table *t) {
+    if (t) {
+        free(t->slots);
+        free(t);
+    }
+}
+
+static unsigned long long hl_path_env_hash(void) {
+    char path[8192];
+    DWORD n = GetEnvironmentVariable("PATH", path, sizeof(path));
+    return n && n < sizeof(path) ? lsh_hash_str(path) : 0;
+}
+
+// Record every file in the directories of path (which is split in place),
+// both as named and, for extensions listed in PATHEXT, without the extension
+static void hl_table_scan(hl_table *t, char *path) {
+    char pathext[512], spec[MAX_PATH + 2];
+    WIN32_FIND_DATA findData;
+
+    if (!GetEnvironmentVariable("PATHEXT", pathext, sizeof(pathext))) {
+        strcpy(pathext, ".COM;.EXE;.BAT;.CMD");
+    }
+
+    // Split by hand: strtok's state is shared with the main thread
+    for (char *dir = path, *next; dir != NULL; dir = next) {
+        next = strchr(dir, ';');
+        if (next) *next++ = '\0';
+        if (*dir == '\0') continue;
+        snprintf(spec, sizeof(spec), "%s\\*", dir);
+        HANDLE hFind = FindFirstFile(spec, &findData);
+        if (hFind == INVALID_HANDLE_VALUE) continue;
+        do {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+            const char *name = findData.cFileName;
+            size_t len = strlen(name);
+            hl_table_add(t, hl_hash_lower(name, len));
+
+            const char *dot = strrchr(name, '.');
+            if (dot && dot != name) {
+                char ext[MAX_PATH + 2];
+                snprintf(ext, sizeof(ext), "%s;", dot);
+                // Case-insensitive search of ".EXT;" in "PATHEXT;"
+                for (const char *p = pathext; *p; p = strchr(p, ';') ? strchr(p, ';') + 1 : p + strlen(p)) {
+                    if (_strnicmp(p, ext, strlen(ext) - 1) == 0 &&
+                        (p[strlen(ext) - 1] == ';' || p[strlen(ext) - 1] == '\0')) {
+                        hl_table_add(t, hl_hash_lower(name, dot - name));
+                        break;
+                    }
+                }
+            }
+        } while (FindNextFile(hFind, &findData));
+        FindClose(hFind);
+    }
+    t->built_ms = GetTickCount64();
+}
+
+static unsigned __stdcall hl_table_worker(void *arg) {
+    hl_table *t = (hl_table*)arg;
+    char path[8192];
+
+    DWORD n = GetEnvironmentVariable("PATH", path, sizeof(path));
+    if (n == 0 || n >= sizeof(path)) path[0] = '\0';
+    hl_table_scan(t, path);
+    hl_table_built = t;
+    return 0;
+}
+
+// An empty table for the PATH with this hash
+static hl_table *hl_table_new(unsigned long long path_hash) {
+    hl_table *t = calloc(1, sizeof(hl_table));
+    if (!t) return NULL;
+    t->mask = 1023;
+    t->slots = calloc(t->mask + 1, sizeof(unsigned long long));
+    t->path_hash = path_hash;
+    if (!t->slots) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// Take over a finished build. Returns 1 if a new table was adopted.
+static int hl_table_poll(void) {
+    if (!hl_table_thread || WaitForSingleObject(hl_table_thread, 0) != WAIT_OBJECT_0) {
+        return 0;
+    }
+    lsh_ev_remove(hl_table_thread);
+    CloseHandle(hl_table_thread);
+    hl_table_thread = NULL;
+    if (!hl_table_built) return 0;
+    hl_table_free(hl_commands);
+    hl_commands = hl_table_built;
+    hl_table_built = NULL;
+    return 1;
+}
+
+// Start a rebuild if the table is missing, stale or PATH has changed
+static void hl_table_refresh(void) {
+    unsigned long long path_hash;
+
+    hl_table_poll();
+    if (hl_table_thread || !lsh_highlight) return;
+    path_hash = hl_path_env_hash();
+    if (hl_commands && hl_commands->path_hash == path_hash &&
+        GetTickCount64() - hl_commands->built_ms < HL_TABLE_MAX_AGE_MS) {
+        return;
+    }
+
+    hl_table *t = hl_table_new(path_hash);
+    if (!t) return;
+    hl_table_thread = (HANDLE)_beginthreadex(NULL, 0, hl_table_worker, t, 0, NULL);
+    if (!hl_table_thread) hl_table_free(t);
+}
+
+// Whether the path exists: 1 or 0, or -1 if unknown and `check` is not set
+static int hl_path_exists(const char *text, size_t len, int check) {
+    unsigned long long h = hl_hash_lower(text, len);
+    unsigned long long now = GetTickCount64();
+    hl_path_entry *e = &hl_paths[h & (HL_PATH_CACHE - 1)];
+
+    if (e->hash == h && now - e->checked_ms < HL_PATH_TTL_MS) {
+        return e->exists;
+    }
+    if (!check || len >= MAX_PATH) return -1;
+
+    char path[MAX_PATH];
+    memcpy(path, text, len);
+    path[len] = '\0';
+    hl_stat_count++;
+    e->hash = h;
+    e->checked_ms = now;
+    e->exists = GetFileAttributes(path) != INVALID_FILE_ATTRIBUTES;
+    return e->exists;
+}
+
+// Relative paths mean something else after a cd, drop them
+static void hl_paths_check_cwd(void) {
+    char cwd[1024];
+    if (!_getcwd(cwd, sizeof(cwd))) return;
+    unsigned long long h = lsh_hash_str(cwd);
+    if (h != hl_paths_cwd) {
+        memset(hl_paths, 0, sizeof(hl_paths));
+        hl_paths_cwd = h;
+        if (hl_cwd_watch) {
+            lsh_ev_remove(hl_cwd_watch);
+            FindCloseChangeNotification(hl_cwd_watch);
+        }
+        hl_cwd_watch = FindFirstChangeNotification(cwd, FALSE,
+                                                   FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME);
+        if (hl_cwd_watch == INVALID_HANDLE_VALUE) hl_cwd_watch = NULL;
+    }
+}
+
+/*
+ * Warm daemon.
+ *
+ * `lsh --daemon` keeps running and holds what a new shell otherwise builds
+ * from cold: the command-name table for each PATH it has seen, and the git
+ * state of the repositories shells start in (refreshed in the background
+ * as the prompt does). An interactive shell started while it runs attaches
+ * to its pipe once, sends its directory and PATH, and gets both back, so
+ * the first prompt has the git segment and highlighting without scanning
+ * PATH or running git. Each attach gets its own thread in the daemon.
+ *
+ * The session itself still runs in the shell's process: a Windows console
+ * cannot be handed across a pipe the way a pty can. Setting LSH_NO_DAEMON
+ * skips the attach.
+ */
+
+#define LSH_DAEMON_MAGIC 0x6873646cUL
+#define LSH_DAEMON_VERSION 2
+#define LSH_DAEMON_TABLES 4         // PATH variants kept
+#define LSH_DAEMON_MAX_PATH 32768
+#define LSH_ATTACH_WAIT_MS 200      // when every pipe instance is busy
+
+typedef struct lsh_attach_request {
+    DWORD magic, version;
+    DWORD path_len;                 // PATH follows
+    DWORD cwd_len;                  // the directory follows PATH
+} lsh_attach_request;
+
+typedef struct lsh_attach_reply {
+    DWORD magic, version;
+    DWORD sessions;                 // attaches served, this one included
+    DWORD table_count;              // command hashes follow
+    DWORD table_age_ms;
+    int git_known;
+    DWORD git_age_ms;
+    DWORD root_len, git_dir_len;    // follow the hashes
+    char branch[128];
+    int dirty;
+    unsigned long long head_mtime, index_mtime;
+} lsh_attach_reply;
+
+static CRITICAL_SECTION lsh_daemon_lock;
+static hl_table *lsh_daemon_tables[LSH_DAEMON_TABLES];
+static DWORD lsh_daemon_sessions = 0;
+
+// The user a process runs as, in a TOKEN_USER to free, or NULL
+static TOKEN_USER *lsh_token_user(HANDLE process) {
+    HANDLE token;
+    DWORD size = 0;
+    TOKEN_USER *user = NULL;
+
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token)) return NULL;
+    GetTokenInformation(token, TokenUser, NULL, 0, &size);
+    if (size) user = malloc(size);
+    if (user && !GetTokenInformation(token, TokenUser, user, size, &size)) {
+        free(user);
+        user = NULL;
+    }
+    CloseHandle(token);
+    return user;
+}
+
+// Security attributes that let only the current user open the daemon's
+// pipe. The descriptor lasts as long as the daemon.
+static int lsh_daemon_security(SECURITY_ATTRIBUTES *sa) {
+    static SECURITY_DESCRIPTOR sd;
+    TOKEN_USER *user = lsh_token_user(GetCurrentProcess());
+    ACL *acl = NULL;
+    int ok = 0;
+
+    if (user) {
+        DWORD acl_size = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) + GetLengthSid(user->User.Sid);
+        acl = malloc(acl_size);
+        ok = acl && InitializeAcl(acl, acl_size, ACL_REVISION) &&
+             AddAccessAllowedAce(acl, ACL_REVISION, GENERIC_ALL, user->User.Sid) &&
+             InitializeSecurityDescriptor(&sd, SECURITY_DESCRIPTOR_REVISION) &&
+             SetSecurityDescriptorDacl(&sd, TRUE, acl, FALSE);
+    }
+    free(user);                     // the ACE keeps its own copy of the SID
+    if (!ok) {
+        free(acl);
+        return 0;
+    }
+    sa->nLength = sizeof(*sa);
+    sa->lpSecurityDescriptor = &sd;
+    sa->bInheritHandle = FALSE;
+    return 1;
+}
+
+// Whether the process serving the pipe runs as this user. Anyone can
+// create a pipe with the daemon's name, so a shell only takes caches
+// from a server it has checked.
+static int lsh_daemon_trusted(HANDLE pipe) {
+    ULONG pid;
+    int trusted = 0;
+
+    if (!GetNamedPipeServerProcessId(pipe, &pid)) return 0;
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (!process) return 0;
+    TOKEN_USER *server = lsh_token_user(process);
+    TOKEN_USER *self = lsh_token_user(GetCurrentProcess());
+    trusted = server && self && EqualSid(server->User.Sid, self->User.Sid);
+    free(server);
+    free(self);
+    CloseHandle(process);
+    return trusted;
+}
+
+static void lsh_daemon_pipe_name(char *out, size_t size) {
+    char user[256];
+    DWORD len = sizeof(user);
+    if (!GetUserName(user, &len)) strcpy(user, "user");
+    snprintf(out, size, "\\\\.\\pipe\\lsh-%s", user);
+}
+
+// ReadFile until len bytes have arrived
+static int lsh_pipe_read(HANDLE pipe, void *buf, DWORD len) {
+    DWORD got;
+    for (DWORD done = 0; done < len; done += got) {
+        if (!ReadFile(pipe, (char*)buf + done, len - done, &got, NULL) || got == 0) return 0;
+    }
+    return 1;
+}
+
+static int lsh_pipe_write(HANDLE pipe, const void *buf, DWORD len) {
+    DWORD put;
+    for (DWORD done = 0; done < len; done += put) {
+        if (!WriteFile(pipe, (const char*)buf + done, len - done, &put, NULL) || put == 0) return 0;
+    }
+    return 1;
+}
+
+// Scan PATH into a fresh table and replace the old one, or the oldest
+static void lsh_daemon_rebuild(const char *path) {
+    unsigned long long path_hash = lsh_hash_str(path);
+    char *copy = _strdup(path);
+    hl_table *t = hl_table_new(path_hash);
+    if (!copy || !t) {
+        free(copy);
+        hl_table_free(t);
+        return;
+    }
+    hl_table_scan(t, copy);
+    free(copy);
+
+    EnterCriticalSection(&lsh_daemon_lock);
+    int slot = 0;
+    for (int i = 0; i < LSH_DAEMON_TABLES; i++) {
+        if (!lsh_daemon_tables[i] || lsh_daemon_tables[i]->path_hash == path_hash) {
+            slot = i;
+            break;
+        }
+        if (lsh_daemon_tables[i]->built_ms < lsh_daemon_tables[slot]->built_ms) slot = i;
+    }
+    hl_table_free(lsh_daemon_tables[slot]);
+    lsh_daemon_tables[slot] = t;
+    LeaveCriticalSection(&lsh_daemon_lock);
+}
+
+// The daemon's table for this PATH, built now if there is none. Returns
+// the hashes in a new array, and whether the table is due a rebuild.
+static unsigned long long *lsh_daemon_table(const char *path, DWORD *count, DWORD *age_ms, int *stale) {
+    unsigned long long path_hash = lsh_hash_str(path);
+    unsigned long long *hashes = NULL;
+    hl_table *t = NULL;
+
+    for (int attempt = 0; attempt < 2 && !hashes; attempt++) {
+        EnterCriticalSection(&lsh_daemon_lock);
+        for (int i = 0; i < LSH_DAEMON_TABLES; i++) {
+            if (lsh_daemon_tables[i] && lsh_daemon_tables[i]->path_hash == path_hash) t = lsh_daemon_tables[i];
+        }
+        if (t) {
+            hashes = malloc((t->count + 1) * sizeof(unsigned long long));
+            *count = 0;
+            for (size_t i = 0; hashes && i <= t->mask; i++) {
+                if (t->slots[i]) hashes[(*count)++] = t->slots[i];
+            }
+            *age_ms = (DWORD)(GetTickCount64() - t->built_ms);
+            *stale = *age_ms >= HL_TABLE_MAX_AGE_MS;
+        }
+        LeaveCriticalSection(&lsh_daemon_lock);
+        if (!t) {
+            lsh_daemon_rebuild(path);
+        } else if (!hashes) {
+            break;
+        }
+    }
+    return hashes;
+}
+
+// Fill in what the daemon knows about the repository cwd is in, and ask
+// the prompt worker to refresh it if that is stale or missing. root and
+// git_dir are sent after the reply when git_known is set.
+static void lsh_daemon_git(const char *cwd, lsh_attach_reply *reply, lsh_path *root, lsh_path *git_dir) {
+    if (!cwd[0] || !prompt_find_repo(cwd, root, git_dir)) return;
+    if (root->len >= LSH_DAEMON_MAX_PATH || git_dir->len >= LSH_DAEMON_MAX_PATH) return;
+
+    int stale = 1;
+    EnterCriticalSection(&prompt_lock);
+    prompt_git_entry *e = prompt_cache_find(root->s, root->len);
+    if (e && e->branch[0]) {
+        reply->git_known = 1;
+        reply->git_age_ms = (DWORD)(GetTickCount64() - e->computed_at);
+        reply->root_len = (DWORD)root->len;
+        reply->git_dir_len = (DWORD)git_dir->len;
+        memcpy(reply->branch, e->branch, sizeof(reply->branch));
+        reply->dirty = e->dirty;
+        reply->head_mtime = e->head_mtime;
+        reply->index_mtime = e->index_mtime;
+        e->last_used = GetTickCount64();
+        stale = e->head_mtime != prompt_file_mtime(git_dir, "HEAD") ||
+                e->index_mtime != prompt_file_mtime(git_dir, "index") ||
+                reply->git_age_ms > PROMPT_GIT_MAX_AGE_MS;
+    }
+    if (stale) {
+        lsh_path_set(&prompt_request_root, root->s, root->len);
+        lsh_path_set(&prompt_request_git_dir, git_dir->s, git_dir->len);
+    }
+    LeaveCriticalSection(&prompt_lock);
+    if (stale) SetEvent(prompt_request_event);
+}
+
+static unsigned __stdcall lsh_daemon_session(void *arg) {
+    HANDLE pipe = (HANDLE)arg;
+    lsh_attach_request request;
+    lsh_attach_reply reply;
+    unsigned long long *hashes = NULL;
+    char *path = NULL;
+    lsh_path cwd = { NULL, 0, 0 }, root = { NULL, 0, 0 }, git_dir = { NULL, 0, 0 };
+    int stale = 0;
+
+    memset(&reply, 0, sizeof(reply));
+    if (!lsh_pipe_read(pipe, &request, sizeof(request)) || request.magic != LSH_DAEMON_MAGIC ||
+        request.version != LSH_DAEMON_VERSION || request.path_len >= LSH_DAEMON_MAX_PATH ||
+        request.cwd_len >= LSH_DAEMON_MAX_PATH) {
+        goto done;
+    }
+    path = malloc(request.path_len + 1);
+    if (!path || !lsh_pipe_read(pipe, path, request.path_len)) goto done;
+    path[request.path_len] = '\0';
+    lsh_path_reserve(&cwd, request.cwd_len);
+    if (!lsh_pipe_read(pipe, cwd.s, request.cwd_len)) goto done;
+    cwd.len = request.cwd_len;
+    cwd.s[cwd.len] = '\0';
+
+    reply.magic = LSH_DAEMON_MAGIC;
+    reply.version = LSH_DAEMON_VERSION;
+    reply.sessions = (DWORD)InterlockedIncrement((volatile LONG*)&lsh_daemon_sessions);
+    hashes = lsh_daemon_table(path, &reply.table_count, &reply.table_age_ms, &stale);
+    if (!hashes) reply.table_count = 0;
+    lsh_daemon_git(cwd.s, &reply, &root, &git_dir);
+
+    if (lsh_pipe_write(pipe, &reply, sizeof(reply)) &&
+        lsh_pipe_write(pipe, hashes, reply.table_count * sizeof(unsigned long long)) &&
+        reply.git_known) {
+        lsh_pipe_write(pipe, root.s, reply.root_len);
+        lsh_pipe_write(pipe, git_dir.s, reply.git_dir_len);
+    }
+    FlushFileBuffers(pipe);
+
+    // A stale table was good enough for this shell; have a fresh one for
+    // the next
+    if (stale) lsh_daemon_rebuild(path);
+
+done:
+    DisconnectNamedPipe(pipe);
+    CloseHandle(pipe);
+    free(hashes);
+    free(path);
+    lsh_path_free(&cwd);
+    lsh_path_free(&root);
+    lsh_path_free(&git_dir);
+    return 0;
+}
+
+// lsh --daemon
+int lsh_daemon(void) {
+    char name[300], path[8192];
+    SECURITY_ATTRIBUTES sa;
+    int first = 1;
+
+    lsh_daemon_pipe_name(name, sizeof(name));
+    if (!lsh_daemon_security(&sa)) {
+        fprintf(stderr, "lsh: daemon: cannot set up the pipe's security\n");
+        return EXIT_FAILURE;
+    }
+    InitializeCriticalSection(&lsh_daemon_lock);
+    prompt_init();
+
+    // Have the table for the daemon's own PATH ready for the first shell
+    DWORD n = GetEnvironmentVariable("PATH", path, sizeof(path));
+    if (n > 0 && n < sizeof(path)) lsh_daemon_rebuild(path);
+
+    printf("lsh: daemon serving %s\n", name);
+    fflush(stdout);
+    while (1) {
+        // The first instance fails if someone else already holds the name
+        HANDLE pipe = CreateNamedPipe(name, PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                                      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                      PIPE_UNLIMITED_INSTANCES, 65536, 65536, 0, &sa);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            fprintf(stderr, "lsh: daemon: cannot create %s%s\n", name,
+                    first ? " (is another daemon running?)" : "");
+            return EXIT_FAILURE;
+        }
+        first = 0;
+        if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED) {
+            CloseHandle(pipe);
+            continue;
+        }
+        HANDLE session = (HANDLE)_beginthreadex(NULL, 0, lsh_daemon_session, pipe, 0, NULL);
+        if (session) {
+            CloseHandle(session);
+        } else {
+            DisconnectNamedPipe(pipe);
+            CloseHandle(pipe);
+        }
+    }
+}
+
+// Take the warm caches from a running daemon. Returns 0 if there is no
+// daemon, 1 if the command table was taken, 2 if git state was too.
+int lsh_attach(void) {
+    char name[300], path[8192];
+    lsh_attach_request request;
+    lsh_attach_reply reply;
+    lsh_path cwd = { NULL, 0, 0 };
+    int result = 0;
+
+    if (GetEnvironmentVariable("LSH_NO_DAEMON", path, sizeof(path))) return 0;
+    lsh_daemon_pipe_name(name, sizeof(name));
+    // Identification only: the server may learn who we are, not act as us
+    DWORD flags = SECURITY_SQOS_PRESENT | SECURITY_IDENTIFICATION;
+    HANDLE pipe = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, flags, NULL);
+    if (pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY &&
+        WaitNamedPipe(name, LSH_ATTACH_WAIT_MS)) {
+        pipe = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, flags, NULL);
+    }
+    if (pipe == INVALID_HANDLE_VALUE) return 0;
+    if (!lsh_daemon_trusted(pipe)) {
+        CloseHandle(pipe);
+        return 0;
+    }
+
+    memset(&request, 0, sizeof(request));
+    request.magic = LSH_DAEMON_MAGIC;
+    request.version = LSH_DAEMON_VERSION;
+    DWORD n = GetEnvironmentVariable("PATH", path, sizeof(path));
+    request.path_len = n < sizeof(path) ? n : 0;
+    if (lsh_path_cwd(&cwd) && cwd.len < LSH_DAEMON_MAX_PATH) request.cwd_len = (DWORD)cwd.len;
+
+    if (lsh_pipe_write(pipe, &request, sizeof(request)) && lsh_pipe_write(pipe, path, request.path_len) &&
+        lsh_pipe_write(pipe, cwd.s, request.cwd_len) &&
+        lsh_pipe_read(pipe, &reply, sizeof(reply)) && reply.magic == LSH_DAEMON_MAGIC &&
+        reply.version == LSH_DAEMON_VERSION) {
+        unsigned long long now = GetTickCount64();
+        hl_table *t = hl_table_new(hl_path_env_hash());
+        unsigned long long chunk[512];
+        DWORD left = reply.table_count;
+        while (left > 0) {
+            DWORD take = left < 512 ? left : 512;
+            if (!lsh_pipe_read(pipe, chunk, take * sizeof(unsigned long long))) break;
+            for (DWORD i = 0; t && i < take; i++) hl_table_add(t, chunk[i]);
+            left -= take;
+        }
+        if (t && left == 0) {
+            t->built_ms = now - reply.table_age_ms;
+            hl_table_free(hl_commands);
+            hl_commands = t;
+            result = 1;
+        } else {
+            hl_table_free(t);
+        }
+
+        lsh_path root = { NULL, 0, 0 }, git_dir = { NULL, 0, 0 };
+        if (left == 0 && reply.git_known && reply.root_len > 0 &&
+            reply.root_len < LSH_DAEMON_MAX_PATH && reply.git_dir_len < LSH_DAEMON_MAX_PATH) {
+            lsh_path_reserve(&root, reply.root_len);
+            lsh_path_reserve(&git_dir, reply.git_dir_len);
+            if (lsh_pipe_read(pipe, root.s, reply.root_len) &&
+                lsh_pipe_read(pipe, git_dir.s, reply.git_dir_len)) {
+                root.len = reply.root_len;
+                root.s[root.len] = '\0';
+                git_dir.len = reply.git_dir_len;
+                git_dir.s[git_dir.len] = '\0';
+                reply.branch[sizeof(reply.branch) - 1] = '\0';
+
+                if (!prompt_ready_event) prompt_init();
+                EnterCriticalSection(&prompt_lock);
+                prompt_git_entry *e = prompt_cache_slot(root.s, root.len);
+                lsh_path_set(&e->git_dir, git_dir.s, git_dir.len);
+                memcpy(e->branch, reply.branch, sizeof(e->branch));
+                e->dirty = reply.dirty;
+                e->head_mtime = reply.head_mtime;
+                e->index_mtime = reply.index_mtime;
+                e->computed_at = now - reply.git_age_ms;
+                e->last_used = now;
+                LeaveCriticalSection(&prompt_lock);
+                result = 2;
+            }
+        }
+        lsh_path_free(&root);
+        lsh_path_free(&git_dir);
+    }
+    lsh_path_free(&cwd);
+    CloseHandle(pipe);
+    return result;
+}
+
+/*
+ * Line editing.
+ *
+ * The line lives in a gap buffer with the gap at the cursor, so inserting
+ * or deleting there is O(1) amortized however long the line is, and the
+ * text before the cursor is always contiguous, which is what completion
+ * looks at. The screen is only redrawn from the first offset that changed.
+ */
+
+typedef struct line_buf {
+    char *data;
+    int cap;
+    int gap_start;  // the cursor
+    int gap_end;
+} line_buf;
+
+static void lb_init(line_buf *lb, int cap) {
+    lb->data = malloc(cap);
+    if (!lb->data) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    lb->cap = cap;
+    lb->gap_start = 0;
+    lb->gap_end = cap;
+}
+
+static int lb_len(const line_buf *lb) {
+    return lb->cap - (lb->gap_end - lb->gap_start);
+}
+
+// Bytes after the cursor
+static int lb_tail(const line_buf *lb) {
+    return lb->cap - lb->gap_end;
+}
+
+// Make room for n more bytes. One byte of gap is always kept spare so the
+// text before the cursor can be NUL terminated in place.
+static void lb_reserve(line_buf *lb, int n) {
+    if (lb->gap_end - lb->gap_start > n) return;
+
+    int tail = lb_tail(lb);
+    int cap = lb->cap * 2;
+    while (cap - lb_len(lb) <= n) {
+        cap *= 2;
+    }
+    char *data = realloc(lb->data, cap);
+    if (!data) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    memmove(data + cap - tail, data + lb->gap_end, tail);
+    lb->data = data;
+    lb->gap_end = cap - tail;
+    lb->cap = cap;
+}
+
+static void lb_insert(line_buf *lb, const char *s, int n) {
+    lb_reserve(lb, n);
+    memcpy(lb->data + lb->gap_start, s, n);
+    lb->gap_start += n;
+}
+
+// Move the cursor, and the gap with it, to pos
+static void lb_move(line_buf *lb, int pos) {
+    if (pos < lb->gap_start) {
+        int n = lb->gap_start - pos;
+        memmove(lb->data + lb->gap_end - n, lb->data + pos, n);
+        lb->gap_start = pos;
+        lb->gap_end -= n;
+    } else if (pos > lb->gap_start) {
+        int n = pos - lb->gap_start;
+        memmove(lb->data + lb->gap_start, lb->data + lb->gap_end, n);
+        lb->gap_start += n;
+        lb->gap_end += n;
+    }
+}
+
+static char lb_at(const line_buf *lb, int i) {
+    return i < lb->gap_start ? lb->data[i] : lb->data[i + lb->gap_end - lb->gap_start];
+}
+
+// Copy the text in [from, to) to out
+static void lb_copy(const line_buf *lb, int from, int to, char *out) {
+    if (from < lb->gap_start) {
+        int n = (to < lb->gap_start ? to : lb->gap_start) - from;
+        memcpy(out, lb->data + from, n);
+        out += n;
+        from += n;
+    }
+    if (to > from) {
+        memcpy(out, lb->data + from + lb->gap_end - lb->gap_start, to - from);
+    }
+}
+
+// One undoable change: text inserted at or deleted from pos
+typedef struct line_edit {
+    int pos;
+    int len;
+    int inserted;
+    char *text;
+} line_edit;
+
+// A highlighted stretch of the line
+typedef struct hl_token {
+    int start, end;
+    int kind;
+    int command;            // in command position
+    int opens;              // a keyword after which a command starts
+    int pending;            // needs a disk check, done once input is idle
+    WORD color;             // foreground, 0 = default
+} hl_token;
+
+typedef struct line_state {
+    line_buf lb;
+    COORD origin;           // screen cell of offset 0, right after the prompt
+    int width;              // console columns
+    int drawn;              // cells in use after origin
+    WORD attributes;
+
+    // Gray text shown at the cursor without being part of the line: the
+    // inline suggestion, or the rest of the match while tab cycling
+    char *overlay;
+    int overlay_len;
+    int cursor_after_overlay;
+    char indicator[32];     // gray "(n/m)" after the line while tab cycling
+
+    completion_cursor *tab_matches;
+    int tab_index;
+    int tab_word_start;
+    char tab_prefix[1024];
+
+    line_edit *edits;
+    int num_edits, max_edits;
+    int merge;              // the next edit may extend the last one
+
+    hl_token *tokens;
+    int num_tokens, max_tokens;
+} line_state;
+
+// Killed text, kept across lines for Ctrl-Y
+static char *kill_buffer = NULL;
+static int kill_len = 0;
+
+// Incremental highlighting. The token list covers the line; an edit
+// re-lexes from the token it touches until the lexer is back in step with
+// the old tokens, so typing costs one token, not one line.
+
+enum { HL_WORD, HL_STRING, HL_OPERATOR, HL_KEYWORD };
+
+#define HL_COMMAND_OK      (FOREGROUND_GREEN | FOREGROUND_INTENSITY)
+#define HL_COMMAND_MISSING (FOREGROUND_RED | FOREGROUND_INTENSITY)
+#define HL_STRING_COLOR    (FOREGROUND_RED | FOREGROUND_GREEN)
+#define HL_PATH_COLOR      (FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
+#define HL_OPERATOR_COLOR  (FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
+#define HL_KEYWORD_COLOR   (FOREGROUND_RED | FOREGROUND_BLUE | FOREGROUND_INTENSITY)
+
+static int hl_is_operator(char ch) {
+    return ch == '|' || ch == '&' || ch == ';' || ch == '<' || ch == '>' || ch == '(' || ch == ')';
+}
+
+// Lex one token starting at pos (not a space). Quotes inside a word are
+// part of it; an unterminated quote runs to the end of the line.
+static int hl_lex(const line_buf *lb, int pos, int len, hl_token *t) {
+    char ch = lb_at(lb, pos);
+    t->start = pos;
+    t->color = 0;
+    t->pending = 0;
+    t->command = 0;
+    t->opens = 0;
+
+    if (hl_is_operator(ch)) {
+        t->kind = HL_OPERATOR;
+        while (pos < len && hl_is_operator(lb_at(lb, pos))) pos++;
+    } else {
+        t->kind = (ch == '"' || ch == '\'') ? HL_STRING : HL_WORD;
+        while (pos < len) {
+            ch = lb_at(lb, pos);
+            if (ch == '"' || ch == '\'') {
+                char quote = ch;
+                pos++;
+                while (pos < len && lb_at(lb, pos) != quote) pos++;
+                if (pos < len) pos++;
+            } else if (ch == ' ' || hl_is_operator(ch)) {
+                break;
+            } else {
+                pos++;
+            }
+        }
+    }
+    t->end = pos;
+    return pos;
+}
+
+// Work out a token's color from the caches. With `check` unset nothing
+// touches the disk: an unknown path stays pending.
+static void hl_classify(line_state *ls, hl_token *t, int check) {
+    char text[MAX_PATH];
+    int len = t->end - t->start;
+
+    t->pending = 0;
+    t->color = 0;
+    t->opens = 0;
+    if (t->kind == HL_KEYWORD) t->kind = HL_WORD;
+    if (t->kind == HL_OPERATOR) {
+        t->color = HL_OPERATOR_COLOR;
+        return;
+    }
+    if (t->kind == HL_STRING) {
+        t->color = HL_STRING_COLOR;
+        return;
+    }
+    if (len >= (int)sizeof(text) - 4) return;
+    lb_copy(&ls->lb, t->start, t->end, text);
+    text[len] = '\0';
+
+    if (t->command) {
+        if (lsh_is_reserved(text)) {
+            t->kind = HL_KEYWORD;
+            t->color = HL_KEYWORD_COLOR;
+            t->opens = lsh_reserved_opens(text);
+            return;
+        }
+        if (lsh_def_find(&lsh_aliases, text) || lsh_def_find(&lsh_functions, text)) {
+            t->color = HL_COMMAND_OK;
+            return;
+        }
+        for (int i = 0; i < lsh_num_builtins(); i++) {
+            if (strcmp(text, builtin_str[i]) == 0) {
+                t->color = HL_COMMAND_OK;
+                return;
+            }
+        }
+        if (!strchr(text, '\\') && !strchr(text, '/') && hl_commands &&
+            hl_table_has(hl_commands, hl_hash_lower(text, len))) {
+            t->color = HL_COMMAND_OK;
+            return;
+        }
+        // CreateProcess also looks in the current directory
+        int here = hl_path_exists(text, len, check);
+        if (here != 1 && !strchr(text, '.')) {
+            strcpy(text + len, ".exe");
+            int exe = hl_path_exists(text, len + 4, check);
+            here = exe == 1 ? 1 : (here < 0 || exe < 0 ? -1 : 0);
+        }
+        if (here == 1) {
+            t->color = HL_COMMAND_OK;
+        } else if (here < 0 || !hl_commands) {
+            t->pending = 1;
+        } else {
+            t->color = HL_COMMAND_MISSING;
+        }
+        return;
+    }
+
+    if (text[0] == '-') return;
+    int exists = hl_path_exists(text, len, check);
+    if (exists < 0) {
+        t->pending = 1;
+    } else if (exists) {
+        t->color = HL_PATH_COLOR;
+    }
+}
+
+static WORD hl_attr(const line_state *ls, const hl_token *t) {
+    return t->color ? (WORD)((ls->attributes & 0xF0) | t->color) : ls->attributes;
+}
+
+// Index of the first token ending at or after pos
+static int hl_find(const line_state *ls, int pos) {
+    int lo = 0, hi = ls->num_tokens;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ls->tokens[mid].end < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Bring the tokens up to date after `removed` bytes at pos were replaced by
+// `inserted` bytes. Returns the first offset whose color may have changed
+// before pos, or pos.
+static int hl_edit(line_state *ls, int pos, int removed, int inserted) {
+    LARGE_INTEGER t0, t1;
+    int len = lb_len(&ls->lb);
+    int delta = inserted - removed;
+    int dirty = pos;
+
+    if (!lsh_highlight) return pos;
+    QueryPerformanceCounter(&t0);
+
+    int i = hl_find(ls, pos);
+    int start = (i < ls->num_tokens && ls->tokens[i].start < pos) ? ls->tokens[i].start : pos;
+    WORD old_attr = i < ls->num_tokens ? hl_attr(ls, &ls->tokens[i]) : 0;
+    int old_start = i < ls->num_tokens ? ls->tokens[i].start : -1;
+    WORD old_color = i < ls->num_tokens ? ls->tokens[i].color : 0;
+
+    // Tokens past the edit keep their text, only their offsets move
+    int j = i;
+    while (j < ls->num_tokens && ls->tokens[j].start <= pos + removed) j++;
+    for (int k = j; k < ls->num_tokens; k++) {
+        ls->tokens[k].start += delta;
+        ls->tokens[k].end += delta;
+    }
+
+    // Re-lex until a token boundary lines up with an old token again
+    static hl_token *fresh = NULL;
+    static int max_fresh = 0;
+    int num_fresh = 0, p = start;
+    while (p < len && lb_at(&ls->lb, p) == ' ') p++;
+    while (p < len) {
+        if (num_fresh == max_fresh) {
+            int max = max_fresh ? max_fresh * 2 : 64;
+            hl_token *grown = realloc(fresh, max * sizeof(hl_token));
+            if (!grown) break;
+            fresh = grown;
+            max_fresh = max;
+        }
+        p = hl_lex(&ls->lb, p, len, &fresh[num_fresh++]);
+        while (p < len && lb_at(&ls->lb, p) == ' ') p++;
+        while (j < ls->num_tokens && ls->tokens[j].start < p) j++;
+        if (p >= pos + inserted && j < ls->num_tokens && ls->tokens[j].start == p) break;
+    }
+    if (p >= len) j = ls->num_tokens;
+
+    // Replace tokens [i, j) with the fresh ones
+    int count = ls->num_tokens - (j - i) + num_fresh;
+    if (count > ls->max_tokens) {
+        int max = ls->max_tokens ? ls->max_tokens : 32;
+        while (max < count) max *= 2;
+        hl_token *tokens = realloc(ls->tokens, max * sizeof(hl_token));
+        if (!tokens) {
+            ls->num_tokens = 0;
+            return 0;
+        }
+        ls->tokens = tokens;
+        ls->max_tokens = max;
+    }
+    memmove(ls->tokens + i + num_fresh, ls->tokens + j, (ls->num_tokens - j) * sizeof(hl_token));
+    memcpy(ls->tokens + i, fresh, num_fresh * sizeof(hl_token));
+    ls->num_tokens = count;
+
+    // Command position depends on the token before; classify the new
+    // tokens and any old ones after them that changed position
+    for (int k = i; k < ls->num_tokens; k++) {
+        hl_token *t = &ls->tokens[k];
+        const hl_token *prev = k > 0 ? &ls->tokens[k - 1] : NULL;
+        int command = !prev || prev->kind == HL_OPERATOR || (prev->kind == HL_KEYWORD && prev->opens);
+        if (k >= i + num_fresh && t->command == command) break;
+        t->command = command;
+        hl_classify(ls, t, 0);
+        // Until the idle check, a word being typed keeps its color
+        // rather than flickering back to plain on every key
+        if (t->pending && k == i && t->start == old_start) t->color = old_color;
+    }
+
+    if (num_fresh > 0 && ls->tokens[i].start < pos &&
+        (ls->tokens[i].start != old_start || hl_attr(ls, &ls->tokens[i]) != old_attr)) {
+        dirty = ls->tokens[i].start;
+    }
+
+    QueryPerformanceCounter(&t1);
+    hl_edit_ticks += t1.QuadPart - t0.QuadPart;
+    if ((unsigned long long)(t1.QuadPart - t0.QuadPart) > hl_edit_max_ticks) {
+        hl_edit_max_ticks = t1.QuadPart - t0.QuadPart;
+    }
+    hl_edit_count++;
+    lsh_metric_stop(LSH_H_HIGHLIGHT, (unsigned long long)t0.QuadPart);
+    return dirty;
+}
+
+// Settle pending tokens, doing their disk checks in one go. Returns the
+// first offset whose color changed, or -1.
+static int hl_resolve(line_state *ls) {
+    LARGE_INTEGER t0, t1;
+    int first = -1;
+
+    if (!lsh_highlight) return -1;
+    QueryPerformanceCounter(&t0);
+    for (int k = 0; k < ls->num_tokens; k++) {
+        hl_token *t = &ls->tokens[k];
+        if (!t->pending) continue;
+        WORD before = hl_attr(ls, t);
+        hl_classify(ls, t, 1);
+        if (hl_attr(ls, t) != before && first < 0) first = t->start;
+    }
+    QueryPerformanceCounter(&t1);
+    hl_idle_ticks += t1.QuadPart - t0.QuadPart;
+    hl_idle_count++;
+    return first;
+}
+
+// The command table arrived or PATH changed: reclassify every command
+static int hl_reclassify_commands(line_state *ls) {
+    int first = -1;
+    for (int k = 0; k < ls->num_tokens; k++) {
+        hl_token *t = &ls->tokens[k];
+        if (!t->command) continue;
+        WORD before = hl_attr(ls, t);
+        hl_classify(ls, t, 0);
+        if (hl_attr(ls, t) != before && first < 0) first = t->start;
+    }
+    return first;
+}
+
+// Files came or went: forget what the path cache knew and leave the tokens
+// that depend on it pending, in their old colors until checked again.
+// Returns the first offset whose color changed, or -1.
+static int hl_recheck_paths(line_state *ls) {
+    int first = -1;
+    memset(hl_paths, 0, sizeof(hl_paths));
+    for (int k = 0; k < ls->num_tokens; k++) {
+        hl_token *t = &ls->tokens[k];
+        WORD before = hl_attr(ls, t), color = t->color;
+        hl_classify(ls, t, 0);
+        if (t->pending) t->color = color;
+        if (hl_attr(ls, t) != before && first < 0) first = t->start;
+    }
+    return first;
+}
+
+// Whether any token still waits for a disk check
+static int hl_pending(const line_state *ls) {
+    for (int k = 0; k < ls->num_tokens; k++) {
+        if (ls->tokens[k].pending) return 1;
+    }
+    return 0;
+}
+
+// Write the text in [from, to) in its token colors. The console is left
+// in the default attributes.
+static void line_write_text(line_state *ls, int from, int to) {
+    const line_buf *lb = &ls->lb;
+    WORD current = ls->attributes;
+    int k = hl_find(ls, from + 1);
+
+    while (from < to) {
+        int stop = to;
+        WORD attr = ls->attributes;
+
+        while (k < ls->num_tokens && ls->tokens[k].end <= from) k++;
+        if (k < ls->num_tokens) {
+            const hl_token *t = &ls->tokens[k];
+            if (t->start <= from) {
+                attr = hl_attr(ls, t);
+                if (t->end < stop) stop = t->end;
+            } else if (t->start < stop) {
+                stop = t->start;
+            }
+        }
+        if (from < lb->gap_start && stop > lb->gap_start) stop = lb->gap_start;
+
+        if (attr != current) {
+            term->set_attr(term, attr);
+            current = attr;
+        }
+        const char *p = from < lb->gap_start ? lb->data + from : lb->data + from + lb->gap_end - lb->gap_start;
+        term->write(term, p, stop - from);
+        from = stop;
+    }
+    if (current != ls->attributes) term->set_attr(term, ls->attributes);
+}
+
+static COORD line_coord(const line_state *ls, int cell) {
+    COORD pos;
+    int x = ls->origin.X + cell;
+    pos.X = (SHORT)(x % ls->width);
+    pos.Y = (SHORT)(ls->origin.Y + x / ls->width);
+    return pos;
+}
+
+// Output that ran past the bottom of the screen buffer scrolled it, move
+// the origin along using where the cursor actually ended up
+static void line_reanchor(line_state *ls, int cell) {
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    if (term->get_info(term, &info)) {
+        ls->origin.Y += info.dwCursorPosition.Y - line_coord(ls, cell).Y;
+    }
+}
+
+// Redraw from offset `from` to the end: text, overlay, the text after the
+// cursor and the indicator, then blank whatever the previous drawing left
+// beyond that. With an overlay showing, redrawing starts at the cursor at
+// the latest.
+static void line_render(line_state *ls, int from) {
+    unsigned long long start = lsh_metric_start();
+    line_buf *lb = &ls->lb;
+    int cursor = lb->gap_start;
+    int tail = lb_tail(lb);
+    int ind_len = strlen(ls->indicator);
+    int end = cursor + ls->overlay_len + tail + ind_len;
+
+    if (from > cursor && (ls->overlay_len || ind_len)) from = cursor;
+    if (from > cursor + tail) from = cursor + tail;
+
+    // Hide the cursor while a long stretch is rewritten, to avoid flicker
+    int hide = end - from > ls->width;
+    BOOL originalCursorVisible = hide ? term->show_cursor(term, FALSE) : TRUE;
+
+    term->set_cursor(term, line_coord(ls, from));
+    if (cursor > from) {
+        line_write_text(ls, from, cursor);
+    }
+    if (ls->overlay_len) {
+        term->set_attr(term, FOREGROUND_INTENSITY);
+        term->write(term, ls->overlay, ls->overlay_len);
+        term->set_attr(term, ls->attributes);
+    }
+    if (tail) {
+        line_write_text(ls, from > cursor ? from : cursor, cursor + tail);
+    }
+    if (ind_len) {
+        term->set_attr(term, FOREGROUND_INTENSITY);
+        term->write(term, ls->indicator, ind_len);
+        term->set_attr(term, ls->attributes);
+    }
+    if (end > from) {
+        line_reanchor(ls, end);
+    }
+    if (end < ls->drawn) {
+        term->fill(term, line_coord(ls, end), ls->drawn - end, ls->attributes);
+    }
+    ls->drawn = end;
+    term->set_cursor(term, line_coord(ls, cursor + (ls->cursor_after_overlay ? ls->overlay_len : 0)));
+    if (hide) term->show_cursor(term, originalCursorVisible);
+    if (end > from) lsh_metric_count(LSH_M_RENDER_BYTES, end - from);
+    lsh_metric_stop(LSH_H_RENDER, start);
+}
+
+static void line_set_overlay(line_state *ls, const char *text, int len, int cursor_after, const char *indicator) {
+    free(ls->overlay);
+    ls->overlay = NULL;
+    ls->overlay_len = 0;
+    if (len > 0) {
+        ls->overlay = malloc(len);
+        if (ls->overlay) {
+            memcpy(ls->overlay, text, len);
+            ls->overlay_len = len;
+        }
+    }
+    ls->cursor_after_overlay = cursor_after;
+    snprintf(ls->indicator, sizeof(ls->indicator), "%s", indicator ? indicator : "");
+    line_render(ls, ls->lb.gap_start);
+}
+
+static void line_clear_overlay(line_state *ls) {
+    if (ls->overlay_len || ls->indicator[0]) {
+        line_set_overlay(ls, NULL, 0, 0, NULL);
+    }
+}
+
+static void line_end_tab(line_state *ls) {
+    if (ls->tab_matches) {
+        completion_close(ls->tab_matches);
+        ls->tab_matches = NULL;
+        ls->tab_index = 0;
+        ls->tab_prefix[0] = '\0';
+        line_clear_overlay(ls);
+    }
+}
+
+// Record an edit for undo. Runs of typed characters, and of deletions in
+// one direction, are merged so undo works a word or burst at a time.
+static void line_record(line_state *ls, int pos, const char *text, int n, int inserted) {
+    line_edit *last = ls->num_edits ? &ls->edits[ls->num_edits - 1] : NULL;
+    int merge = ls->merge && last && last->inserted == inserted;
+
+    if (merge && inserted && last->pos + last->len == pos && !(n == 1 && text[0] == ' ')) {
+        char *grown = realloc(last->text, last->len + n);
+        if (grown) {
+            memcpy(grown + last->len, text, n);
+            last->text = grown;
+            last->len += n;
+            return;
+        }
+    } else if (merge && !inserted && (last->pos == pos + n || last->pos == pos)) {
+        char *grown = realloc(last->text, last->len + n);
+        if (grown) {
+            if (last->pos == pos + n) {
+                // Backspace: the new text goes in front
+                memmove(grown + n, grown, last->len);
+                memcpy(grown, text, n);
+                last->pos = pos;
+            } else {
+                memcpy(grown + last->len, text, n);
+            }
+            last->text = grown;
+            last->len += n;
+            return;
+        }
+    }
+
+    if (ls->num_edits == ls->max_edits) {
+        int max = ls->max_edits ? ls->max_edits * 2 : 16;
+        line_edit *edits = realloc(ls->edits, max * sizeof(line_edit));
+        if (!edits) return;
+        ls->edits = edits;
+        ls->max_edits = max;
+    }
+    line_edit *e = &ls->edits[ls->num_edits];
+    e->text = malloc(n);
+    if (!e->text) return;
+    memcpy(e->text, text, n);
+    e->pos = pos;
+    e->len = n;
+    e->inserted = inserted;
+    ls->num_edits++;
+}
+
+static void line_insert(line_state *ls, const char *s, int n) {
+    int pos = ls->lb.gap_start;
+    if (n <= 0) return;
+
+    line_record(ls, pos, s, n, 1);
+    ls->merge = 1;
+    lb_insert(&ls->lb, s, n);
+    int dirty = hl_edit(ls, pos, 0, n);
+    if (lb_tail(&ls->lb) == 0 && ls->overlay_len == 0 && !ls->indicator[0] && ls->drawn == pos && dirty == pos) {
+        // Appending at the end of the line without recoloring: just echo
+        line_write_text(ls, pos, pos + n);
+        ls->drawn += n;
+        if ((ls->origin.X + pos) / ls->width != (ls->origin.X + ls->drawn) / ls->width) {
+            line_reanchor(ls, ls->drawn);
+        }
+    } else {
+        line_render(ls, dirty);
+    }
+}
+
+// Delete n bytes before (back) or after the cursor
+static void line_delete(line_state *ls, int n, int back) {
+    line_buf *lb = &ls->lb;
+
+    if (back) {
+        if (n > lb->gap_start) n = lb->gap_start;
+        if (n <= 0) return;
+        line_record(ls, lb->gap_start - n, lb->data + lb->gap_start - n, n, 0);
+        lb->gap_start -= n;
+    } else {
+        if (n > lb_tail(lb)) n = lb_tail(lb);
+        if (n <= 0) return;
+        line_record(ls, lb->gap_start, lb->data + lb->gap_end, n, 0);
+        lb->gap_end += n;
+    }
+    ls->merge = 1;
+    line_render(ls, hl_edit(ls, lb->gap_start, n, 0));
+}
+
+static void line_move(line_state *ls, int pos) {
+    int len = lb_len(&ls->lb);
+    if (pos < 0) pos = 0;
+    if (pos > len) pos = len;
+    lb_move(&ls->lb, pos);
+    ls->merge = 0;
+    term->set_cursor(term, line_coord(ls, pos));
+}
+
+// Start of the word before the cursor / end of the word after it, where
+// words are separated by spaces
+static int line_word_left(const line_state *ls) {
+    int pos = ls->lb.gap_start;
+    while (pos > 0 && lb_at(&ls->lb, pos - 1) == ' ') pos--;
+    while (pos > 0 && lb_at(&ls->lb, pos - 1) != ' ') pos--;
+    return pos;
+}
+
+static int line_word_right(const line_state *ls) {
+    int pos = ls->lb.gap_start, len = lb_len(&ls->lb);
+    while (pos < len && lb_at(&ls->lb, pos) == ' ') pos++;
+    while (pos < len && lb_at(&ls->lb, pos) != ' ') pos++;
+    return pos;
+}
+
+// Cut [from, to) into the kill buffer
+static void line_kill(line_state *ls, int from, int to) {
+    if (to <= from) return;
+    char *text = malloc(to - from);
+    if (!text) return;
+    lb_copy(&ls->lb, from, to, text);
+    free(kill_buffer);
+    kill_buffer = text;
+    kill_len = to - from;
+
+    lb_move(&ls->lb, to);
+    ls->merge = 0;
+    line_delete(ls, to - from, 1);
+    ls->merge = 0;
+}
+
+static void line_undo(line_state *ls) {
+    if (ls->num_edits == 0) return;
+    line_edit *e = &ls->edits[--ls->num_edits];
+
+    int dirty;
+    if (e->inserted) {
+        lb_move(&ls->lb, e->pos + e->len);
+        ls->lb.gap_start -= e->len;
+        dirty = hl_edit(ls, e->pos, e->len, 0);
+    } else {
+        lb_move(&ls->lb, e->pos);
+        lb_insert(&ls->lb, e->text, e->len);
+        dirty = hl_edit(ls, e->pos, 0, e->len);
+    }
+    ls->merge = 0;
+    line_render(ls, dirty);
+    free(e->text);
+}
+
+// Complete the word before the cursor and show the rest of the match in
+// gray. Only done at the end of the line.
+static void line_suggest(line_state *ls) {
+    line_buf *lb = &ls->lb;
+    int position = lb->gap_start;
+
+    if (lb_tail(lb) != 0 || position == 0) return;
+    lb->data[position] = '\0';  // the spare gap byte
+    suggestion_scans++;
+    char *suggestion = find_best_match(lb->data);
+    if (!suggestion) return;
+
+    // Calculate the start of the current word
+    int word_start = position - 1;
+    while (word_start >= 0 && lb->data[word_start] != ' ' && lb->data[word_start] != '\\') {
+        word_start--;
+    }
+    word_start++; // Move past the space or backslash
+
+    // Extract just the last word from the suggested path
+    char *lastWord = strrchr(suggestion, ' ');
+    if (lastWord) {
+        lastWord++; // Move past the space
+    } else {
+        lastWord = suggestion;
+    }
+
+    // Only display the suggestion if it starts with what we're typing
+    int typedLen = position - word_start;
+    if ((int)strlen(lastWord) >= typedLen && strncmp(lastWord, lb->data + word_start, typedLen) == 0) {
+        line_set_overlay(ls, lastWord + typedLen, strlen(lastWord + typedLen), 0, NULL);
+    }
+    free(suggestion);
+}
+
+// Insert the overlay into the line for real
+static void line_accept_overlay(line_state *ls) {
+    char *text = ls->overlay;
+    int len = ls->overlay_len;
+
+    ls->overlay = NULL;
+    ls->overlay_len = 0;
+    ls->indicator[0] = '\0';
+    ls->cursor_after_overlay = 0;
+    ls->merge = 0;
+    line_insert(ls, text, len);
+    ls->merge = 0;
+    free(text);
+}
+
+// Show match number tab_index after the word being completed
+static void line_show_tab_match(line_state *ls) {
+    const char *match = completion_get(ls->tab_matches, ls->tab_index);
+    int typed = ls->lb.gap_start - ls->tab_word_start;
+    int total = ls->tab_matches->total;
+    char indicator[32] = "";
+
+    // A negative count is still being worked out
+    if (total < 0) {
+        snprintf(indicator, sizeof(indicator), " (%d/...)", ls->tab_index + 1);
+    } else if (total > 1) {
+        snprintf(indicator, sizeof(indicator), " (%d/%d)", ls->tab_index + 1, total);
+    }
+    if (!match || (int)strlen(match) < typed) match = "";
+    line_set_overlay(ls, match + (*match ? typed : 0), *match ? strlen(match) - typed : 0, 1, indicator);
+}
+
+// Replace the word being completed with the current match
+static void line_accept_tab(line_state *ls) {
+    const char *match = completion_get(ls->tab_matches, ls->tab_index);
+    char *copy = match ? _strdup(match) : NULL;
+
+    line_end_tab(ls);
+    if (copy) {
+        ls->merge = 0;
+        line_delete(ls, ls->lb.gap_start - ls->tab_word_start, 1);
+        ls->merge = 0;
+        line_insert(ls, copy, strlen(copy));
+        ls->merge = 0;
+        free(copy);
+    }
+}
+
+static void line_tab(line_state *ls) {
+    line_buf *lb = &ls->lb;
+    int position = lb->gap_start;
+
+    // Find the start of the current word
+    int word_start = position;
+    while (word_start > 0 && lb->data[word_start - 1] != ' ' && lb->data[word_start - 1] != '\\') {
+        word_start--;
+    }
+    if (position - word_start >= (int)sizeof(ls->tab_prefix)) return;
+
+    char partial_path[1024];
+    memcpy(partial_path, lb->data + word_start, position - word_start);
+    partial_path[position - word_start] = '\0';
+
+    if (ls->tab_matches && strcmp(partial_path, ls->tab_prefix) == 0) {
+        // Same prefix, cycle to next match
+        ls->tab_index = completion_next(ls->tab_matches, ls->tab_index);
+    } else {
+        // New prefix, open a cursor over the matches. Only the first page
+        // is read now, the total is counted in the background.
+        line_end_tab(ls);
+        line_clear_overlay(ls);
+        ls->tab_matches = find_matches(partial_path, 1);
+        if (!ls->tab_matches || !completion_get(ls->tab_matches, 0)) {
+            completion_close(ls->tab_matches);
+            ls->tab_matches = NULL;
+            return;
+        }
+        strcpy(ls->tab_prefix, partial_path);
+        ls->tab_word_start = word_start;
+        ls->tab_index = 0;
+    }
+    line_show_tab_match(ls);
+}
+
+// What lsh_read_line waits for besides keys, for the event loop callbacks
+typedef struct line_wait {
+    line_state *ls;
+    int suggestion_due;     // work out the suggestion once input is idle
+    int resolve_due;        // and the highlighter's disk checks
+    lsh_ev_timer *idle;
+} line_wait;
+
+static void line_idle(void *data, HANDLE h) {
+    line_wait *w = (line_wait*)data;
+    w->idle = NULL;
+    if (w->resolve_due) {
+        int first = hl_resolve(w->ls);
+        if (first >= 0) line_render(w->ls, first);
+        w->resolve_due = 0;
+    }
+    if (w->suggestion_due) line_suggest(w->ls);
+    w->suggestion_due = 0;
+}
+
+// Do the idle work once input has been quiet for a moment
+static void line_wait_arm(line_wait *w) {
+    if (!w->idle && (w->suggestion_due || w->resolve_due)) {
+        w->idle = lsh_ev_after(LSH_SUGGEST_IDLE_MS, line_idle, w);
+    }
+}
+
+// The highlighter's command table is built
+static void line_table_ready(void *data, HANDLE h) {
+    line_wait *w = (line_wait*)data;
+    if (hl_table_poll()) {
+        int first = hl_reclassify_commands(w->ls);
+        if (first >= 0) line_render(w->ls, first);
+        w->resolve_due = hl_pending(w->ls);
+        line_wait_arm(w);
+    }
+}
+
+// The match count for the "(n/...)" indicator while tab cycling is in
+static void line_counted(void *data, HANDLE h) {
+    line_wait *w = (line_wait*)data;
+    completion_cursor *c = w->ls->tab_matches;
+    lsh_ev_remove(h);
+    if (c && c->hCounter == h) {
+        if (c->total >= 0) line_show_tab_match(w->ls);
+        // The thread stays signaled, stop waiting on it
+        CloseHandle(c->hCounter);
+        c->hCounter = NULL;
+    }
+}
+
+static void line_dir_changed(void *data, HANDLE h) {
+    line_wait *w = (line_wait*)data;
+    FindNextChangeNotification(h);
+    int first = hl_recheck_paths(w->ls);
+    if (first >= 0) line_render(w->ls, first);
+    w->resolve_due = !input_in_paste && hl_pending(w->ls);
+    line_wait_arm(w);
+}
+
+// Editing keys:
+//   Left/Right, Ctrl-B/Ctrl-F      move a character
+//   Ctrl-Left/Ctrl-Right           move a word
+//   Home/End, Ctrl-A/Ctrl-E        start/end of line (Right/End at the end accept a suggestion)
+//   Backspace, Delete/Ctrl-D       delete a character
+//   Ctrl-W, Ctrl-U, Ctrl-K         cut the word before, everything before, everything after
+//   Ctrl-Y                         paste the last cut
+//   Ctrl-Z, Ctrl-_                 undo
+//   Tab                            complete and cycle; Enter accepts a completion, a second Enter runs
+char *lsh_read_line(void) {
+    line_state ls;
+    CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
+    int ready_to_execute = 0;   // a completion was just accepted, the next Enter runs the line
+    int c;
+
+    memset(&ls, 0, sizeof(ls));
+    lb_init(&ls.lb, LSH_RL_BUFSIZE);
+    term->get_info(term, &consoleInfo);
+    ls.attributes = consoleInfo.wAttributes;
+    ls.origin = consoleInfo.dwCursorPosition;
+    ls.width = consoleInfo.dwSize.X > 0 ? consoleInfo.dwSize.X : 80;
+    hl_paths_check_cwd();
+    hl_table_refresh();
+
+    line_wait lw = { &ls, 0, 0, NULL };
+    if (hl_table_thread) lsh_ev_add(hl_table_thread, line_table_ready, &lw, LSH_EV_PROMPT);
+    if (hl_cwd_watch) lsh_ev_add(hl_cwd_watch, line_dir_changed, &lw, LSH_EV_PROMPT);
+
+    while (1) {
+        // The suggestion is only worked out once input goes idle, so a paste
+        // or a burst of type-ahead costs one directory scan instead of one
+        // per character. The same goes for the highlighter's disk checks.
+        int suggestion_due = !ls.tab_matches && !ready_to_execute && !input_in_paste && !ls.overlay_len;
+        int resolve_due = !input_in_paste && hl_pending(&ls);
+
+        if (input_head == input_tail) {
+            if (!term->live) {
+                // Scripted input has no idle time, the queue running dry stands in
+                if (hl_table_poll()) {
+                    int first = hl_reclassify_commands(&ls);
+                    if (first >= 0) line_render(&ls, first);
+                    resolve_due = !input_in_paste && hl_pending(&ls);
+                }
+                if (resolve_due) {
+                    int first = hl_resolve(&ls);
+                    if (first >= 0) line_render(&ls, first);
+                }
+                if (suggestion_due) line_suggest(&ls);
+                suggestion_due = resolve_due = 0;
+            }
+
+            // Wait for a key. Meanwhile the event loop repaints the prompt's
+            // git segment, fills in the match count for the "(n/...)"
+            // indicator while tab cycling, takes over the highlighter's
+            // command table, notices files coming and going in cwd, and
+            // does the idle work once typing pauses
+            if (term->live) {
+                lw.suggestion_due = suggestion_due;
+                lw.resolve_due = resolve_due;
+                line_wait_arm(&lw);
+                if (ls.tab_matches && ls.tab_matches->total < 0 && ls.tab_matches->hCounter) {
+                    lsh_ev_add(ls.tab_matches->hCounter, line_counted, &lw, LSH_EV_PROMPT);
+                }
+                // Events that carry no key are skipped, as _getch would.
+                // Ctrl-C never reaches the input queue, only the handler.
+                while (!lsh_interrupted &&
+                       (!lsh_ev_run(GetStdHandle(STD_INPUT_HANDLE), LSH_EV_PROMPT, INFINITE) ||
+                        !console_key_ready()));
+                lsh_ev_cancel(lw.idle);
+                lw.idle = NULL;
+            }
+
+            if (!lsh_interrupted) input_fill(1);
+        }
+
+        c = lsh_interrupted ? 3 : input_next();  // Get character without echo
+
+        // Enter runs the line; Ctrl-C abandons it and the prompt starts over
+        if (c == KEY_ENTER || c == 3) {
+            int cancel = c == 3;
+            if (!cancel && !ready_to_execute && ls.tab_matches) {
+                // Accept the match being shown, but don't run yet
+                line_accept_tab(&ls);
+                ready_to_execute = 1;
+                continue;
+            }
+            if (!cancel && !ready_to_execute && ls.overlay_len && !ls.cursor_after_overlay) {
+                // Accept the inline suggestion, but don't run yet
+                line_accept_overlay(&ls);
+                ready_to_execute = 1;
+                continue;
+            }
+
+            line_end_tab(&ls);
+            line_clear_overlay(&ls);
+            int len = lb_len(&ls.lb);
+            term->set_cursor(term, line_coord(&ls, len));
+            term_puts(cancel ? "^C\n" : "\n");  // Echo newline
+
+            for (int i = 0; i < ls.num_edits; i++) {
+                free(ls.edits[i].text);
+            }
+            free(ls.edits);
+            free(ls.tokens);
+            lsh_ev_forget(&lw);
+            lb_move(&ls.lb, len);
+            ls.lb.data[cancel ? 0 : len] = '\0';
+            return ls.lb.data;
+        }
+
+        if (c == KEY_TAB) {
+            line_tab(&ls);
+            ready_to_execute = 0;
+            continue;
+        }
+
+        // Any other key ends tab cycling. Backspace does nothing else: it
+        // just takes back the completion being shown.
+        if (ls.tab_matches) {
+            line_end_tab(&ls);
+            if (c == KEY_BACKSPACE) {
+                ready_to_execute = 0;
+                continue;
+            }
+        }
+        ready_to_execute = 0;
+
+        int at_end = ls.lb.gap_start == lb_len(&ls.lb);
+        if (ls.overlay_len && at_end && (c == KEY_RIGHT || c == KEY_END || c == 6 || c == 5)) {
+            line_accept_overlay(&ls);
+            continue;
+        }
+        line_clear_overlay(&ls);
+
+        switch (c) {
+        case KEY_LEFT:
+        case 2:     // Ctrl-B
+            line_move(&ls, ls.lb.gap_start - 1);
+            break;
+        case KEY_RIGHT:
+        case 6:     // Ctrl-F
+            line_move(&ls, ls.lb.gap_start + 1);
+            break;
+        case KEY_CTRL_LEFT:
+            line_move(&ls, line_word_left(&ls));
+            break;
+        case KEY_CTRL_RIGHT:
+            line_move(&ls, line_word_right(&ls));
+            break;
+        case KEY_HOME:
+        case 1:     // Ctrl-A
+            line_move(&ls, 0);
+            break;
+        case KEY_END:
+        case 5:     // Ctrl-E
+            line_move(&ls, lb_len(&ls.lb));
+            break;
+        case KEY_BACKSPACE:
+            line_delete(&ls, 1, 1);
+            break;
+        case KEY_DELETE:
+        case 4:     // Ctrl-D
+            line_delete(&ls, 1, 0);
+            break;
+        case 23:    // Ctrl-W
+            line_kill(&ls, line_word_left(&ls), ls.lb.gap_start);
+            break;
+        case 21:    // Ctrl-U
+            line_kill(&ls, 0, ls.lb.gap_start);
+            break;
+        case 11:    // Ctrl-K
+            line_kill(&ls, ls.lb.gap_start, lb_len(&ls.lb));
+            break;
+        case 25:    // Ctrl-Y
+            ls.merge = 0;
+            line_insert(&ls, kill_buffer, kill_len);
+            ls.merge = 0;
+            break;
+        case 26:    // Ctrl-Z
+        case 31:    // Ctrl-_
+            line_undo(&ls);
+            break;
+        default:
+            if (isprint(c)) {
+                // Insert the rest of a paste or type-ahead burst along with it
+                char chunk[LSH_INPUT_QUEUE + 1];
+                chunk[0] = (char)c;
+                int n = 1 + input_take_printable(chunk + 1, LSH_INPUT_QUEUE);
+                line_insert(&ls, chunk, n);
+            }
+            break;
+        }
+    }
+}
+
+/*
+ * lsh --bench-keys [-n entries] [-r runs] [-H] [script]
+ *
+ * Replays a keystroke script through lsh_read_line on the in-memory
+ * terminal, inside a scratch directory of `entries` files and folders, and
+ * reports the time from each read being handed to the editor until it asks
+ * for more input (i.e. the keys are fully rendered), plus the output each
+ * key produced. In the script a newline is Enter and \t, \b, \n, \e, \\
+ * and \xHH are escapes, so "cd fi\t\t\n\n" types, cycles twice and accepts.
+ * \x1b[200~ ... \x1b[201~ is a bracketed paste and arrives in one read.
+ * The highlighter's share of the cost is reported separately; -H turns it
+ * off for comparison.
+ *
+ * lsh --bench-paste [-n entries] [max-length] pastes command lines of
+ * growing length, bracketed and as unbracketed keystrokes, and reports the
+ * time and suggestion scans each one costs.
+ */
+
+enum { KB_TYPE, KB_TAB, KB_BACKSPACE, KB_ENTER, KB_PASTE, KB_OTHER, KB_KINDS };
+static const char *keybench_kind_names[KB_KINDS] = { "typing", "tab", "backspace", "enter", "paste", "other" };
+
+typedef struct key_sample {
+    unsigned long long ns;
+    unsigned long long bytes;
+    unsigned long long keys;    // keys in the read, more than one for a paste
+    int kind;
+} key_sample;
+
+typedef struct keybench {
+    key_sample *samples;
+    size_t count, cap;
+    int pending;                // a read has been delivered and not yet timed
+    int pending_kind;
+    int pending_keys;
+    LARGE_INTEGER delivered;
+    unsigned long long bytes_at_delivery;
+    LARGE_INTEGER freq;
+} keybench;
+
+static const char keybench_default_script[] =
+    "cd fil\t\t\t\b\n"
+    "cat file_001\t\n\n"
+    "ls di\t\t\t\t\n\n"
+    "echo hello world\n"
+    "type file_00\b\b\b\bdir_0\t\n\n";
+
+static int keybench_kind(int key) {
+    if (key == KEY_TAB) return KB_TAB;
+    if (key == KEY_BACKSPACE) return KB_BACKSPACE;
+    if (key == KEY_ENTER) return KB_ENTER;
+    if (isprint(key)) return KB_TYPE;
+    return KB_OTHER;
+}
+
+static void keybench_finish_key(mem_term *m) {
+    keybench *kb = (keybench*)m->ctx;
+    LARGE_INTEGER now;
+
+    if (!kb->pending) return;
+    QueryPerformanceCounter(&now);
+    if (kb->count == kb->cap) {
+        kb->cap = kb->cap ? kb->cap * 2 : 1024;
+        kb->samples = realloc(kb->samples, kb->cap * sizeof(key_sample));
+        if (!kb->samples) {
+            fprintf(stderr, "lsh: allocation error\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    key_sample *sample = &kb->samples[kb->count++];
+    sample->ns = (unsigned long long)(now.QuadPart - kb->delivered.QuadPart) * 1000000000ULL / kb->freq.QuadPart;
+    sample->bytes = m->bytes - kb->bytes_at_delivery;
+    sample->keys = kb->pending_keys;
+    sample->kind = kb->pending_kind;
+    kb->pending = 0;
+}
+
+static void keybench_on_read(mem_term *m, const unsigned char *buf, int n) {
+    keybench *kb = (keybench*)m->ctx;
+
+    keybench_finish_key(m);
+    if (m->exhausted) return;   // filler Enter past the end of the script
+    kb->pending = 1;
+    kb->pending_kind = n > 1 ? KB_PASTE : keybench_kind(buf[0]);
+    kb->pending_keys = n;
+    kb->bytes_at_delivery = m->bytes;
+    QueryPerformanceCounter(&kb->delivered);
+}
+
+// Decode the escapes described above
+static size_t keybench_parse_script(const char *text, size_t len, unsigned char *keys) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        char ch = text[i];
+        if (ch == '\r') continue;
+        if (ch == '\n') {
+            keys[n++] = KEY_ENTER;
+        } else if (ch == '\\' && i + 1 < len) {
+            char e = text[++i];
+            if (e == 't') keys[n++] = KEY_TAB;
+            else if (e == 'b') keys[n++] = KEY_BACKSPACE;
+            else if (e == 'n') keys[n++] = KEY_ENTER;
+            else if (e == 'e') keys[n++] = KEY_ESC;
+            else if (e == 'x' && i + 2 < len && isxdigit((unsigned char)text[i + 1]) && isxdigit((unsigned char)text[i + 2])) {
+                char hex[3] = { text[i + 1], text[i + 2], '\0' };
+                keys[n++] = (unsigned char)strtol(hex, NULL, 16);
+                i += 2;
+            } else keys[n++] = (unsigned char)e;
+        } else {
+            keys[n++] = (unsigned char)ch;
+        }
+    }
+    return n;
+}
+
+static int key_sample_cmp(const void *a, const void *b) {
+    unsigned long long x = ((const key_sample*)a)->ns, y = ((const key_sample*)b)->ns;
+    return x < y ? -1 : x > y;
+}
+
+static void keybench_report_row(const char *name, key_sample *s, size_t n) {
+    unsigned long long bytes = 0, max_bytes = 0, keys = 0;
+    if (n == 0) return;
+    qsort(s, n, sizeof(key_sample), key_sample_cmp);
+    for (size_t i = 0; i < n; i++) {
+        bytes += s[i].bytes;
+        keys += s[i].keys;
+        if (s[i].bytes > max_bytes) max_bytes = s[i].bytes;
+    }
+    printf("%-10s %8llu %10.1f %10.1f %10.1f %10.1f %8llu\n", name, (unsigned long long)n,
+           s[n / 2].ns / 1000.0, s[(n * 99) / 100].ns / 1000.0, s[n - 1].ns / 1000.0,
+           keys ? (double)bytes / keys : 0.0, max_bytes);
+}
+
+// Create a scratch directory of `entries` files and folders under %TEMP%
+// and make it the current directory
+static int keybench_make_dir(char *dir, size_t size, int entries) {
+    char path[MAX_PATH];
+    GetTempPath((DWORD)size, dir);
+    snprintf(dir + strlen(dir), size - strlen(dir), "lsh_keybench_%lu", (unsigned long)GetCurrentProcessId());
+    if (!CreateDirectory(dir, NULL)) return 0;
+    for (int i = 0; i < entries; i++) {
+        // One folder for every nine files
+        if (i % 10 == 0) {
+            snprintf(path, sizeof(path), "%s\\dir_%05d", dir, i / 10);
+            CreateDirectory(path, NULL);
+        } else {
+            snprintf(path, sizeof(path), "%s\\file_%05d.txt", dir, i);
+            HANDLE h = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (h != INVALID_HANDLE_VALUE) CloseHandle(h);
+        }
+    }
+    return _chdir(dir) == 0;
+}
+
+static void keybench_remove_dir(const char *dir, int entries) {
+    char path[MAX_PATH];
+    for (int i = 0; i < entries; i++) {
+        if (i % 10 == 0) {
+            snprintf(path, sizeof(path), "%s\\dir_%05d", dir, i / 10);
+            RemoveDirectory(path);
+        } else {
+            snprintf(path, sizeof(path), "%s\\file_%05d.txt", dir, i);
+            DeleteFile(path);
+        }
+    }
+    RemoveDirectory(dir);
+}
+
+int lsh_bench_keys(int argc, char **argv) {
+    int entries = 1000, runs = 20;
+    const char *script_path = NULL;
+    char *text = NULL;
+    size_t text_len;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            entries = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-H") == 0) {
+            lsh_highlight = 0;
+        } else {
+            script_path = argv[i];
+        }
+    }
+    if (entries < 0) entries = 0;
+    if (runs < 1) runs = 1;
+
+    if (script_path) {
+        FILE *f = fopen(script_path, "rb");
+        if (!f) {
+            fprintf(stderr, "lsh: --bench-keys: cannot open '%s': ", script_path);
+            perror("");
+            return EXIT_FAILURE;
+        }
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        text = malloc(size > 0 ? size : 1);
+        text_len = text ? fread(text, 1, size, f) : 0;
+        fclose(f);
+    } else {
+        text = _strdup(keybench_default_script);
+        text_len = strlen(keybench_default_script);
+    }
+    unsigned char *keys = malloc(text_len + 1);
+    if (!text || !keys) {
+        fprintf(stderr, "lsh: allocation error\n");
+        return EXIT_FAILURE;
+    }
+    size_t num_keys = keybench_parse_script(text, text_len, keys);
+    free(text);
+
+    char old_cwd[1024], dir[MAX_PATH];
+    _getcwd(old_cwd, sizeof(old_cwd));
+    if (!keybench_make_dir(dir, sizeof(dir), entries)) {
+        fprintf(stderr, "lsh: --bench-keys: cannot create '%s'\n", dir);
+        free(keys);
+        return EXIT_FAILURE;
+    }
+
+    // Have the command table ready so every run sees the same colors
+    hl_table_refresh();
+    if (hl_table_thread) WaitForSingleObject(hl_table_thread, INFINITE);
+    hl_table_poll();
+
+    keybench kb;
+    mem_term *m = malloc(sizeof(mem_term));
+    memset(&kb, 0, sizeof(kb));
+    QueryPerformanceFrequency(&kb.freq);
+    unsigned long long start = lsh_now_us();
+
+    for (int run = 0; run < runs; run++) {
+        mem_term_init(m, keys, num_keys);
+        m->on_read = keybench_on_read;
+        m->ctx = &kb;
+        term = &m->base;
+        while (m->next_key < m->num_keys && !m->exhausted) {
+            char *line = lsh_read_line();
+            keybench_finish_key(m);    // the Enter that returned the line
+            free(line);
+        }
+    }
+    unsigned long long elapsed = lsh_now_us() - start;
+    term = &lsh_console_term;
+
+    _chdir(old_cwd);
+    keybench_remove_dir(dir, entries);
+
+    printf("%llu keystrokes, %d runs of %llu keys, %d directory entries, %.1f ms total\n\n",
+           (unsigned long long)kb.count, runs, (unsigned long long)num_keys, entries, elapsed / 1000.0);
+    printf("%-10s %8s %10s %10s %10s %10s %8s\n", "read", "count", "p50 us", "p99 us", "max us", "bytes/key", "max B");
+
+    key_sample *bucket = malloc((kb.count ? kb.count : 1) * sizeof(key_sample));
+    for (int kind = 0; kind < KB_KINDS; kind++) {
+        size_t n = 0;
+        for (size_t i = 0; i < kb.count; i++) {
+            if (kb.samples[i].kind == kind) bucket[n++] = kb.samples[i];
+        }
+        keybench_report_row(keybench_kind_names[kind], bucket, n);
+    }
+    keybench_report_row("all", kb.samples, kb.count);
+
+    if (lsh_highlight && hl_edit_count) {
+        printf("\nhighlighter: %llu edits, %.2f us avg, %.1f us max; %llu idle batches, %.1f us avg, %llu path checks\n",
+               hl_edit_count, hl_edit_ticks * 1e6 / kb.freq.QuadPart / hl_edit_count,
+               hl_edit_max_ticks * 1e6 / kb.freq.QuadPart,
+               hl_idle_count, hl_idle_count ? hl_idle_ticks * 1e6 / kb.freq.QuadPart / hl_idle_count : 0.0,
+               hl_stat_count);
+    }
+
+    free(bucket);
+    free(kb.samples);
+    free(m);
+    free(keys);
+    return EXIT_SUCCESS;
+}
+
+// Replay one line through the editor on the in-memory terminal
+static unsigned long long keybench_replay_line(const unsigned char *keys, size_t num_keys,
+                                               unsigned long long *bytes, unsigned long *scans) {
+    mem_term *m = malloc(sizeof(mem_term));
+    unsigned long scans_before = suggestion_scans;
+    if (!m) {
+        fprintf(stderr, "lsh: allocation error\n");
+        exit(EXIT_FAILURE);
+    }
+    mem_term_init(m, keys, num_keys);
+    term = &m->base;
+    unsigned long long start = lsh_now_us();
+    char *line = lsh_read_line();
+    unsigned long long elapsed = lsh_now_us() - start;
+    term = &lsh_console_term;
+    *bytes = m->bytes;
+    *scans = suggestion_scans - scans_before;
+    free(line);
+    free(m);
+    return elapsed;
+}
+
+int lsh_bench_paste(int argc, char **argv) {
+    int entries = 1000, max_len = 16384;
+
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            entries = atoi(argv[++i]);
+        } else {
+            max_len = atoi(argv[i]);
+        }
+    }
+    if (entries < 0) entries = 0;
+    if (max_len < 64) max_len = 64;
+
+    unsigned char *keys = malloc(max_len + 64);
+    char old_cwd[1024], dir[MAX_PATH];
+    if (!keys) {
+        fprintf(stderr, "lsh: allocation error\n");
+        return EXIT_FAILURE;
+    }
+    _getcwd(old_cwd, sizeof(old_cwd));
+    if (!keybench_make_dir(dir, sizeof(dir), entries)) {
+        fprintf(stderr, "lsh: --bench-paste: cannot create '%s'\n", dir);
+        free(keys);
+        return EXIT_FAILURE;
+    }
+
+    printf("%8s %14s %8s %10s %14s %8s %10s\n", "length", "bracketed ms", "scans", "bytes",
+           "typed ms", "scans", "bytes");
+    for (int len = 64; len <= max_len; len *= 4) {
+        // "echo file_00001.txt file_00002.txt ..." cut to len characters
+        unsigned char *text = keys + 6;
+        int n = snprintf((char*)text, len + 1, "echo ");
+        for (int i = 1; n < len; i++) {
+            n += snprintf((char*)text + n, len + 1 - n, "file_%05d.txt ", i % (entries > 0 ? entries : 1));
+        }
+        n = len;
+
+        // Best of three for each way of delivering the same line
+        unsigned long long best_paste = ~0ULL, best_typed = ~0ULL, paste_bytes, typed_bytes;
+        unsigned long paste_scans, typed_scans;
+        for (int round = 0; round < 3; round++) {
+            memcpy(keys, "\x1b[200~", 6);
+            memcpy(text + n, "\x1b[201~\r", 7);
+            unsigned long long t = keybench_replay_line(keys, n + 13, &paste_bytes, &paste_scans);
+            if (t < best_paste) best_paste = t;
+
+            text[n] = KEY_ENTER;
+            t = keybench_replay_line(text, n + 1, &typed_bytes, &typed_scans);
+            if (t < best_typed) best_typed = t;
+        }
+        printf("%8d %14.3f %8lu %10llu %14.3f %8lu %10llu\n", len,
+               best_paste / 1000.0, paste_scans, paste_bytes,
+               best_typed / 1000.0, typed_scans, typed_bytes);
+    }
+
+    _chdir(old_cwd);
+    keybench_remove_dir(dir, entries);
+    free(keys);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * lsh --bench-dispatch [-n iterations]
+ *
+ * Runs lines of builtins that do nothing, through the parser every time
+ * and through the parse cache, and reports the cost per line and per
+ * command: what the shell itself spends getting from a line to a builtin.
+ */
+
+static const char *dispatch_bench_lines[] = {
+  "true",
+  "true one two 'three four' \"five\" six",
+  "true && false || true; true",
+  "{ true; true; } && true",
+  "f a b",
+  "t x",
+};
+
+int lsh_bench_dispatch(int argc, char **argv) {
+  int iterations = 100000;
+
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    }
+  }
+  if (iterations < 1) iterations = 1;
+
+  lsh_run_line("f() { true \"$1\" $2; true; }");
+  lsh_run_line("alias t='true a b'");
+
+  printf("%d runs of each line; the function f runs 2 commands, the alias t 1\n\n", iterations);
+  printf("%-40s %5s %12s %12s %12s %8s\n", "line", "cmds", "uncached ns", "cached ns", "ns/cmd", "AST B");
+  for (size_t l = 0; l < sizeof(dispatch_bench_lines) / sizeof(dispatch_bench_lines[0]); l++) {
+    const char *line = dispatch_bench_lines[l];
+    unsigned long long before = lsh_commands_run, start;
+    double uncached, cached;
+
+    lsh_run_line(line);
+    unsigned long long commands = lsh_commands_run - before;
+
+    lsh_parse_cache_enabled = 0;
+    start = lsh_now_us();
+    for (int i = 0; i < iterations; i++) lsh_run_line(line);
+    uncached = (lsh_now_us() - start) * 1000.0 / iterations;
+
+    lsh_parse_cache_enabled = 1;
+    lsh_run_line(line);
+    start = lsh_now_us();
+    for (int i = 0; i < iterations; i++) lsh_run_line(line);
+    cached = (lsh_now_us() - start) * 1000.0 / iterations;
+
+    lsh_ast *ast = lsh_parse(line);
+    printf("%-40s %5llu %12.1f %12.1f %12.1f %8llu\n", line, commands, uncached, cached,
+           commands ? cached / commands : 0.0, ast ? (unsigned long long)ast->bytes : 0ULL);
+    lsh_ast_release(ast);
+  }
+  printf("\nparse cache: %llu hits, %llu misses\n", lsh_metric_total(LSH_M_PARSE_HITS),
+         lsh_metric_total(LSH_M_PARSE_MISSES));
+  return EXIT_SUCCESS;
+}
+
+/*
+ * lsh --bench-loop [-n iterations]
+ *
+ * Runs a counting loop in lsh and, from the same script file, in bash and
+ * dash if they can be started, and reports the time per iteration.
+ */
+
+#define LOOP_BENCH_SCRIPT \
+  "i=0; sum=0\nwhile [ $i -lt %d ]; do\n  sum=$((sum + i))\n  i=$((i + 1))\ndone\n"
+
+// Run `shell file` and time it. Returns the milliseconds taken, or -1 if
+// the shell could not be started.
+static double loopbench_run_shell(const char *shell, const char *file) {
+  char command[MAX_PATH + 64];
+  STARTUPINFO si;
+  PROCESS_INFORMATION pi;
+  DWORD exit_code = 0;
+
+  snprintf(command, sizeof(command), "%s \"%s\"", shell, file);
+  ZeroMemory(&si, sizeof(si));
+  si.cb = sizeof(si);
+  ZeroMemory(&pi, sizeof(pi));
+  unsigned long long start = lsh_now_us();
+  if (!CreateProcess(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) return -1;
+  WaitForSingleObject(pi.hProcess, INFINITE);
+  double ms = (lsh_now_us() - start) / 1000.0;
+  GetExitCodeProcess(pi.hProcess, &exit_code);
+  CloseHandle(pi.hProcess);
+  CloseHandle(pi.hThread);
+  return exit_code == 127 ? -1 : ms;
+}
+
+int lsh_bench_loop(int argc, char **argv) {
+  static const char *shells[] = { "bash", "dash" };
+  char script[256], dir[MAX_PATH], file[MAX_PATH];
+  int iterations = 100000;
+
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    }
+  }
+  if (iterations < 1) iterations = 1;
+  snprintf(script, sizeof(script), LOOP_BENCH_SCRIPT, iterations);
+
+  printf("%d iterations of:\n%s\n", iterations, script);
+  printf("%-8s %12s %12s\n", "shell", "total ms", "ns/iter");
+
+  unsigned long long before = lsh_commands_run;
+  unsigned long long start = lsh_now_us();
+  lsh_run_text(script);
+  double ms = (lsh_now_us() - start) / 1000.0;
+  printf("%-8s %12.1f %12.1f\n", "lsh", ms, ms * 1e6 / iterations);
+  const char *sum = lsh_var_get(lsh_var_slot("sum", 3));
+  if (lsh_last_status != 0 || lsh_commands_run - before != (unsigned long long)iterations + 1 ||
+      !sum || strtoll(sum, NULL, 10) != (long long)iterations * (iterations - 1) / 2) {
+    fprintf(stderr, "lsh: loop gave the wrong result\n");
   }
-  printf("Use the command for information on other programs.\n");
-  return 1;
+
+  GetTempPath(sizeof(dir), dir);
+  if (!GetTempFileName(dir, "lsh", 0, file)) {
+    fprintf(stderr, "lsh: could not create a temporary file\n");
+    return EXIT_FAILURE;
+  }
+  FILE *f = fopen(file, "wb");
+  if (!f) {
+    fprintf(stderr, "lsh: could not write %s\n", file);
+    return EXIT_FAILURE;
+  }
+  fputs(script, f);
+  fclose(f);
+  for (size_t i = 0; i < sizeof(shells) / sizeof(shells[0]); i++) {
+    ms = loopbench_run_shell(shells[i], file);
+    if (ms < 0) {
+      printf("%-8s %12s\n", shells[i], "not found");
+    } else {
+      printf("%-8s %12.1f %12.1f\n", shells[i], ms, ms * 1e6 / iterations);
+    }
+  }
+  DeleteFile(file);
+  return EXIT_SUCCESS;
 }
 
-int lsh_exit(char **args) {
-  return 0;
+/*
+ * lsh --bench-startup [-n attaches]
+ *
+ * What a new shell needs before its first prompt is complete, cold and
+ * from the daemon: cold is scanning PATH for the highlighter and running
+ * git for the prompt, attached is one round trip to a daemon. A daemon is
+ * started for the measurement unless one is running already.
+ */
+
+static int startup_bench_compare(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+  return x < y ? -1 : x > y;
 }
 
-int lsh_launch(char **args) {
-    // Construct command line string for CreateProcess
-    char command[1024] = "";
-    for (int i = 0; args[i] != NULL; i++) {
-        strcat(command, args[i]);
-        strcat(command, " ");
+int lsh_bench_startup(int argc, char **argv) {
+  char path[8192], name[300];
+  lsh_path cwd = { NULL, 0, 0 }, root = { NULL, 0, 0 }, git_dir = { NULL, 0, 0 };
+  int attaches = 50, git = 0;
+  double table_ms, git_ms = 0;
+
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      attaches = atoi(argv[++i]);
     }
+  }
+  if (attaches < 1) attaches = 1;
+
+  // Cold
+  DWORD n = GetEnvironmentVariable("PATH", path, sizeof(path));
+  if (n == 0 || n >= sizeof(path)) path[0] = '\0';
+  hl_table *t = hl_table_new(0);
+  if (!t) return EXIT_FAILURE;
+  unsigned long long start = lsh_now_us();
+  hl_table_scan(t, path);
+  table_ms = (lsh_now_us() - start) / 1000.0;
+  printf("cold: PATH scan          %10.2f ms  (%llu names)\n", table_ms, (unsigned long long)t->count);
+  hl_table_free(t);
+  if (lsh_path_cwd(&cwd) && prompt_find_repo(cwd.s, &root, &git_dir)) {
+    char branch[128];
+    start = lsh_now_us();
+    prompt_read_branch(&git_dir, branch, sizeof(branch));
+    prompt_git_dirty(root.s);
+    git_ms = (lsh_now_us() - start) / 1000.0;
+    git = 1;
+    printf("cold: git state          %10.2f ms\n", git_ms);
+  }
+  lsh_path_free(&cwd);
+  lsh_path_free(&root);
+  lsh_path_free(&git_dir);
+  printf("cold: total              %10.2f ms\n\n", table_ms + git_ms);
+
+  // Attached
+  PROCESS_INFORMATION pi;
+  ZeroMemory(&pi, sizeof(pi));
+  lsh_daemon_pipe_name(name, sizeof(name));
+  if (!WaitNamedPipe(name, 0)) {
+    char exe[MAX_PATH], command[MAX_PATH + 32];
     STARTUPINFO si;
-    PROCESS_INFORMATION pi;
     ZeroMemory(&si, sizeof(si));
     si.cb = sizeof(si);
-    ZeroMemory(&pi, sizeof(pi));
-    // Create a new process
+    GetModuleFileName(NULL, exe, sizeof(exe));
+    snprintf(command, sizeof(command), "\"%s\" --daemon", exe);
     if (!CreateProcess(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
-        fprintf(stderr, "lsh: failed to execute %s\n", args[0]);
-        return 1;
+      fprintf(stderr, "lsh: could not start the daemon\n");
+      return EXIT_FAILURE;
     }
-    // Wait for the process to finish
-    WaitForSingleObject(pi.hProcess, INFINITE);
+    ULONGLONG deadline = GetTickCount64() + 5000;
+    while (!WaitNamedPipe(name, 0) && GetTickCount64() < deadline) Sleep(10);
+  }
+
+  start = lsh_now_us();
+  int result = lsh_attach();
+  printf("attach, first            %10.2f ms\n", (lsh_now_us() - start) / 1000.0);
+  if (result == 0) {
+    fprintf(stderr, "lsh: could not attach to the daemon\n");
+  } else {
+    // Let the daemon's prompt worker finish its first git run
+    ULONGLONG deadline = GetTickCount64() + 5000;
+    while (git && result < 2 && GetTickCount64() < deadline) {
+      Sleep(20);
+      result = lsh_attach();
+    }
+    unsigned long long *times = malloc(attaches * sizeof(unsigned long long));
+    if (!times) return EXIT_FAILURE;
+    for (int i = 0; i < attaches; i++) {
+      start = lsh_now_us();
+      lsh_attach();
+      times[i] = lsh_now_us() - start;
+    }
+    qsort(times, attaches, sizeof(unsigned long long), startup_bench_compare);
+    printf("attach, warm (median)    %10.2f ms  (%d attaches, max %.2f ms)\n", times[attaches / 2] / 1000.0,
+           attaches, times[attaches - 1] / 1000.0);
+    printf("attach gives: command table %s, git state %s\n", hl_commands ? "yes" : "no",
+           result == 2 ? "yes" : git ? "no" : "not in a repository");
+    free(times);
+  }
+
+  if (pi.hProcess) {
+    TerminateProcess(pi.hProcess, 0);
     CloseHandle(pi.hProcess);
     CloseHandle(pi.hThread);
-    return 1;
+  }
+  return EXIT_SUCCESS;
 }
 
-int lsh_execute(char **args) {
-  int i;
-  if (args[0] == NULL) {
-    return 1;
-  }
-  for (i = 0; i < lsh_num_builtins(); i++) {
-    if (strcmp(args[0], builtin_str[i]) == 0) {
-      return (*builtin_func[i])(args);
+/*
+ * lsh --bench-idle [-s seconds]
+ *
+ * Sits in the event loop as at an idle prompt, with the prompt worker, the
+ * highlighter's table build, a watch on cwd and a background job as its
+ * sources, and reports how often it woke up and the CPU time the waiting
+ * thread used. The console is left out so this runs anywhere. Only real
+ * events should wake it, such as the table arriving or the job finishing.
+ */
+
+static void idlebench_table_ready(void *data, HANDLE h) {
+  hl_table_poll();
+}
+
+static void idlebench_dir_changed(void *data, HANDLE h) {
+  FindNextChangeNotification(h);
+}
+
+static unsigned long long idlebench_cpu_us(void) {
+  FILETIME created, exited, kernel, user;
+  if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+  return (lsh_filetime_100ns(kernel) + lsh_filetime_100ns(user)) / 10;
+}
+
+int lsh_bench_idle(int argc, char **argv) {
+  double seconds = 2;
+
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seconds = atof(argv[++i]);
     }
   }
-  return lsh_launch(args);
+  if (seconds <= 0) seconds = 2;
+
+  prompt_init();
+  hl_paths_check_cwd();
+  hl_table_refresh();
+  if (hl_table_thread) lsh_ev_add(hl_table_thread, idlebench_table_ready, NULL, LSH_EV_PROMPT);
+  if (hl_cwd_watch) lsh_ev_add(hl_cwd_watch, idlebench_dir_changed, NULL, LSH_EV_PROMPT);
+  lsh_job_start(NULL, "i=0; while [ $i -lt 100000 ]; do i=$((i + 1)); done");
+  int sources = lsh_ev_count;
+
+  unsigned long long cpu = idlebench_cpu_us(), wakeups = lsh_ev_wakeups, job_us = 0;
+  unsigned long long start = lsh_now_us(), end = start + (unsigned long long)(seconds * 1e6), now;
+  while ((now = lsh_now_us()) < end) {
+    lsh_ev_run(NULL, LSH_EV_PROMPT, (DWORD)((end - now + 999) / 1000));
+    if (!job_us && lsh_job_table[0].done) job_us = lsh_now_us() - start;
+  }
+  cpu = idlebench_cpu_us() - cpu;
+  wakeups = lsh_ev_wakeups - wakeups;
+
+  printf("idle %.2f s with %d sources: %llu wakeups, %.2f ms CPU in the waiting thread (%.3f%%)\n",
+         seconds, sources, wakeups, cpu / 1000.0, cpu / (seconds * 1e4));
+  if (job_us) printf("background job seen finishing after %.1f ms\n", job_us / 1000.0);
+  lsh_jobs_notify(1);
+  return EXIT_SUCCESS;
 }
 
-#define LSH_RL_BUFSIZE 1024
+/*
+ * lsh --bench-out [-m MB]
+ *
+ * Prints a generated log of MB megabytes (default 64) with cat, with and
+ * without the output being captured for the scrollback, and the same with
+ * `cmd /c type` before and after `out -x on`. Output goes to NUL, so this
+ * measures the relay rather than the console. Then reports how well the
+ * last entry compresses, how fast it reads back, what capturing costs
+ * a line that prints nothing, what unbuffered stdout costs a builtin
+ * printing line by line, and how long a program waits for the relay to
+ * drain before it starts.
+ */
 
-// Helper function to redraw tab completion without flickering
-void redraw_tab_suggestion(HANDLE hConsole, COORD promptEndPos, 
-                           char *original_line, char *tab_match, char *last_tab_prefix,
-                           int tab_index, int tab_num_matches, WORD originalAttributes) {
-    CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
-    
-    // Lock the console changes to minimize flickering
-    CONSOLE_CURSOR_INFO cursorInfo;
-    GetConsoleCursorInfo(hConsole, &cursorInfo);
-    BOOL originalCursorVisible = cursorInfo.bVisible;
-    
-    // Hide cursor during redraw
-    cursorInfo.bVisible = FALSE;
-    SetConsoleCursorInfo(hConsole, &cursorInfo);
-    
-    // Clear line with a single API call (more efficient than printing spaces)
-    DWORD numCharsWritten;
-    COORD clearPos = promptEndPos;
-    FillConsoleOutputCharacter(hConsole, ' ', 120, clearPos, &numCharsWritten);
-    FillConsoleOutputAttribute(hConsole, originalAttributes, 120, clearPos, &numCharsWritten);
-    
-    // Position cursor at beginning of line (immediately after prompt)
-    SetConsoleCursorPosition(hConsole, promptEndPos);
-    
-    // Get the prefix length (what user typed)
-    int prefixLen = strlen(last_tab_prefix);
-    
-    // 1. Print the command prefix (e.g., "cd ")
-    WriteConsole(hConsole, original_line, strlen(original_line), &numCharsWritten, NULL);
-    
-    // 2. Print matching prefix part
-    char matchPrefix[1024] = "";
-    strncpy(matchPrefix, tab_match, prefixLen);
-    matchPrefix[prefixLen] = '\0';
-    WriteConsole(hConsole, matchPrefix, strlen(matchPrefix), &numCharsWritten, NULL);
-    
-    // 3. Print remaining suggestion in gray
-    SetConsoleTextAttribute(hConsole, FOREGROUND_INTENSITY);
-    WriteConsole(hConsole, tab_match + prefixLen, strlen(tab_match + prefixLen), &numCharsWritten, NULL);
-    
-    // Save cursor position at end of suggestion
-    GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-    COORD endOfSuggestionPos = consoleInfo.dwCursorPosition;
-    
-    // 4. Print indicator if needed
-    if (tab_num_matches > 1) {
-        char indicatorBuffer[20];
-        sprintf(indicatorBuffer, " (%d/%d)", tab_index + 1, tab_num_matches);
-        WriteConsole(hConsole, indicatorBuffer, strlen(indicatorBuffer), &numCharsWritten, NULL);
-    }
-    
-    // Reset attributes
-    SetConsoleTextAttribute(hConsole, originalAttributes);
-    
-    // Move cursor to end of suggestion (before indicator)
-    SetConsoleCursorPosition(hConsole, endOfSuggestionPos);
-    
-    // Show cursor again
-    cursorInfo.bVisible = originalCursorVisible;
-    SetConsoleCursorInfo(hConsole, &cursorInfo);
-}// Modified read_line function with improved tab cycling and enter acceptance
-char *lsh_read_line(void) {
-    int bufsize = LSH_RL_BUFSIZE;
-    int position = 0;
-    char *buffer = malloc(sizeof(char) * bufsize);
-    int c;
-    char *suggestion = NULL;
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    CONSOLE_SCREEN_BUFFER_INFO consoleInfo;
-    WORD originalAttributes;
-    
-    // For tab completion cycling
-    static int tab_index = 0;
-    static char **tab_matches = NULL;
-    static int tab_num_matches = 0;
-    static char last_tab_prefix[1024] = "";
-    static int tab_word_start = 0;  // Track where the word being completed starts
-    
-    // Flag to track if we're showing a suggestion
-    int showing_suggestion = 0;
-    
-    // Flag to track if we're ready to execute after accepting a suggestion
-    int ready_to_execute = 0;
-    
-    // Variables to track the prompt and original line
-    static char original_line[LSH_RL_BUFSIZE];
-    COORD promptEndPos;
-    
-    // Get original console attributes
-    GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-    originalAttributes = consoleInfo.wAttributes;
-    
-    // Save prompt end position for reference
-    promptEndPos = consoleInfo.dwCursorPosition;
-    
-    if (!buffer) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-    }
-    
-    buffer[0] = '\0';  // Initialize empty string
-    
-    while (1) {
-        // Clear any previous suggestion from screen if not in tab cycling
-        if (suggestion && !tab_matches) {
-            // Get current cursor position
-            GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-            // Calculate suggestion length
-            int suggestionLen = strlen(suggestion) - strlen(buffer);
-            if (suggestionLen > 0) {
-                // Set cursor to current position
-                SetConsoleCursorPosition(hConsole, consoleInfo.dwCursorPosition);
-                // Clear the suggestion by printing spaces
-                for (int i = 0; i < suggestionLen; i++) {
-                    putchar(' ');
-                }
-                // Reset cursor position
-                SetConsoleCursorPosition(hConsole, consoleInfo.dwCursorPosition);
-            }
-            free(suggestion);
-            suggestion = NULL;
-            showing_suggestion = 0;
-        }
-        
-        // Find and display new suggestion only if we're not in tab cycling mode
-        if (!tab_matches && !ready_to_execute) {
-            buffer[position] = '\0';  // Ensure buffer is null-terminated
-            suggestion = find_best_match(buffer);
-            if (suggestion) {
-                // Get current cursor position
-                GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-                // Calculate the start of the current word
-                int word_start = position - 1;
-                while (word_start >= 0 && buffer[word_start] != ' ' && buffer[word_start] != '\\') {
-                    word_start--;
-                }
-                word_start++; // Move past the space or backslash
-                
-                // Extract just the last word from the suggested path
-                char *lastWord = strrchr(suggestion, ' ');
-                if (lastWord) {
-                    lastWord++; // Move past the space
-                } else {
-                    lastWord = suggestion;
-                }
-                
-                // Extract just the last word from what we've typed so far
-                char currentWord[1024] = "";
-                strncpy(currentWord, buffer + word_start, position - word_start);
-                currentWord[position - word_start] = '\0';
-                
-                // Only display the suggestion if it starts with what we're typing
-                if (strncmp(lastWord, currentWord, strlen(currentWord)) == 0) {
-                    // Set text color to gray for suggestion
-                    SetConsoleTextAttribute(hConsole, FOREGROUND_INTENSITY);
-                    // Print only the part of the suggestion that hasn't been typed yet
-                    printf("%s", lastWord + strlen(currentWord));
-                    // Reset color
-                    SetConsoleTextAttribute(hConsole, originalAttributes);
-                    // Reset cursor position
-                    SetConsoleCursorPosition(hConsole, consoleInfo.dwCursorPosition);
-                    showing_suggestion = 1;
-                }
-            }
-        }
-        
-        c = _getch();  // Get character without echo
-        
-        if (c == KEY_ENTER) {
-            // If we're ready to execute after accepting a suggestion
-            if (ready_to_execute) {
-                putchar('\n');  // Echo newline
-                buffer[position] = '\0';
-                
-                // Clean up
-                if (suggestion) {
-                    free(suggestion);
-                    suggestion = NULL;
-                }
-                showing_suggestion = 0;
-                
-                // Clean up tab completion resources
-                if (tab_matches) {
-                    for (int i = 0; i < tab_num_matches; i++) {
-                        free(tab_matches[i]);
-                    }
-                    free(tab_matches);
-                    tab_matches = NULL;
-                    tab_num_matches = 0;
-                    tab_index = 0;
-                    last_tab_prefix[0] = '\0';
-                }
-                
-                ready_to_execute = 0;
-                return buffer;
-            }
-            // If we're in tab cycling mode, accept the current suggestion
-            else if (tab_matches) {
-                // Tab cycling is active - accept the current suggestion but don't execute
-                // Find the start of the current word
-                int word_start = tab_word_start;
-                
-                // Insert the selected match into buffer
-                char *current_match = tab_matches[tab_index];
-                
-                // Replace partial path with current match
-                strcpy(buffer + word_start, current_match);
-                position = word_start + strlen(current_match);
-                
-                // Clean up tab completion resources
-                for (int i = 0; i < tab_num_matches; i++) {
-                    free(tab_matches[i]);
-                }
-                free(tab_matches);
-                tab_matches = NULL;
-                tab_num_matches = 0;
-                tab_index = 0;
-                last_tab_prefix[0] = '\0';
-                
-                // Hide cursor to prevent flicker
-                CONSOLE_CURSOR_INFO cursorInfo;
-                GetConsoleCursorInfo(hConsole, &cursorInfo);
-                BOOL originalCursorVisible = cursorInfo.bVisible;
-                cursorInfo.bVisible = FALSE;
-                SetConsoleCursorInfo(hConsole, &cursorInfo);
-                
-                // Clear the line
-                DWORD numCharsWritten;
-                COORD clearPos = promptEndPos;
-                FillConsoleOutputCharacter(hConsole, ' ', 120, clearPos, &numCharsWritten);
-                FillConsoleOutputAttribute(hConsole, originalAttributes, 120, clearPos, &numCharsWritten);
-                
-                // Move cursor back to beginning
-                SetConsoleCursorPosition(hConsole, promptEndPos);
-                
-                // Print the full command with the accepted match
-                buffer[position] = '\0';
-                WriteConsole(hConsole, buffer, strlen(buffer), &numCharsWritten, NULL);
-                
-                // Restore cursor visibility
-                cursorInfo.bVisible = originalCursorVisible;
-                SetConsoleCursorInfo(hConsole, &cursorInfo);
-                
-                // Set flag to execute on next Enter
-                ready_to_execute = 1;
-                
-                // Continue editing - don't submit yet
-                continue;
-            }
-            // Otherwise, if we have a suggestion showing, accept it
-            else if (showing_suggestion && suggestion) {
-                // Find the start of the current word
-                int word_start = position - 1;
-                while (word_start >= 0 && buffer[word_start] != ' ' && buffer[word_start] != '\\') {
-                    word_start--;
-                }
-                word_start++; // Move past the space or backslash
-                
-                // Extract just the last word from the suggested path
-                char *lastWord = strrchr(suggestion, ' ');
-                if (lastWord) {
-                    lastWord++; // Move past the space
-                } else {
-                    lastWord = suggestion;
-                }
-                
-                // Extract just the last word from what we've typed so far
-                char currentWord[1024] = "";
-                strncpy(currentWord, buffer + word_start, position - word_start);
-                currentWord[position - word_start] = '\0';
-                
-                // Get current cursor position
-                GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-                
-                // Print the remainder of the suggestion in normal color
-                printf("%s", lastWord + strlen(currentWord));
-                
-                // Update buffer with the suggestion
-                // Keep the prefix (everything before the current word)
-                char tempBuffer[1024] = "";
-                strncpy(tempBuffer, buffer, word_start);
-                tempBuffer[word_start] = '\0';
-                
-                // Add the completed word
-                strcat(tempBuffer, lastWord);
-                
-                // Copy back to buffer
-                strcpy(buffer, tempBuffer);
-                position = strlen(buffer);
-                
-                // Set flag to execute on next Enter
-                ready_to_execute = 1;
-                
-                // Continue editing - don't submit yet
-                free(suggestion);
-                suggestion = NULL;
-                showing_suggestion = 0;
-                continue;
-            }
-            // No tab cycling or suggestion - submit the command
-            else {
-                putchar('\n');  // Echo newline
-                buffer[position] = '\0';
-                
-                // Clean up
-                if (suggestion) free(suggestion);
-                
-                // Clean up tab completion resources
-                if (tab_matches) {
-                    for (int i = 0; i < tab_num_matches; i++) {
-                        free(tab_matches[i]);
-                    }
-                    free(tab_matches);
-                    tab_matches = NULL;
-                    tab_num_matches = 0;
-                    tab_index = 0;
-                    last_tab_prefix[0] = '\0';
-                }
-                
-                return buffer;
-            }
-        } else if (c == KEY_BACKSPACE) {
-            // User pressed Backspace
-            if (position > 0) {
-                // Handle backspace differently when in tab cycling mode
-                if (tab_matches) {
-                    // If in tab cycling mode, immediately revert to original input
-                    // Clear the line and redraw with just the original input
-                    GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-                    SetConsoleCursorPosition(hConsole, promptEndPos);
-                    
-                    // Clear the entire line
-                    for (int i = 0; i < 80; i++) {
-                        putchar(' ');
-                    }
-                    
-                    // Move cursor back to beginning of line
-                    SetConsoleCursorPosition(hConsole, promptEndPos);
-                    
-                    // Restore original buffer and position (what the user typed)
-                    buffer[tab_word_start] = '\0';
-                    strcat(buffer, last_tab_prefix);
-                    position = tab_word_start + strlen(last_tab_prefix);
-                    
-                    // Print the original input
-                    printf("%s", buffer);
-                    
-                    // Reset tab cycling
-                    for (int i = 0; i < tab_num_matches; i++) {
-                        free(tab_matches[i]);
-                    }
-                    free(tab_matches);
-                    tab_matches = NULL;
-                    tab_num_matches = 0;
-                    tab_index = 0;
-                    last_tab_prefix[0] = '\0';
-                } else {
-                    // Standard backspace behavior when not in tab cycling mode
-                    position--;
-                    // Move cursor back, print space, move cursor back again
-                    printf("\b \b");
-                    buffer[position] = '\0';
-                }
-                
-                // Reset execution flag when editing
-                ready_to_execute = 0;
-            }
-        } else if (c == KEY_TAB) {
-            // User pressed Tab - activate completion
-            buffer[position] = '\0';  // Ensure null termination
-            
-            // Find the start of the current word
-            int word_start = position;
-            while (word_start > 0 && buffer[word_start - 1] != ' ' && buffer[word_start - 1] != '\\') {
-                word_start--;
-            }
-            
-            // Save word_start for later use
-            tab_word_start = word_start;
-            
-            // Save original command line up to the word being completed
-            strncpy(original_line, buffer, word_start);
-            original_line[word_start] = '\0';
-            
-            char partial_path[1024] = "";
-            strncpy(partial_path, buffer + word_start, position - word_start);
-            partial_path[position - word_start] = '\0';
-            
-            // Check if we're continuing to tab through the same prefix
-            if (strcmp(partial_path, last_tab_prefix) != 0 || tab_matches == NULL) {
-                // New prefix or first tab press, find all matches
-                // Clean up previous matches if any
-                if (tab_matches) {
-                    for (int i = 0; i < tab_num_matches; i++) {
-                        free(tab_matches[i]);
-                    }
-                    free(tab_matches);
-                }
-                
-                // Store the current prefix
-                strcpy(last_tab_prefix, partial_path);
-                
-                // Reset tab index
-                tab_index = 0;
-                
-                // Find matches for the new prefix
-                tab_matches = find_matches(partial_path, &tab_num_matches);
-                
-                // If no matches, don't do anything
-                if (!tab_matches || tab_num_matches == 0) {
-                    if (tab_matches) {
-                        free(tab_matches);
-                        tab_matches = NULL;
-                    }
-                    tab_num_matches = 0;
-                    last_tab_prefix[0] = '\0';
-                    continue;
-                }
-                
-                // Display the first match with our helper function to avoid flickering
-                if (tab_matches && tab_num_matches > 0) {
-                    redraw_tab_suggestion(hConsole, promptEndPos, original_line, 
-                                          tab_matches[tab_index], last_tab_prefix,
-                                          tab_index, tab_num_matches, originalAttributes);
-                    continue;
-                }
-            } else {
-                // Same prefix, cycle to next match
-                tab_index = (tab_index + 1) % tab_num_matches;
-                
-                // Redraw with the next match
-                redraw_tab_suggestion(hConsole, promptEndPos, original_line, 
-                                      tab_matches[tab_index], last_tab_prefix,
-                                      tab_index, tab_num_matches, originalAttributes);
-                continue;
-            }
-            
-            if (tab_matches && tab_num_matches > 0) {
-                // Create a buffer for what we want to display in one go
-                char displayBuffer[2048] = "";
-                
-                // Same prefix, cycle to next match
-                tab_index = (tab_index + 1) % tab_num_matches;
-                
-                // Build the command display in our buffer instead of printing directly
-                // First the original command prefix
-                strcat(displayBuffer, original_line);
-                
-                // Get prefix length for later use (what user typed after the command)
-                int prefixLen = strlen(last_tab_prefix);
-                
-                // Matching prefix part in normal color
-                char matchPrefix[1024] = "";
-                strncpy(matchPrefix, tab_matches[tab_index], prefixLen);
-                matchPrefix[prefixLen] = '\0';
-                strcat(displayBuffer, matchPrefix);
-                
-                // The rest of the match
-                strcat(displayBuffer, tab_matches[tab_index] + prefixLen);
-                
-                // Add indicator if needed
-                char indicatorBuffer[20] = "";
-                if (tab_num_matches > 1) {
-                    sprintf(indicatorBuffer, " (%d/%d)", tab_index + 1, tab_num_matches);
-                }
-                
-                // Get the cursor position where it should end up (after suggestion, before indicator)
-                int cursorPos = strlen(displayBuffer);
-                
-                // Add the indicator to the display buffer
-                strcat(displayBuffer, indicatorBuffer);
-                
-                // Clear the line and print everything at once to avoid cursor flicker
-                
-                // First, FillConsoleOutputCharacter to clear the line
-                DWORD numCharsWritten;
-                FillConsoleOutputCharacter(hConsole, ' ', 80, promptEndPos, &numCharsWritten);
-                
-                // Move cursor to beginning of line
-                SetConsoleCursorPosition(hConsole, promptEndPos);
-                
-                // Print command and normal part of suggestion
-                printf("%s%s", original_line, matchPrefix);
-                
-                // Print rest of suggestion in gray
-                SetConsoleTextAttribute(hConsole, FOREGROUND_INTENSITY);
-                printf("%s", tab_matches[tab_index] + prefixLen);
-                
-                // Save cursor position (end of suggestion)
-                GetConsoleScreenBufferInfo(hConsole, &consoleInfo);
-                COORD endOfSuggestionPos = consoleInfo.dwCursorPosition;
-                
-                // Print indicator in gray
-                if (tab_num_matches > 1) {
-                    printf("%s", indicatorBuffer);
-                }
-                
-                // Reset text color
-                SetConsoleTextAttribute(hConsole, originalAttributes);
-                
-                // Move cursor back to end of suggestion
-                SetConsoleCursorPosition(hConsole, endOfSuggestionPos);
-                
-                // Reset execution flag when using Tab
-                ready_to_execute = 0;
-            }
-        } else if (isprint(c)) {
-            // Regular printable character
-            
-            // Special handling when tab cycling is active but user hasn't accepted a suggestion
-            if (tab_matches) {
-                // Hide cursor temporarily
-                CONSOLE_CURSOR_INFO cursorInfo;
-                GetConsoleCursorInfo(hConsole, &cursorInfo);
-                BOOL originalCursorVisible = cursorInfo.bVisible;
-                cursorInfo.bVisible = FALSE;
-                SetConsoleCursorInfo(hConsole, &cursorInfo);
-                
-                // Restore original input (what user typed before tab)
-                buffer[tab_word_start] = '\0';
-                strcat(buffer, last_tab_prefix);
-                position = tab_word_start + strlen(last_tab_prefix);
-                
-                // Clear the entire line
-                DWORD numCharsWritten;
-                FillConsoleOutputCharacter(hConsole, ' ', 120, promptEndPos, &numCharsWritten);
-                FillConsoleOutputAttribute(hConsole, originalAttributes, 120, promptEndPos, &numCharsWritten);
-                
-                // Move cursor to beginning of line
-                SetConsoleCursorPosition(hConsole, promptEndPos);
-                
-                // Redraw the original input
-                WriteConsole(hConsole, buffer, strlen(buffer), &numCharsWritten, NULL);
-                
-                // Now add the new character
-                buffer[position] = c;
-                position++;
-                WriteConsole(hConsole, &c, 1, &numCharsWritten, NULL);
-                
-                // Clean up tab completion resources
-                for (int i = 0; i < tab_num_matches; i++) {
-                    free(tab_matches[i]);
-                }
-                free(tab_matches);
-                tab_matches = NULL;
-                tab_num_matches = 0;
-                tab_index = 0;
-                last_tab_prefix[0] = '\0';
-                
-                // Show cursor again
-                cursorInfo.bVisible = originalCursorVisible;
-                SetConsoleCursorInfo(hConsole, &cursorInfo);
-            } else {
-                // Standard character handling when not in tab cycling mode
-                putchar(c);  // Echo character
-                buffer[position] = c;
-                position++;
-            }
-            
-            // Reset execution flag when editing
-            ready_to_execute = 0;
-            
-            // Resize buffer if needed
-            if (position >= bufsize) {
-                bufsize += LSH_RL_BUFSIZE;
-                buffer = realloc(buffer, bufsize);
-                if (!buffer) {
-                    fprintf(stderr, "lsh: allocation error\n");
-                    exit(EXIT_FAILURE);
-                }
-            }
-        }
-        
-        buffer[position] = '\0';  // Ensure null termination
-    }
+#define OUTBENCH_LINES 100000
+#define OUTBENCH_SYNCS 1000
+
+static unsigned long long outbench_run(const char *line, int capture) {
+  unsigned long long best = 0;
+  for (int i = 0; i < 3; i++) {
+    unsigned long long start = lsh_now_us();
+    if (capture) lsh_out_begin(line);
+    lsh_run_line(line);
+    if (capture) lsh_out_end(lsh_last_status);
+    unsigned long long us = lsh_now_us() - start;
+    if (i == 0 || us < best) best = us;
+  }
+  return best;
 }
 
-#define LSH_TOK_BUFSIZE 64
-#define LSH_TOK_DELIM " \t\r\n\a"
+static void outbench_report(const char *what, unsigned long long plain, unsigned long long captured,
+                            size_t bytes) {
+  printf("%-22s %9.1f ms  captured %9.1f ms  (%+.1f%%, %.0f MB/s)\n", what, plain / 1000.0,
+         captured / 1000.0, plain ? (captured - (double)plain) * 100.0 / plain : 0.0,
+         captured ? bytes / (double)captured : 0.0);
+}
 
-char **lsh_split_line(char *line) {
-  int bufsize = LSH_TOK_BUFSIZE, position = 0;
-  char **tokens = malloc(bufsize * sizeof(char*));
-  char *token;
-  if (!tokens) {
-    fprintf(stderr, "lsh: allocation error\n");
-    exit(EXIT_FAILURE);
+int lsh_bench_out(int argc, char **argv) {
+  size_t megabytes = 64;
+  char dir[MAX_PATH], path[MAX_PATH], line[MAX_PATH + 32];
+
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      megabytes = (size_t)atoi(argv[++i]);
+    }
   }
-  token = strtok(line, LSH_TOK_DELIM);
-  while (token != NULL) {
-    tokens[position] = token;
-    position++;
-    if (position >= bufsize) {
-      bufsize += LSH_TOK_BUFSIZE;
-      tokens = realloc(tokens, bufsize * sizeof(char*));
-      if (!tokens) {
-        fprintf(stderr, "lsh: allocation error\n");
-        exit(EXIT_FAILURE);
-      }
+  if (megabytes == 0) megabytes = 64;
+
+  GetTempPath(sizeof(dir), dir);
+  GetTempFileName(dir, "lsh", 0, path);
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    fprintf(stderr, "lsh: cannot create %s\n", path);
+    return EXIT_FAILURE;
+  }
+  static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+  size_t bytes = 0;
+  unsigned int seed = 12345;
+  for (unsigned long n = 0; bytes < megabytes * 1024 * 1024; n++) {
+    seed = seed * 1103515245 + 12345;
+    int written = fprintf(f, "2024-05-%02lu 12:%02lu:%02lu.%03u [%s] worker-%u: request %lu served in %u ms\r\n",
+                          1 + n / 86400 % 28, n / 60 % 60, n % 60, seed % 1000, levels[(seed >> 8) % 6],
+                          (seed >> 12) % 16, n, (seed >> 16) % 500);
+    if (written < 0) break;
+    bytes += (size_t)written;
+  }
+  fclose(f);
+
+  // Everything printed goes to NUL from here on
+  HANDLE nul = CreateFile("NUL", GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+  if (nul == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "lsh: cannot open NUL\n");
+    DeleteFile(path);
+    return EXIT_FAILURE;
+  }
+  fflush(stdout);
+  int console = _dup(1);
+  HANDLE console_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+  _dup2(_open_osfhandle((intptr_t)nul, _O_TEXT), 1);
+  SetStdHandle(STD_OUTPUT_HANDLE, (HANDLE)_get_osfhandle(1));
+
+  snprintf(line, sizeof(line), "cat \"%s\"", path);
+  unsigned long long cat_plain = outbench_run(line, 0);
+  unsigned long long cat_captured = outbench_run(line, 1);
+
+  snprintf(line, sizeof(line), "cmd /c type \"%s\"", path);
+  lsh_last_status = 0;
+  unsigned long long type_plain = outbench_run(line, 0);
+  int type_status = lsh_last_status;
+  lsh_out_programs = 1;
+  unsigned long long type_captured = outbench_run(line, 1);
+  lsh_out_programs = 0;
+
+  // The setup and teardown every line at the prompt now pays
+  unsigned long long start = lsh_now_us();
+  for (int i = 0; i < 1000; i++) {
+    lsh_out_begin("true");
+    lsh_out_end(0);
+  }
+  unsigned long long per_line = lsh_now_us() - start;
+
+  // Short lines printed into a capture, unbuffered as captures are and
+  // with the buffering a pipe would otherwise get
+  unsigned long long lines_us[2];
+  for (int buffered = 0; buffered < 2; buffered++) {
+    lsh_out_begin("printf");
+    lsh_out_cap.skip = 1;
+    if (buffered) setvbuf(stdout, lsh_out_stdio_buffer, _IOFBF, sizeof(lsh_out_stdio_buffer));
+    start = lsh_now_us();
+    for (int i = 0; i < OUTBENCH_LINES; i++) {
+      printf("line %d of the output\n", i);
     }
-    token = strtok(NULL, LSH_TOK_DELIM);
+    fflush(stdout);
+    lines_us[buffered] = lsh_now_us() - start;
+    lsh_out_end(0);
+  }
+
+  // A line printed, then the wait a program started next makes
+  lsh_out_begin("sync");
+  lsh_out_cap.skip = 1;
+  start = lsh_now_us();
+  for (int i = 0; i < OUTBENCH_SYNCS; i++) {
+    printf("before a program\n");
+    lsh_out_sync();
+  }
+  unsigned long long sync_us = lsh_now_us() - start;
+  lsh_out_end(0);
+
+  fflush(stdout);
+  _dup2(console, 1);
+  _close(console);
+  SetStdHandle(STD_OUTPUT_HANDLE, console_handle);
+  DeleteFile(path);
+
+  printf("%llu MB of log lines\n", (unsigned long long)(bytes >> 20));
+  outbench_report("cat", cat_plain, cat_captured, bytes);
+  if (type_status == 0) {
+    outbench_report("cmd /c type, -x on", type_plain, type_captured, bytes);
+  } else {
+    printf("cmd /c type: not found, skipped\n");
   }
-  tokens[position] = NULL;
-  return tokens;
+  printf("capture setup per line %9.1f us\n", per_line / 1000.0);
+  printf("%d printf lines  %9.1f ms  buffered %9.1f ms  (%+.1f%%)\n", OUTBENCH_LINES, lines_us[0] / 1000.0,
+         lines_us[1] / 1000.0, lines_us[1] ? (lines_us[0] - (double)lines_us[1]) * 100.0 / lines_us[1] : 0.0);
+  printf("drain before a program %9.1f us\n", sync_us / (double)OUTBENCH_SYNCS);
+
+  lsh_out_entry *e = lsh_out_get(1);
+  if (!e) return EXIT_SUCCESS;
+  unsigned char *packed = (unsigned char*)malloc(e->size);
+  char *text = NULL;
+  size_t size = 0;
+  start = lsh_now_us();
+  if (packed) size = lsh_lz_compress(e->data, e->size, packed, e->size);
+  unsigned long long compress_us = lsh_now_us() - start;
+  if (size) {
+    lsh_out_entry copy = *e;
+    copy.data = packed;
+    copy.size = size;
+    copy.compressed = 1;
+    start = lsh_now_us();
+    text = lsh_out_load(&copy);
+    unsigned long long load_us = lsh_now_us() - start;
+    printf("last entry %llu KB -> %llu KB (%.1fx), compress %.0f MB/s, read back %.0f MB/s%s\n",
+           (unsigned long long)(e->raw_size >> 10), (unsigned long long)(size >> 10), e->raw_size / (double)size,
+           e->raw_size / (double)(compress_us ? compress_us : 1), e->raw_size / (double)(load_us ? load_us : 1),
+           text && memcmp(text, e->data, e->raw_size) == 0 ? "" : "  MISMATCH");
+  } else {
+    printf("last entry %llu KB does not compress\n", (unsigned long long)(e->raw_size >> 10));
+  }
+  free(text);
+  free(packed);
+  return EXIT_SUCCESS;
+}
+
+// lsh FILE [args]: run a script with $1... set to args
+int lsh_run_file(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "lsh: %s: cannot open\n", path);
+    return 127;
+  }
+  lsh_strbuf text = { NULL, 0, 0 };
+  char chunk[4096];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) lsh_strbuf_add(&text, chunk, n);
+  fclose(f);
+  if (!text.s) lsh_strbuf_add(&text, "", 0);
+  lsh_run_text(text.s);
+  free(text.s);
+  return lsh_last_status;
 }
 
 void lsh_loop(void) {
   char *line;
-  char **args;
   int status;
-  char cwd[1024];
-  char prompt_path[1024];
-  char username[256] = "Elden Lord";
-  /*char username[256] = "user"; // Default value if username can't be retrieved*/
-  /*DWORD username_len = sizeof(username);*/
-  /**/
-  /*// Get the Windows username once (doesn't change during execution)*/
-  /*if (!GetUserName(username, &username_len)) {*/
-  /*  perror("lsh: failed to get username");*/
-  /*}*/
-  /**/
+
+  lsh_track_commands = 1;
+  lsh_interrupt_init();
+  lsh_attach();
   do {
-    // Get current directory for the prompt
-    if (_getcwd(cwd, sizeof(cwd)) == NULL) {
-      perror("lsh");
-      strcpy(prompt_path, "unknown_path"); // Fallback in case of error
-    } else {
-      // Find the last directory in the path
-      char *last_dir = strrchr(cwd, '\\');
-      
-      if (last_dir != NULL) {
-        char last_dir_name[256];
-        strcpy(last_dir_name, last_dir + 1); // Save the last directory name
-        
-        *last_dir = '\0';  // Temporarily terminate string at last backslash
-        char *parent_dir = strrchr(cwd, '\\');
-        
-        if (parent_dir != NULL) {
-          // We have at least two levels deep
-          sprintf(prompt_path, "%s in %s\\%s", username, parent_dir + 1, last_dir_name);
-        } else {
-          // We're at top level (like C:)
-          sprintf(prompt_path, "%s in %s", username, last_dir_name);
-        }
-      } else {
-        // No backslash found (rare case)
-        sprintf(prompt_path, "%s in %s", username, cwd);
-      }
-    }
-    
-    // Print prompt with username and shortened directory
-    printf("%s> ", prompt_path);
+    lsh_interrupt_clear();
+    lsh_jobs_notify(1);
+    prompt_draw();
+    lsh_metric_count(LSH_M_PROMPTS, 1);
     
     line = lsh_read_line();
-    args = lsh_split_line(line);
-    status = lsh_execute(args);
+    lsh_out_begin(line);
+    status = lsh_run_line(line);
+    lsh_out_end(lsh_last_status);
+
     free(line);
-    free(args);
   } while (status);
 }
 
+/*
+ * lsh --bench-paths [-n paths]
+ *
+ * Indexes a generated tree of paths (a million by default), each
+ * directory holding 16 files and 4 subdirectories, two ways: as full
+ * strings built with strcpy/strcat and strdup'd, the way paths used to
+ * be kept, and interned in an lsh_path_pool. Reports the memory per path
+ * and the time to build each index, then what it costs to get full paths
+ * back out of the pool. Heap blocks are counted with 16 bytes of
+ * allocator overhead each.
+ */
+
+#define PATHBENCH_FILES 16
+#define PATHBENCH_DIRS 4
+
+static void pathbench_name(int i, char *name, size_t size) {
+  if ((i - 1) % (PATHBENCH_FILES + PATHBENCH_DIRS) < PATHBENCH_DIRS) {
+    snprintf(name, size, "component_%d", i);
+  } else {
+    snprintf(name, size, "source_file_%d.cpp", i);
+  }
+}
+
+int lsh_bench_paths(int argc, char **argv) {
+  int count = 1000000;
+  const char *root = "C:\\Users\\developer\\src\\project";
+
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      count = atoi(argv[++i]);
+    }
+  }
+  if (count < 2) count = 2;
+
+  // Entry i > 0 sits in directory dirs[(i - 1) / 20], breadth first
+  int *dirs = (int*)malloc(sizeof(int) * (count / (PATHBENCH_FILES + PATHBENCH_DIRS) * PATHBENCH_DIRS + 2));
+  char **strings = (char**)malloc(sizeof(char*) * count);
+  lsh_path_id *ids = (lsh_path_id*)malloc(sizeof(lsh_path_id) * count);
+  if (!dirs || !strings || !ids) {
+    fprintf(stderr, "lsh: allocation error\n");
+    return EXIT_FAILURE;
+  }
+  int num_dirs = 1;
+  dirs[0] = 0;
+  for (int i = 1; i < count; i++) {
+    if ((i - 1) % (PATHBENCH_FILES + PATHBENCH_DIRS) < PATHBENCH_DIRS) dirs[num_dirs++] = i;
+  }
+
+  // Full strings
+  char name[64], buf[1024];
+  unsigned long long string_bytes = sizeof(char*) * (unsigned long long)count, total_len = 0;
+  unsigned long long start = lsh_now_us();
+  strings[0] = _strdup(root);
+  for (int i = 1; i < count; i++) {
+    pathbench_name(i, name, sizeof(name));
+    strcpy(buf, strings[dirs[(i - 1) / (PATHBENCH_FILES + PATHBENCH_DIRS)]]);
+    strcat(buf, "\\");
+    strcat(buf, name);
+    strings[i] = _strdup(buf);
+  }
+  unsigned long long string_us = lsh_now_us() - start;
+  for (int i = 0; i < count; i++) {
+    size_t len = strlen(strings[i]);
+    total_len += len;
+    string_bytes += ((len + 1 + 15) & ~(size_t)15) + 16;
+  }
+
+  // Interned
+  lsh_path_pool pool;
+  lsh_path_pool_init(&pool);
+  start = lsh_now_us();
+  ids[0] = lsh_path_intern(&pool, 0, root, strlen(root));
+  for (int i = 1; i < count; i++) {
+    pathbench_name(i, name, sizeof(name));
+    ids[i] = lsh_path_intern(&pool, ids[dirs[(i - 1) / (PATHBENCH_FILES + PATHBENCH_DIRS)]], name, strlen(name));
+  }
+  unsigned long long pool_us = lsh_now_us() - start;
+  unsigned long long pool_bytes = pool.bytes + sizeof(lsh_path_node*) * LSH_PATH_MAX_BLOCKS +
+                                  sizeof(lsh_path_id) * (unsigned long long)count;
+
+  // Getting the paths back, and looking them up again
+  lsh_path path = { NULL, 0, 0 };
+  int mismatches = 0;
+  start = lsh_now_us();
+  for (int i = 0; i < count; i++) {
+    lsh_path_build(&pool, ids[i], &path);
+    if (path.len != strlen(strings[i])) mismatches++;
+  }
+  unsigned long long build_us = lsh_now_us() - start;
+  for (int i = 0; i < count; i++) {
+    lsh_path_build(&pool, ids[i], &path);
+    if (strcmp(path.s, strings[i]) != 0) mismatches++;
+  }
+  start = lsh_now_us();
+  for (int i = 1; i < count; i++) {
+    pathbench_name(i, name, sizeof(name));
+    if (lsh_path_intern(&pool, ids[dirs[(i - 1) / (PATHBENCH_FILES + PATHBENCH_DIRS)]], name, strlen(name)) != ids[i]) {
+      mismatches++;
+    }
+  }
+  unsigned long long lookup_us = lsh_now_us() - start;
+
+  printf("%d paths, %d directories, %.0f bytes long on average\n\n", count, num_dirs, total_len / (double)count);
+  printf("%-16s %10s %12s %10s\n", "", "MB", "bytes/path", "build ms");
+  printf("%-16s %10.1f %12.1f %10.1f\n", "full strings", string_bytes / 1048576.0, string_bytes / (double)count,
+         string_us / 1000.0);
+  printf("%-16s %10.1f %12.1f %10.1f\n", "interned", pool_bytes / 1048576.0, pool_bytes / (double)count,
+         pool_us / 1000.0);
+  printf("\nnode %d bytes; full path from a node %.0f ns, lookup of a known path %.0f ns%s\n",
+         (int)sizeof(lsh_path_node), build_us * 1000.0 / count, lookup_us * 1000.0 / count,
+         mismatches ? "  MISMATCH" : "");
+
+  lsh_path_free(&path);
+  lsh_path_pool_free(&pool);
+  for (int i = 0; i < count; i++) free(strings[i]);
+  free(strings);
+  free(ids);
+  free(dirs);
+  return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv) {
+  // lsh --stats-out FILE ...: write the metrics to FILE on exit
+  if (argc > 2 && strcmp(argv[1], "--stats-out") == 0) {
+    lsh_stats_dump_at_exit(argv[2]);
+    argv[2] = argv[0];
+    argv += 2;
+    argc -= 2;
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-keys") == 0) {
+    return lsh_bench_keys(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-paste") == 0) {
+    return lsh_bench_paste(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-dispatch") == 0) {
+    return lsh_bench_dispatch(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-loop") == 0) {
+    return lsh_bench_loop(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-startup") == 0) {
+    return lsh_bench_startup(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-idle") == 0) {
+    return lsh_bench_idle(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-out") == 0) {
+    return lsh_bench_out(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--bench-paths") == 0) {
+    return lsh_bench_paths(argc - 2, argv + 2);
+  }
+  if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+    return lsh_daemon();
+  }
+
+  // lsh -c COMMAND [name args...] and lsh FILE [args...]
+  if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+    lsh_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.argv = argc > 3 ? argv + 3 : argv;
+    frame.argc = argc > 3 ? argc - 3 : 1;
+    lsh_frame_top = &frame;
+    lsh_run_text(argv[2]);
+    return lsh_last_status;
+  }
+  if (argc > 1 && argv[1][0] != '-') {
+    lsh_frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.argv = argv + 1;
+    frame.argc = argc - 1;
+    lsh_frame_top = &frame;
+    return lsh_run_file(argv[1]);
+  }
   lsh_loop();
-  return EXIT_SUCCESS;
+  return lsh_last_status;
 }
 